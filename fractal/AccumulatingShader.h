@@ -0,0 +1,52 @@
+#pragma once
+
+#include "logging/debugOutput.h"
+#include "Shader.h"
+
+#include <cstdint>
+
+// NOTE: Takes the same arguments as AveragingShader, plus the accumulation buffer and the number of frames that are already in it.
+class AccumulatingShader : public Shader {
+	friend class Renderer;
+
+	ErrorCode init(cl_context context, cl_device_id device) override {
+		std::string buildLog;
+		std::string sourceCodePrefix = specializedSamplesPerPixelSideLength != 0 ? "#define SAMPLES_PER_PIXEL_SIDE_LENGTH " + std::to_string(specializedSamplesPerPixelSideLength) : "";
+		ErrorCode err = sourceCodePrefix.empty() ? setupFromFile(context, device, "averager.cl", "doAccumulate", buildLog) : setupFromFile(context, device, "averager.cl", "doAccumulate", sourceCodePrefix.c_str(), buildLog);
+		if (err == ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG) {
+			debuglogger::out << buildLog << '\n';
+		}
+		return err;
+	}
+
+	bool release() override {
+		return releaseBaseVars();
+	}
+
+public:
+	uint16_t specializedSamplesPerPixelSideLength = 0;					// NOTE: Gets built into the kernel if it isn't 0, has to be set before init. setSamplesPerPixelSideLength still has to get the same value.
+
+	void setBeforeAverageFrameData(cl_mem computeBeforeAverageFrame, cl_uint beforeAverageFrameWidth, cl_uint beforeAverageFrameHeight) {
+		clSetKernelArg(computeKernel, 0, sizeof(cl_mem), &computeBeforeAverageFrame);
+		clSetKernelArg(computeKernel, 1, sizeof(cl_uint), &beforeAverageFrameWidth);
+		clSetKernelArg(computeKernel, 2, sizeof(cl_uint), &beforeAverageFrameHeight);
+	}
+
+	void setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) {
+		clSetKernelArg(computeKernel, 3, sizeof(uint16_t), &samplesPerPixelSideLength);
+	}
+
+	void setFrameData(cl_mem computeFrame, cl_uint frameWidth, cl_uint frameHeight) {
+		clSetKernelArg(computeKernel, 4, sizeof(cl_mem), &computeFrame);
+		clSetKernelArg(computeKernel, 5, sizeof(cl_uint), &frameWidth);
+		clSetKernelArg(computeKernel, 6, sizeof(cl_uint), &frameHeight);
+	}
+
+	void setAccumulationFrame(cl_mem computeAccumulationFrame) {
+		clSetKernelArg(computeKernel, 7, sizeof(cl_mem), &computeAccumulationFrame);
+	}
+
+	void setAccumulatedFrameCount(cl_uint accumulatedFrameCount) {
+		clSetKernelArg(computeKernel, 8, sizeof(cl_uint), &accumulatedFrameCount);
+	}
+};
@@ -10,7 +10,8 @@ class AveragingShader : public Shader {
 
 	ErrorCode init(cl_context context, cl_device_id device) override {
 		std::string buildLog;
-		ErrorCode err = setupFromFile(context, device, "averager.cl", "doAverage", buildLog);
+		std::string sourceCodePrefix = specializedSamplesPerPixelSideLength != 0 ? "#define SAMPLES_PER_PIXEL_SIDE_LENGTH " + std::to_string(specializedSamplesPerPixelSideLength) : "";
+		ErrorCode err = sourceCodePrefix.empty() ? setupFromFile(context, device, "averager.cl", "doAverage", buildLog) : setupFromFile(context, device, "averager.cl", "doAverage", sourceCodePrefix.c_str(), buildLog);
 		if (err == ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG) {
 			debuglogger::out << buildLog << '\n';
 		}
@@ -22,6 +23,7 @@ class AveragingShader : public Shader {
 	}
 
 public:
+	uint16_t specializedSamplesPerPixelSideLength = 0;					// NOTE: Gets built into the kernel if it isn't 0, has to be set before init. setSamplesPerPixelSideLength still has to get the same value.
 
 	void setBeforeAverageFrameData(cl_mem computeBeforeAverageFrame, cl_uint beforeAverageFrameWidth, cl_uint beforeAverageFrameHeight) {
 		clSetKernelArg(computeKernel, 0, sizeof(cl_mem), &computeBeforeAverageFrame);
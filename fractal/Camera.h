@@ -2,6 +2,8 @@
 
 #include "nmath/vectors/Vector3f.h"
 
+#include <limits>
+
 struct Camera {
 	nmath::Vector3f position;
 	nmath::Vector3f rotation;
@@ -9,4 +11,12 @@ struct Camera {
 
 	Camera() = default;
 	Camera(nmath::Vector3f position, nmath::Vector3f rotation, float FOV) : position(position), rotation(rotation), FOV(FOV) { }
+
+	// NOTE: All NaN, which doesn't compare equal to anything. The renderers keep one of these as the last transferred camera after init, so the first transfers always count as changes.
+	static Camera makeUntransferred() {
+		float nan = std::numeric_limits<float>::quiet_NaN();
+		return Camera({ nan, nan, nan }, { nan, nan, nan }, nan);
+	}
+
+	static bool vectorsEqual(nmath::Vector3f a, nmath::Vector3f b) { return a.x == b.x && a.y == b.y && a.z == b.z; }
 };
@@ -1 +1,48 @@
 #include "DefaultShader.h"
+
+#include <algorithm>
+
+// NOTE: The argument indices after TRACE_KERNEL_PARAMETERS that only the PERSISTENT_THREADS variants have. Never together with the statistics buffer (30).
+enum PersistentArgument : cl_uint {
+	PERSISTENT_WORK_COUNTER_ARGUMENT = 30,
+	PERSISTENT_BATCH_SIZE_ARGUMENT,
+	PERSISTENT_FIRST_ROW_ARGUMENT,
+	PERSISTENT_ROW_COUNT_ARGUMENT
+};
+
+cl_int DefaultShader::enqueuePersistentTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+											 cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent) {
+	// NOTE: The renderers size the launch for one work item per pixel, rounded up to whole tiles (getTraceLocalSize). Only the rows matter in here,
+	// and those can stick out of the frame at the bottom. The persistent groups are flat, but get as many work items as a tile has.
+	cl_uint firstRow = (cl_uint)(globalOffset ? globalOffset[1] : 0);
+	cl_uint rowCount = (cl_uint)std::min(globalSize[1], (size_t)(frameHeight > firstRow ? frameHeight - firstRow : 0));
+	size_t pixelCount = (size_t)rowCount * frameWidth;
+	size_t groupSize = localSize ? localSize[0] * localSize[1] : computeKernelWorkGroupSize;
+	cl_uint batchSize = persistentBatchSize != 0 ? persistentBatchSize : (cl_uint)groupSize;
+
+	size_t groupsPerComputeUnit = persistentGroupsPerComputeUnit != 0 ? persistentGroupsPerComputeUnit : std::max((size_t)2048 / groupSize, (size_t)1);
+	size_t groupCount = std::min(computeUnitCount * groupsPerComputeUnit, std::max((pixelCount + batchSize - 1) / batchSize, (size_t)1));
+	size_t persistentGlobalSize[2] = { groupCount * groupSize, 1 };
+	size_t persistentLocalSize[2] = { groupSize, 1 };
+
+	// NOTE: The counter gets reset for every trace. The in-order queue keeps the reset from happening while the last trace still uses it, the kernel waits on it explicitly anyway.
+	cl_uint zero = 0;
+	cl_event resetEvent;
+	cl_int err = clEnqueueFillBuffer(commandQueue, computePersistentWorkCounter, &zero, sizeof(zero), 0, sizeof(zero), waitListLength, waitList, &resetEvent);
+	if (err != CL_SUCCESS) { return err; }
+
+	setKernelArgument(PERSISTENT_WORK_COUNTER_ARGUMENT, sizeof(cl_mem), &computePersistentWorkCounter);
+	setKernelArgument(PERSISTENT_BATCH_SIZE_ARGUMENT, sizeof(cl_uint), &batchSize);
+	setKernelArgument(PERSISTENT_FIRST_ROW_ARGUMENT, sizeof(cl_uint), &firstRow);
+	setKernelArgument(PERSISTENT_ROW_COUNT_ARGUMENT, sizeof(cl_uint), &rowCount);
+
+	cl_event traceEvent;
+	err = clEnqueueNDRangeKernel(commandQueue, computeKernel, 2, nullptr, persistentGlobalSize, persistentLocalSize, 1, &resetEvent, endEvent ? &traceEvent : nullptr);
+	if (err != CL_SUCCESS) { clReleaseEvent(resetEvent); return err; }
+
+	// NOTE: The span starts at the reset, it's part of the trace as far as the profiler is concerned.
+	if (startEvent) { *startEvent = resetEvent; }
+	else { clReleaseEvent(resetEvent); }
+	if (endEvent) { *endEvent = traceEvent; }
+	return CL_SUCCESS;
+}
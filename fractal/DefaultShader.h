@@ -10,22 +10,168 @@
 
 #include "nmath/matrices/Matrix4f.h"
 
+enum class KDTreeTraversalType {
+	PARENT_LINKS,						// NOTE: Walks back up the tree through the parent indices. Needs no extra memory, but reconstructs the parent bounds on every step up.
+	ROPES,								// NOTE: Jumps from leaf to leaf through the ropes in Scene::kdTreeRopeHeap. Needs Scene::kdTreeRopesEnabled.
+	COMPACT_RESTART						// NOTE: Goes down Scene::compactKDTreeNodeHeap from the root for every leaf it visits. Needs Scene::compactKDTreeEnabled.
+};
+
+/*
+
+NOTE: The settings that DefaultShader builds into raytracer.cl as constants. Every distinct combination is its own kernel variant, see Shader::selectVariant.
+	- maxBounces can be at most 127, the kernels count the bounces in a char.
+	- A samplesPerPixelSideLength of 0 means the kernel reads the argument at runtime like before. The renderers fill it in through specializeSamplesPerPixelSideLength.
+	- persistentThreads launches only enough work groups to fill the device and lets them fetch pixel batches off an atomic counter, see enqueueTrace.
+		It doesn't go together with traversal statistics, a shader that collects them ignores the flag.
+	- mortonTileOrder makes the work items of a square tile walk it in Z-order, see getTracePixelCoords in raytracer.cl. Only does something with tiles, see setTileSideLength.
+
+*/
+struct DefaultShaderVariant {
+	KDTreeTraversalType traversalType = KDTreeTraversalType::PARENT_LINKS;
+	uint8_t maxBounces = 10;
+	uint16_t samplesPerPixelSideLength = 0;
+	bool persistentThreads = false;
+	bool mortonTileOrder = false;
+
+	bool operator==(const DefaultShaderVariant& right) const = default;
+};
+
 class DefaultShader : public RaytracingShader
 {
+	DefaultShaderVariant variant;
+	TraversalStatisticsMode traversalStatisticsMode;
+
+	cl_context context;
+	cl_uint computeUnitCount;
+	cl_mem computePersistentWorkCounter;
+	uint8_t tileSideLength = 0;
+	size_t traceTileSideLength = 1;
+	uint32_t frameWidth = 0;
+	uint32_t frameHeight = 0;
+	uint32_t persistentBatchSize = 0;
+	uint32_t persistentGroupsPerComputeUnit = 0;
+
+	static const char* getKernelName(KDTreeTraversalType traversalType) {
+		switch (traversalType) {
+		case KDTreeTraversalType::ROPES: return "traceRaysWithRopes";
+		case KDTreeTraversalType::COMPACT_RESTART: return "traceRaysCompact";
+		default: return "traceRays";
+		}
+	}
+
+	std::string getSourceCodePrefix(const DefaultShaderVariant& variant) const {
+		std::string sourceCodePrefix;
+		switch (traversalStatisticsMode) {
+		case TraversalStatisticsMode::COUNTERS: sourceCodePrefix = "#define TRAVERSAL_STATISTICS\n"; break;
+		case TraversalStatisticsMode::HEATMAP: sourceCodePrefix = "#define TRAVERSAL_STATISTICS\n#define TRAVERSAL_HEATMAP\n"; break;
+		default: break;
+		}
+		sourceCodePrefix += "#define MAX_BOUNCES " + std::to_string(variant.maxBounces > 127 ? 127 : variant.maxBounces) + '\n';
+		if (variant.samplesPerPixelSideLength != 0) { sourceCodePrefix += "#define SAMPLES_PER_PIXEL_SIDE_LENGTH " + std::to_string(variant.samplesPerPixelSideLength) + '\n'; }
+		if (usesPersistentThreads(variant)) { sourceCodePrefix += "#define PERSISTENT_THREADS\n"; }
+		if (variant.mortonTileOrder) { sourceCodePrefix += "#define MORTON_TILE_ORDER\n"; }
+		return sourceCodePrefix;
+	}
+
+	bool usesPersistentThreads(const DefaultShaderVariant& variant) const { return variant.persistentThreads && traversalStatisticsMode == TraversalStatisticsMode::OFF; }
+
+	cl_int enqueuePersistentTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+								  cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent);
+
 	ErrorCode init(cl_context context, cl_device_id device) override {
 		std::string buildLog;
-		ErrorCode err = setupFromFile(context, device, "raytracer.cl", "traceRays", buildLog);
+		ErrorCode err = selectVariant(context, device, "raytracer.cl", getKernelName(variant.traversalType), getSourceCodePrefix(variant), buildLog);
 		if (err == ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG) {
 			debuglogger::out << buildLog << '\n';
 		}
-		return err;
+		if (err != ErrorCode::SUCCESS) { return err; }
+		// NOTE: Whoever doesn't care about the statistics never has to set the buffer, the kernel skips the write for a null one.
+		if (traversalStatisticsMode != TraversalStatisticsMode::OFF) { setTraversalStatisticsBuffer(nullptr); }
+
+		// NOTE: The counter is only 4 bytes, so it just always exists. That way setVariant can switch persistent threads on without having to allocate anything.
+		cl_int bufferErr;
+		computePersistentWorkCounter = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizeof(cl_uint), nullptr, &bufferErr);
+		if (!computePersistentWorkCounter) { releaseBaseVars(); return ErrorCode::SHADER_BUFFER_ALLOCATION_FAILED; }
+		if (clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnitCount), &computeUnitCount, nullptr) != CL_SUCCESS || computeUnitCount == 0) { computeUnitCount = 1; }
+		this->context = context;
+
+		// NOTE: The biggest square power of two tile, up to the side length we want, that fits into a work group of the kernel on this device.
+		size_t maxWorkItemSizes[3];
+		if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxWorkItemSizes), maxWorkItemSizes, nullptr) != CL_SUCCESS) { maxWorkItemSizes[0] = 1; maxWorkItemSizes[1] = 1; }
+		traceTileSideLength = tileSideLength == 0 ? 16 : tileSideLength;
+		while (traceTileSideLength & (traceTileSideLength - 1)) { traceTileSideLength &= traceTileSideLength - 1; }
+		while (traceTileSideLength > 1 && (traceTileSideLength * traceTileSideLength > computeKernelWorkGroupSize || traceTileSideLength > maxWorkItemSizes[0] || traceTileSideLength > maxWorkItemSizes[1])) { traceTileSideLength /= 2; }
+		return ErrorCode::SUCCESS;
 	}
 
 	bool release() override {
-		return releaseBaseVars();
+		bool successful = clReleaseMemObject(computePersistentWorkCounter) == CL_SUCCESS;
+		if (!releaseBaseVars()) { successful = false; }
+		return successful;
 	}
 
 public:
+	DefaultShader(KDTreeTraversalType traversalType = KDTreeTraversalType::PARENT_LINKS, TraversalStatisticsMode traversalStatisticsMode = TraversalStatisticsMode::OFF) 
+				: traversalStatisticsMode(traversalStatisticsMode) { variant.traversalType = traversalType; }
+	DefaultShader(const DefaultShaderVariant& variant, TraversalStatisticsMode traversalStatisticsMode = TraversalStatisticsMode::OFF) : variant(variant), traversalStatisticsMode(traversalStatisticsMode) { }
+
+	const DefaultShaderVariant& getVariant() const { return variant; }
+	uint8_t getMaxBounces() const override { return variant.maxBounces > 127 ? 127 : variant.maxBounces; }
+
+	// NOTE: Before init, this only decides what init builds. After init, it switches kernels, building the variant first if it's new. The arguments carry over, the frames in flight keep the kernel they were enqueued with.
+	ErrorCode setVariant(const DefaultShaderVariant& newVariant) {
+		if (!hasVariants()) { variant = newVariant; return ErrorCode::SUCCESS; }
+		std::string buildLog;
+		ErrorCode err = selectVariant("raytracer.cl", getKernelName(newVariant.traversalType), getSourceCodePrefix(newVariant), buildLog);
+		if (err == ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG) {
+			debuglogger::out << buildLog << '\n';
+		}
+		if (err == ErrorCode::SUCCESS) { variant = newVariant; }
+		return err;
+	}
+
+	/*
+
+	NOTE: The knobs of the persistent threads launch. They're arguments, so changing them doesn't build anything.
+		- batchSize is how many pixels a work group takes off the counter at a time, 0 means one per work item. Bigger batches mean fewer atomics, smaller ones
+			balance better at the end of the frame.
+		- groupsPerComputeUnit is how many work groups get launched per compute unit. OpenCL can't tell how many of them actually fit at once, so 0 guesses
+			2048 work items per compute unit, which is about what current GPUs keep resident. Too many isn't wrong, the extra groups just find the counter done.
+
+	*/
+	/*
+
+	NOTE: The trace gets launched in square tiles of sideLength x sideLength pixels instead of strips of computeKernelWorkGroupSize x 1. The primary rays of a tile
+		are a lot closer together than the ones of a strip, so they go down the same kd-tree nodes and share the fetches in cache.
+		- 0 (the default) picks a side length for the device at init, 16 where the work groups are big enough and smaller where they aren't.
+		- Anything else gets rounded down to a power of two and shrunk the same way if it doesn't fit. 1 gives the strips.
+		- Has to be set before init, the renderers size their launches at init through getTraceLocalSize.
+
+	*/
+	void setTileSideLength(uint8_t sideLength) { tileSideLength = sideLength; }
+	// NOTE: The side length that init went with, 1 for strips.
+	size_t getTraceTileSideLength() const { return traceTileSideLength; }
+
+	void getTraceLocalSize(size_t* localSize) const override {
+		if (traceTileSideLength <= 1) { RaytracingShader::getTraceLocalSize(localSize); return; }
+		localSize[0] = traceTileSideLength;
+		localSize[1] = traceTileSideLength;
+	}
+
+	void setPersistentBatchSize(uint32_t batchSize) { persistentBatchSize = batchSize; }
+	uint32_t getPersistentBatchSize() const { return persistentBatchSize; }
+	void setPersistentGroupsPerComputeUnit(uint32_t groupsPerComputeUnit) { persistentGroupsPerComputeUnit = groupsPerComputeUnit; }
+	uint32_t getPersistentGroupsPerComputeUnit() const { return persistentGroupsPerComputeUnit; }
+
+	cl_int enqueueTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+						cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent) override {
+		if (!usesPersistentThreads(variant)) { return RaytracingShader::enqueueTrace(commandQueue, globalOffset, globalSize, localSize, waitListLength, waitList, startEvent, endEvent); }
+		return enqueuePersistentTrace(commandQueue, globalOffset, globalSize, localSize, waitListLength, waitList, startEvent, endEvent);
+	}
+
+	void specializeSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) override {
+		if (!hasVariants()) { variant.samplesPerPixelSideLength = samplesPerPixelSideLength; }
+	}
 
 	// SIDE-NOTE: Difference between nothing, virtual and override while inheriting from virtual classes:
 	// You can override virtual functions just fine without writing virtual or override, they are both kind of just syntactic sugar.
@@ -37,52 +183,99 @@ public:
 	// (You can also use virtual and the override tag, which has all the advantages of override plus the syntactic sugar of the virtual keyword, but I don't like that).
 
 	void setBeforeAverageFrameData(cl_mem computeBeforeAverageFrame, cl_uint beforeAverageFrameWidth, cl_uint beforeAverageFrameHeight) override {
-		clSetKernelArg(computeKernel, 0, sizeof(cl_mem), &computeBeforeAverageFrame);
-		clSetKernelArg(computeKernel, 1, sizeof(cl_uint), &beforeAverageFrameWidth);
-		clSetKernelArg(computeKernel, 2, sizeof(cl_uint), &beforeAverageFrameHeight);
+		frameWidth = beforeAverageFrameWidth;
+		frameHeight = beforeAverageFrameHeight;
+		setKernelArgument(0, sizeof(cl_mem), &computeBeforeAverageFrame);
+		setKernelArgument(1, sizeof(cl_uint), &beforeAverageFrameWidth);
+		setKernelArgument(2, sizeof(cl_uint), &beforeAverageFrameHeight);
 	}
 
 	void setCameraPosition(nmath::Vector3f position) override {
-		clSetKernelArg(computeKernel, 3, sizeof(nmath::Vector3f), &position);
+		setKernelArgument(3, sizeof(nmath::Vector3f), &position);
 	}
 
 	void setCameraRotation(nmath::Vector3f rotation) override {
 		nmath::Matrix4f rotationMatrix = nmath::Matrix4f::createRotation(rotation);
-		clSetKernelArg(computeKernel, 4, sizeof(nmath::Matrix4f), &rotationMatrix);
+		setKernelArgument(4, sizeof(nmath::Matrix4f), &rotationMatrix);
 	}
 
 	void setRayOrigin(float rayOrigin) override {
-		clSetKernelArg(computeKernel, 5, sizeof(float), &rayOrigin);
+		setKernelArgument(5, sizeof(float), &rayOrigin);
+	}
+
+	void setSampleIndex(uint32_t sampleIndex) override {
+		setKernelArgument(26, sizeof(uint32_t), &sampleIndex);
+	}
+
+	void setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) override {
+		setKernelArgument(27, sizeof(uint16_t), &samplesPerPixelSideLength);
+		// NOTE: A kernel built for another side length would ignore the argument and render the wrong grid, so that one can't stay. The runtime variant is the safe way out if the new one doesn't build.
+		if (variant.samplesPerPixelSideLength != 0 && variant.samplesPerPixelSideLength != samplesPerPixelSideLength) {
+			DefaultShaderVariant newVariant = variant;
+			newVariant.samplesPerPixelSideLength = samplesPerPixelSideLength;
+			if (setVariant(newVariant) != ErrorCode::SUCCESS) {
+				newVariant.samplesPerPixelSideLength = 0;
+				setVariant(newVariant);
+			}
+		}
+	}
+
+	void setAccumulationFrame(cl_mem computeAccumulationFrame, uint32_t accumulatedFrameCount) override {
+		setKernelArgument(28, sizeof(cl_mem), &computeAccumulationFrame);
+		setKernelArgument(29, sizeof(uint32_t), &accumulatedFrameCount);
 	}
 
 	void setEntityHeap(cl_mem computeEntityHeap, uint64_t computeEntityHeapLength) override {
-		clSetKernelArg(computeKernel, 6, sizeof(cl_mem), &computeEntityHeap);
-		clSetKernelArg(computeKernel, 7, sizeof(uint64_t), &computeEntityHeapLength);
+		setKernelArgument(6, sizeof(cl_mem), &computeEntityHeap);
+		setKernelArgument(7, sizeof(uint64_t), &computeEntityHeapLength);
 	}
 
 	void setKDTree(nmath::Vector3f position, nmath::Vector3f size, cl_mem computeKDTreeNodeHeap, uint64_t computeKDTreeNodeHeapLength) override {
-		clSetKernelArg(computeKernel, 8, sizeof(nmath::Vector3f), &position);
-		clSetKernelArg(computeKernel, 9, sizeof(nmath::Vector3f), &size);
-		clSetKernelArg(computeKernel, 10, sizeof(cl_mem), &computeKDTreeNodeHeap);
-		clSetKernelArg(computeKernel, 11, sizeof(uint64_t), &computeKDTreeNodeHeapLength);
+		setKernelArgument(8, sizeof(nmath::Vector3f), &position);
+		setKernelArgument(9, sizeof(nmath::Vector3f), &size);
+		setKernelArgument(10, sizeof(cl_mem), &computeKDTreeNodeHeap);
+		setKernelArgument(11, sizeof(uint64_t), &computeKDTreeNodeHeapLength);
 	}
 
 	void setLeafObjectHeap(cl_mem computeLeafObjectHeap, uint64_t computeLeafObjectHeapLength) override {
-		clSetKernelArg(computeKernel, 12, sizeof(cl_mem), &computeLeafObjectHeap);
-		clSetKernelArg(computeKernel, 13, sizeof(uint64_t), &computeLeafObjectHeapLength);
+		setKernelArgument(12, sizeof(cl_mem), &computeLeafObjectHeap);
+		setKernelArgument(13, sizeof(uint64_t), &computeLeafObjectHeapLength);
+	}
+
+	void setKDTreeRopeHeap(cl_mem computeKDTreeRopeHeap, uint64_t computeKDTreeRopeHeapLength) override {
+		setKernelArgument(19, sizeof(cl_mem), &computeKDTreeRopeHeap);
+		setKernelArgument(20, sizeof(uint64_t), &computeKDTreeRopeHeapLength);
+	}
+
+	void setCompactKDTreeNodeHeap(cl_mem computeCompactKDTreeNodeHeap, uint64_t computeCompactKDTreeNodeHeapLength) override {
+		setKernelArgument(21, sizeof(cl_mem), &computeCompactKDTreeNodeHeap);
+		setKernelArgument(22, sizeof(uint64_t), &computeCompactKDTreeNodeHeapLength);
+	}
+
+	void setLeafSphereHeap(cl_mem computeLeafSphereHeap, cl_mem computeLeafEntityIndexHeap, uint64_t computeLeafSphereHeapLength) override {
+		setKernelArgument(23, sizeof(cl_mem), &computeLeafSphereHeap);
+		setKernelArgument(24, sizeof(cl_mem), &computeLeafEntityIndexHeap);
+		setKernelArgument(25, sizeof(uint64_t), &computeLeafSphereHeapLength);
 	}
 
 	void setLightHeap(cl_mem computeLightHeap, uint64_t computeLightHeapLength) override {
-		clSetKernelArg(computeKernel, 14, sizeof(cl_mem), &computeLightHeap);
-		clSetKernelArg(computeKernel, 15, sizeof(uint64_t), &computeLightHeapLength);
+		setKernelArgument(14, sizeof(cl_mem), &computeLightHeap);
+		setKernelArgument(15, sizeof(uint64_t), &computeLightHeapLength);
 	}
 
 	void setMaterialHeap(cl_mem computeMaterialHeap, uint64_t computeMaterialHeapLength) override {
-		clSetKernelArg(computeKernel, 16, sizeof(cl_mem), &computeMaterialHeap);
-		clSetKernelArg(computeKernel, 17, sizeof(uint64_t), &computeMaterialHeapLength);
+		setKernelArgument(16, sizeof(cl_mem), &computeMaterialHeap);
+		setKernelArgument(17, sizeof(uint64_t), &computeMaterialHeapLength);
 	}
 
 	void setMaterialHeapOffset(uint64_t computeMaterialHeapOffset) override {
-		clSetKernelArg(computeKernel, 18, sizeof(uint64_t), &computeMaterialHeapOffset);
+		setKernelArgument(18, sizeof(uint64_t), &computeMaterialHeapOffset);
+	}
+
+	TraversalStatisticsMode getTraversalStatisticsMode() const override { return traversalStatisticsMode; }
+
+	void setTraversalStatisticsBuffer(cl_mem computeTraversalStatistics) override {
+		if (traversalStatisticsMode == TraversalStatisticsMode::OFF) { return; }			// NOTE: The argument doesn't even exist then.
+		setKernelArgument(30, sizeof(cl_mem), &computeTraversalStatistics);
 	}
 };
@@ -0,0 +1,116 @@
+#include "DeviceMemoryPool.h"
+
+#include <algorithm>
+
+void DeviceMemoryPool::init(cl_context context, cl_device_id device, cl_command_queue commandQueue, cl_mem_flags flags) {
+	this->context = context;
+	this->commandQueue = commandQueue;
+	this->flags = flags;
+	cl_uint baseAddressAlignmentInBits;
+	if (clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(baseAddressAlignmentInBits), &baseAddressAlignmentInBits, nullptr) != CL_SUCCESS) {
+		baseAddressAlignmentInBits = 4096 * 8;															// NOTE: Nothing out there needs more than a page, so that's always safe, just a bit wasteful.
+	}
+	alignment = std::max<size_t>(baseAddressAlignmentInBits / 8, 1);
+}
+
+bool DeviceMemoryPool::createSubBuffer(cl_mem parentBuffer, Region& region) {
+	cl_buffer_region bufferRegion = { region.offset, region.capacity };
+	cl_int err;
+	region.subBuffer = clCreateSubBuffer(parentBuffer, flags, CL_BUFFER_CREATE_TYPE_REGION, &bufferRegion, &err);
+	return region.subBuffer != nullptr;
+}
+
+bool DeviceMemoryPool::rebuild(size_t handle, size_t newCapacity) {
+	size_t liveCapacity = 0;
+	for (size_t i = 0; i < regions.size(); i++) { liveCapacity += i == handle ? newCapacity : regions[i].capacity; }
+	size_t newPoolCapacity = alignUp(std::max((size_t)(liveCapacity * growthFactor), minimumCapacity));
+
+	cl_int err;
+	cl_mem newBuffer = clCreateBuffer(context, flags, newPoolCapacity, nullptr, &err);
+	if (!newBuffer) { return false; }
+
+	std::vector<Region> newRegions(regions.size());
+	size_t newTop = 0;
+	for (size_t i = 0; i < regions.size(); i++) {
+		Region& newRegion = newRegions[i];
+		newRegion.offset = newTop;
+		newRegion.capacity = i == handle ? newCapacity : regions[i].capacity;
+		newRegion.size = regions[i].size;
+		newRegion.subBuffer = nullptr;
+		newTop += newRegion.capacity;
+		if (newRegion.capacity == 0) { continue; }
+
+		bool successful = createSubBuffer(newBuffer, newRegion);
+		if (successful && i != handle && regions[i].size != 0) {
+			cl_event event;
+			successful = clEnqueueCopyBuffer(commandQueue, regions[i].subBuffer, newRegion.subBuffer, 0, 0, regions[i].size, 0, nullptr, profiler ? &event : nullptr) == CL_SUCCESS;
+			if (successful && profiler) { profiler->record(ProfileStage::UPLOAD, event); clReleaseEvent(event); }
+		}
+		if (!successful) {
+			for (size_t j = 0; j <= i; j++) { if (newRegions[j].subBuffer) { clReleaseMemObject(newRegions[j].subBuffer); } }
+			clReleaseMemObject(newBuffer);
+			return false;
+		}
+	}
+
+	// NOTE: The copies above and the kernels that are still in flight might still be using the old buffer. That's fine, OpenCL only really frees it once nothing on the queue needs it anymore.
+	for (Region& region : regions) { if (region.subBuffer) { clReleaseMemObject(region.subBuffer); } }
+	if (buffer) { clReleaseMemObject(buffer); }
+
+	buffer = newBuffer;
+	capacity = newPoolCapacity;
+	top = newTop;
+	regions = std::move(newRegions);
+	generation++;
+	return true;
+}
+
+bool DeviceMemoryPool::reserve(Handle& handle, size_t size, bool& subBufferChanged) {
+	subBufferChanged = false;
+	if (handle == INVALID_HANDLE) {
+		handle = regions.size();
+		regions.push_back({ top, 0, 0, nullptr });
+	}
+	Region& region = regions[handle];
+	if (size <= region.capacity) { region.size = size; return true; }
+
+	size_t newCapacity = alignUp(std::max(size, (size_t)(size * growthFactor)));
+	subBufferChanged = true;
+
+	if (region.offset + region.capacity == top && region.offset + newCapacity <= capacity) {
+		// NOTE: Last region in the pool, so it can just grow into the free space behind it.
+		if (region.subBuffer) { clReleaseMemObject(region.subBuffer); region.subBuffer = nullptr; }
+		region.capacity = newCapacity;
+		if (!createSubBuffer(buffer, region)) { region.capacity = 0; return false; }
+		region.size = size;
+		top = region.offset + newCapacity;
+		return true;
+	}
+
+	if (top + newCapacity <= capacity) {
+		if (region.subBuffer) { clReleaseMemObject(region.subBuffer); region.subBuffer = nullptr; }
+		region.offset = top;
+		region.capacity = newCapacity;
+		if (!createSubBuffer(buffer, region)) { region.capacity = 0; return false; }
+		region.size = size;
+		top += newCapacity;
+		return true;
+	}
+
+	if (!rebuild(handle, newCapacity)) { return false; }
+	regions[handle].size = size;
+	return true;
+}
+
+bool DeviceMemoryPool::release() {
+	bool successful = true;
+	for (Region& region : regions) {
+		if (region.subBuffer && clReleaseMemObject(region.subBuffer) != CL_SUCCESS) { successful = false; }
+	}
+	regions.clear();
+	if (buffer && clReleaseMemObject(buffer) != CL_SUCCESS) { successful = false; }
+	buffer = nullptr;
+	capacity = 0;
+	top = 0;
+	return successful;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "cl_bindings_and_helpers.h"
+
+#include "FrameProfiler.h"
+
+#include <cstdint>
+
+#include <vector>
+
+/*
+
+NOTE: How the device memory pool works:
+	- There is one big buffer and every heap gets a region of it, which the kernels see as a normal sub-buffer, so they don't need to know about the pool.
+	- Every region has a capacity that's bigger than what was asked for (growthFactor), so a heap that grows by a couple of elements just gets written again.
+	- If a region runs out, it grows in place if it's the last one, otherwise it moves to the end of the pool. Its old space is wasted until the next rebuild.
+	- If the end of the pool runs out too, the whole pool gets rebuilt into a new buffer that's growthFactor times as big as everything that's live,
+		which also throws away the wasted space. The other regions get copied over on the device, so their contents survive.
+	- A rebuild changes every sub-buffer. That's what the generation is for: if it changed, every kernel argument that points into the pool has to be set again.
+	- reserve doesn't keep the contents of the region that it grows, since the caller is going to write the whole heap right after anyway.
+
+*/
+
+class DeviceMemoryPool {
+	struct Region {
+		size_t offset;
+		size_t capacity;
+		size_t size;								// NOTE: How much of the region is in use. Only that much gets copied when the pool is rebuilt.
+		cl_mem subBuffer;
+	};
+
+	cl_context context = nullptr;
+	cl_command_queue commandQueue = nullptr;
+	cl_mem_flags flags = 0;
+	size_t alignment = 1;							// NOTE: Sub-buffer origins have to be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN.
+
+	cl_mem buffer = nullptr;
+	size_t capacity = 0;
+	size_t top = 0;									// NOTE: Everything from here on is free.
+	uint64_t generation = 0;
+
+	std::vector<Region> regions;
+
+	size_t alignUp(size_t value) const { return (value + alignment - 1) / alignment * alignment; }
+
+	bool createSubBuffer(cl_mem parentBuffer, Region& region);
+	bool rebuild(size_t handle, size_t newCapacity);
+
+public:
+	typedef size_t Handle;
+	static constexpr Handle INVALID_HANDLE = (Handle)-1;
+
+	float growthFactor = 1.5f;
+	size_t minimumCapacity = 1 << 20;
+
+	FrameProfiler* profiler = nullptr;				// NOTE: If set, the copies of a rebuild get recorded into it as uploads.
+
+	void init(cl_context context, cl_device_id device, cl_command_queue commandQueue, cl_mem_flags flags);
+
+	// NOTE: Makes sure that the region behind handle can hold size bytes. An INVALID_HANDLE gets replaced by a new region. subBufferChanged tells you if getBuffer returns something new now.
+	bool reserve(Handle& handle, size_t size, bool& subBufferChanged);
+
+	cl_mem getBuffer(Handle handle) const { return regions[handle].subBuffer; }
+	size_t getCapacity() const { return capacity; }
+	uint64_t getGeneration() const { return generation; }
+
+	bool release();
+};
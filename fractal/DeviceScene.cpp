@@ -0,0 +1,269 @@
+#include "DeviceScene.h"
+
+#include <cstring>
+#include <algorithm>
+
+void DeviceScene::init(cl_context context, cl_device_id device, cl_command_queue commandQueue) {
+	this->commandQueue = commandQueue;
+	memoryPool.init(context, device, commandQueue, CL_MEM_READ_ONLY);							// NOTE: Doesn't allocate anything yet, the first transfer does that.
+}
+
+void DeviceScene::waitForStagedUploads(HeapUploadStaging& staging) {
+	if (staging.events.empty()) { return; }
+	clWaitForEvents(staging.events.size(), staging.events.data());
+	for (cl_event event : staging.events) {
+		uploadWaitList.erase(std::remove(uploadWaitList.begin(), uploadWaitList.end(), event), uploadWaitList.end());
+		clReleaseEvent(event);
+	}
+	staging.events.clear();
+}
+
+ErrorCode DeviceScene::transferDirtyHeap(DeviceMemoryPool::Handle& allocation, cl_mem& computeHeap, size_t& computeHeapLength, const void* heap, size_t heapLength, size_t elementSize, const DirtyRanges& dirtyRanges, HeapUploadStaging& staging, bool& heapChanged, 
+									ErrorCode writeFailedError, ErrorCode reallocationFailedError) {
+	if (computeHeapLength == 0 || heapLength != computeHeapLength) {
+		return transferOptionalSceneBuffer(allocation, computeHeap, computeHeapLength, heap, heapLength, elementSize, heapChanged, writeFailedError, reallocationFailedError);
+	}
+
+	heapChanged = false;
+	if (dirtyRanges.empty()) { return ErrorCode::SUCCESS; }
+
+	// NOTE: The staging copy from the last upload might still be getting read, we can only reuse it once those writes are done. They're tiny and long done by the time the next transfer comes along, so this practically never waits.
+	waitForStagedUploads(staging);
+
+	// NOTE: Another heap could have rebuilt the pool earlier in this same transfer, then computeHeap is a sub-buffer that's already released. The allocation always knows the current one.
+	computeHeap = memoryPool.getBuffer(allocation);
+
+	size_t stagingSize = 0;
+	for (const DirtyRanges::Range& range : dirtyRanges.getRanges()) {
+		size_t end = std::min(range.end, heapLength);
+		if (range.start < end) { stagingSize += (end - range.start) * elementSize; }
+	}
+	staging.data.resize(stagingSize);
+
+	size_t stagingOffset = 0;
+	for (const DirtyRanges::Range& range : dirtyRanges.getRanges()) {
+		size_t end = std::min(range.end, heapLength);
+		if (range.start >= end) { continue; }
+		size_t offset = range.start * elementSize;
+		size_t size = (end - range.start) * elementSize;
+		std::memcpy(staging.data.data() + stagingOffset, (const char*)heap + offset, size);
+		cl_event event;
+		if (clEnqueueWriteBuffer(commandQueue, computeHeap, false, offset, size, staging.data.data() + stagingOffset, 0, nullptr, &event) != CL_SUCCESS) { return writeFailedError; }
+		if (profiler) { profiler->record(ProfileStage::UPLOAD, event); }
+		staging.events.push_back(event);
+		uploadWaitList.push_back(event);
+		stagingOffset += size;
+	}
+
+	return ErrorCode::SUCCESS;
+}
+
+ErrorCode DeviceScene::transferResources(const ResourceHeap& resources, RaytracingShader* raytracingShader) {
+	bool heapChanged;
+	ErrorCode err = transferDirtyHeap(computeMaterialHeapAllocation, computeMaterialHeap, computeMaterialHeapLength, resources.materialHeap, resources.materialHeapLength, sizeof(Material), resources.materialHeapDirtyRanges, materialHeapStaging, heapChanged, 
+									ErrorCode::DEVICE_MATERIAL_HEAP_WRITE_FAILED, ErrorCode::DEVICE_MATERIAL_HEAP_REALLOCATION_AND_WRITE_FAILED);
+	rebindMemoryPool(raytracingShader);															// NOTE: Before the error check, a failed reserve can still have rebuilt the pool.
+	if (err != ErrorCode::SUCCESS) { return err; }
+	if (heapChanged && raytracingShader) { raytracingShader->setMaterialHeap(computeMaterialHeapLength == 0 ? nullptr : computeMaterialHeap, computeMaterialHeapLength); }
+
+	if (resources.materialHeapOffset != computeMaterialHeapOffset) {
+		if (raytracingShader) { raytracingShader->setMaterialHeapOffset(resources.materialHeapOffset); }
+		computeMaterialHeapOffset = resources.materialHeapOffset;
+	}
+
+	return ErrorCode::SUCCESS;
+}
+
+ErrorCode DeviceScene::transferOptionalSceneBuffer(DeviceMemoryPool::Handle& allocation, cl_mem& computeBuffer, size_t& computeBufferLength, const void* data, size_t length, size_t elementSize, bool& bufferChanged, 
+												ErrorCode writeFailedError, ErrorCode reallocationFailedError) {
+	bufferChanged = length != computeBufferLength;				// NOTE: The length is a kernel argument too, so the shader has to hear about it even if the sub-buffer stays the same.
+	if (length == 0) {
+		computeBufferLength = 0;
+		return ErrorCode::SUCCESS;
+	}
+
+	bool subBufferChanged;
+	memoryPool.profiler = profiler;															// NOTE: The profiler can change between inits, so the pool just gets whatever is current before it might rebuild.
+	if (!memoryPool.reserve(allocation, length * elementSize, subBufferChanged)) { computeBufferLength = 0; bufferChanged = true; return reallocationFailedError; }
+	computeBuffer = memoryPool.getBuffer(allocation);
+	if (subBufferChanged) { bufferChanged = true; }
+
+	cl_event event;
+	if (clEnqueueWriteBuffer(commandQueue, computeBuffer, true, 0, length * elementSize, data, 0, nullptr, profiler ? &event : nullptr) != CL_SUCCESS) { computeBufferLength = 0; return writeFailedError; }
+	if (profiler) { profiler->record(ProfileStage::UPLOAD, event); clReleaseEvent(event); }
+	computeBufferLength = length;
+	return ErrorCode::SUCCESS;
+}
+
+void DeviceScene::rebindMemoryPool(RaytracingShader* raytracingShader) {
+	if (memoryPool.getGeneration() == boundMemoryPoolGeneration) { return; }
+
+	if (computeMaterialHeapLength != 0) { computeMaterialHeap = memoryPool.getBuffer(computeMaterialHeapAllocation); }
+	if (computeEntityHeapLength != 0) { computeEntityHeap = memoryPool.getBuffer(computeEntityHeapAllocation); }
+	if (computeKDTreeNodeHeapLength != 0) { computeKDTreeNodeHeap = memoryPool.getBuffer(computeKDTreeNodeHeapAllocation); }
+	if (computeLeafObjectHeapLength != 0) { computeLeafObjectHeap = memoryPool.getBuffer(computeLeafObjectHeapAllocation); }
+	if (computeKDTreeRopeHeapLength != 0) { computeKDTreeRopeHeap = memoryPool.getBuffer(computeKDTreeRopeHeapAllocation); }
+	if (computeCompactKDTreeNodeHeapLength != 0) { computeCompactKDTreeNodeHeap = memoryPool.getBuffer(computeCompactKDTreeNodeHeapAllocation); }
+	if (computeLeafSphereHeapLength != 0) { computeLeafSphereHeap = memoryPool.getBuffer(computeLeafSphereHeapAllocation); }
+	if (computeLeafEntityIndexHeapLength != 0) { computeLeafEntityIndexHeap = memoryPool.getBuffer(computeLeafEntityIndexHeapAllocation); }
+	if (computeLightHeapLength != 0) { computeLightHeap = memoryPool.getBuffer(computeLightHeapAllocation); }
+
+	if (raytracingShader) { bindTo(raytracingShader); }
+
+	boundMemoryPoolGeneration = memoryPool.getGeneration();
+}
+
+void DeviceScene::bindTo(RaytracingShader* raytracingShader) const {
+	raytracingShader->setMaterialHeap(computeMaterialHeapLength == 0 ? nullptr : computeMaterialHeap, computeMaterialHeapLength);
+	raytracingShader->setEntityHeap(computeEntityHeapLength == 0 ? nullptr : computeEntityHeap, computeEntityHeapLength);
+	if (computeKDTreeNodeHeapLength == 0) { raytracingShader->setKDTree(nmath::Vector3f(0, 0, 0), nmath::Vector3f(0, 0, 0), nullptr, 0); }
+	else { raytracingShader->setKDTree(kdTreePosition, kdTreeSize, computeKDTreeNodeHeap, computeKDTreeNodeHeapLength); }
+	raytracingShader->setLeafObjectHeap(computeLeafObjectHeapLength == 0 ? nullptr : computeLeafObjectHeap, computeLeafObjectHeapLength);
+	raytracingShader->setKDTreeRopeHeap(computeKDTreeRopeHeapLength == 0 ? nullptr : computeKDTreeRopeHeap, computeKDTreeRopeHeapLength);
+	raytracingShader->setCompactKDTreeNodeHeap(computeCompactKDTreeNodeHeapLength == 0 ? nullptr : computeCompactKDTreeNodeHeap, computeCompactKDTreeNodeHeapLength);
+	if (computeLeafSphereHeapLength == 0) { raytracingShader->setLeafSphereHeap(nullptr, nullptr, 0); }
+	else { raytracingShader->setLeafSphereHeap(computeLeafSphereHeap, computeLeafEntityIndexHeap, computeLeafSphereHeapLength); }
+	raytracingShader->setLightHeap(computeLightHeapLength == 0 ? nullptr : computeLightHeap, computeLightHeapLength);
+	if (computeMaterialHeapOffset != (size_t)-1) { raytracingShader->setMaterialHeapOffset(computeMaterialHeapOffset); }
+}
+
+ErrorCode DeviceScene::transferScene(const Scene& scene, RaytracingShader* raytracingShader) {
+	ErrorCode err = transferSceneHeaps(scene, raytracingShader);
+	// NOTE: Has to happen on the error paths too. Any heap before the one that failed could have rebuilt the pool, and then the shader (or whoever calls bindTo) would be left with released sub-buffers.
+	rebindMemoryPool(raytracingShader);
+	return err;
+}
+
+ErrorCode DeviceScene::transferSceneHeaps(const Scene& scene, RaytracingShader* raytracingShader) {
+	bool heapChanged;
+	ErrorCode err = transferDirtyHeap(computeEntityHeapAllocation, computeEntityHeap, computeEntityHeapLength, scene.entityHeap, scene.entityHeapLength, sizeof(Entity), scene.entityHeapDirtyRanges, entityHeapStaging, heapChanged, 
+									ErrorCode::DEVICE_ENTITY_HEAP_WRITE_FAILED, ErrorCode::DEVICE_ENTITY_HEAP_REALLOCATION_AND_WRITE_FAILED);
+	if (err != ErrorCode::SUCCESS) { return err; }
+	if (heapChanged && raytracingShader) { raytracingShader->setEntityHeap(computeEntityHeapLength == 0 ? nullptr : computeEntityHeap, computeEntityHeapLength); }
+
+	// NOTE: The kd-tree heaps only change as a whole, when the tree gets regenerated, so they're either uploaded completely or not at all.
+	if (scene.kdTreeDirty) {
+		// TODO: Consider putting this under the umbrella of entityHeapLength != 0, since you wouldn't ever want a tree without objects right?
+		if (scene.kdTreeNodeHeap.size() == 0) {
+			// NOTE: The regions stay in the pool, only the lengths go to zero.
+			computeKDTreeNodeHeapLength = 0;
+			computeLeafObjectHeapLength = 0;
+			computeKDTreeRopeHeapLength = 0;
+			computeCompactKDTreeNodeHeapLength = 0;
+			computeLeafSphereHeapLength = 0;
+			computeLeafEntityIndexHeapLength = 0;
+			if (raytracingShader) {
+				raytracingShader->setKDTree(nmath::Vector3f(0, 0, 0), nmath::Vector3f(0, 0, 0), nullptr, 0);
+				raytracingShader->setLeafObjectHeap(nullptr, 0);
+				raytracingShader->setKDTreeRopeHeap(nullptr, 0);
+				raytracingShader->setCompactKDTreeNodeHeap(nullptr, 0);
+				raytracingShader->setLeafSphereHeap(nullptr, nullptr, 0);
+			}
+		} else {
+			bool bufferChanged;
+			err = transferOptionalSceneBuffer(computeKDTreeNodeHeapAllocation, computeKDTreeNodeHeap, computeKDTreeNodeHeapLength, scene.kdTreeNodeHeap.data(), scene.kdTreeNodeHeap.size(), sizeof(KDTreeNode), bufferChanged, 
+											ErrorCode::DEVICE_KD_TREE_NODE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_KD_TREE_NODE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			kdTreePosition = scene.kdTree.position;
+			kdTreeSize = scene.kdTree.size;
+			if (raytracingShader) { raytracingShader->setKDTree(kdTreePosition, kdTreeSize, computeKDTreeNodeHeap, computeKDTreeNodeHeapLength); }			// NOTE: The bounds can change without the buffer changing, so this always gets set.
+
+			err = transferOptionalSceneBuffer(computeLeafObjectHeapAllocation, computeLeafObjectHeap, computeLeafObjectHeapLength, scene.leafObjectHeap.data(), scene.leafObjectHeap.size(), sizeof(uint64_t), bufferChanged, 
+											ErrorCode::DEVICE_LEAF_OBJECT_HEAP_WRITE_FAILED, ErrorCode::DEVICE_LEAF_OBJECT_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			if (bufferChanged && raytracingShader) { raytracingShader->setLeafObjectHeap(computeLeafObjectHeapLength == 0 ? nullptr : computeLeafObjectHeap, computeLeafObjectHeapLength); }
+
+			err = transferOptionalSceneBuffer(computeKDTreeRopeHeapAllocation, computeKDTreeRopeHeap, computeKDTreeRopeHeapLength, scene.kdTreeRopeHeap.data(), scene.kdTreeRopeHeap.size(), sizeof(KDTreeNodeRopes), bufferChanged, 
+											ErrorCode::DEVICE_KD_TREE_ROPE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_KD_TREE_ROPE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			if (bufferChanged && raytracingShader) { raytracingShader->setKDTreeRopeHeap(computeKDTreeRopeHeapLength == 0 ? nullptr : computeKDTreeRopeHeap, computeKDTreeRopeHeapLength); }
+
+			err = transferOptionalSceneBuffer(computeCompactKDTreeNodeHeapAllocation, computeCompactKDTreeNodeHeap, computeCompactKDTreeNodeHeapLength, scene.compactKDTreeNodeHeap.data(), scene.compactKDTreeNodeHeap.size(), sizeof(CompactKDTreeNode), bufferChanged, 
+											ErrorCode::DEVICE_COMPACT_KD_TREE_NODE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_COMPACT_KD_TREE_NODE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			if (bufferChanged && raytracingShader) { raytracingShader->setCompactKDTreeNodeHeap(computeCompactKDTreeNodeHeapLength == 0 ? nullptr : computeCompactKDTreeNodeHeap, computeCompactKDTreeNodeHeapLength); }
+
+			err = transferOptionalSceneBuffer(computeLeafSphereHeapAllocation, computeLeafSphereHeap, computeLeafSphereHeapLength, scene.leafSphereHeap.data(), scene.leafSphereHeap.size(), sizeof(LeafSphere), bufferChanged, 
+											ErrorCode::DEVICE_LEAF_SPHERE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_LEAF_SPHERE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			bool leafSphereHeapChanged = bufferChanged;
+			err = transferOptionalSceneBuffer(computeLeafEntityIndexHeapAllocation, computeLeafEntityIndexHeap, computeLeafEntityIndexHeapLength, scene.leafEntityIndexHeap.data(), scene.leafEntityIndexHeap.size(), sizeof(uint32_t), bufferChanged, 
+											ErrorCode::DEVICE_LEAF_SPHERE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_LEAF_SPHERE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+			if (err != ErrorCode::SUCCESS) { return err; }
+			if ((leafSphereHeapChanged || bufferChanged) && raytracingShader) {
+				if (computeLeafSphereHeapLength == 0) { raytracingShader->setLeafSphereHeap(nullptr, nullptr, 0); }
+				else { raytracingShader->setLeafSphereHeap(computeLeafSphereHeap, computeLeafEntityIndexHeap, computeLeafSphereHeapLength); }
+			}
+		}
+	} else {
+		// NOTE: Entities that moved inside their leaves, Scene::markEntitiesDirty patched their spheres in place. The length can't have changed without a new tree, so this only ever writes the dirty ranges.
+		err = transferDirtyHeap(computeLeafSphereHeapAllocation, computeLeafSphereHeap, computeLeafSphereHeapLength, scene.leafSphereHeap.data(), scene.leafSphereHeap.size(), sizeof(LeafSphere), scene.leafSphereHeapDirtyRanges, leafSphereHeapStaging, heapChanged, 
+								ErrorCode::DEVICE_LEAF_SPHERE_HEAP_WRITE_FAILED, ErrorCode::DEVICE_LEAF_SPHERE_HEAP_REALLOCATION_AND_WRITE_FAILED);
+		if (err != ErrorCode::SUCCESS) { return err; }
+		if (heapChanged && raytracingShader) {
+			if (computeLeafSphereHeapLength == 0) { raytracingShader->setLeafSphereHeap(nullptr, nullptr, 0); }
+			else { raytracingShader->setLeafSphereHeap(computeLeafSphereHeap, computeLeafEntityIndexHeap, computeLeafSphereHeapLength); }
+		}
+	}
+
+	err = transferDirtyHeap(computeLightHeapAllocation, computeLightHeap, computeLightHeapLength, scene.lightHeap, scene.lightHeapLength, sizeof(Light), scene.lightHeapDirtyRanges, lightHeapStaging, heapChanged, 
+							ErrorCode::DEVICE_LIGHT_HEAP_WRITE_FAILED, ErrorCode::DEVICE_LIGHT_HEAP_REALLOCATION_AND_WRITE_FAILED);
+	if (err != ErrorCode::SUCCESS) { return err; }
+	if (heapChanged && raytracingShader) { raytracingShader->setLightHeap(computeLightHeapLength == 0 ? nullptr : computeLightHeap, computeLightHeapLength); }
+
+	/*
+	* 
+	* NOTE: I assume that when you call LoadLibraryA, it loads the 32-bit DLL when you're running as 32-bit and the 64-bit one when running as 64-bit.
+	* In Linux this wouldn't work so easily AFAIK. Windows has these special extra files that specify version info and such for different instances of an ambigiuos
+	* name like "OpenCL.dll", so that's how LoadLibraryA presumably knows which exact file to load for which bit-width of the program.
+	* 
+	* NOTE: The compute device can have a completely different bit-width than the host (for example host 32-bit and GPU 64-bit).
+	* 
+	* NOTE: I am very sure that cl_mem is just a pointer, and no crazy behind the scenes magic is going on. That means that if you receive a pointer argument in the
+	* kernel and somehow output it's value, it'll be the same value as the cl_mem variable on the host.
+	* 
+	* NOTE: Following from those assumptions, in the case of the 64-bit GPU and the 32-bit CPU, allocating device memory would always give you back 32-bit values,
+	* since the size of cl_mem is 32-bit on 32-bit systems. But that only allows you to use like 4 GB of the VRAM, even if there is sooooo much more.
+	* I guess that's just the price one would have to pay.
+	* 
+	* What if it's the other way around? --> CPU 64-bit and GPU 32-bit?
+	*	- Then I think allocating device memory should still only give you back 32-bit values. Since everything is presumably little-endian,
+	*		copying that 64-bit value into the 32-bit container of the kernel argument shouldn't matter, since only the zeros get cut off and the 32-bit address contained
+	*		inside remains completely intact.
+	* 
+	* NOTE: Here is my understanding of what happens when you tell the compute device to use host memory for it's operations (obviously this is implementation dependant and only one of many possibilities):
+	*	- GPU almost definitely has virtual memory, which allows the GPU MMU to just map a part of host memory into a part of virtual GPU memory.
+	*	- That way the GPU doesn't really need to do anything special, it just uses the memory like normal.
+	*	- The interesting thing about that is that if you've got a 32-bit GPU and you use 2 GB of VRAM and 2 GB of host memory for your device memory, you can't add anymore, even though you technically still
+	*		have more physical memory left in VRAM.
+	* 
+	* NOTE: One last thing: It's defined by the standard that you can pass nullptr as a cl_mem variable into clSetKernelArg.
+	* 
+	*/
+
+	return ErrorCode::SUCCESS;
+}
+
+void DeviceScene::finishUploads() {
+	waitForStagedUploads(entityHeapStaging);
+	waitForStagedUploads(lightHeapStaging);
+	waitForStagedUploads(leafSphereHeapStaging);
+	waitForStagedUploads(materialHeapStaging);
+}
+
+bool DeviceScene::release() {
+	finishUploads();
+	bool successful = memoryPool.release();														// NOTE: Takes every heap with it, they're all just regions of the pool.
+	computeMaterialHeapLength = 0; computeMaterialHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeEntityHeapLength = 0; computeEntityHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeKDTreeNodeHeapLength = 0; computeKDTreeNodeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeLeafObjectHeapLength = 0; computeLeafObjectHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeKDTreeRopeHeapLength = 0; computeKDTreeRopeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeCompactKDTreeNodeHeapLength = 0; computeCompactKDTreeNodeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeLeafSphereHeapLength = 0; computeLeafSphereHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeLeafEntityIndexHeapLength = 0; computeLeafEntityIndexHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeLightHeapLength = 0; computeLightHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	computeMaterialHeapOffset = -1;
+	uploadWaitList.clear();
+	return successful;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Scene.h"
+#include "ResourceHeap.h"
+
+#include "ErrorCode.h"
+
+#include "cl_bindings_and_helpers.h"
+
+#include "RaytracingShader.h"
+
+#include "DeviceMemoryPool.h"
+#include "FrameProfiler.h"
+
+#include <cstdint>
+
+#include <vector>
+
+// NOTE: Host-side copy of the dirty spans of one heap. The non-blocking writes read out of this, so the caller can go on changing the heap right after the transfer.
+struct HeapUploadStaging {
+	std::vector<char> data;
+	std::vector<cl_event> events;
+};
+
+/*
+
+NOTE: The copy of the scene and the resources that lives on one device, plus the shader arguments that point at it.
+	- Renderer has one of these. SplitFrameRenderer has one per device, that's how the scene gets replicated. RenderContext has one that all of its RendererInstances read from.
+	- The transfers only read the dirty state of the scene and the resources, they don't clear it, since every copy needs to see it.
+		Whoever owns the copies clears it once all of them are up to date.
+
+*/
+
+class DeviceScene {
+	cl_command_queue commandQueue;
+
+	DeviceMemoryPool memoryPool;													// NOTE: Every heap lives in here. The allocations are what the heaps use to find their region again.
+	uint64_t boundMemoryPoolGeneration = 0;
+	DeviceMemoryPool::Handle computeMaterialHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeEntityHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeKDTreeNodeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeLeafObjectHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeKDTreeRopeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeCompactKDTreeNodeHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeLeafSphereHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeLeafEntityIndexHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+	DeviceMemoryPool::Handle computeLightHeapAllocation = DeviceMemoryPool::INVALID_HANDLE;
+
+	HeapUploadStaging entityHeapStaging;
+	HeapUploadStaging lightHeapStaging;
+	HeapUploadStaging leafSphereHeapStaging;
+	HeapUploadStaging materialHeapStaging;
+
+	size_t computeMaterialHeapOffset = -1;
+	nmath::Vector3f kdTreePosition;													// NOTE: What the kd-tree argument was last set with, so that a rebind doesn't need the scene.
+	nmath::Vector3f kdTreeSize;
+
+	void waitForStagedUploads(HeapUploadStaging& staging);
+
+	// NOTE: If the pool got rebuilt since the last call, every heap sits in a new sub-buffer, so this points the heaps and the shader (if there is one) at the new ones.
+	void rebindMemoryPool(RaytracingShader* raytracingShader);
+
+	// NOTE: Uploads only the dirty ranges if the length didn't change, otherwise writes the whole heap like transferOptionalSceneBuffer.
+	ErrorCode transferDirtyHeap(DeviceMemoryPool::Handle& allocation, cl_mem& computeHeap, size_t& computeHeapLength, const void* heap, size_t heapLength, size_t elementSize, const DirtyRanges& dirtyRanges, HeapUploadStaging& staging, bool& heapChanged,
+								ErrorCode writeFailedError, ErrorCode reallocationFailedError);
+
+	// NOTE: Everything transferScene does except the rebind, which it does afterwards no matter how this went.
+	ErrorCode transferSceneHeaps(const Scene& scene, RaytracingShader* raytracingShader);
+
+	// NOTE: Writes the whole buffer into its region of the pool, which only grows if the buffer doesn't fit anymore. An empty buffer keeps its region, so it doesn't have to grow again when it comes back.
+	ErrorCode transferOptionalSceneBuffer(DeviceMemoryPool::Handle& allocation, cl_mem& computeBuffer, size_t& computeBufferLength, const void* data, size_t length, size_t elementSize, bool& bufferChanged,
+											ErrorCode writeFailedError, ErrorCode reallocationFailedError);
+
+public:
+	cl_mem computeMaterialHeap;
+	size_t computeMaterialHeapLength = 0;
+
+	cl_mem computeEntityHeap;
+	size_t computeEntityHeapLength = 0;
+	cl_mem computeKDTreeNodeHeap;
+	size_t computeKDTreeNodeHeapLength = 0;
+	cl_mem computeLeafObjectHeap;
+	size_t computeLeafObjectHeapLength = 0;
+	cl_mem computeKDTreeRopeHeap;
+	size_t computeKDTreeRopeHeapLength = 0;
+	cl_mem computeCompactKDTreeNodeHeap;
+	size_t computeCompactKDTreeNodeHeapLength = 0;
+	cl_mem computeLeafSphereHeap;
+	size_t computeLeafSphereHeapLength = 0;
+	cl_mem computeLeafEntityIndexHeap;
+	size_t computeLeafEntityIndexHeapLength = 0;
+	cl_mem computeLightHeap;
+	size_t computeLightHeapLength = 0;
+
+	FrameProfiler* profiler = nullptr;												// NOTE: If set, every upload gets recorded into it. The queue has to have profiling turned on then.
+
+	std::vector<cl_event> uploadWaitList;											// NOTE: The uploads that the next frame has to wait for. The frame clears it once it's enqueued, the events themselves belong to the staging.
+
+	void init(cl_context context, cl_device_id device, cl_command_queue commandQueue);
+
+	// NOTE: The shader can be nullptr, then only the device copy gets updated and whoever renders with it calls bindTo afterwards. That's how RenderContext shares one copy between many shaders.
+	// WARNING: A valid state is not garanteed if these functions fail.
+	ErrorCode transferResources(const ResourceHeap& resources, RaytracingShader* raytracingShader);
+	ErrorCode transferScene(const Scene& scene, RaytracingShader* raytracingShader);
+
+	// NOTE: Points every heap argument of the shader at this copy, no matter what it was set to before.
+	void bindTo(RaytracingShader* raytracingShader) const;
+
+	void finishUploads();
+
+	bool release();
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+
+#include <vector>
+#include <algorithm>
+
+/*
+
+NOTE: Keeps track of which elements of a heap changed since the last upload, so that the renderer only has to send those.
+	- The ranges are half-open ([start, end)), sorted and never overlap or touch. Marking a range merges it with every range it overlaps or touches.
+	- Once there are more than maxRangeCount ranges, everything collapses into one range that covers all of them. Past that point,
+		one big write is cheaper than lots of small ones plus the bookkeeping.
+	- markAll uses an end of SIZE_MAX, which the renderer clamps to the heap length. That way, it doesn't need to know how long the heap is.
+
+*/
+
+class DirtyRanges {
+public:
+	struct Range {
+		size_t start;
+		size_t end;
+	};
+
+private:
+	std::vector<Range> ranges;
+
+public:
+	size_t maxRangeCount = 64;
+
+	constexpr DirtyRanges() = default;
+
+	void mark(size_t start, size_t count = 1) {
+		if (count == 0) { return; }
+		size_t end = count > SIZE_MAX - start ? SIZE_MAX : start + count;
+
+		// NOTE: First range that ends at or after start. Everything before it neither overlaps nor touches the new range.
+		auto first = std::lower_bound(ranges.begin(), ranges.end(), start, [](const Range& range, size_t value) { return range.end < value; });
+		auto last = first;
+		while (last != ranges.end() && last->start <= end) {
+			start = std::min(start, last->start);
+			end = std::max(end, last->end);
+			last++;
+		}
+		first = ranges.erase(first, last);
+		ranges.insert(first, { start, end });
+
+		if (ranges.size() > maxRangeCount) {
+			Range all = { ranges.front().start, ranges.back().end };
+			ranges.clear();
+			ranges.push_back(all);
+		}
+	}
+
+	void markAll() {
+		ranges.clear();
+		ranges.push_back({ 0, SIZE_MAX });
+	}
+
+	void clear() { ranges.clear(); }
+
+	bool empty() const { return ranges.empty(); }
+
+	const std::vector<Range>& getRanges() const { return ranges; }
+};
@@ -64,7 +64,25 @@ public:
 		DEVICE_ENQUEUE_AVERAGE_FAILED_KERNEL_ARGS_UNSPECIFIED,
 		DEVICE_ENQUEUE_AVERAGE_FAILED_INSUFFICIENT_MEM,
 		DEVICE_ENQUEUE_AVERAGE_FAILED,
-		DEVICE_WAIT_FOR_RENDER_AND_AVERAGE_FAILED
+		DEVICE_WAIT_FOR_RENDER_AND_AVERAGE_FAILED,
+		DEVICE_KD_TREE_ROPE_HEAP_WRITE_FAILED,
+		DEVICE_RELEASE_KD_TREE_ROPE_HEAP_FAILED,
+		DEVICE_KD_TREE_ROPE_HEAP_REALLOCATION_AND_WRITE_FAILED,
+		DEVICE_COMPACT_KD_TREE_NODE_HEAP_WRITE_FAILED,
+		DEVICE_RELEASE_COMPACT_KD_TREE_NODE_HEAP_FAILED,
+		DEVICE_COMPACT_KD_TREE_NODE_HEAP_REALLOCATION_AND_WRITE_FAILED,
+		DEVICE_LEAF_SPHERE_HEAP_WRITE_FAILED,
+		DEVICE_RELEASE_LEAF_SPHERE_HEAP_FAILED,
+		DEVICE_LEAF_SPHERE_HEAP_REALLOCATION_AND_WRITE_FAILED,
+		FRAME_PIPELINE_FULL,
+		FRAME_PIPELINE_EMPTY,
+		DEVICE_ENQUEUE_READ_FRAME_FAILED,
+		DEVICE_MAP_FRAME_FAILED,
+		DEVICE_UNMAP_FRAME_FAILED,
+		DEVICE_CONTEXT_CREATION_FAILED,
+		DEVICE_COMMAND_QUEUE_CREATION_FAILED,
+		SHADER_VARIANT_WORK_GROUP_SIZE_TOO_SMALL,
+		SHADER_BUFFER_ALLOCATION_FAILED
 	};
 
 private:
@@ -0,0 +1,102 @@
+#include "FrameProfiler.h"
+
+#include <cstdio>
+#include <cinttypes>
+#include <algorithm>
+
+static const char* const profileStageNames[] = { "trace", "resolve", "read frame", "upload", "sort" };
+static_assert(sizeof(profileStageNames) / sizeof(profileStageNames[0]) == (size_t)ProfileStage::COUNT, "Every stage needs a name.");
+
+const char* getProfileStageName(ProfileStage stage) { return profileStageNames[(size_t)stage]; }
+
+void FrameProfiler::record(ProfileStage stage, cl_event startEvent, cl_event endEvent) {
+	if (clRetainEvent(startEvent) != CL_SUCCESS) { return; }
+	if (clRetainEvent(endEvent) != CL_SUCCESS) { clReleaseEvent(startEvent); return; }
+	pendingRecords.push_back({ stage, currentFrameIndex, startEvent, endEvent });
+}
+
+void FrameProfiler::collect() {
+	size_t keptCount = 0;
+	for (size_t i = 0; i < pendingRecords.size(); i++) {
+		PendingRecord& pending = pendingRecords[i];
+		cl_int status;
+		if (clGetEventInfo(pending.endEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr) != CL_SUCCESS) { status = -1; }
+		if (status > CL_COMPLETE) { pendingRecords[keptCount++] = pending; continue; }			// NOTE: Still queued, submitted or running.
+
+		// NOTE: A negative status means the command failed. There are no timestamps then, same as when the queue can't profile.
+		ProfileRecord record = { pending.stage, pending.frameIndex };
+		if (status == CL_COMPLETE &&
+			clGetEventProfilingInfo(pending.startEvent, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &record.queued, nullptr) == CL_SUCCESS &&
+			clGetEventProfilingInfo(pending.startEvent, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &record.submitted, nullptr) == CL_SUCCESS &&
+			clGetEventProfilingInfo(pending.startEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &record.started, nullptr) == CL_SUCCESS &&
+			clGetEventProfilingInfo(pending.endEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &record.ended, nullptr) == CL_SUCCESS) {
+			// NOTE: Uploads from different transfers can complete out of order, so the record gets sorted in by frame.
+			auto position = std::upper_bound(records.begin(), records.end(), record.frameIndex, [](uint64_t frameIndex, const ProfileRecord& right) { return frameIndex < right.frameIndex; });
+			records.insert(position, record);
+		}
+		clReleaseEvent(pending.startEvent);
+		clReleaseEvent(pending.endEvent);
+	}
+	pendingRecords.resize(keptCount);
+	trimWindow();
+}
+
+void FrameProfiler::trimWindow() {
+	if (currentFrameIndex <= windowFrameCount) { return; }
+	uint64_t oldestFrameIndex = currentFrameIndex - windowFrameCount;
+	while (!records.empty() && records.front().frameIndex < oldestFrameIndex) { records.pop_front(); }
+}
+
+ProfileStageStatistics FrameProfiler::getStageStatistics(ProfileStage stage) const {
+	std::vector<double> durations;
+	for (const ProfileRecord& record : records) {
+		if (record.stage == stage) { durations.push_back((record.ended - record.started) / 1000000.0); }
+	}
+	if (durations.empty()) { return { 0, 0, 0, 0, 0 }; }
+
+	std::sort(durations.begin(), durations.end());
+	double sum = 0;
+	for (double duration : durations) { sum += duration; }
+	// NOTE: Nearest rank, so p99 of a handful of samples is just the slowest one.
+	auto percentile = [&durations](double percent) { return durations[std::min(durations.size() - 1, (size_t)(percent / 100 * durations.size()))]; };
+	return { durations.size(), durations.front(), sum / durations.size(), percentile(95), percentile(99) };
+}
+
+bool FrameProfiler::writeChromeTrace(const char* path, uint32_t frameCount) const {
+	FILE* file = fopen(path, "w");
+	if (!file) { return false; }
+
+	uint64_t oldestFrameIndex = currentFrameIndex >= frameCount ? currentFrameIndex - frameCount : 0;
+	cl_ulong origin = (cl_ulong)-1;
+	for (const ProfileRecord& record : records) {
+		if (record.frameIndex >= oldestFrameIndex) { origin = std::min(origin, record.queued); }
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	// NOTE: The separator goes before every element, so the list stays valid JSON when there are no records in the range.
+	bool first = true;
+	for (size_t i = 0; i < (size_t)ProfileStage::COUNT; i++) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", i, profileStageNames[i]);
+		first = false;
+	}
+	for (const ProfileRecord& record : records) {
+		if (record.frameIndex < oldestFrameIndex) { continue; }
+		// NOTE: Chrome traces are in microseconds. The queue latencies go into the args, so the bars themselves only show the execution.
+		fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"device\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%" PRIu64 ",\"queuedToSubmitUs\":%.3f,\"submitToStartUs\":%.3f}}",
+				first ? "" : ",\n", getProfileStageName(record.stage), (int)record.stage, (record.started - origin) / 1000.0, (record.ended - record.started) / 1000.0,
+				record.frameIndex, (record.submitted - record.queued) / 1000.0, (record.started - record.submitted) / 1000.0);
+		first = false;
+	}
+	fprintf(file, "\n]}\n");
+
+	bool successful = !ferror(file);
+	if (fclose(file) != 0) { successful = false; }
+	return successful;
+}
+
+void FrameProfiler::reset() {
+	for (PendingRecord& pending : pendingRecords) { clReleaseEvent(pending.startEvent); clReleaseEvent(pending.endEvent); }
+	pendingRecords.clear();
+	records.clear();
+	currentFrameIndex = 0;
+}
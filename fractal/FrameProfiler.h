@@ -0,0 +1,87 @@
+#pragma once
+
+#include "cl_bindings_and_helpers.h"
+
+#include <cstdint>
+
+#include <vector>
+#include <deque>
+
+enum class ProfileStage {
+	TRACE,							// NOTE: The raytracer kernel, or all of them from the first to the last for shaders that have more than one.
+	RESOLVE,						// NOTE: The averaging or accumulating kernel. Not there in fused mode.
+	READ_FRAME,						// NOTE: The read or map of the frame back to the host.
+	UPLOAD,							// NOTE: Every write that transferScene and transferResources enqueue, plus the copies of a memory pool rebuild. They count towards the frame that gets submitted after them.
+	SORT,							// NOTE: Every ray sort that WavefrontShader does, from the key kernel to the gather. These are part of TRACE as well.
+	COUNT
+};
+
+const char* getProfileStageName(ProfileStage stage);
+
+// NOTE: The four timestamps OpenCL gives us for one command, in nanoseconds on the device clock.
+struct ProfileRecord {
+	ProfileStage stage;
+	uint64_t frameIndex;
+	cl_ulong queued;
+	cl_ulong submitted;
+	cl_ulong started;
+	cl_ulong ended;
+};
+
+// NOTE: Execution times (started to ended) of the records of one stage in the window, in milliseconds.
+struct ProfileStageStatistics {
+	size_t sampleCount;
+	double min;
+	double mean;
+	double p95;
+	double p99;
+};
+
+/*
+
+NOTE: Collects the timestamps of the commands that Renderer enqueues, for finding out where the frame time goes.
+	- Renderer hands every command's event to record. The event is retained until it completes and collect has read its timestamps.
+	- collect never waits. Records of commands that aren't done yet just stay pending until the next call.
+	- Only the last windowFrameCount frames are kept, everything older falls out of the statistics and the trace.
+	- The queue has to be created with CL_QUEUE_PROFILING_ENABLE, otherwise the timestamps can't be read and the records get dropped. That's why profiling can only be turned on at init.
+
+*/
+
+class FrameProfiler {
+	struct PendingRecord {
+		ProfileStage stage;
+		uint64_t frameIndex;
+		cl_event startEvent;
+		cl_event endEvent;
+	};
+
+	std::vector<PendingRecord> pendingRecords;
+	std::deque<ProfileRecord> records;											// NOTE: Oldest first, sorted by frameIndex.
+
+	uint64_t currentFrameIndex = 0;
+
+	void trimWindow();
+
+public:
+	uint32_t windowFrameCount = 256;
+
+	// NOTE: Called once a frame's commands are all enqueued. Everything recorded from here on belongs to the next frame.
+	void nextFrame() { currentFrameIndex++; }
+	uint64_t getCurrentFrameIndex() const { return currentFrameIndex; }
+
+	// NOTE: Doesn't take the caller's reference, the caller can release the event right after.
+	void record(ProfileStage stage, cl_event event) { record(stage, event, event); }
+	// NOTE: For stages that take more than one command. The record spans from startEvent's command to endEvent's, the queue being in-order means that endEvent finishes last.
+	void record(ProfileStage stage, cl_event startEvent, cl_event endEvent);
+
+	void collect();
+
+	ProfileStageStatistics getStageStatistics(ProfileStage stage) const;
+	const std::deque<ProfileRecord>& getRecords() const { return records; }
+
+	// NOTE: Writes the records of the last frameCount frames as a Chrome trace (chrome://tracing, Perfetto). Every stage gets its own track, timestamps start at the oldest command.
+	bool writeChromeTrace(const char* path, uint32_t frameCount) const;
+
+	// NOTE: Waits for nothing, just drops the pending events and the window.
+	void reset();
+};
@@ -12,6 +12,49 @@ struct KDTreeNode {
 	//char dimension;
 };
 
+#define KD_TREE_NO_ROPE ((uint64_t)-1)
+
+/*
+
+NOTE: Ropes are links from every face of a leaf to the node on the other side of that face (or KD_TREE_NO_ROPE if the face is on the edge of the tree).
+	- Face indices go -x, +x, -y, +y, -z, +z.
+	- The rope points at the smallest node that still covers the whole face, so a ray that leaves through the face only has to go down from there, never up.
+	- The kernel also needs to know the bounds of whatever node it lands in, which is why we store the bounds of every node in here as well.
+	- Rope entries of inner nodes aren't used.
+
+*/
+struct KDTreeNodeRopes {
+	nmath::Vector3f position;
+	alignas(16) nmath::Vector3f size;
+	alignas(16) uint64_t ropes[6];
+};
+
+#define COMPACT_KD_TREE_LEAF_AXIS 3
+#define COMPACT_KD_TREE_MAX_INDEX ((uint32_t)-1 >> 2)
+
+/*
+
+NOTE: Compact version of KDTreeNode (8 bytes instead of 24):
+	- header: The first two bits are the split axis, or COMPACT_KD_TREE_LEAF_AXIS for leaves. The other 30 bits are the index of the left child for inner nodes
+		(the right child is always right after it) and the offset into leafObjectHeap for leaves.
+	- The second word is the absolute position of the split plane for inner nodes and the object count for leaves.
+	- No parent index, since a tree with absolute splits can't be walked back up anyway. The kernel restarts from the root instead.
+
+*/
+struct CompactKDTreeNode {
+	uint32_t header;
+	union {
+		float split;
+		uint32_t objectCount;
+	};
+};
+
+// NOTE: One of these per leafObjectHeap entry, so that the kernel can test a leaf's spheres without going through the entities. Position + radius line up with a float4 on the device.
+struct alignas(16) LeafSphere {
+	nmath::Vector3f position;
+	float radius;
+};
+
 struct KDTree {
 	nmath::Vector3f position;
 	alignas(16) nmath::Vector3f size;
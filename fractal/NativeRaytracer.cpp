@@ -0,0 +1,454 @@
+#include "NativeRaytracer.h"
+
+#include "nmath/matrices/Matrix4f.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <vector>
+
+#include <new>
+
+// NOTE: SSE2 is always there on x64, MSVC doesn't define __SSE2__ for it though. AVX2 has to be turned on in the build (/arch:AVX2 or -mavx2), we never check for it at runtime.
+#if defined(__AVX2__)
+#define NATIVE_RAYTRACER_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NATIVE_RAYTRACER_SSE
+#endif
+
+#if defined(NATIVE_RAYTRACER_AVX2)
+#include <immintrin.h>
+#elif defined(NATIVE_RAYTRACER_SSE)
+#include <emmintrin.h>
+#endif
+
+#define NATIVE_NO_LEAF_OBJECT ((uint64_t)-1)
+#define NATIVE_TRAVERSAL_STACK_SIZE 128										// NOTE: Way deeper than Scene::kdTreeMaxDepth ever goes. Anything beyond it goes into NativeTraversalStack::overflow.
+
+// NOTE: Small float3 stand-in, so that the math below reads the same as in raytracer.cl.
+struct NativeFloat3 {
+	float x;
+	float y;
+	float z;
+
+	NativeFloat3 operator+(NativeFloat3 right) const { return { x + right.x, y + right.y, z + right.z }; }
+	NativeFloat3 operator-(NativeFloat3 right) const { return { x - right.x, y - right.y, z - right.z }; }
+	NativeFloat3 operator*(NativeFloat3 right) const { return { x * right.x, y * right.y, z * right.z }; }
+	NativeFloat3 operator*(float right) const { return { x * right, y * right, z * right }; }
+	NativeFloat3 operator/(float right) const { return { x / right, y / right, z / right }; }
+	NativeFloat3& operator+=(NativeFloat3 right) { x += right.x; y += right.y; z += right.z; return *this; }
+	NativeFloat3& operator-=(NativeFloat3 right) { x -= right.x; y -= right.y; z -= right.z; return *this; }
+	NativeFloat3& operator*=(NativeFloat3 right) { x *= right.x; y *= right.y; z *= right.z; return *this; }
+	float operator[](int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+};
+
+static inline NativeFloat3 toNativeFloat3(nmath::Vector3f vector) { return { vector.x, vector.y, vector.z }; }
+static inline float dot(NativeFloat3 left, NativeFloat3 right) { return left.x * right.x + left.y * right.y + left.z * right.z; }
+static inline NativeFloat3 normalize(NativeFloat3 vector) { return vector * (1 / sqrtf(dot(vector, vector))); }
+
+// NOTE: Everything a traversal needs to know about the ray. The SSE copies are there so the box tests don't have to build them over and over.
+struct NativeRay {
+	NativeFloat3 origin;
+	NativeFloat3 direction;
+	NativeFloat3 inverseDirection;
+	float directionLengthSquared;
+#ifdef NATIVE_RAYTRACER_SSE
+	__m128 origin4;
+	__m128 inverseDirection4;
+#endif
+
+	void set(NativeFloat3 origin, NativeFloat3 direction) {
+		this->origin = origin;
+		this->direction = direction;
+		inverseDirection = { 1 / direction.x, 1 / direction.y, 1 / direction.z };
+		directionLengthSquared = dot(direction, direction);
+#ifdef NATIVE_RAYTRACER_SSE
+		origin4 = _mm_setr_ps(origin.x, origin.y, origin.z, 0);
+		inverseDirection4 = _mm_setr_ps(inverseDirection.x, inverseDirection.y, inverseDirection.z, 0);
+#endif
+	}
+};
+
+// NOTE: Same as initRandSeed, randInt and randFloat in raytracer.cl, so the same pixel gets the same random numbers on both.
+static inline uint64_t initRandSeed(uint32_t x, uint32_t y, uint32_t frameWidth, uint32_t sampleIndex) {
+	return (((uint64_t)y * (uint64_t)frameWidth + (uint64_t)x) << 32) | (uint32_t)(sampleIndex * 2654435761u);
+}
+static inline uint32_t randInt(uint64_t& seed) {
+	seed *= 1345678;
+	return seed >> 32;
+}
+static inline float randFloat(uint64_t& seed) { return randInt(seed) * (1 / (float)((uint32_t)-1)); }
+
+static inline NativeFloat3 sampleSkybox(NativeFloat3 ray) {
+	ray = normalize(ray);
+	return { fabsf(ray.x), fabsf(ray.y), fabsf(ray.z) };
+}
+
+static inline NativeFloat3 calculateBounceRay(NativeFloat3 ray, NativeFloat3 normal, float reflectivity, uint64_t& randSeed) {
+	float dotIncomingRayNormal = dot(ray, normal);
+	NativeFloat3 reflectedRay = ray - normal * (dotIncomingRayNormal * 2);
+	NativeFloat3 diffuseRay;
+	diffuseRay.x = randFloat(randSeed) * 2 - 1;						// NOTE: Separate statements, so the random numbers get drawn in the same order as on the device.
+	diffuseRay.y = randFloat(randSeed) * 2 - 1;
+	diffuseRay.z = randFloat(randSeed) * 2 - 1;
+	diffuseRay = normalize(diffuseRay);
+	float dotUnadjustedDiffuseRayNormal = dot(diffuseRay, normal);
+	if (dotUnadjustedDiffuseRayNormal < 0) { diffuseRay -= normal * (dotUnadjustedDiffuseRayNormal * 2); }
+	NativeFloat3 diffReflectedDiffuse = reflectedRay - diffuseRay;
+	return normalize(diffuseRay + diffReflectedDiffuse * reflectivity);
+}
+
+// NOTE: Same as rayIntersectAABBInterval in raytracer.cl.
+static inline bool intersectAABBInterval(const NativeRay& ray, NativeFloat3 startPosition, NativeFloat3 size, float& entryDistance, float& exitDistance) {
+#ifdef NATIVE_RAYTRACER_SSE
+	__m128 start = _mm_setr_ps(startPosition.x, startPosition.y, startPosition.z, 0);
+	__m128 stop = _mm_add_ps(start, _mm_setr_ps(size.x, size.y, size.z, 0));
+	__m128 startDistances = _mm_mul_ps(_mm_sub_ps(start, ray.origin4), ray.inverseDirection4);
+	__m128 stopDistances = _mm_mul_ps(_mm_sub_ps(stop, ray.origin4), ray.inverseDirection4);
+	__m128 nearDistances = _mm_min_ps(startDistances, stopDistances);
+	__m128 farDistances = _mm_max_ps(startDistances, stopDistances);
+	// NOTE: Only x, y and z count, the w lane is garbage.
+	float nearDistance = _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(nearDistances, _mm_shuffle_ps(nearDistances, nearDistances, _MM_SHUFFLE(1, 1, 1, 1))), _mm_movehl_ps(nearDistances, nearDistances)));
+	float farDistance = _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(farDistances, _mm_shuffle_ps(farDistances, farDistances, _MM_SHUFFLE(1, 1, 1, 1))), _mm_movehl_ps(farDistances, farDistances)));
+#else
+	NativeFloat3 stopPosition = startPosition + size;
+	float nearDistance = -std::numeric_limits<float>::infinity();
+	float farDistance = std::numeric_limits<float>::infinity();
+	for (int axis = 0; axis < 3; axis++) {
+		float startDistance = (startPosition[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+		float stopDistance = (stopPosition[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+		nearDistance = std::max(nearDistance, std::min(startDistance, stopDistance));
+		farDistance = std::min(farDistance, std::max(startDistance, stopDistance));
+	}
+#endif
+	entryDistance = std::max(nearDistance, 0.0f);
+	exitDistance = farDistance;
+	return farDistance >= 0 && nearDistance <= farDistance;
+}
+
+// NOTE: Same as intersectLineSphere in raytracer.cl. Since the ray length is never 0, d1 is always the smaller root, so the branches collapse into the one line at the end.
+static inline float intersectSphere(const NativeRay& ray, const LeafSphere& sphere) {
+	NativeFloat3 offset = ray.origin - toNativeFloat3(sphere.position);
+	float halfB = dot(offset, ray.direction) * 2;
+	float otherTerm = -halfB;
+	float determinant = halfB * halfB - 4 * ray.directionLengthSquared * (dot(offset, offset) - sphere.radius * sphere.radius);
+	if (determinant < 0) { return -1; }
+	determinant = sqrtf(determinant);
+	float d0 = (otherTerm + determinant) / ray.directionLengthSquared / 2;
+	float d1 = (otherTerm - determinant) / ray.directionLengthSquared / 2;
+	return d1 >= 0 ? d1 : (d0 >= 0 ? d0 : -1);
+}
+
+#ifdef NATIVE_RAYTRACER_SSE
+// NOTE: The same math 4 spheres at a time. The spheres are 16-byte (x, y, z, radius) records, so a 4x4 transpose turns them into one register per component.
+static inline __m128 intersectSpheres4(const NativeRay& ray, const LeafSphere* spheres) {
+	__m128 x = _mm_loadu_ps(&spheres[0].position.x);
+	__m128 y = _mm_loadu_ps(&spheres[1].position.x);
+	__m128 z = _mm_loadu_ps(&spheres[2].position.x);
+	__m128 radius = _mm_loadu_ps(&spheres[3].position.x);
+	_MM_TRANSPOSE4_PS(x, y, z, radius);
+
+	__m128 offsetX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), x);
+	__m128 offsetY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), y);
+	__m128 offsetZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), z);
+	__m128 halfB = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(offsetX, _mm_set1_ps(ray.direction.x)), _mm_mul_ps(offsetY, _mm_set1_ps(ray.direction.y))), _mm_mul_ps(offsetZ, _mm_set1_ps(ray.direction.z))), _mm_set1_ps(2));
+	__m128 offsetLengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsetX, offsetX), _mm_mul_ps(offsetY, offsetY)), _mm_mul_ps(offsetZ, offsetZ));
+	__m128 determinant = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(_mm_set1_ps(4 * ray.directionLengthSquared), _mm_sub_ps(offsetLengthSquared, _mm_mul_ps(radius, radius))));
+	__m128 hitMask = _mm_cmpge_ps(determinant, _mm_setzero_ps());
+	__m128 root = _mm_sqrt_ps(_mm_max_ps(determinant, _mm_setzero_ps()));
+	__m128 divisor = _mm_set1_ps(ray.directionLengthSquared * 2);
+	__m128 d0 = _mm_div_ps(_mm_sub_ps(root, halfB), divisor);
+	__m128 d1 = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), halfB), root), divisor);
+	__m128 d1Valid = _mm_cmpge_ps(d1, _mm_setzero_ps());
+	__m128 d0Valid = _mm_cmpge_ps(d0, _mm_setzero_ps());
+	__m128 distance = _mm_or_ps(_mm_and_ps(d1Valid, d1), _mm_andnot_ps(d1Valid, _mm_or_ps(_mm_and_ps(d0Valid, d0), _mm_andnot_ps(d0Valid, _mm_set1_ps(-1)))));
+	return _mm_or_ps(_mm_and_ps(hitMask, distance), _mm_andnot_ps(hitMask, _mm_set1_ps(-1)));
+}
+#endif
+
+#ifdef NATIVE_RAYTRACER_AVX2
+static inline __m256 intersectSpheres8(const NativeRay& ray, const LeafSphere* spheres) {
+	__m128 lowX = _mm_loadu_ps(&spheres[0].position.x);
+	__m128 lowY = _mm_loadu_ps(&spheres[1].position.x);
+	__m128 lowZ = _mm_loadu_ps(&spheres[2].position.x);
+	__m128 lowRadius = _mm_loadu_ps(&spheres[3].position.x);
+	_MM_TRANSPOSE4_PS(lowX, lowY, lowZ, lowRadius);
+	__m128 highX = _mm_loadu_ps(&spheres[4].position.x);
+	__m128 highY = _mm_loadu_ps(&spheres[5].position.x);
+	__m128 highZ = _mm_loadu_ps(&spheres[6].position.x);
+	__m128 highRadius = _mm_loadu_ps(&spheres[7].position.x);
+	_MM_TRANSPOSE4_PS(highX, highY, highZ, highRadius);
+	__m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(lowX), highX, 1);
+	__m256 y = _mm256_insertf128_ps(_mm256_castps128_ps256(lowY), highY, 1);
+	__m256 z = _mm256_insertf128_ps(_mm256_castps128_ps256(lowZ), highZ, 1);
+	__m256 radius = _mm256_insertf128_ps(_mm256_castps128_ps256(lowRadius), highRadius, 1);
+
+	__m256 offsetX = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), x);
+	__m256 offsetY = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), y);
+	__m256 offsetZ = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), z);
+	__m256 halfB = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(offsetX, _mm256_set1_ps(ray.direction.x)), _mm256_mul_ps(offsetY, _mm256_set1_ps(ray.direction.y))), _mm256_mul_ps(offsetZ, _mm256_set1_ps(ray.direction.z))), _mm256_set1_ps(2));
+	__m256 offsetLengthSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(offsetX, offsetX), _mm256_mul_ps(offsetY, offsetY)), _mm256_mul_ps(offsetZ, offsetZ));
+	__m256 determinant = _mm256_sub_ps(_mm256_mul_ps(halfB, halfB), _mm256_mul_ps(_mm256_set1_ps(4 * ray.directionLengthSquared), _mm256_sub_ps(offsetLengthSquared, _mm256_mul_ps(radius, radius))));
+	__m256 hitMask = _mm256_cmp_ps(determinant, _mm256_setzero_ps(), _CMP_GE_OQ);
+	__m256 root = _mm256_sqrt_ps(_mm256_max_ps(determinant, _mm256_setzero_ps()));
+	__m256 divisor = _mm256_set1_ps(ray.directionLengthSquared * 2);
+	__m256 d0 = _mm256_div_ps(_mm256_sub_ps(root, halfB), divisor);
+	__m256 d1 = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), halfB), root), divisor);
+	__m256 distance = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_set1_ps(-1), d0, _mm256_cmp_ps(d0, _mm256_setzero_ps(), _CMP_GE_OQ)), d1, _mm256_cmp_ps(d1, _mm256_setzero_ps(), _CMP_GE_OQ));
+	return _mm256_blendv_ps(_mm256_set1_ps(-1), distance, hitMask);
+}
+#endif
+
+// NOTE: Same as intersectLeafSpheres in raytracer.cl, including which of two equally close spheres wins (the later one).
+static inline void considerLeafSphereHit(float distance, uint64_t leafObjectIndex, const uint32_t* leafEntityIndexHeap, uint32_t skipEntityIndex, float& closestDistance, uint64_t& closestLeafObjectIndex) {
+	if (distance < 0 || distance > closestDistance) { return; }
+	if (leafEntityIndexHeap[leafObjectIndex] == skipEntityIndex) { return; }
+	closestDistance = distance;
+	closestLeafObjectIndex = leafObjectIndex;
+}
+
+static uint64_t intersectLeafSpheres(const LeafSphere* leafSphereHeap, const uint32_t* leafEntityIndexHeap, uint64_t leafObjectsStart, uint64_t leafObjectsEnd,
+									const NativeRay& ray, float maxDistance, uint32_t skipEntityIndex, float& closestDistance) {
+	uint64_t closestLeafObjectIndex = NATIVE_NO_LEAF_OBJECT;
+	closestDistance = maxDistance;
+	uint64_t i = leafObjectsStart;
+#ifdef NATIVE_RAYTRACER_AVX2
+	for (; i + 8 <= leafObjectsEnd; i += 8) {
+		float distances[8];
+		_mm256_storeu_ps(distances, intersectSpheres8(ray, leafSphereHeap + i));
+		for (int lane = 0; lane < 8; lane++) { considerLeafSphereHit(distances[lane], i + lane, leafEntityIndexHeap, skipEntityIndex, closestDistance, closestLeafObjectIndex); }
+	}
+#endif
+#ifdef NATIVE_RAYTRACER_SSE
+	for (; i + 4 <= leafObjectsEnd; i += 4) {
+		float distances[4];
+		_mm_storeu_ps(distances, intersectSpheres4(ray, leafSphereHeap + i));
+		for (int lane = 0; lane < 4; lane++) { considerLeafSphereHit(distances[lane], i + lane, leafEntityIndexHeap, skipEntityIndex, closestDistance, closestLeafObjectIndex); }
+	}
+#endif
+	for (; i < leafObjectsEnd; i++) { considerLeafSphereHit(intersectSphere(ray, leafSphereHeap[i]), i, leafEntityIndexHeap, skipEntityIndex, closestDistance, closestLeafObjectIndex); }
+	return closestLeafObjectIndex;
+}
+
+struct NativeTraversalStackEntry {
+	uint64_t nodeIndex;
+	NativeFloat3 position;
+	NativeFloat3 size;
+	float entryDistance;
+	float exitDistance;
+};
+
+// NOTE: The far children that still have to be visited. The array covers every tree that the builder makes, the vector only allocates if one is ever deeper than that, so no subtree gets lost.
+struct NativeTraversalStack {
+	NativeTraversalStackEntry entries[NATIVE_TRAVERSAL_STACK_SIZE];
+	size_t size = 0;
+	std::vector<NativeTraversalStackEntry> overflow;							// NOTE: Only used while entries is full, so its top is always the top of the whole stack.
+
+	bool empty() const { return size == 0 && overflow.empty(); }
+	void push(const NativeTraversalStackEntry& entry) {
+		if (size < NATIVE_TRAVERSAL_STACK_SIZE) { entries[size++] = entry; }
+		else { overflow.push_back(entry); }
+	}
+	NativeTraversalStackEntry pop() {
+		if (overflow.empty()) { return entries[--size]; }
+		NativeTraversalStackEntry entry = overflow.back();
+		overflow.pop_back();
+		return entry;
+	}
+};
+
+// NOTE: Finds the closest hit along the ray by visiting the leaves front to back, which is the order the rope and compact kernels visit them in.
+// NOTE: The splits are percentages like for the parent-link kernel, so the child bounds get rebuilt on the way down and stored on the stack for the far children.
+static uint64_t findClosestHit(const Scene& scene, const NativeRay& ray, float entryDistance, float exitDistance, uint32_t skipEntityIndex, float& closestDistance) {
+	NativeTraversalStack stack;
+	NativeTraversalStackEntry current = { 0, toNativeFloat3(scene.kdTree.position), toNativeFloat3(scene.kdTree.size), entryDistance, exitDistance };
+
+	while (true) {
+		const KDTreeNode* node = &scene.kdTreeNodeHeap[current.nodeIndex];
+		while (node->objectCount == (uint32_t)-1) {
+			int splitAxis = (int)(node->childrenIndex >> (sizeof(uint64_t) * 8 - 2));
+			uint64_t childrenIndex = node->childrenIndex & ((uint64_t)-1 >> 2);
+
+			NativeTraversalStackEntry left = current;
+			NativeTraversalStackEntry right = current;
+			left.nodeIndex = childrenIndex;
+			right.nodeIndex = childrenIndex + 1;
+			float leftSize = current.size[splitAxis] * node->split;
+			float rightSize = current.size[splitAxis] * (1 - node->split);
+			float splitPosition = current.position[splitAxis] + leftSize;
+			switch (splitAxis) {
+			case 0: left.size.x = leftSize; right.size.x = rightSize; right.position.x = splitPosition; break;
+			case 1: left.size.y = leftSize; right.size.y = rightSize; right.position.y = splitPosition; break;
+			default: left.size.z = leftSize; right.size.z = rightSize; right.position.z = splitPosition; break;
+			}
+
+			float originComponent = ray.origin[splitAxis];
+			float rayComponent = ray.direction[splitAxis];
+			float splitDistance = (splitPosition - originComponent) * ray.inverseDirection[splitAxis];
+			// NOTE: An origin right on the split plane counts as being on the side the ray is headed for, same as in the kernels.
+			bool originIsLeft = originComponent < splitPosition || (originComponent == splitPosition && rayComponent < 0);
+			NativeTraversalStackEntry& nearChild = originIsLeft ? left : right;
+			NativeTraversalStackEntry& farChild = originIsLeft ? right : left;
+
+			if (rayComponent == 0 || splitDistance <= 0 || splitDistance > current.exitDistance) { current = nearChild; }
+			else if (splitDistance <= current.entryDistance) { current = farChild; }
+			else {
+				farChild.entryDistance = splitDistance;
+				stack.push(farChild);
+				nearChild.exitDistance = splitDistance;
+				current = nearChild;
+			}
+			node = &scene.kdTreeNodeHeap[current.nodeIndex];
+		}
+
+		// NOTE: Hits behind the leaf belong to a later leaf and could be hidden by something in between, so they have to wait until we get there.
+		uint64_t closestLeafObjectIndex = intersectLeafSpheres(scene.leafSphereHeap.data(), scene.leafEntityIndexHeap.data(), node->childrenIndex, node->childrenIndex + node->objectCount,
+																ray, current.exitDistance, skipEntityIndex, closestDistance);
+		if (closestLeafObjectIndex != NATIVE_NO_LEAF_OBJECT) { return closestLeafObjectIndex; }
+		if (stack.empty()) { return NATIVE_NO_LEAF_OBJECT; }
+		current = stack.pop();
+	}
+}
+
+static NativeFloat3 traceRay(const Scene& scene, const ResourceHeap& resources, NativeFloat3 cameraPos, NativeFloat3 direction, char maxBounces, uint64_t& randSeed) {
+	if (scene.kdTreeNodeHeap.size() == 0) { return sampleSkybox(direction); }
+
+	NativeRay ray;
+	ray.set(cameraPos, direction);
+	float entryDistance;
+	float exitDistance;
+	if (!intersectAABBInterval(ray, toNativeFloat3(scene.kdTree.position), toNativeFloat3(scene.kdTree.size), entryDistance, exitDistance)) { return sampleSkybox(direction); }
+
+	uint32_t lastHitEntityIndex = (uint32_t)-1;
+	// NOTE: The kernels also keep a colorSum, but nothing ever gets added to it until point lights are in, so what comes out is always the color product.
+	NativeFloat3 colorProduct = { 1, 1, 1 };
+
+	while (true) {
+		float closestDistance;
+		uint64_t closestLeafObjectIndex = findClosestHit(scene, ray, entryDistance, exitDistance, lastHitEntityIndex, closestDistance);
+		if (closestLeafObjectIndex == NATIVE_NO_LEAF_OBJECT || maxBounces == 0) { return colorProduct; }
+
+		uint32_t closestEntityIndex = scene.leafEntityIndexHeap[closestLeafObjectIndex];
+		uint32_t materialIndex = scene.entityHeap[closestEntityIndex].material;
+		float reflectivity = 0;
+		if (materialIndex < resources.materialHeapLength) {				// NOTE: The kernel just reads whatever is there. We'd rather not crash.
+			colorProduct *= toNativeFloat3(resources.materialHeap[materialIndex].color);
+			reflectivity = resources.materialHeap[materialIndex].reflectivity;
+		}
+		NativeFloat3 closestHitPoint = ray.origin + ray.direction * closestDistance;
+		NativeFloat3 normal = normalize(closestHitPoint - toNativeFloat3(scene.leafSphereHeap[closestLeafObjectIndex].position));
+		ray.set(closestHitPoint, calculateBounceRay(ray.direction, normal, reflectivity, randSeed));
+		lastHitEntityIndex = closestEntityIndex;
+		maxBounces--;
+		// NOTE: The hit point is inside the tree, so this only fails if it's right on the edge and the new ray points outwards.
+		if (!intersectAABBInterval(ray, toNativeFloat3(scene.kdTree.position), toNativeFloat3(scene.kdTree.size), entryDistance, exitDistance)) { return colorProduct; }
+	}
+}
+
+static inline unsigned char saturateToByte(float value) { return (unsigned char)std::min(std::max(value, 0.0f), 255.0f); }
+
+NativeRaytracer::NativeRaytracer(size_t threadCount) : threadPool(threadCount) {
+	cameraPosition[0] = 0; cameraPosition[1] = 0; cameraPosition[2] = 0;
+	std::memset(cameraRotation, 0, sizeof(cameraRotation));
+	cameraRotation[0] = 1; cameraRotation[5] = 1; cameraRotation[10] = 1; cameraRotation[15] = 1;
+	rayOrigin = 1;
+}
+
+void NativeRaytracer::setCameraPosition(nmath::Vector3f position) {
+	cameraPosition[0] = position.x;
+	cameraPosition[1] = position.y;
+	cameraPosition[2] = position.z;
+}
+
+void NativeRaytracer::setCameraRotation(nmath::Vector3f rotation) {
+	nmath::Matrix4f rotationMatrix = nmath::Matrix4f::createRotation(rotation);
+	static_assert(sizeof(rotationMatrix) == sizeof(cameraRotation), "The kernel reads Matrix4f as 16 floats, so do we.");
+	std::memcpy(cameraRotation, &rotationMatrix, sizeof(cameraRotation));
+}
+
+void NativeRaytracer::setRayOrigin(float rayOrigin) { this->rayOrigin = rayOrigin; }
+void NativeRaytracer::setSampleIndex(uint32_t sampleIndex) { this->sampleIndex = sampleIndex; }
+void NativeRaytracer::setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) { this->samplesPerPixelSideLength = samplesPerPixelSideLength; }
+void NativeRaytracer::setMaxBounces(uint8_t maxBounces) { this->maxBounces = maxBounces > 127 ? 127 : maxBounces; }
+
+void NativeRaytracer::setAccumulation(bool accumulate, uint32_t accumulatedFrameCount) {
+	this->accumulate = accumulate && accumulationFrame != nullptr;
+	this->accumulatedFrameCount = accumulatedFrameCount;
+}
+
+bool NativeRaytracer::resizeAccumulationFrame(uint32_t frameWidth, uint32_t frameHeight) {
+	accumulationFrame.reset(new (std::nothrow) float[(size_t)frameWidth * frameHeight * 4]);
+	accumulationFrameWidth = accumulationFrame ? frameWidth : 0;
+	accumulationFrameHeight = accumulationFrame ? frameHeight : 0;
+	accumulate = false;
+	return accumulationFrame != nullptr;
+}
+
+void NativeRaytracer::renderTile(const Scene& scene, const ResourceHeap& resources, char* frame, uint32_t frameWidth, uint32_t frameHeight, const NativeFrameLayout& frameLayout,
+								uint32_t tileX, uint32_t tileY, uint32_t tileWidth, uint32_t tileHeight) const {
+	NativeFloat3 cameraPos = { cameraPosition[0], cameraPosition[1], cameraPosition[2] };
+	int sampleGridWidth = frameWidth * samplesPerPixelSideLength;
+	int sampleGridHeight = frameHeight * samplesPerPixelSideLength;
+	bool accumulateTile = accumulate && accumulationFrameWidth == frameWidth && accumulationFrameHeight == frameHeight;
+
+	for (uint32_t y = tileY; y < tileY + tileHeight; y++) {
+		for (uint32_t x = tileX; x < tileX + tileWidth; x++) {
+			uint64_t randSeed = initRandSeed(x, y, frameWidth, sampleIndex);
+
+			NativeFloat3 colorSum = { 0, 0, 0 };
+			for (uint16_t subY = 0; subY < samplesPerPixelSideLength; subY++) {
+				for (uint16_t subX = 0; subX < samplesPerPixelSideLength; subX++) {
+					// NOTE: Same as generateCameraRay in raytracer.cl.
+					int sampleX = x * samplesPerPixelSideLength + subX;
+					int sampleY = y * samplesPerPixelSideLength + subY;
+					NativeFloat3 ray;
+					ray.x = sampleX - sampleGridWidth / 2 + randFloat(randSeed);
+					ray.y = -sampleY + sampleGridHeight / 2 - randFloat(randSeed);
+					ray.z = -rayOrigin;
+					ray = normalize(ray);
+					ray = { cameraRotation[0] * ray.x + cameraRotation[1] * ray.y + cameraRotation[2] * ray.z,
+							cameraRotation[4] * ray.x + cameraRotation[5] * ray.y + cameraRotation[6] * ray.z,
+							cameraRotation[8] * ray.x + cameraRotation[9] * ray.y + cameraRotation[10] * ray.z };
+
+					NativeFloat3 color = traceRay(scene, resources, cameraPos, ray, (char)maxBounces, randSeed);
+					colorSum += { std::min(color.x, 1.0f), std::min(color.y, 1.0f), std::min(color.z, 1.0f) };
+				}
+			}
+			NativeFloat3 color = colorSum / (float)(samplesPerPixelSideLength * samplesPerPixelSideLength);
+
+			// NOTE: Same as writeResolvedPixel in raytracer.cl. Without accumulation the device truncates, with it it rounds to nearest even, so we do too.
+			float pixel[4] = { color.x * 255, color.y * 255, color.z * 255, 255 };
+			if (accumulateTile) {
+				float* mean = accumulationFrame.get() + ((size_t)y * frameWidth + x) * 4;
+				for (int channel = 0; channel < 4; channel++) {
+					if (accumulatedFrameCount != 0) { pixel[channel] = mean[channel] + (pixel[channel] - mean[channel]) / (accumulatedFrameCount + 1); }
+					mean[channel] = pixel[channel];
+					pixel[channel] = nearbyintf(pixel[channel]);
+				}
+			}
+
+			unsigned char* destination = (unsigned char*)frame + ((size_t)y * frameWidth + x) * frameLayout.bytesPerPixel;
+			if (frameLayout.redOffset >= 0) { destination[frameLayout.redOffset] = saturateToByte(pixel[0]); }
+			if (frameLayout.greenOffset >= 0) { destination[frameLayout.greenOffset] = saturateToByte(pixel[1]); }
+			if (frameLayout.blueOffset >= 0) { destination[frameLayout.blueOffset] = saturateToByte(pixel[2]); }
+			if (frameLayout.alphaOffset >= 0) { destination[frameLayout.alphaOffset] = saturateToByte(pixel[3]); }
+		}
+	}
+}
+
+void NativeRaytracer::render(const Scene& scene, const ResourceHeap& resources, char* frame, uint32_t frameWidth, uint32_t frameHeight, const NativeFrameLayout& frameLayout) {
+	// NOTE: One task per tile. The tiles in the busy parts of the frame take way longer than the sky, that's what the work stealing evens out.
+	TaskGroup tiles(threadPool);
+	for (uint32_t tileY = 0; tileY < frameHeight; tileY += tileSize) {
+		for (uint32_t tileX = 0; tileX < frameWidth; tileX += tileSize) {
+			uint32_t tileWidth = std::min(tileSize, frameWidth - tileX);
+			uint32_t tileHeight = std::min(tileSize, frameHeight - tileY);
+			tiles.run([this, &scene, &resources, frame, frameWidth, frameHeight, &frameLayout, tileX, tileY, tileWidth, tileHeight]() {
+				renderTile(scene, resources, frame, frameWidth, frameHeight, frameLayout, tileX, tileY, tileWidth, tileHeight);
+			});
+		}
+	}
+	tiles.wait();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Scene.h"
+#include "ResourceHeap.h"
+
+#include "ThreadPool.h"
+
+#include "nmath/vectors/Vector3f.h"
+
+#include <cstdint>
+
+#include <memory>
+
+// NOTE: Where the channels go inside of a pixel. -1 means the frame doesn't have that channel. Same thing the image format does for write_imageui on the device.
+struct NativeFrameLayout {
+	unsigned char bytesPerPixel;
+	int8_t redOffset;
+	int8_t greenOffset;
+	int8_t blueOffset;
+	int8_t alphaOffset;
+};
+
+/*
+
+NOTE: The native CPU version of raytracer.cl, for machines without any OpenCL platform and as a reference to check the kernels against.
+	- Mirrors the fused kernel: same random numbers, same camera rays, same bounce shading, same accumulation. Every pixel traces all of its sub-samples.
+	- The setters are the ones from RaytracingShader, minus the cl_mem ones. Instead of buffers, render reads the host copies in Scene and ResourceHeap directly,
+		so there's no transfer step at all.
+	- The traversal is a front-to-back walk over Scene::kdTreeNodeHeap with a small stack, which spills onto the heap if a tree is ever deeper than it. It visits the same leaves
+		in the same order as the rope and compact kernels, so the hits are the same, only the way of getting from leaf to leaf is different.
+	- benchmark --compare-native renders every resolution with this as well and reports how far it is from the kernel's frame.
+	- The frame is cut into tiles that go onto a work stealing ThreadPool. Ray-box and ray-sphere tests use SSE, the leaf sphere tests go 8 wide with AVX2 if the build has it.
+
+*/
+
+class NativeRaytracer {
+	float cameraPosition[3];
+	float cameraRotation[16];
+	float rayOrigin;
+	uint32_t sampleIndex = 0;
+	uint16_t samplesPerPixelSideLength = 1;
+	uint8_t maxBounces = 10;
+
+	std::unique_ptr<float[]> accumulationFrame;									// NOTE: 4 floats per pixel, the running mean of the unrounded pixels, same as the device version.
+	uint32_t accumulationFrameWidth = 0;
+	uint32_t accumulationFrameHeight = 0;
+	bool accumulate = false;
+	uint32_t accumulatedFrameCount = 0;
+
+	ThreadPool threadPool;
+
+	void renderTile(const Scene& scene, const ResourceHeap& resources, char* frame, uint32_t frameWidth, uint32_t frameHeight, const NativeFrameLayout& frameLayout,
+					uint32_t tileX, uint32_t tileY, uint32_t tileWidth, uint32_t tileHeight) const;
+
+public:
+	uint32_t tileSize = 16;
+
+	// NOTE: A threadCount of 0 means one thread per hardware thread.
+	NativeRaytracer(size_t threadCount = 0);
+
+	void setCameraPosition(nmath::Vector3f position);
+	void setCameraRotation(nmath::Vector3f rotation);
+	void setRayOrigin(float rayOrigin);
+	void setSampleIndex(uint32_t sampleIndex);
+	void setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength);
+	void setMaxBounces(uint8_t maxBounces);										// NOTE: Capped at 127 like DefaultShaderVariant::maxBounces. Renderer mirrors RaytracingShader::getMaxBounces into here.
+	void setAccumulation(bool accumulate, uint32_t accumulatedFrameCount);		// NOTE: Same as setAccumulationFrame, except that the buffer lives in here.
+
+	// NOTE: Not having the accumulation frame only means no accumulation, same as on the device.
+	bool resizeAccumulationFrame(uint32_t frameWidth, uint32_t frameHeight);
+	bool hasAccumulationFrame() const { return accumulationFrame != nullptr; }
+
+	// NOTE: Blocks until the whole frame is done. The calling thread helps out with the tiles while it waits.
+	void render(const Scene& scene, const ResourceHeap& resources, char* frame, uint32_t frameWidth, uint32_t frameHeight, const NativeFrameLayout& frameLayout);
+};
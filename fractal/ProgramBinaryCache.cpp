@@ -0,0 +1,157 @@
+#include "ProgramBinaryCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+bool ProgramBinaryCache::enabled = true;
+std::string ProgramBinaryCache::directory;
+
+// NOTE: Bump the last character whenever the file layout changes. It's part of the key as well, so old files just stop matching.
+static constexpr char cacheFileMagic[8] = { 'F', 'R', 'C', 'L', 'B', 'I', 'N', '1' };
+
+struct CacheFileHeader {
+	char magic[8];
+	uint64_t key;
+	uint64_t binaryLength;
+};
+
+static void hashBytes(uint64_t& hash, const void* data, size_t length) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+}
+
+// NOTE: Strings go in with their terminator, so that "ab" followed by "c" doesn't hash the same as "a" followed by "bc".
+static void hashString(uint64_t& hash, const char* string) { hashBytes(hash, string, strlen(string) + 1); }
+
+static bool hashDeviceInfo(uint64_t& hash, cl_device_id device, cl_device_info info) {
+	size_t size;
+	if (clGetDeviceInfo(device, info, 0, nullptr, &size) != CL_SUCCESS) { return false; }
+	std::vector<char> value(size);
+	if (clGetDeviceInfo(device, info, size, value.data(), nullptr) != CL_SUCCESS) { return false; }
+	hashBytes(hash, value.data(), size);
+	return true;
+}
+
+static bool hashPlatformInfo(uint64_t& hash, cl_platform_id platform, cl_platform_info info) {
+	size_t size;
+	if (clGetPlatformInfo(platform, info, 0, nullptr, &size) != CL_SUCCESS) { return false; }
+	std::vector<char> value(size);
+	if (clGetPlatformInfo(platform, info, size, value.data(), nullptr) != CL_SUCCESS) { return false; }
+	hashBytes(hash, value.data(), size);
+	return true;
+}
+
+bool ProgramBinaryCache::getKey(cl_device_id device, const char* sourceCode, const char* buildOptions, uint64_t& key) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+	hashBytes(hash, cacheFileMagic, sizeof(cacheFileMagic));
+	hashString(hash, sourceCode);
+	hashString(hash, buildOptions);
+	if (!hashDevice(device, hash)) { return false; }
+	key = hash;
+	return true;
+}
+
+bool ProgramBinaryCache::hashDevice(cl_device_id device, uint64_t& hash) {
+	// NOTE: The driver version alone isn't enough, ICD loaders can have multiple platforms with the same device name and driver string but different compilers.
+	cl_platform_id platform;
+	if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr) != CL_SUCCESS) { return false; }
+	if (!hashPlatformInfo(hash, platform, CL_PLATFORM_NAME) || !hashPlatformInfo(hash, platform, CL_PLATFORM_VERSION)) { return false; }
+	return hashDeviceInfo(hash, device, CL_DEVICE_NAME) && hashDeviceInfo(hash, device, CL_DEVICE_VENDOR) &&
+		   hashDeviceInfo(hash, device, CL_DEVICE_VERSION) && hashDeviceInfo(hash, device, CL_DRIVER_VERSION);
+}
+
+// NOTE: Only the error_code overloads of std::filesystem get used in here, the project is built without exceptions.
+bool ProgramBinaryCache::getDirectory(std::filesystem::path& path) {
+	if (!ProgramBinaryCache::directory.empty()) { path = ProgramBinaryCache::directory; return true; }
+	const char* environmentDirectory = getenv("FRACTAL_KERNEL_CACHE_DIR");
+	if (environmentDirectory && *environmentDirectory) { path = environmentDirectory; return true; }
+	std::error_code err;
+	path = std::filesystem::temp_directory_path(err);
+	if (err) { return false; }
+	path /= "fractal-kernel-cache";
+	return true;
+}
+
+static bool getCacheFilePath(uint64_t key, std::filesystem::path& path) {
+	if (!ProgramBinaryCache::getDirectory(path)) { return false; }
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), "%016llx.bin", (unsigned long long)key);
+	path /= fileName;
+	return true;
+}
+
+bool ProgramBinaryCache::load(uint64_t key, std::vector<unsigned char>& binary) {
+	std::filesystem::path path;
+	if (!enabled || !getCacheFilePath(key, path)) { return false; }
+	FILE* file = fopen(path.string().c_str(), "rb");
+	if (!file) { return false; }
+
+	CacheFileHeader header;
+	bool successful = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, cacheFileMagic, sizeof(cacheFileMagic)) && header.key == key && header.binaryLength != 0;
+	if (successful) {
+		binary.resize(header.binaryLength);
+		// NOTE: Reading one byte past the end makes sure that the file isn't longer than the header says, that would mean something else wrote to it.
+		unsigned char extraByte;
+		successful = fread(binary.data(), 1, binary.size(), file) == binary.size() && fread(&extraByte, 1, 1, file) == 0;
+	}
+	fclose(file);
+	return successful;
+}
+
+bool ProgramBinaryCache::store(uint64_t key, cl_device_id device, cl_program program) {
+	std::filesystem::path path;
+	if (!enabled || !getCacheFilePath(key, path)) { return false; }
+
+	cl_uint deviceCount;
+	if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(deviceCount), &deviceCount, nullptr) != CL_SUCCESS || deviceCount == 0) { return false; }
+	std::vector<cl_device_id> devices(deviceCount);
+	if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, deviceCount * sizeof(cl_device_id), devices.data(), nullptr) != CL_SUCCESS) { return false; }
+	size_t deviceIndex = 0;
+	while (deviceIndex < deviceCount && devices[deviceIndex] != device) { deviceIndex++; }
+	if (deviceIndex == deviceCount) { return false; }
+
+	std::vector<size_t> binaryLengths(deviceCount);
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, deviceCount * sizeof(size_t), binaryLengths.data(), nullptr) != CL_SUCCESS || binaryLengths[deviceIndex] == 0) { return false; }
+	// NOTE: The driver skips the null entries, so only our device's binary gets copied out.
+	std::vector<unsigned char> binary(binaryLengths[deviceIndex]);
+	std::vector<unsigned char*> binaryPointers(deviceCount, nullptr);
+	binaryPointers[deviceIndex] = binary.data();
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, deviceCount * sizeof(unsigned char*), binaryPointers.data(), nullptr) != CL_SUCCESS) { return false; }
+
+	std::error_code err;
+	std::filesystem::create_directories(path.parent_path(), err);
+	if (err) { return false; }
+
+	// NOTE: Other processes might be storing the same key right now, so the temporary name has to be unique across processes as well, not just across threads.
+	uint64_t uniqueValue = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)std::hash<std::thread::id>{}(std::this_thread::get_id());
+	char temporarySuffix[32];
+	snprintf(temporarySuffix, sizeof(temporarySuffix), ".%016llx.tmp", (unsigned long long)uniqueValue);
+	std::filesystem::path temporaryPath = path;
+	temporaryPath += temporarySuffix;
+
+	FILE* file = fopen(temporaryPath.string().c_str(), "wb");
+	if (!file) { return false; }
+	CacheFileHeader header;
+	memcpy(header.magic, cacheFileMagic, sizeof(cacheFileMagic));
+	header.key = key;
+	header.binaryLength = binary.size();
+	bool successful = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+	if (fclose(file) != 0) { successful = false; }
+
+	// NOTE: rename replaces the target on every platform we build for, so whoever comes last wins. Their binaries are the same anyway.
+	if (successful) {
+		std::filesystem::rename(temporaryPath, path, err);
+		successful = !err;
+	}
+	if (!successful) { std::filesystem::remove(temporaryPath, err); }
+	return successful;
+}
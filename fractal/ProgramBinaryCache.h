@@ -0,0 +1,34 @@
+#pragma once
+
+#include "cl_bindings_and_helpers.h"
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <filesystem>
+
+/*
+
+NOTE: On-disk cache for built OpenCL programs. Shader goes through here before it builds anything from source, which turns the multi-second raytracer.cl build on POCL into a file read.
+	- The key is an FNV-1a hash of the source, the build options, the device and the driver. A driver update just means new keys. The old files stay around, unused.
+	- Every file starts with a small header holding the key and the binary length. Truncated or foreign files get ignored instead of being handed to the driver.
+	- store writes to a temporary file and renames it over the real one, so workers that start at the same time never read a half written binary.
+	- Everything in here is best effort. A miss or a failure at any point just means that the program gets built from source, same as without the cache.
+
+*/
+
+class ProgramBinaryCache {
+public:
+	static bool enabled;
+	static std::string directory;						// NOTE: Empty means FRACTAL_KERNEL_CACHE_DIR if that's set, otherwise fractal-kernel-cache in the system's temp directory.
+
+	static bool getKey(cl_device_id device, const char* sourceCode, const char* buildOptions, uint64_t& key);
+	// NOTE: FNV-1a over the platform, the device and the driver, on top of whatever hash already has in it. What getKey uses for the device part, for other per-device files.
+	static bool hashDevice(cl_device_id device, uint64_t& hash);
+	static bool getDirectory(std::filesystem::path& path);
+
+	static bool load(uint64_t key, std::vector<unsigned char>& binary);
+	// NOTE: program has to be built for device already. Programs with multiple devices are fine, only device's binary gets stored.
+	static bool store(uint64_t key, cl_device_id device, cl_program program);
+};
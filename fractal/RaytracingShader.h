@@ -2,19 +2,66 @@
 
 #include "Shader.h"
 
+#include "TraversalStatistics.h"
+#include "FrameProfiler.h"
+
 class RaytracingShader : public Shader {
 public:
+	FrameProfiler* profiler = nullptr;							// NOTE: Set by Renderer when profiling is on. Shaders that enqueue more than the trace itself can record the parts in here.
+
 	virtual void setBeforeAverageFrameData(cl_mem computeBeforeAverageFrame, uint32_t beforeAverageFrameWidth, uint32_t beforeAverageFrameHeight) = 0;
 
 	virtual void setCameraPosition(nmath::Vector3f position) = 0;
 	virtual void setCameraRotation(nmath::Vector3f rotation) = 0;
 	virtual void setRayOrigin(float rayOrigin) = 0;
+	virtual void setSampleIndex(uint32_t sampleIndex) = 0;
+	virtual void setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) = 0;
+	// NOTE: The renderers call this before init with the value that setSamplesPerPixelSideLength is going to get, so that it can be built into the kernel right away. Shaders that don't specialize can ignore it.
+	virtual void specializeSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) { }
+	virtual void setAccumulationFrame(cl_mem computeAccumulationFrame, uint32_t accumulatedFrameCount) = 0;				// NOTE: Only used in fused mode, a null frame turns accumulation off.
+	// NOTE: What the kernels were built with, already capped at 127. Renderer hands it to NativeRaytracer, so that the fallback bounces as often as the shader would have.
+	virtual uint8_t getMaxBounces() const = 0;
 
 	virtual void setEntityHeap(cl_mem computeEntityHeap, uint64_t computeEntityHeapLength) = 0;
 	virtual void setKDTree(nmath::Vector3f position, nmath::Vector3f size, cl_mem computeKDTreeNodeHeap, uint64_t computeKDTreeNodeHeapLength) = 0;
 	virtual void setLeafObjectHeap(cl_mem computeLeafObjectHeap, uint64_t computeLeafObjectHeapLength) = 0;
+	virtual void setKDTreeRopeHeap(cl_mem computeKDTreeRopeHeap, uint64_t computeKDTreeRopeHeapLength) = 0;
+	virtual void setCompactKDTreeNodeHeap(cl_mem computeCompactKDTreeNodeHeap, uint64_t computeCompactKDTreeNodeHeapLength) = 0;
+	virtual void setLeafSphereHeap(cl_mem computeLeafSphereHeap, cl_mem computeLeafEntityIndexHeap, uint64_t computeLeafSphereHeapLength) = 0;
 	virtual void setLightHeap(cl_mem computeLightHeap, uint64_t computeLightHeapLength) = 0;
 
 	virtual void setMaterialHeap(cl_mem computeMaterialHeap, uint64_t computeMaterialHeapLength) = 0;
 	virtual void setMaterialHeapOffset(uint64_t computeMaterialHeapOffset) = 0;
+
+	// NOTE: Only shaders that were built with traversal statistics have the buffer argument, the rest don't need to override these.
+	virtual TraversalStatisticsMode getTraversalStatisticsMode() const { return TraversalStatisticsMode::OFF; }
+	virtual void setTraversalStatisticsBuffer(cl_mem computeTraversalStatistics) { }
+
+	// NOTE: The work group shape that the renderers launch the trace with. They ask once at init, same as for computeKernelWorkGroupSize. The default is a strip of computeKernelWorkGroupSize pixels.
+	virtual void getTraceLocalSize(size_t* localSize) const {
+		localSize[0] = computeKernelWorkGroupSize;
+		localSize[1] = 1;
+	}
+
+	// NOTE: Only shaders whose trace launch actually takes the local size that the renderers pass in are worth autotuning, see WorkGroupAutotuner.
+	virtual bool usesTraceLocalSize() const { return true; }
+
+	/*
+
+	NOTE: Enqueues the whole trace of the pixels that globalOffset and globalSize cover, which the renderers size for a 2D launch of computeKernel.
+		- The default is just that launch. Shaders that need more than one kernel (WavefrontShader) enqueue all of them in here, the queue has to be in-order for that.
+		- Only the first command waits on waitList. startEvent gets the event of the first command and endEvent the one of the last, so that the two
+			span the whole trace. Either one can be null. For a single launch they're the same event, retained once for each of them.
+
+	*/
+	virtual cl_int enqueueTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+								cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent) {
+		cl_event event;
+		cl_int err = clEnqueueNDRangeKernel(commandQueue, computeKernel, 2, globalOffset, globalSize, localSize, waitListLength, waitList, startEvent || endEvent ? &event : nullptr);
+		if (err != CL_SUCCESS) { return err; }
+		if (startEvent && endEvent) { clRetainEvent(event); }
+		if (startEvent) { *startEvent = event; }
+		if (endEvent) { *endEvent = event; }
+		return CL_SUCCESS;
+	}
 };
@@ -0,0 +1,71 @@
+#include "RenderContext.h"
+
+#include <mutex>
+
+ErrorCode RenderContext::init() {
+	switch (initOpenCLBindings()) {
+	case CL_SUCCESS: break;
+	case CL_EXT_DLL_LOAD_FAILURE: freeOpenCLLib(); return ErrorCode::OPENCL_DLL_LOAD_FAILED;
+	case CL_EXT_DLL_FUNC_BIND_FAILURE: freeOpenCLLib(); return ErrorCode::OPENCL_DLL_FUNC_BIND_FAILED;
+	}
+
+	switch (initOpenCLVarsForBestDevice(VersionIdentifier(3, 0), computePlatform, computeDevice, computeContext, uploadCommandQueue)) {
+	case CL_SUCCESS: break;
+	case CL_EXT_NO_PLATFORMS_FOUND: freeOpenCLLib(); return ErrorCode::NO_ACCELERATION_PLATFORMS_FOUND;
+	case CL_EXT_INSUFFICIENT_HOST_MEM: freeOpenCLLib(); return ErrorCode::DEVICE_DISCOVERY_FAILED_INSUFFICIENT_HOST_MEM;
+	case CL_EXT_NO_DEVICES_FOUND_ON_PLATFORM: freeOpenCLLib(); return ErrorCode::EMPTY_ACCELERATION_PLATFORM_ENCOUNTERED;
+	case CL_EXT_NO_DEVICES_FOUND: freeOpenCLLib(); return ErrorCode::NO_DEVICES_FOUND;
+	}
+
+	deviceScene.init(computeContext, computeDevice, uploadCommandQueue);
+	sceneVersion = 0;
+	return ErrorCode::SUCCESS;
+}
+
+void RenderContext::loadResources(ResourceHeap&& resources) {
+	this->resources = std::move(resources);
+	this->resources.materialHeapDirtyRanges.markAll();
+}
+
+ErrorCode RenderContext::transferResources() {
+	std::unique_lock<std::shared_mutex> sceneLock(sceneMutex);
+	bool changed = resources.isDirty();
+	ErrorCode err = deviceScene.transferResources(resources, nullptr);				// NOTE: No shader, every instance binds the heaps to its own before its next frame.
+	// NOTE: The instances render on other queues, which can't wait for events of this one, so everything has to be on the device before the lock goes.
+	clFinish(uploadCommandQueue);
+	deviceScene.finishUploads();
+	deviceScene.uploadWaitList.clear();
+	if (changed || err != ErrorCode::SUCCESS) { sceneVersion++; }					// NOTE: Even on failure, some of the heaps could have moved. Without changes, the instances keep their accumulation.
+	if (err != ErrorCode::SUCCESS) { return err; }
+	resources.clearDirty();
+	return ErrorCode::SUCCESS;
+}
+
+void RenderContext::loadScene(Scene&& scene) {
+	this->scene = std::move(scene);
+	this->scene.markAllDirty();
+}
+
+ErrorCode RenderContext::transferScene() {
+	std::unique_lock<std::shared_mutex> sceneLock(sceneMutex);
+	scene.updateKDTree();
+	bool changed = scene.isDirty();
+	ErrorCode err = deviceScene.transferScene(scene, nullptr);
+	clFinish(uploadCommandQueue);
+	deviceScene.finishUploads();
+	deviceScene.uploadWaitList.clear();
+	if (changed || err != ErrorCode::SUCCESS) { sceneVersion++; }
+	if (err != ErrorCode::SUCCESS) { return err; }
+	scene.clearDirty();
+	return ErrorCode::SUCCESS;
+}
+
+bool RenderContext::release() {
+	bool successful = true;
+	clFinish(uploadCommandQueue);
+	if (!deviceScene.release()) { successful = false; }
+	if (clReleaseCommandQueue(uploadCommandQueue) != CL_SUCCESS) { successful = false; }
+	if (clReleaseContext(computeContext) != CL_SUCCESS) { successful = false; }
+	if (!freeOpenCLLib()) { successful = false; }
+	return successful;
+}
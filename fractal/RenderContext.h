@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Scene.h"
+#include "ResourceHeap.h"
+
+#include "DeviceScene.h"
+
+#include "ErrorCode.h"
+
+#include "cl_bindings_and_helpers.h"
+
+#include <cstdint>
+
+#include <shared_mutex>
+
+/*
+
+NOTE: The part of rendering that RendererInstances share: the device, the context, and the one device copy of the scene and the resources.
+	- Instances only ever read the scene buffers. The transfers take sceneMutex exclusively and wait for their uploads before letting go, so no kernel ever reads a half-written heap.
+	- Every transfer that uploads something (or fails halfway) bumps sceneVersion. That's how the instances find out that they have to point their shaders at the heaps again, and that their accumulation is stale.
+	- This loads and frees the OpenCL library, so there's only one of these per process, and not at the same time as Renderer or SplitFrameRenderer.
+
+*/
+
+class RenderContext {
+public:
+	cl_platform_id computePlatform;
+	cl_device_id computeDevice;
+	cl_context computeContext;
+	cl_command_queue uploadCommandQueue;											// NOTE: Only the transfers use this one, every instance renders on its own queue.
+
+	ResourceHeap resources;
+	Scene scene;
+	DeviceScene deviceScene;
+
+	std::shared_mutex sceneMutex;													// NOTE: Shared while an instance renders, exclusive while a transfer writes the heaps.
+	uint64_t sceneVersion = 0;
+
+	ErrorCode init();
+
+	void loadResources(ResourceHeap&& resources);
+
+	// WARNING: A valid state is not garanteed if this function fails.
+	ErrorCode transferResources();
+
+	void loadScene(Scene&& scene);
+
+	// WARNING: A valid state is not garanteed if this function fails.
+	ErrorCode transferScene();
+
+	// NOTE: Release every instance before this.
+	bool release();
+};
@@ -1,10 +1,13 @@
 #include "Renderer.h"
 
 #include "ErrorCode.h"
+#include "WorkGroupAutotuner.h"
 
 #include "nmath/constants.h"
 
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include <new>
 
@@ -13,104 +16,368 @@
 cl_image_format Renderer::frameFormat;
 unsigned char Renderer::frameBPP;
 uint16_t Renderer::samplesPerPixelSideLength;
+FrameResolveType Renderer::frameResolveType;
 
 float Renderer::baseRayOrigin = -1;
 
-size_t Renderer::computeMaterialHeapOffset = -1;
-
 size_t Renderer::computeFrameOrigin[3];
 
-size_t Renderer::computeBeforeAverageFrameGlobalSize[2];
-size_t Renderer::computeBeforeAverageFrameLocalSize[2];
+size_t Renderer::computeTraceGlobalSize[2];
+size_t Renderer::computeTraceLocalSize[2];
 size_t Renderer::computeBeforeAverageFrameRegion[3];
 
 size_t Renderer::computeFrameGlobalSize[2];
 size_t Renderer::computeFrameLocalSize[2];
 size_t Renderer::computeFrameRegion[3];
 
+FramePipelineSlot Renderer::framePipeline[MAX_FRAME_PIPELINE_DEPTH];
+uint8_t Renderer::framePipelineDepth;
+uint8_t Renderer::nextSubmitSlotIndex = 0;
+uint8_t Renderer::inFlightFrameCount = 0;
+
+FrameMemoryType Renderer::frameMemoryType;
+bool Renderer::framesMapped = false;
+
 AveragingShader Renderer::averagingShader;
+AccumulatingShader Renderer::accumulatingShader;
+
+cl_mem Renderer::computeAccumulationFrame;
+bool Renderer::computeAccumulationFrameAllocated = false;
+
+cl_mem Renderer::computeTraversalStatistics;
+bool Renderer::computeTraversalStatisticsAllocated = false;
+size_t Renderer::traversalStatisticsGroupCount = 0;
+
 
 cl_platform_id Renderer::computePlatform;
 cl_device_id Renderer::computeDevice;
 cl_context Renderer::computeContext;
 cl_command_queue Renderer::computeCommandQueue;
 
-char* Renderer::beforeAverageFrame;						// TODO: Get rid of this whole host side before average cache thing since we technically don't need it anymore.
 uint32_t Renderer::beforeAverageFrameWidth;
 uint32_t Renderer::beforeAverageFrameHeight;
 cl_mem Renderer::computeBeforeAverageFrame;
 bool Renderer::computeBeforeAverageFrameAllocated = false;
 
 char* Renderer::frame;
+Camera Renderer::frameCamera;
 uint32_t Renderer::frameWidth;
 uint32_t Renderer::frameHeight;
-cl_mem Renderer::computeFrame;
 bool Renderer::computeFrameAllocated = false;
 
 ResourceHeap Renderer::resources;
-cl_mem Renderer::computeMaterialHeap;
-size_t Renderer::computeMaterialHeapLength = 0;
-
 Scene Renderer::scene;
-cl_mem Renderer::computeEntityHeap;
-size_t Renderer::computeEntityHeapLength = 0;
-cl_mem Renderer::computeKDTreeNodeHeap;
-size_t Renderer::computeKDTreeNodeHeapLength = 0;
-cl_mem Renderer::computeLeafObjectHeap;
-size_t Renderer::computeLeafObjectHeapLength = 0;
-cl_mem Renderer::computeLightHeap;
-size_t Renderer::computeLightHeapLength = 0;
+DeviceScene Renderer::deviceScene;
 
 Camera Renderer::camera;
+Camera Renderer::transferredCamera = Camera::makeUntransferred();
+
+bool Renderer::accumulationEnabled = true;
+uint32_t Renderer::accumulatedFrameCount = 0;
 
 RaytracingShader* Renderer::raytracingShader;
 
+TraversalStatistics Renderer::frameTraversalStatistics;
+
+NativeRaytracer* Renderer::nativeRaytracer = nullptr;
+NativeFrameLayout Renderer::nativeFrameLayout;
+
+bool Renderer::nativeFallbackEnabled = true;
+bool Renderer::nativeBackendActive = false;
+
+bool Renderer::profilingEnabled = false;
+FrameProfiler Renderer::profiler;
+
+bool Renderer::workGroupProfileLoaded = false;
+
 bool Renderer::initFrameBuffers(uint32_t frameWidth, uint32_t frameHeight) {
 	beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
-	beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
-	beforeAverageFrame = new (std::nothrow) char[beforeAverageFrameWidth * frameBPP * beforeAverageFrameHeight];
-	if (!beforeAverageFrame) { return false; }
-	frame = new (std::nothrow) char[frameWidth * frameBPP * frameHeight];
-	if (!frame) { delete[] beforeAverageFrame; return false; }
+	beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;				// NOTE: Still needed in fused mode, the ray origin and the sub-sample grid are based on it.
 	Renderer::frameWidth = frameWidth;
 	Renderer::frameHeight = frameHeight;
+	if (framesMapped) { frame = nullptr; return true; }								// NOTE: Mapped frames don't need any host memory of their own.
+	for (uint8_t i = 0; i < framePipelineDepth; i++) {
+		framePipeline[i].frame = new (std::nothrow) char[(size_t)frameWidth * frameBPP * frameHeight];
+		if (!framePipeline[i].frame) {
+			for (uint8_t j = 0; j < i; j++) { delete[] framePipeline[j].frame; }
+			return false;
+		}
+	}
+	frame = framePipeline[0].frame;
 	return true;
 }
 
+void Renderer::releaseFrameBuffers() {
+	for (uint8_t i = 0; i < framePipelineDepth; i++) {
+		delete[] framePipeline[i].frame;
+		framePipeline[i].frame = nullptr;										// NOTE: So that a failed reallocation followed by release doesn't delete anything twice.
+	}
+	frame = nullptr;
+}
+
 bool Renderer::allocateBeforeAverageFrameBufferOnDevice() {
 	cl_int err;
 	computeBeforeAverageFrame = clCreateImage2D(computeContext, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, &frameFormat, beforeAverageFrameWidth, beforeAverageFrameHeight, 0, nullptr, &err);
 	if (!computeBeforeAverageFrame) { return false; }
 	raytracingShader->setBeforeAverageFrameData(computeBeforeAverageFrame, beforeAverageFrameWidth, beforeAverageFrameHeight);
 	averagingShader.setBeforeAverageFrameData(computeBeforeAverageFrame, beforeAverageFrameWidth, beforeAverageFrameHeight);
-	computeBeforeAverageFrameGlobalSize[0] = beforeAverageFrameWidth + (raytracingShader->computeKernelWorkGroupSize - (beforeAverageFrameWidth % raytracingShader->computeKernelWorkGroupSize));
-	computeBeforeAverageFrameGlobalSize[1] = beforeAverageFrameHeight;
+	accumulatingShader.setBeforeAverageFrameData(computeBeforeAverageFrame, beforeAverageFrameWidth, beforeAverageFrameHeight);
+	Shader::getGlobalSize(computeTraceLocalSize, beforeAverageFrameWidth, beforeAverageFrameHeight, computeTraceGlobalSize);
 	computeBeforeAverageFrameRegion[0] = beforeAverageFrameWidth;											// NOTE: Having the frame size be expressed multiple times in the class sucks, but the alternative is to spend a little tiny bit of processing power building together these structs every render call,
 	computeBeforeAverageFrameRegion[1] = beforeAverageFrameHeight;										// NOTE: which I don't want to do. We could also define frameWidth and frameHeight as references to computeFrameRegion, but that would force me to use size_t, which I also don't want to do.
+	computeBeforeAverageFrameAllocated = true;
 	return true;
 }
 
-bool Renderer::allocateFrameBuffersOnDevice() {
-	if (!allocateBeforeAverageFrameBufferOnDevice()) { return false; }
+bool Renderer::allocateMappedFrameBuffersOnDevice() {
+	if (frameMemoryType == FrameMemoryType::AUTO) {
+		// NOTE: On a discrete GPU, host-visible memory is either slow for the kernel to write or gets copied behind our backs anyway, so copying ourselves is the better deal there.
+		cl_device_type deviceType;
+		cl_bool hostUnifiedMemory;
+		if (clGetDeviceInfo(computeDevice, CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, nullptr) != CL_SUCCESS) { return false; }
+		if (clGetDeviceInfo(computeDevice, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(hostUnifiedMemory), &hostUnifiedMemory, nullptr) != CL_SUCCESS) { hostUnifiedMemory = CL_FALSE; }
+		if (!(deviceType & CL_DEVICE_TYPE_CPU) && !hostUnifiedMemory) { return false; }
+	}
 
+	for (uint8_t i = 0; i < framePipelineDepth; i++) {
+		cl_int err;
+		framePipeline[i].computeFrame = clCreateImage2D(computeContext, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
+		if (!framePipeline[i].computeFrame) {
+			for (uint8_t j = 0; j < i; j++) { clReleaseMemObject(framePipeline[j].computeFrame); }
+			return false;
+		}
+		framePipeline[i].mapped = false;
+	}
+
+	// NOTE: The consumers want tightly packed rows. The pitch is up to the implementation, so we map once to see what we get.
 	cl_int err;
-	computeFrame = clCreateImage2D(computeContext, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
-	if (!computeFrame) { clReleaseMemObject(computeBeforeAverageFrame); return false; }
-	averagingShader.setFrameData(computeFrame, frameWidth, frameHeight);
-	computeFrameGlobalSize[0] = frameWidth + (averagingShader.computeKernelWorkGroupSize - (frameWidth % averagingShader.computeKernelWorkGroupSize));
-	computeFrameGlobalSize[1] = frameHeight;
+	size_t rowPitch;
+	void* probe = clEnqueueMapImage(computeCommandQueue, framePipeline[0].computeFrame, CL_TRUE, CL_MAP_READ, computeFrameOrigin, computeFrameRegion, &rowPitch, nullptr, 0, nullptr, nullptr, &err);
+	if (probe) { clEnqueueUnmapMemObject(computeCommandQueue, framePipeline[0].computeFrame, probe, 0, nullptr, nullptr); clFinish(computeCommandQueue); }
+	if (!probe || rowPitch != (size_t)frameWidth * frameBPP) {
+		for (uint8_t i = 0; i < framePipelineDepth; i++) { clReleaseMemObject(framePipeline[i].computeFrame); }
+		return false;
+	}
+	return true;
+}
+
+bool Renderer::allocateFrameBuffersOnDevice() {
+	if (frameResolveType == FrameResolveType::SEPARATE_AVERAGE && !allocateBeforeAverageFrameBufferOnDevice()) { return false; }
+
 	computeFrameRegion[0] = frameWidth;											// NOTE: Having the frame size be expressed multiple times in the class sucks, but the alternative is to spend a little tiny bit of processing power building together these structs every render call,
 	computeFrameRegion[1] = frameHeight;										// NOTE: which I don't want to do. We could also define frameWidth and frameHeight as references to computeFrameRegion, but that would force me to use size_t, which I also don't want to do.
 
+	if (framesMapped && !allocateMappedFrameBuffersOnDevice()) {
+		framesMapped = false;
+		if (!initFrameBuffers(frameWidth, frameHeight)) {
+			if (computeBeforeAverageFrameAllocated) { clReleaseMemObject(computeBeforeAverageFrame); computeBeforeAverageFrameAllocated = false; }
+			return false;
+		}
+	}
+	if (!framesMapped) {
+		for (uint8_t i = 0; i < framePipelineDepth; i++) {
+			cl_int err;
+			framePipeline[i].computeFrame = clCreateImage2D(computeContext, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
+			if (!framePipeline[i].computeFrame) {
+				for (uint8_t j = 0; j < i; j++) { clReleaseMemObject(framePipeline[j].computeFrame); }
+				if (computeBeforeAverageFrameAllocated) { clReleaseMemObject(computeBeforeAverageFrame); computeBeforeAverageFrameAllocated = false; }
+				return false;
+			}
+		}
+	}
+	computeFrameAllocated = true;
+	if (frameResolveType == FrameResolveType::FUSED) {
+		Shader::getGlobalSize(computeTraceLocalSize, frameWidth, frameHeight, computeTraceGlobalSize);
+	}
+	Shader::getGlobalSize(computeFrameLocalSize, frameWidth, frameHeight, computeFrameGlobalSize);
+
+	allocateAccumulationFrameOnDevice();
+	allocateTraversalStatisticsOnDevice();
+
 	return true;
 }
 
+bool Renderer::releaseFrameBuffersOnDevice() {
+	bool successful = true;
+	if (computeBeforeAverageFrameAllocated) {
+		if (clReleaseMemObject(computeBeforeAverageFrame) == CL_SUCCESS) { computeBeforeAverageFrameAllocated = false; } else { successful = false; }
+	}
+	if (computeFrameAllocated) {
+		bool unmapped = false;
+		for (uint8_t i = 0; i < framePipelineDepth; i++) {
+			if (framePipeline[i].mapped) {
+				if (clEnqueueUnmapMemObject(computeCommandQueue, framePipeline[i].computeFrame, framePipeline[i].mappedFrame, 0, nullptr, nullptr) != CL_SUCCESS) { successful = false; }
+				framePipeline[i].mapped = false;
+				unmapped = true;
+			}
+		}
+		if (unmapped) { clFinish(computeCommandQueue); }
+		for (uint8_t i = 0; i < framePipelineDepth; i++) {
+			if (clReleaseMemObject(framePipeline[i].computeFrame) != CL_SUCCESS) { successful = false; }
+		}
+		computeFrameAllocated = false;
+	}
+	return successful;
+}
+
+void Renderer::allocateAccumulationFrameOnDevice() {
+	// NOTE: The accumulation buffer is only a cache, so not being able to release or allocate it isn't an error. Without it, render just averages like it would with accumulation turned off.
+	if (computeAccumulationFrameAllocated) {
+		clReleaseMemObject(computeAccumulationFrame);
+		computeAccumulationFrameAllocated = false;
+	}
+	cl_int err;
+	computeAccumulationFrame = clCreateBuffer(computeContext, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, (size_t)frameWidth * frameHeight * sizeof(cl_float4), nullptr, &err);
+	if (!computeAccumulationFrame) { return; }
+	computeAccumulationFrameAllocated = true;
+	accumulatingShader.setAccumulationFrame(computeAccumulationFrame);
+	resetAccumulation();
+}
+
+void Renderer::allocateTraversalStatisticsOnDevice() {
+	// NOTE: Same deal as the accumulation buffer, the statistics are nice to have. Without the buffer, the kernel just doesn't write them and we report zeros.
+	if (computeTraversalStatisticsAllocated) {
+		clReleaseMemObject(computeTraversalStatistics);
+		computeTraversalStatisticsAllocated = false;
+	}
+	if (raytracingShader->getTraversalStatisticsMode() == TraversalStatisticsMode::OFF) { return; }
+
+	traversalStatisticsGroupCount = computeTraceGlobalSize[0] / computeTraceLocalSize[0] * (computeTraceGlobalSize[1] / computeTraceLocalSize[1]);
+	size_t countsLength = traversalStatisticsGroupCount * (size_t)TraversalStatistic::COUNT;
+	cl_int err;
+	computeTraversalStatistics = clCreateBuffer(computeContext, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, countsLength * sizeof(cl_uint), nullptr, &err);
+	if (!computeTraversalStatistics) { raytracingShader->setTraversalStatisticsBuffer(nullptr); return; }
+	computeTraversalStatisticsAllocated = true;
+	raytracingShader->setTraversalStatisticsBuffer(computeTraversalStatistics);
+	for (uint8_t i = 0; i < framePipelineDepth; i++) { framePipeline[i].traversalStatistics.resize(countsLength); }
+}
+
+void Renderer::resetAccumulation() { accumulatedFrameCount = 0; }
+
+// NOTE: The averaging shapes have to work for the accumulating kernel too, it gets launched with the same ones.
+static size_t getAverageMaxWorkGroupSize(const AveragingShader& averagingShader, const AccumulatingShader& accumulatingShader) {
+	return std::min(averagingShader.computeKernelWorkGroupSize, accumulatingShader.computeKernelWorkGroupSize);
+}
+
+void Renderer::loadWorkGroupProfile() {
+	workGroupProfileLoaded = false;
+	WorkGroupProfile profile;
+	if (!WorkGroupAutotuner::load(computeDevice, profile)) { return; }
+
+	// NOTE: A shape that doesn't fit anymore (new kernel variant with a smaller maximum, edited file) gets ignored, as if it had never been measured.
+	bool complete = true;
+	std::string kernelName;
+	size_t localSize[2];
+	if (raytracingShader->usesTraceLocalSize()) {
+		if (WorkGroupAutotuner::getKernelName(raytracingShader->computeKernel, kernelName) && profile.get(kernelName, localSize) &&
+			WorkGroupAutotuner::fits(computeDevice, raytracingShader->computeKernelWorkGroupSize, localSize)) {
+			computeTraceLocalSize[0] = localSize[0];
+			computeTraceLocalSize[1] = localSize[1];
+		} else { complete = false; }
+	}
+	if (frameResolveType == FrameResolveType::SEPARATE_AVERAGE) {
+		if (WorkGroupAutotuner::getKernelName(averagingShader.computeKernel, kernelName) && profile.get(kernelName, localSize) &&
+			WorkGroupAutotuner::fits(computeDevice, getAverageMaxWorkGroupSize(averagingShader, accumulatingShader), localSize)) {
+			computeFrameLocalSize[0] = localSize[0];
+			computeFrameLocalSize[1] = localSize[1];
+		} else { complete = false; }
+	}
+	workGroupProfileLoaded = complete;
+}
+
+ErrorCode Renderer::autotuneWorkGroups(bool force) {
+	if (nativeBackendActive || (workGroupProfileLoaded && !force)) { return ErrorCode::SUCCESS; }
+	finishFramePipeline();
+
+	// NOTE: The measurements render into a frame of their own, so that none of the slots (which could be mapped right now) get touched.
+	// submitFrame sets the frame, accumulation and sample arguments again for every frame, so pointing them somewhere else in here doesn't stick.
+	cl_int err;
+	cl_mem tuningFrame = clCreateImage2D(computeContext, CL_MEM_WRITE_ONLY | CL_MEM_HOST_NO_ACCESS, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
+	if (!tuningFrame) { return ErrorCode::DEVICE_FRAME_ALLOCATION_FAILED; }
+
+	bool fused = frameResolveType == FrameResolveType::FUSED;
+	if (fused) { raytracingShader->setBeforeAverageFrameData(tuningFrame, frameWidth, frameHeight); }
+	raytracingShader->setAccumulationFrame(nullptr, 0);
+	raytracingShader->setSampleIndex(0);
+	raytracingShader->setTraversalStatisticsBuffer(nullptr);				// NOTE: The number of work groups changes with every candidate, the buffer only has room for the current one.
+	if (!fused) { averagingShader.setFrameData(tuningFrame, frameWidth, frameHeight); }
+
+	WorkGroupProfile profile;
+	WorkGroupAutotuner::load(computeDevice, profile);					// NOTE: Keeps what was measured for the other kernels.
+	std::string kernelName;
+
+	uint32_t traceWidth = fused ? frameWidth : beforeAverageFrameWidth;
+	uint32_t traceHeight = fused ? frameHeight : beforeAverageFrameHeight;
+	if (raytracingShader->usesTraceLocalSize()) {
+		auto enqueueTrace = [](const size_t* globalSize, const size_t* localSize) -> cl_int {
+			return raytracingShader->enqueueTrace(computeCommandQueue, nullptr, globalSize, localSize, 0, nullptr, nullptr, nullptr);
+		};
+		if (WorkGroupAutotuner::tune(computeCommandQueue, computeDevice, raytracingShader->computeKernelWorkGroupSize, traceWidth, traceHeight, enqueueTrace, computeTraceLocalSize) &&
+			WorkGroupAutotuner::getKernelName(raytracingShader->computeKernel, kernelName)) { profile.set(kernelName, computeTraceLocalSize); }
+	}
+	if (!fused) {
+		auto enqueueAverage = [](const size_t* globalSize, const size_t* localSize) -> cl_int {
+			return clEnqueueNDRangeKernel(computeCommandQueue, averagingShader.computeKernel, 2, nullptr, globalSize, localSize, 0, nullptr, nullptr);
+		};
+		if (WorkGroupAutotuner::tune(computeCommandQueue, computeDevice, getAverageMaxWorkGroupSize(averagingShader, accumulatingShader), frameWidth, frameHeight, enqueueAverage, computeFrameLocalSize) &&
+			WorkGroupAutotuner::getKernelName(averagingShader.computeKernel, kernelName)) { profile.set(kernelName, computeFrameLocalSize); }
+	}
+	clReleaseMemObject(tuningFrame);
+
+	Shader::getGlobalSize(computeTraceLocalSize, traceWidth, traceHeight, computeTraceGlobalSize);
+	Shader::getGlobalSize(computeFrameLocalSize, frameWidth, frameHeight, computeFrameGlobalSize);
+	allocateTraversalStatisticsOnDevice();								// NOTE: Sizes the buffer for the new shape and hands it back to the shader.
+
+	WorkGroupAutotuner::store(computeDevice, profile);					// NOTE: Best effort, the shapes are in use either way.
+	workGroupProfileLoaded = true;
+	return ErrorCode::SUCCESS;
+}
+
+float Renderer::getRayOrigin() { return (beforeAverageFrameWidth > beforeAverageFrameHeight ? beforeAverageFrameHeight : beforeAverageFrameWidth) * baseRayOrigin; }
+
 void Renderer::transferRayOrigin() {
-	raytracingShader->setRayOrigin((beforeAverageFrameWidth > beforeAverageFrameHeight ? beforeAverageFrameHeight : beforeAverageFrameWidth) * baseRayOrigin);
+	if (nativeBackendActive) { nativeRaytracer->setRayOrigin(getRayOrigin()); return; }
+	raytracingShader->setRayOrigin(getRayOrigin());
+}
+
+ErrorCode Renderer::initNativeFallback(RaytracingShader* raytracingShader, ErrorCode openCLError, uint32_t frameWidth, uint32_t frameHeight) {
+	if (!nativeFallbackEnabled) { return openCLError; }
+
+	framesMapped = false;															// NOTE: Nothing to map without a device.
+	if (!initFrameBuffers(frameWidth, frameHeight)) { return ErrorCode::FRAME_INIT_FAILED_INSUFFICIENT_HOST_MEM; }
+
+	switch (frameFormat.image_channel_order) {
+	case CL_RGBA: nativeFrameLayout = { 4, 0, 1, 2, 3 }; break;
+	case CL_BGRA: nativeFrameLayout = { 4, 2, 1, 0, 3 }; break;
+	case CL_ARGB: nativeFrameLayout = { 4, 1, 2, 3, 0 }; break;
+	default: nativeFrameLayout = { 3, 0, 1, 2, -1 }; break;
+	}
+
+	nativeRaytracer = new (std::nothrow) NativeRaytracer();
+	if (!nativeRaytracer) { releaseFrameBuffers(); return ErrorCode::FRAME_INIT_FAILED_INSUFFICIENT_HOST_MEM; }
+	nativeRaytracer->setSamplesPerPixelSideLength(samplesPerPixelSideLength);		// NOTE: Every pixel traces all of its samples, so it's always the full side length, no matter what frameResolveType says.
+	nativeRaytracer->resizeAccumulationFrame(frameWidth, frameHeight);				// NOTE: Same as on the device, no accumulation frame only means no accumulation.
+	for (uint8_t i = 0; i < framePipelineDepth; i++) { framePipeline[i].mapped = false; }
+	Renderer::raytracingShader = raytracingShader;									// NOTE: Never gets init, it's only around for the settings that the native backend mirrors.
+
+	nativeBackendActive = true;
+	resetAccumulation();
+	return ErrorCode::SUCCESS;
 }
 
-ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder) {
+ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder, 
+						FrameResolveType frameResolveType, uint8_t framePipelineDepth, FrameMemoryType frameMemoryType) {
 	Renderer::samplesPerPixelSideLength = samplesPerPixelSideLength;
+	Renderer::frameResolveType = frameResolveType;
+	transferredCamera = Camera::makeUntransferred();							// NOTE: The new shader hasn't seen any camera yet.
+	if (framePipelineDepth == 0) { framePipelineDepth = 1; }
+	if (framePipelineDepth > MAX_FRAME_PIPELINE_DEPTH) { framePipelineDepth = MAX_FRAME_PIPELINE_DEPTH; }
+	Renderer::framePipelineDepth = framePipelineDepth;
+	nextSubmitSlotIndex = 0;
+	inFlightFrameCount = 0;
+	Renderer::frameMemoryType = frameMemoryType;
+	nativeBackendActive = false;
+	framesMapped = frameMemoryType != FrameMemoryType::COPY;						// NOTE: Only tentative. allocateFrameBuffersOnDevice switches back to copying if mapping doesn't work out on this device.
 
 	switch (frameChannelOrder) {
 	case ImageChannelOrderType::RGBA: frameFormat.image_channel_order = CL_RGBA; frameBPP = 4; break;
@@ -124,24 +391,49 @@ ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPer
 
 	switch (initOpenCLBindings()) {
 	case CL_SUCCESS: break;
-	case CL_EXT_DLL_LOAD_FAILURE: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::OPENCL_DLL_LOAD_FAILED;
-	case CL_EXT_DLL_FUNC_BIND_FAILURE: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::OPENCL_DLL_FUNC_BIND_FAILED;
+	case CL_EXT_DLL_LOAD_FAILURE: releaseFrameBuffers(); freeOpenCLLib(); return initNativeFallback(raytracingShader, ErrorCode::OPENCL_DLL_LOAD_FAILED, frameWidth, frameHeight);
+	case CL_EXT_DLL_FUNC_BIND_FAILURE: releaseFrameBuffers(); freeOpenCLLib(); return ErrorCode::OPENCL_DLL_FUNC_BIND_FAILED;
 	}
 
 	switch (initOpenCLVarsForBestDevice(VersionIdentifier(3, 0), computePlatform, computeDevice, computeContext, computeCommandQueue)) {
 	case CL_SUCCESS: break;
-	case CL_EXT_NO_PLATFORMS_FOUND: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::NO_ACCELERATION_PLATFORMS_FOUND;
-	case CL_EXT_INSUFFICIENT_HOST_MEM: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::DEVICE_DISCOVERY_FAILED_INSUFFICIENT_HOST_MEM;
-	case CL_EXT_NO_DEVICES_FOUND_ON_PLATFORM: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::EMPTY_ACCELERATION_PLATFORM_ENCOUNTERED;
-	case CL_EXT_NO_DEVICES_FOUND: delete[] beforeAverageFrame; delete[] frame; freeOpenCLLib(); return ErrorCode::NO_DEVICES_FOUND;
+	case CL_EXT_NO_PLATFORMS_FOUND: releaseFrameBuffers(); freeOpenCLLib(); return initNativeFallback(raytracingShader, ErrorCode::NO_ACCELERATION_PLATFORMS_FOUND, frameWidth, frameHeight);
+	case CL_EXT_INSUFFICIENT_HOST_MEM: releaseFrameBuffers(); freeOpenCLLib(); return ErrorCode::DEVICE_DISCOVERY_FAILED_INSUFFICIENT_HOST_MEM;
+	case CL_EXT_NO_DEVICES_FOUND_ON_PLATFORM: releaseFrameBuffers(); freeOpenCLLib(); return initNativeFallback(raytracingShader, ErrorCode::EMPTY_ACCELERATION_PLATFORM_ENCOUNTERED, frameWidth, frameHeight);
+	case CL_EXT_NO_DEVICES_FOUND: releaseFrameBuffers(); freeOpenCLLib(); return initNativeFallback(raytracingShader, ErrorCode::NO_DEVICES_FOUND, frameWidth, frameHeight);
 	}
 
+	if (profilingEnabled) {
+		// NOTE: The helper creates the queue without any properties, so we swap it for one that can profile.
+		cl_queue_properties queueProperties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+		cl_int err;
+		cl_command_queue profilingCommandQueue = clCreateCommandQueueWithProperties(computeContext, computeDevice, queueProperties, &err);
+		if (!profilingCommandQueue) {
+			clReleaseCommandQueue(computeCommandQueue);
+			clReleaseContext(computeContext);
+			releaseFrameBuffers();
+			freeOpenCLLib();
+			return ErrorCode::DEVICE_COMMAND_QUEUE_CREATION_FAILED;
+		}
+		clReleaseCommandQueue(computeCommandQueue);
+		computeCommandQueue = profilingCommandQueue;
+	}
+	profiler.reset();
+
+	deviceScene.init(computeContext, computeDevice, computeCommandQueue);
+	deviceScene.profiler = profilingEnabled ? &profiler : nullptr;
+	raytracingShader->profiler = profilingEnabled ? &profiler : nullptr;
+
+	// NOTE: Known up front and never changes until the next init, so the kernels can have it built in.
+	raytracingShader->specializeSamplesPerPixelSideLength(frameResolveType == FrameResolveType::FUSED ? samplesPerPixelSideLength : 1);
+	averagingShader.specializedSamplesPerPixelSideLength = samplesPerPixelSideLength;
+	accumulatingShader.specializedSamplesPerPixelSideLength = samplesPerPixelSideLength;
+
 	ErrorCode err = raytracingShader->init(computeContext, computeDevice);
 	if (err != ErrorCode::SUCCESS) {
 		clReleaseCommandQueue(computeCommandQueue);
 		clReleaseContext(computeContext);
-		delete[] beforeAverageFrame;
-		delete[] frame;
+		releaseFrameBuffers();
 		freeOpenCLLib();
 		return err;
 	}
@@ -151,8 +443,18 @@ ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPer
 		raytracingShader->release();
 		clReleaseCommandQueue(computeCommandQueue);
 		clReleaseContext(computeContext);
-		delete[] beforeAverageFrame;
-		delete[] frame;
+		releaseFrameBuffers();
+		freeOpenCLLib();
+		return err;
+	}
+
+	err = accumulatingShader.init(computeContext, computeDevice);
+	if (err != ErrorCode::SUCCESS) {
+		averagingShader.release();
+		raytracingShader->release();
+		clReleaseCommandQueue(computeCommandQueue);
+		clReleaseContext(computeContext);
+		releaseFrameBuffers();
 		freeOpenCLLib();
 		return err;
 	}
@@ -161,8 +463,7 @@ ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPer
 	computeFrameOrigin[1] = 0;
 	computeFrameOrigin[2] = 0;
 
-	computeBeforeAverageFrameLocalSize[0] = raytracingShader->computeKernelWorkGroupSize;
-	computeBeforeAverageFrameLocalSize[1] = 1;
+	raytracingShader->getTraceLocalSize(computeTraceLocalSize);
 	computeBeforeAverageFrameRegion[2] = 1;
 
 	computeFrameLocalSize[0] = averagingShader.computeKernelWorkGroupSize;
@@ -170,98 +471,52 @@ ErrorCode Renderer::init(RaytracingShader* raytracingShader, uint16_t samplesPer
 	computeFrameRegion[2] = 1;
 
 	Renderer::raytracingShader = raytracingShader;
+	loadWorkGroupProfile();
 
 	if (!allocateFrameBuffersOnDevice()) {
+		accumulatingShader.release();
 		averagingShader.release();
 		raytracingShader->release();
 		clReleaseCommandQueue(computeCommandQueue);
 		clReleaseContext(computeContext);
-		delete[] beforeAverageFrame;
-		delete[] frame;
+		releaseFrameBuffers();
 		freeOpenCLLib();
 		return ErrorCode::DEVICE_FRAME_ALLOCATION_FAILED;
 	}
 
 	averagingShader.setSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	accumulatingShader.setSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	raytracingShader->setSamplesPerPixelSideLength(frameResolveType == FrameResolveType::FUSED ? samplesPerPixelSideLength : 1);		// NOTE: In separate mode, every pixel of the before-average frame is one sample.
 
 	return ErrorCode::SUCCESS;
 }
 
 ErrorCode Renderer::resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight) {
+	finishFramePipeline();							// NOTE: The frames in flight have the old size, nobody wants them anymore.
+
 	uint32_t oldFrameWidth = frameWidth;
 	uint32_t oldFrameHeight = frameHeight;
-	delete[] frame;
+	releaseFrameBuffers();
 	if (!initFrameBuffers(newFrameWidth, newFrameHeight)) {
-		beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
-		beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
-
-		beforeAverageFrame = new (std::nothrow) char[beforeAverageFrameWidth * frameBPP * frameHeight];
-		if (!beforeAverageFrame) { return ErrorCode::FRAME_REINIT_FALLBACK_REALLOCATION_FAILED; }
-
-		frame = new (std::nothrow) char[frameWidth * frameBPP * frameHeight];
-		if (!frame) { delete[] beforeAverageFrame; return ErrorCode::FRAME_REINIT_FALLBACK_REALLOCATION_FAILED; }
-
+		if (!initFrameBuffers(oldFrameWidth, oldFrameHeight)) { return ErrorCode::FRAME_REINIT_FALLBACK_REALLOCATION_FAILED; }
 		return ErrorCode::FRAME_REINIT_FAILED_INSUFFICIENT_HOST_MEM;
 	}
-	if (clReleaseMemObject(computeBeforeAverageFrame) != CL_SUCCESS) {
-		frameWidth = oldFrameWidth;
-		frameHeight = oldFrameHeight;
-		beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
-		beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
-
-		delete[] beforeAverageFrame;
-		beforeAverageFrame = new (std::nothrow) char[beforeAverageFrameWidth * frameBPP * frameHeight];
-		if (!beforeAverageFrame) { return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		delete[] frame;
-		frame = new (std::nothrow) char[frameWidth * frameBPP * frameHeight];
-		if (!frame) { delete[] beforeAverageFrame; return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		return ErrorCode::DEVICE_RELEASE_FRAME_FAILED;
+	if (nativeBackendActive) {
+		nativeRaytracer->resizeAccumulationFrame(newFrameWidth, newFrameHeight);
+		resetAccumulation();
+		if (baseRayOrigin != -1) { transferRayOrigin(); }
+		return ErrorCode::SUCCESS;
 	}
-	if (clReleaseMemObject(computeFrame) != CL_SUCCESS) {
-		frameWidth = oldFrameWidth;
-		frameHeight = oldFrameHeight;
-		beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
-		beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
-
-		delete[] beforeAverageFrame;
-		beforeAverageFrame = new (std::nothrow) char[beforeAverageFrameWidth * frameBPP * frameHeight];
-		if (!beforeAverageFrame) { return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		delete[] frame;
-		frame = new (std::nothrow) char[frameWidth * frameBPP * frameHeight];
-		if (!frame) { delete[] beforeAverageFrame; return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		if (clReleaseMemObject(computeBeforeAverageFrame) != CL_SUCCESS) {
-			delete[] frame;
-			delete[] beforeAverageFrame;
-			return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_DEVICE_REALLOCATION_FAILED;
-		}
-		if (!allocateBeforeAverageFrameBufferOnDevice()) {
-			delete[] frame;
-			delete[] beforeAverageFrame;
-			return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_DEVICE_REALLOCATION_FAILED;
-		}
-
+	if (!releaseFrameBuffersOnDevice()) {
+		releaseFrameBuffers();
+		if (!initFrameBuffers(oldFrameWidth, oldFrameHeight)) { return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_REALLOCATION_FAILED; }
+		if (!allocateFrameBuffersOnDevice()) { return ErrorCode::DEVICE_RELEASE_FRAME_FALLBACK_DEVICE_REALLOCATION_FAILED; }
 		return ErrorCode::DEVICE_RELEASE_FRAME_FAILED;
 	}
 	if (!allocateFrameBuffersOnDevice()) {
-		frameWidth = oldFrameWidth;
-		frameHeight = oldFrameHeight;
-		beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
-		beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
-
-		delete[] beforeAverageFrame;
-		beforeAverageFrame = new (std::nothrow) char[beforeAverageFrameWidth * frameBPP * frameHeight];
-		if (!beforeAverageFrame) { return ErrorCode::DEVICE_REALLOCATE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		delete[] frame;
-		frame = new (std::nothrow) char[frameWidth * frameBPP * frameHeight];
-		if (!frame) { delete[] beforeAverageFrame; return ErrorCode::DEVICE_REALLOCATE_FRAME_FALLBACK_REALLOCATION_FAILED; }
-
-		if (!allocateFrameBuffersOnDevice()) { computeFrameAllocated = false; return ErrorCode::DEVICE_REALLOCATE_FRAME_FALLBACK_DEVICE_REALLOCATION_FAILED; }
-
+		releaseFrameBuffers();
+		if (!initFrameBuffers(oldFrameWidth, oldFrameHeight)) { return ErrorCode::DEVICE_REALLOCATE_FRAME_FALLBACK_REALLOCATION_FAILED; }
+		if (!allocateFrameBuffersOnDevice()) { return ErrorCode::DEVICE_REALLOCATE_FRAME_FALLBACK_DEVICE_REALLOCATION_FAILED; }
 		return ErrorCode::DEVICE_REALLOCATE_FRAME_FAILED_INSUFFICIENT_DEVICE_MEM;
 	}
 
@@ -270,225 +525,229 @@ ErrorCode Renderer::resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight)
 	return ErrorCode::SUCCESS;
 }
 
-void Renderer::loadResources(ResourceHeap&& resources) { Renderer::resources = std::move(resources); }
+void Renderer::loadResources(ResourceHeap&& resources) {
+	Renderer::resources = std::move(resources);
+	Renderer::resources.materialHeapDirtyRanges.markAll();							// NOTE: The device still has the old resources, so everything has to go up, even if the lengths happen to match.
+}
 
 ErrorCode Renderer::transferResources() {
-	if (resources.materialHeapLength == 0) {
-		if (computeMaterialHeapLength != 0) {
-			if (clReleaseMemObject(computeMaterialHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_MATERIAL_HEAP_FAILED; }
-			computeMaterialHeapLength = 0;
-		}
-		raytracingShader->setMaterialHeap(nullptr, 0);
-	} else {
-		if (computeMaterialHeapLength != 0) {
-			if (resources.materialHeapLength == computeMaterialHeapLength) {
-				if (clEnqueueWriteBuffer(computeCommandQueue, computeMaterialHeap, true, 0, computeMaterialHeapLength * sizeof(Material), resources.materialHeap, 0, nullptr, nullptr) != CL_SUCCESS) {
-					return ErrorCode::DEVICE_MATERIAL_HEAP_WRITE_FAILED;
-				}
-				return ErrorCode::SUCCESS;
-			}
-			if (clReleaseMemObject(computeMaterialHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_MATERIAL_HEAP_FAILED; }
-		}
-		cl_int err;
-		computeMaterialHeap = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, resources.materialHeapLength * sizeof(Material), resources.materialHeap, &err);
-		if (!computeMaterialHeap) { computeMaterialHeapLength = 0; return ErrorCode::DEVICE_MATERIAL_HEAP_REALLOCATION_AND_WRITE_FAILED; }
-		computeMaterialHeapLength = resources.materialHeapLength;
-		raytracingShader->setMaterialHeap(computeMaterialHeap, computeMaterialHeapLength);
-
-		if (resources.materialHeapOffset != computeMaterialHeapOffset) {
-			raytracingShader->setMaterialHeapOffset(resources.materialHeapOffset);
-			computeMaterialHeapOffset = resources.materialHeapOffset;
-		}
-	}
-
+	if (resources.isDirty()) { resetAccumulation(); }								// NOTE: Nothing to upload means the frames look the same as before, so the mean can keep going.
+	if (nativeBackendActive) { resources.clearDirty(); return ErrorCode::SUCCESS; }				// NOTE: The native backend reads resources directly, there's no copy to update.
+	ErrorCode err = deviceScene.transferResources(resources, raytracingShader);
+	if (err != ErrorCode::SUCCESS) { return err; }
+	resources.clearDirty();
 	return ErrorCode::SUCCESS;
 }
 
-void Renderer::loadScene(Scene&& scene) { Renderer::scene = std::move(scene); }
+void Renderer::loadScene(Scene&& scene) {
+	Renderer::scene = std::move(scene);
+	Renderer::scene.markAllDirty();														// NOTE: Same reason as in loadResources.
+}
 
 ErrorCode Renderer::transferScene() {
-	if (scene.entityHeapLength == 0) {
-		if (computeEntityHeapLength != 0) {
-			if (clReleaseMemObject(computeEntityHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_ENTITY_HEAP_FAILED; }
-			computeEntityHeapLength = 0;
-		}
-		raytracingShader->setEntityHeap(nullptr, 0);
-	} else {
-		if (computeEntityHeapLength != 0) {
-			if (scene.entityHeapLength == computeEntityHeapLength) {
-				if (clEnqueueWriteBuffer(computeCommandQueue, computeEntityHeap, true, 0, computeEntityHeapLength * sizeof(Entity), scene.entityHeap, 0, nullptr, nullptr) != CL_SUCCESS) {
-					return ErrorCode::DEVICE_ENTITY_HEAP_WRITE_FAILED;
-				}
-				return ErrorCode::SUCCESS;
-			}
-			if (clReleaseMemObject(computeEntityHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_ENTITY_HEAP_FAILED; }
-		}
-		cl_int err;
-		computeEntityHeap = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, scene.entityHeapLength * sizeof(Entity), scene.entityHeap, &err);
-		if (!computeEntityHeap) { computeEntityHeapLength = 0; return ErrorCode::DEVICE_ENTITY_HEAP_REALLOCATION_AND_WRITE_FAILED; }
-		computeEntityHeapLength = scene.entityHeapLength;
-		raytracingShader->setEntityHeap(computeEntityHeap, computeEntityHeapLength);
-	}
-
-	// TODO: Consider putting this under the umbrella of entityHeapLength != 0, since you wouldn't ever want a tree without objects right?
-	size_t kdTreeNodeHeapVectorSize = scene.kdTreeNodeHeap.size();
-	if (kdTreeNodeHeapVectorSize == 0) {
-		if (computeKDTreeNodeHeapLength != 0) {
-			if (clReleaseMemObject(computeKDTreeNodeHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_KD_TREE_NODE_HEAP_FAILED; }
-			computeKDTreeNodeHeapLength = 0;
-		}
-		raytracingShader->setKDTree(nmath::Vector3f(0, 0, 0), nmath::Vector3f(0, 0, 0), nullptr, 0);
-		if (computeLeafObjectHeapLength != 0) {
-			if (clReleaseMemObject(computeLeafObjectHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_LEAF_OBJECT_HEAP_FAILED; }
-			computeLeafObjectHeapLength = 0;
-		}
-		raytracingShader->setLeafObjectHeap(nullptr, 0);
-	} else {
-		KDTreeNode* kdTreeNodeHeapVectorData = scene.kdTreeNodeHeap.data();
-		if (computeKDTreeNodeHeapLength != 0) {
-			if (kdTreeNodeHeapVectorSize == computeKDTreeNodeHeapLength) {
-				if (clEnqueueWriteBuffer(computeCommandQueue, computeKDTreeNodeHeap, true, 0, computeKDTreeNodeHeapLength * sizeof(KDTreeNode), kdTreeNodeHeapVectorData, 0, nullptr, nullptr) != CL_SUCCESS) {
-					return ErrorCode::DEVICE_KD_TREE_NODE_HEAP_WRITE_FAILED;
-				}
-				return ErrorCode::SUCCESS;
-			}
-			if (clReleaseMemObject(computeKDTreeNodeHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_KD_TREE_NODE_HEAP_FAILED; }
-		}
-		cl_int err;
-		computeKDTreeNodeHeap = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, kdTreeNodeHeapVectorSize * sizeof(KDTreeNode), kdTreeNodeHeapVectorData, &err);
-		if (!computeKDTreeNodeHeap) { computeKDTreeNodeHeapLength = 0; return ErrorCode::DEVICE_KD_TREE_NODE_HEAP_REALLOCATION_AND_WRITE_FAILED; }
-		computeKDTreeNodeHeapLength = kdTreeNodeHeapVectorSize;
-		raytracingShader->setKDTree(scene.kdTree.position, scene.kdTree.size, computeKDTreeNodeHeap, computeKDTreeNodeHeapLength);
-
-		size_t leafObjectHeapVectorSize = scene.leafObjectHeap.size();
-		uint64_t* leafObjectHeapVectorData = scene.leafObjectHeap.data();
-		if (computeLeafObjectHeapLength != 0) {
-			if (leafObjectHeapVectorSize == computeLeafObjectHeapLength) {
-				if (clEnqueueWriteBuffer(computeCommandQueue, computeLeafObjectHeap, true, 0, computeLeafObjectHeapLength * sizeof(uint64_t), leafObjectHeapVectorData, 0, nullptr, nullptr) != CL_SUCCESS) {
-					return ErrorCode::DEVICE_LEAF_OBJECT_HEAP_WRITE_FAILED;
-				}
-				return ErrorCode::SUCCESS;
-			}
-			if (clReleaseMemObject(computeLeafObjectHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_LEAF_OBJECT_HEAP_FAILED; }
-		}
-		computeLeafObjectHeap = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, leafObjectHeapVectorSize * sizeof(uint64_t), leafObjectHeapVectorData, &err);
-		if (!computeLeafObjectHeap) { computeLeafObjectHeapLength = 0; return ErrorCode::DEVICE_LEAF_OBJECT_HEAP_REALLOCATION_AND_WRITE_FAILED; }
-		computeLeafObjectHeapLength = leafObjectHeapVectorSize;
-		raytracingShader->setLeafObjectHeap(computeLeafObjectHeap, computeLeafObjectHeapLength);
-	}
-
-	if (scene.lightHeapLength == 0) {
-		if (computeLightHeapLength != 0) {
-			if (clReleaseMemObject(computeLightHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_LIGHT_HEAP_FAILED; }
-			computeLightHeapLength = 0;
-		}
-		raytracingShader->setLightHeap(nullptr, 0);
-
-		/*
-		* 
-		* NOTE: I assume that when you call LoadLibraryA, it loads the 32-bit DLL when you're running as 32-bit and the 64-bit one when running as 64-bit.
-		* In Linux this wouldn't work so easily AFAIK. Windows has these special extra files that specify version info and such for different instances of an ambigiuos
-		* name like "OpenCL.dll", so that's how LoadLibraryA presumably knows which exact file to load for which bit-width of the program.
-		* 
-		* NOTE: The compute device can have a completely different bit-width than the host (for example host 32-bit and GPU 64-bit).
-		* 
-		* NOTE: I am very sure that cl_mem is just a pointer, and no crazy behind the scenes magic is going on. That means that if you receive a pointer argument in the
-		* kernel and somehow output it's value, it'll be the same value as the cl_mem variable on the host.
-		* 
-		* NOTE: Following from those assumptions, in the case of the 64-bit GPU and the 32-bit CPU, allocating device memory would always give you back 32-bit values,
-		* since the size of cl_mem is 32-bit on 32-bit systems. But that only allows you to use like 4 GB of the VRAM, even if there is sooooo much more.
-		* I guess that's just the price one would have to pay.
-		* 
-		* What if it's the other way around? --> CPU 64-bit and GPU 32-bit?
-		*	- Then I think allocating device memory should still only give you back 32-bit values. Since everything is presumably little-endian,
-		*		copying that 64-bit value into the 32-bit container of the kernel argument shouldn't matter, since only the zeros get cut off and the 32-bit address contained
-		*		inside remains completely intact.
-		* 
-		* NOTE: Here is my understanding of what happens when you tell the compute device to use host memory for it's operations (obviously this is implementation dependant and only one of many possibilities):
-		*	- GPU almost definitely has virtual memory, which allows the GPU MMU to just map a part of host memory into a part of virtual GPU memory.
-		*	- That way the GPU doesn't really need to do anything special, it just uses the memory like normal.
-		*	- The interesting thing about that is that if you've got a 32-bit GPU and you use 2 GB of VRAM and 2 GB of host memory for your device memory, you can't add anymore, even though you technically still
-		*		have more physical memory left in VRAM.
-		* 
-		* NOTE: One last thing: It's defined by the standard that you can pass nullptr as a cl_mem variable into clSetKernelArg.
-		* 
-		*/
-
-	} else {
-		if (computeLightHeapLength != 0) {
-			if (scene.lightHeapLength == computeLightHeapLength) {
-				if (clEnqueueWriteBuffer(computeCommandQueue, computeLightHeap, true, 0, computeLightHeapLength * sizeof(Light), scene.lightHeap, 0, nullptr, nullptr) != CL_SUCCESS) {
-					return ErrorCode::DEVICE_LIGHT_HEAP_WRITE_FAILED;
-				}
-				return ErrorCode::SUCCESS;
-			}
-			if (clReleaseMemObject(computeLightHeap) != CL_SUCCESS) { return ErrorCode::DEVICE_RELEASE_LIGHT_HEAP_FAILED; }
-		}
-		cl_int err;
-		computeLightHeap = clCreateBuffer(computeContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, scene.lightHeapLength * sizeof(Light), scene.lightHeap, &err);
-		if (!computeLightHeap) { computeLightHeapLength = 0; return ErrorCode::DEVICE_LIGHT_HEAP_REALLOCATION_AND_WRITE_FAILED; }
-		computeLightHeapLength = scene.lightHeapLength;
-		raytracingShader->setLightHeap(computeLightHeap, computeLightHeapLength);
-	}
-
+	scene.updateKDTree();
+	if (scene.isDirty()) { resetAccumulation(); }									// NOTE: After the rebuild, which marks the kd-tree dirty if it happens.
+	if (nativeBackendActive) { scene.clearDirty(); return ErrorCode::SUCCESS; }
+	ErrorCode err = deviceScene.transferScene(scene, raytracingShader);
+	if (err != ErrorCode::SUCCESS) { return err; }
+	scene.clearDirty();
 	return ErrorCode::SUCCESS;
 }
 
 void Renderer::loadCamera(const Camera& camera) { Renderer::camera = camera; }
-void Renderer::transferCameraPosition() { raytracingShader->setCameraPosition(camera.position); }
-void Renderer::transferCameraRotation() { raytracingShader->setCameraRotation(camera.rotation); }
+void Renderer::transferCameraPosition() {
+	if (nativeBackendActive) { nativeRaytracer->setCameraPosition(camera.position); } else { raytracingShader->setCameraPosition(camera.position); }
+	if (!Camera::vectorsEqual(camera.position, transferredCamera.position)) { resetAccumulation(); }
+	transferredCamera.position = camera.position;
+}
+void Renderer::transferCameraRotation() {
+	if (nativeBackendActive) { nativeRaytracer->setCameraRotation(camera.rotation); } else { raytracingShader->setCameraRotation(camera.rotation); }
+	if (!Camera::vectorsEqual(camera.rotation, transferredCamera.rotation)) { resetAccumulation(); }
+	transferredCamera.rotation = camera.rotation;
+}
 void Renderer::transferCameraFOV() {
 	baseRayOrigin = 0.5f / tanf(camera.FOV / 360 * nmath::constants::pi);
 	transferRayOrigin();
+	if (camera.FOV != transferredCamera.FOV) { resetAccumulation(); }
+	transferredCamera.FOV = camera.FOV;
 }
 
-ErrorCode Renderer::render() {
-	switch(clEnqueueNDRangeKernel(computeCommandQueue, raytracingShader->computeKernel, 2, nullptr, computeBeforeAverageFrameGlobalSize, computeBeforeAverageFrameLocalSize, 0, nullptr, nullptr)) {
-	case CL_SUCCESS: break;
+ErrorCode Renderer::submitFrame() {
+	if (inFlightFrameCount == framePipelineDepth) { return ErrorCode::FRAME_PIPELINE_FULL; }
+	FramePipelineSlot& slot = framePipeline[nextSubmitSlotIndex];
+
+	if (nativeBackendActive) {
+		// NOTE: The frame is done by the time render returns, so retrieveFrame has nothing left to wait for.
+		bool accumulate = accumulationEnabled && nativeRaytracer->hasAccumulationFrame();
+		if (!accumulate) { accumulatedFrameCount = 0; }
+		nativeRaytracer->setSampleIndex(accumulatedFrameCount);
+		nativeRaytracer->setAccumulation(accumulate, accumulatedFrameCount);
+		nativeRaytracer->setMaxBounces(raytracingShader->getMaxBounces());			// NOTE: Every frame, so that a setVariant in between shows up right away, same as on the device.
+		nativeRaytracer->render(scene, resources, slot.frame, frameWidth, frameHeight, nativeFrameLayout);
+
+		slot.camera = camera;
+		nextSubmitSlotIndex = (nextSubmitSlotIndex + 1) % framePipelineDepth;
+		inFlightFrameCount++;
+		if (accumulate && accumulatedFrameCount != (uint32_t)-1) { accumulatedFrameCount++; }
+		return ErrorCode::SUCCESS;
+	}
+
+	if (slot.mapped) {
+		// NOTE: The consumer is done with this slot's last frame by now, it's been framePipelineDepth submits. The unmap is queued before the kernels, so they don't write into the frame while it's mapped.
+		if (clEnqueueUnmapMemObject(computeCommandQueue, slot.computeFrame, slot.mappedFrame, 0, nullptr, nullptr) != CL_SUCCESS) { return ErrorCode::DEVICE_UNMAP_FRAME_FAILED; }
+		slot.mapped = false;
+	}
+
+	bool accumulate = accumulationEnabled && computeAccumulationFrameAllocated;
+	if (!accumulate) { accumulatedFrameCount = 0; }
+	raytracingShader->setSampleIndex(accumulatedFrameCount);						// NOTE: Gives every accumulated frame a different seed, otherwise we'd just be averaging the same frame over and over.
+
+	bool fused = frameResolveType == FrameResolveType::FUSED;
+	if (fused) {
+		// NOTE: The raytracer resolves the pixels itself in fused mode, so it gets the frame in the spot where the before-average frame would normally go.
+		raytracingShader->setBeforeAverageFrameData(slot.computeFrame, frameWidth, frameHeight);
+		if (accumulate) { raytracingShader->setAccumulationFrame(computeAccumulationFrame, accumulatedFrameCount); }
+		else { raytracingShader->setAccumulationFrame(nullptr, 0); }
+	} else { raytracingShader->setAccumulationFrame(nullptr, 0); }
+
+	// NOTE: The queue is in-order, so the uploads would come first anyway, but this way the dependency is spelled out and survives a switch to an out-of-order queue.
+	cl_event profileStartEvent;
+	cl_event profileEvent;
+	switch(raytracingShader->enqueueTrace(computeCommandQueue, nullptr, computeTraceGlobalSize, computeTraceLocalSize, (cl_uint)deviceScene.uploadWaitList.size(), 
+										deviceScene.uploadWaitList.empty() ? nullptr : deviceScene.uploadWaitList.data(), profilingEnabled ? &profileStartEvent : nullptr, profilingEnabled ? &profileEvent : nullptr)) {
+	case CL_SUCCESS:
+		deviceScene.uploadWaitList.clear();
+		if (profilingEnabled) { profiler.record(ProfileStage::TRACE, profileStartEvent, profileEvent); clReleaseEvent(profileStartEvent); clReleaseEvent(profileEvent); }
+		break;
 	case CL_INVALID_KERNEL_ARGS: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_KERNEL_ARGS_UNSPECIFIED;
-	case CL_OUT_OF_RESOURCES: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_INSUFFICIENT_MEM;
+	case CL_OUT_OF_RESOURCES: case CL_MEM_OBJECT_ALLOCATION_FAILURE: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_INSUFFICIENT_MEM;
 	default: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED;
 	}
 
-	//if (clFlush(computeCommandQueue) != CL_SUCCESS) {							// TODO: Put this in at a higher load and see if it really makes things faster.
-	//	debuglogger::out << "bruh\n";
-	//}
-
-	switch(clEnqueueNDRangeKernel(computeCommandQueue, averagingShader.computeKernel, 2, nullptr, computeFrameGlobalSize, computeFrameLocalSize, 0, nullptr, nullptr)) {
-	case CL_SUCCESS: break;
-	case CL_INVALID_KERNEL_ARGS: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED_KERNEL_ARGS_UNSPECIFIED;
-	case CL_OUT_OF_RESOURCES: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED_INSUFFICIENT_MEM;
-	default: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED;
+	if (!fused) {
+		cl_kernel averageKernel = averagingShader.computeKernel;
+		if (accumulate) {
+			accumulatingShader.setFrameData(slot.computeFrame, frameWidth, frameHeight);
+			accumulatingShader.setAccumulatedFrameCount(accumulatedFrameCount);
+			averageKernel = accumulatingShader.computeKernel;
+		} else { averagingShader.setFrameData(slot.computeFrame, frameWidth, frameHeight); }
+
+		switch(clEnqueueNDRangeKernel(computeCommandQueue, averageKernel, 2, nullptr, computeFrameGlobalSize, computeFrameLocalSize, 0, nullptr, profilingEnabled ? &profileEvent : nullptr)) {
+		case CL_SUCCESS: if (profilingEnabled) { profiler.record(ProfileStage::RESOLVE, profileEvent); clReleaseEvent(profileEvent); } break;
+		case CL_INVALID_KERNEL_ARGS: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED_KERNEL_ARGS_UNSPECIFIED;
+		case CL_OUT_OF_RESOURCES: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED_INSUFFICIENT_MEM;
+		default: clFinish(computeCommandQueue); return ErrorCode::DEVICE_ENQUEUE_AVERAGE_FAILED;
+		}
 	}
 
 	// NOTE: Enqueueing something on the command queue doesn't actually execute it, you have to do a clFlush to start executing the command queue.
 	// NOTE: Then you can do a clFinish to wait for the command queue to finish and then you can get the data back.
 	// NOTE: clFinish is garanteed to return only after all items on command queue have returned, which means that it must also contain a clFlush (by definition).
-	// NOTE: That means you can do all this with just a single call to clFinish if you want.
 	// NOTE: Separating it into clFlush and clFinish can give you better performance though, in case you want to do some CPU processing while the kernel is
-	// NOTE: executing to save time.
+	// NOTE: executing to save time. That's exactly what we do here: the read is non-blocking, so we flush and go back to the caller. retrieveFrame does the waiting.
 
-	// NOTE: The following blocking clEnqueueReadImage takes care of flushing and finishing the command queue for us, so no need to handle that explicitly in this case.
+	slot.traversalStatisticsRead = false;
+	if (computeTraversalStatisticsAllocated) {
+		if (clEnqueueReadBuffer(computeCommandQueue, computeTraversalStatistics, false, 0, slot.traversalStatistics.size() * sizeof(cl_uint), slot.traversalStatistics.data(), 0, nullptr, nullptr) != CL_SUCCESS) {
+			clFinish(computeCommandQueue);
+			return ErrorCode::DEVICE_ENQUEUE_READ_FRAME_FAILED;
+		}
+		slot.traversalStatisticsRead = true;					// NOTE: The queue is in-order, so this read is done once the frame's read is.
+	}
 
-	cl_int err;
-	if ((err = clEnqueueReadImage(computeCommandQueue, computeFrame, true, computeFrameOrigin, computeFrameRegion, 0, 0, frame, 0, nullptr, nullptr)) != CL_SUCCESS) {
-		return clFinish(computeCommandQueue); ErrorCode::READ_DEVICE_FRAME_FAILED;
+	if (framesMapped) {
+		cl_int err;
+		size_t rowPitch;
+		slot.mappedFrame = (char*)clEnqueueMapImage(computeCommandQueue, slot.computeFrame, CL_FALSE, CL_MAP_READ, computeFrameOrigin, computeFrameRegion, &rowPitch, nullptr, 0, nullptr, &slot.readEvent, &err);
+		if (!slot.mappedFrame) { clFinish(computeCommandQueue); return ErrorCode::DEVICE_MAP_FRAME_FAILED; }
+		slot.mapped = true;
+	} else if (clEnqueueReadImage(computeCommandQueue, slot.computeFrame, false, computeFrameOrigin, computeFrameRegion, 0, 0, slot.frame, 0, nullptr, &slot.readEvent) != CL_SUCCESS) {
+		clFinish(computeCommandQueue);
+		return ErrorCode::DEVICE_ENQUEUE_READ_FRAME_FAILED;
+	}
+	clFlush(computeCommandQueue);
+	if (profilingEnabled) {
+		profiler.record(ProfileStage::READ_FRAME, slot.readEvent);
+		profiler.nextFrame();
+	}
+
+	slot.camera = camera;
+	nextSubmitSlotIndex = (nextSubmitSlotIndex + 1) % framePipelineDepth;
+	inFlightFrameCount++;
+	if (accumulate && accumulatedFrameCount != (uint32_t)-1) { accumulatedFrameCount++; }
+	return ErrorCode::SUCCESS;
+}
+
+ErrorCode Renderer::retrieveFrame() {
+	if (inFlightFrameCount == 0) { return ErrorCode::FRAME_PIPELINE_EMPTY; }
+	FramePipelineSlot& slot = framePipeline[(nextSubmitSlotIndex + framePipelineDepth - inFlightFrameCount) % framePipelineDepth];			// NOTE: The oldest frame in flight.
+
+	if (nativeBackendActive) {
+		inFlightFrameCount--;
+		frame = slot.frame;
+		frameCamera = slot.camera;
+		return ErrorCode::SUCCESS;
+	}
+
+	cl_int err = clWaitForEvents(1, &slot.readEvent);
+	clReleaseEvent(slot.readEvent);
+	inFlightFrameCount--;
+	if (err != CL_SUCCESS) { return ErrorCode::READ_DEVICE_FRAME_FAILED; }
+	if (profilingEnabled) { profiler.collect(); }						// NOTE: Everything of this frame is done by now, its read was the last thing on the queue for it.
+
+	frame = framesMapped ? slot.mappedFrame : slot.frame;
+	frameCamera = slot.camera;
+	frameTraversalStatistics = { };
+	if (slot.traversalStatisticsRead) {
+		for (size_t i = 0; i < slot.traversalStatistics.size(); i++) { frameTraversalStatistics.counts[i % (size_t)TraversalStatistic::COUNT] += slot.traversalStatistics[i]; }
 	}
 	return ErrorCode::SUCCESS;
 }
 
+void Renderer::finishFramePipeline() {
+	if (inFlightFrameCount == 0) { return; }
+	if (nativeBackendActive) { inFlightFrameCount = 0; return; }
+	clFinish(computeCommandQueue);
+	while (inFlightFrameCount != 0) {
+		FramePipelineSlot& slot = framePipeline[(nextSubmitSlotIndex + framePipelineDepth - inFlightFrameCount) % framePipelineDepth];
+		clReleaseEvent(slot.readEvent);
+		inFlightFrameCount--;
+	}
+	if (profilingEnabled) { profiler.collect(); }
+}
+
+uint8_t Renderer::getInFlightFrameCount() { return inFlightFrameCount; }
+
+Renderer::FrameView Renderer::getFrameView() { return { frame, frameWidth, frameHeight, frameBPP, framesMapped, frameCamera }; }
+
+ErrorCode Renderer::render() {
+	ErrorCode err = submitFrame();
+	if (err != ErrorCode::SUCCESS) { return err; }
+	return retrieveFrame();
+}
+
 bool Renderer::release() {
 	bool successful = true;
+	finishFramePipeline();																		// NOTE: Nothing can be in flight anymore once we start pulling the buffers out from under the queue.
+	if (nativeBackendActive) {
+		delete nativeRaytracer;
+		nativeRaytracer = nullptr;
+		releaseFrameBuffers();
+		nativeBackendActive = false;
+		return true;																			// NOTE: The OpenCL lib was already freed when init fell back.
+	}
+	deviceScene.finishUploads();
+	profiler.reset();
 	if (!averagingShader.release()) { successful = false; }									// NOTE: We release the shaders as early as possible in the release schedule so their release functions can still play with all the data that they might need.
+	if (!accumulatingShader.release()) { successful = false; }
 	if (!raytracingShader->release()) { successful = false; }
-	if (computeLightHeapLength != 0 && clReleaseMemObject(computeLightHeap) == CL_SUCCESS) { computeLightHeapLength = 0; } else { successful = false; }
-	if (computeEntityHeapLength != 0 && clReleaseMemObject(computeEntityHeap) == CL_SUCCESS) { computeEntityHeapLength = 0; } else { successful = false; }
-	if (computeMaterialHeapLength != 0 && clReleaseMemObject(computeMaterialHeap) == CL_SUCCESS) { computeMaterialHeapLength = 0; } else { successful = false; }
-	if (computeFrameAllocated && clReleaseMemObject(computeFrame) == CL_SUCCESS) { computeFrameAllocated = false; } else { successful = false; }
+	if (!deviceScene.release()) { successful = false; }
+	if (!computeFrameAllocated || !releaseFrameBuffersOnDevice()) { successful = false; }
+	if (computeAccumulationFrameAllocated) { if (clReleaseMemObject(computeAccumulationFrame) == CL_SUCCESS) { computeAccumulationFrameAllocated = false; } else { successful = false; } }
+	if (computeTraversalStatisticsAllocated) { if (clReleaseMemObject(computeTraversalStatistics) == CL_SUCCESS) { computeTraversalStatisticsAllocated = false; } else { successful = false; } }
 	if (clReleaseCommandQueue(computeCommandQueue) != CL_SUCCESS) { successful = false; }
 	if (clReleaseContext(computeContext) != CL_SUCCESS) { successful = false; }
-	delete[] beforeAverageFrame;
-	delete[] frame;
+	releaseFrameBuffers();
 	if (!freeOpenCLLib()) { successful = false; }
 	return successful;
 }
@@ -5,15 +5,24 @@
 
 #include "Camera.h"
 
+#include "DeviceScene.h"
+
 #include "ErrorCode.h"
 
 #include "cl_bindings_and_helpers.h"
 
 #include "RaytracingShader.h"
 #include "AveragingShader.h"
+#include "AccumulatingShader.h"
+
+#include "NativeRaytracer.h"
+
+#include "FrameProfiler.h"
 
 #include <cstdint>
 
+#include <vector>
+
 enum class ImageChannelOrderType {
 	RGBA,
 	BGRA,
@@ -21,76 +30,158 @@ enum class ImageChannelOrderType {
 	RGB
 };
 
+enum class FrameResolveType {
+	SEPARATE_AVERAGE,				// NOTE: The raytracer writes every sample into the before-average frame, which is samplesPerPixelSideLength^2 times the size of the frame. A second kernel averages it down.
+	FUSED							// NOTE: Every work item of the raytracer traces all the samples of its pixel and writes the pixel straight into the frame. No before-average frame and no second dispatch.
+};
+
+enum class FrameMemoryType {
+	COPY,							// NOTE: The frames get read from device-only images into separate host arrays.
+	MAPPED,							// NOTE: The images live in host-visible memory (CL_MEM_ALLOC_HOST_PTR) and get mapped, so nothing is copied on devices that share memory with the host.
+	AUTO							// NOTE: MAPPED on CPUs and integrated devices, COPY on everything else.
+};
+
+#define MAX_FRAME_PIPELINE_DEPTH 4
+
+// NOTE: One frame that can be in flight. Every slot has its own device frame and host frame, so the device can render into one while the host still reads out of another.
+struct FramePipelineSlot {
+	cl_mem computeFrame;
+	char* frame;														// NOTE: Only used for copied frames.
+	char* mappedFrame;													// NOTE: Only used for mapped frames. Valid from the moment readEvent completes until the slot gets submitted again.
+	bool mapped;
+	cl_event readEvent;
+	Camera camera;														// NOTE: The camera the frame was submitted with.
+	std::vector<cl_uint> traversalStatistics;							// NOTE: The per-work-group counts of the frame, only read back if the shader was built with traversal statistics.
+	bool traversalStatisticsRead;
+};
+
 class Renderer
 {
 	static cl_image_format frameFormat;																// NOTE: Can't just be const, needs to be static const even though that shouldn't really make a difference. Probably enforced just to make you be explicit.
 	static unsigned char frameBPP;
 	static uint16_t samplesPerPixelSideLength;
+	static FrameResolveType frameResolveType;
 
 	static float baseRayOrigin;
-
-	static size_t computeMaterialHeapOffset;
+	static Camera transferredCamera;																// NOTE: What the camera transfers last sent to the device, so that a transfer of the same values doesn't reset the accumulation.
 
 	static size_t computeFrameOrigin[3];
 
-	static size_t computeBeforeAverageFrameGlobalSize[2];
-	static size_t computeBeforeAverageFrameLocalSize[2];
+	static size_t computeTraceGlobalSize[2];																				// NOTE: Covers the before-average frame in separate mode and the frame in fused mode.
+	static size_t computeTraceLocalSize[2];
 	static size_t computeBeforeAverageFrameRegion[3];
 
 	static size_t computeFrameGlobalSize[2];
 	static size_t computeFrameLocalSize[2];
 	static size_t computeFrameRegion[3];
 
+	static FramePipelineSlot framePipeline[MAX_FRAME_PIPELINE_DEPTH];
+	static uint8_t framePipelineDepth;
+	static uint8_t nextSubmitSlotIndex;
+	static uint8_t inFlightFrameCount;
+
+	static FrameMemoryType frameMemoryType;
+	static bool framesMapped;
+
 	static AveragingShader averagingShader;																					// NOTE: Since I never use AveragingShader's vtable for anything, I assume it gets optimized out, allowing this to be used without overhead.
+	static AccumulatingShader accumulatingShader;
+
+	static cl_mem computeAccumulationFrame;
+	static bool computeAccumulationFrameAllocated;
+
+	static cl_mem computeTraversalStatistics;
+	static bool computeTraversalStatisticsAllocated;
+	static size_t traversalStatisticsGroupCount;
 
 	static bool initFrameBuffers(uint32_t frameWidth, uint32_t frameHeight);
+	static void releaseFrameBuffers();
 
 	static bool allocateBeforeAverageFrameBufferOnDevice();
+	static bool allocateMappedFrameBuffersOnDevice();
 	static bool allocateFrameBuffersOnDevice();
+	static bool releaseFrameBuffersOnDevice();
+	static void allocateAccumulationFrameOnDevice();
+	static void allocateTraversalStatisticsOnDevice();
 
 	static void transferRayOrigin();
 
+	static void loadWorkGroupProfile();
+
+	static NativeRaytracer* nativeRaytracer;
+	static NativeFrameLayout nativeFrameLayout;
+
+	static ErrorCode initNativeFallback(RaytracingShader* raytracingShader, ErrorCode openCLError, uint32_t frameWidth, uint32_t frameHeight);
+
 public:
 	static cl_platform_id computePlatform;
 	static cl_device_id computeDevice;
 	static cl_context computeContext;
 	static cl_command_queue computeCommandQueue;
 
-	static char* beforeAverageFrame;
 	static uint32_t beforeAverageFrameWidth;
 	static uint32_t beforeAverageFrameHeight;
 	static cl_mem computeBeforeAverageFrame;
 	static bool computeBeforeAverageFrameAllocated;
 
-	static char* frame;
+	static char* frame;																	// NOTE: Points into the slot of the frame that was retrieved last. Rows are always tightly packed, for mapped frames as well.
+	static Camera frameCamera;															// NOTE: The camera that frame was rendered with.
 	static uint32_t frameWidth;
 	static uint32_t frameHeight;
-	static cl_mem computeFrame;
 	static bool computeFrameAllocated;
 
 	static ResourceHeap resources;
-	static cl_mem computeMaterialHeap;
-	static size_t computeMaterialHeapLength;
-
 	static Scene scene;
-	static cl_mem computeEntityHeap;
-	static size_t computeEntityHeapLength;
-	static cl_mem computeKDTreeNodeHeap;
-	static size_t computeKDTreeNodeHeapLength;
-	static cl_mem computeLeafObjectHeap;
-	static size_t computeLeafObjectHeapLength;
-	static cl_mem computeLightHeap;
-	static size_t computeLightHeapLength;
+	static DeviceScene deviceScene;														// NOTE: The device copy of scene and resources.
 
 	static Camera camera;
 
+	// NOTE: While this is on, every frame gets mixed into a running mean of the frames before it, so a view that doesn't change keeps getting cleaner.
+	// NOTE: Every transfer function that actually changes something resets the mean, so nothing from before the change bleeds into the new frames. Transferring the same camera again keeps it going. If the device runs out of memory for the accumulation buffer, we fall back to plain averaging.
+	static bool accumulationEnabled;
+	static uint32_t accumulatedFrameCount;
+	static void resetAccumulation();
+
 	static RaytracingShader* raytracingShader;
 
-	static ErrorCode init(RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder);
+	// NOTE: If the shader was built with traversal statistics (see TraversalStatisticsMode), these are the counts of the frame that was retrieved last. All zeros otherwise.
+	static TraversalStatistics frameTraversalStatistics;
+
+	// NOTE: If there's no OpenCL on the machine at all (no DLL, no platforms or no devices), init renders on the CPU with NativeRaytracer instead of failing, unless this is turned off before init.
+	// NOTE: The native backend always resolves whole pixels (like FUSED) into copied frames and renders synchronously inside submitFrame. The rest of the interface works the same.
+	static bool nativeFallbackEnabled;
+	static bool nativeBackendActive;
+
+	// NOTE: Has to be set before init, the queue can only get profiling turned on when it's created. Then every kernel, frame read and upload gets timed into profiler.
+	// NOTE: The results are there once the frame was retrieved, see FrameProfiler for the statistics and the trace dump. Does nothing for the native backend.
+	static bool profilingEnabled;
+	static FrameProfiler profiler;
+
+	/*
+
+	NOTE: Work group autotuning, see WorkGroupAutotuner.
+		- init loads the device's profile, if there is one, and launches the trace and the averaging with the shapes in there instead of the defaults.
+			workGroupProfileLoaded says whether it had every kernel that this renderer launches.
+		- autotuneWorkGroups measures the shapes on whatever scene and camera are transferred right now and stores the winners in the profile.
+			It does nothing if the profile was loaded already, unless force is set, so calling it after every startup only costs time on the first one.
+		- Everything in flight gets finished first. The frames that it renders for the measurements never show up anywhere.
+
+	*/
+	static bool workGroupProfileLoaded;
+	static ErrorCode autotuneWorkGroups(bool force = false);
+	// NOTE: The shapes that the trace and the averaging get launched with right now, 2 entries each.
+	static const size_t* getTraceLocalSize() { return computeTraceLocalSize; }
+	static const size_t* getAverageLocalSize() { return computeFrameLocalSize; }
+
+	// NOTE: framePipelineDepth is the number of frames that can be in flight at once, clamped to [1, MAX_FRAME_PIPELINE_DEPTH].
+	// NOTE: MAPPED and AUTO quietly fall back to COPY if the device can't give us tightly packed host-visible images.
+	static ErrorCode init(RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder, 
+						FrameResolveType frameResolveType = FrameResolveType::SEPARATE_AVERAGE, uint8_t framePipelineDepth = 1, FrameMemoryType frameMemoryType = FrameMemoryType::COPY);
 
 	static ErrorCode resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight);							// SIDE-NOTE: class members are implicitly inline. Also, the static modifier doesn't mess with the linkage, it just changes the access pattern (induces classic static behaviour) when used on members.
 
 	static void loadCamera(const Camera& camera);
+	// NOTE: What transferCameraFOV hands the shader. It's measured in before-average pixels, so it grows with the samples per pixel side length.
+	static float getRayOrigin();
 	static void transferCameraPosition();
 	static void transferCameraRotation();
 	static void transferCameraFOV();
@@ -105,6 +196,32 @@ public:
 	// WARNING: A valid state is not garanteed if this function fails.
 	static ErrorCode transferScene();
 
+	/*
+
+	NOTE: How the frame pipeline works:
+		- submitFrame enqueues the kernels and a non-blocking read of the result into a free slot and returns right away.
+		- retrieveFrame waits for the oldest submitted frame, points frame at its host copy and sets frameCamera.
+		- So the caller can submit frame N + 1, then retrieve and present frame N while the device is busy with N + 1.
+		- Kernel arguments get captured at enqueue time, so camera changes that are transferred after a submit only show up in the frames submitted after them.
+		- render is just a submit followed by a retrieve, which is the old synchronous behaviour as long as nothing else is in flight.
+
+	*/
+	static ErrorCode submitFrame();
+	static ErrorCode retrieveFrame();
+	static void finishFramePipeline();													// NOTE: Waits for every frame in flight and throws them away.
+	static uint8_t getInFlightFrameCount();
+
+	// NOTE: Read-only view of the frame that was retrieved last. For mapped frames, the pixels are read in place, out of the memory the device rendered into.
+	struct FrameView {
+		const char* data;
+		uint32_t width;
+		uint32_t height;
+		unsigned char bytesPerPixel;
+		bool mapped;
+		Camera camera;
+	};
+	static FrameView getFrameView();
+
 	static ErrorCode render();
 
 	// WARNING: A valid state is not garanteed if this function fails. This function will try it's best to release all the resources. Even if one step fails, it'll try to release everything as good as possible, so don't worry about that.
@@ -0,0 +1,183 @@
+#include "RendererInstance.h"
+
+#include "nmath/constants.h"
+
+#include <cmath>
+
+#include <new>
+#include <mutex>
+#include <shared_mutex>
+
+bool RendererInstance::allocateFrameBuffersOnDevice() {
+	cl_int err;
+	computeFrame = clCreateImage2D(context->computeContext, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
+	if (!computeFrame) { return false; }
+	raytracingShader->setBeforeAverageFrameData(computeFrame, frameWidth, frameHeight);			// NOTE: Fused mode, so the frame goes where the before-average frame would go.
+
+	// NOTE: Same as in Renderer, the accumulation buffer is only a cache. Not having it only means no accumulation.
+	computeAccumulationFrame = clCreateBuffer(context->computeContext, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, (size_t)frameWidth * frameHeight * sizeof(cl_float4), nullptr, &err);
+	computeAccumulationFrameAllocated = computeAccumulationFrame != nullptr;
+
+	Shader::getGlobalSize(computeTraceLocalSize, frameWidth, frameHeight, computeTraceGlobalSize);
+	computeFrameRegion[0] = frameWidth;
+	computeFrameRegion[1] = frameHeight;
+	return true;
+}
+
+bool RendererInstance::releaseFrameBuffersOnDevice() {
+	bool successful = true;
+	if (computeFrame) {
+		if (clReleaseMemObject(computeFrame) != CL_SUCCESS) { successful = false; }
+		computeFrame = nullptr;
+	}
+	if (computeAccumulationFrameAllocated) {
+		if (clReleaseMemObject(computeAccumulationFrame) != CL_SUCCESS) { successful = false; }
+		computeAccumulationFrameAllocated = false;
+	}
+	return successful;
+}
+
+void RendererInstance::resetAccumulation() { accumulatedFrameCount = 0; }
+
+void RendererInstance::transferRayOrigin() {
+	uint32_t beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
+	uint32_t beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
+	raytracingShader->setRayOrigin((beforeAverageFrameWidth > beforeAverageFrameHeight ? beforeAverageFrameHeight : beforeAverageFrameWidth) * baseRayOrigin);
+}
+
+ErrorCode RendererInstance::init(RenderContext* context, RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder) {
+	this->context = context;
+	this->raytracingShader = raytracingShader;
+	this->samplesPerPixelSideLength = samplesPerPixelSideLength;
+	transferredCamera = Camera::makeUntransferred();
+	this->frameWidth = frameWidth;
+	this->frameHeight = frameHeight;
+
+	switch (frameChannelOrder) {
+	case ImageChannelOrderType::RGBA: frameFormat.image_channel_order = CL_RGBA; frameBPP = 4; break;
+	case ImageChannelOrderType::BGRA: frameFormat.image_channel_order = CL_BGRA; frameBPP = 4; break;
+	case ImageChannelOrderType::ARGB: frameFormat.image_channel_order = CL_ARGB; frameBPP = 4; break;
+	case ImageChannelOrderType::RGB: frameFormat.image_channel_order = CL_RGB; frameBPP = 3; break;
+	}
+	frameFormat.image_channel_data_type = CL_UNSIGNED_INT8;
+
+	frame = new (std::nothrow) char[(size_t)frameWidth * frameBPP * frameHeight];
+	if (!frame) { return ErrorCode::FRAME_INIT_FAILED_INSUFFICIENT_HOST_MEM; }
+
+	cl_int err;
+	commandQueue = clCreateCommandQueueWithProperties(context->computeContext, context->computeDevice, nullptr, &err);
+	if (!commandQueue) { delete[] frame; frame = nullptr; return ErrorCode::DEVICE_COMMAND_QUEUE_CREATION_FAILED; }
+
+	raytracingShader->specializeSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	ErrorCode shaderErr = raytracingShader->init(context->computeContext, context->computeDevice);
+	if (shaderErr != ErrorCode::SUCCESS) {
+		clReleaseCommandQueue(commandQueue);
+		commandQueue = nullptr;
+		delete[] frame;
+		frame = nullptr;
+		return shaderErr;
+	}
+
+	computeFrameOrigin[0] = 0;
+	computeFrameOrigin[1] = 0;
+	computeFrameOrigin[2] = 0;
+	computeFrameRegion[2] = 1;
+	raytracingShader->getTraceLocalSize(computeTraceLocalSize);
+
+	if (!allocateFrameBuffersOnDevice()) {
+		raytracingShader->release();
+		clReleaseCommandQueue(commandQueue);
+		commandQueue = nullptr;
+		delete[] frame;
+		frame = nullptr;
+		return ErrorCode::DEVICE_FRAME_ALLOCATION_FAILED;
+	}
+
+	raytracingShader->setSamplesPerPixelSideLength(samplesPerPixelSideLength);
+
+	boundSceneVersion = -1;
+	resetAccumulation();
+	return ErrorCode::SUCCESS;
+}
+
+ErrorCode RendererInstance::resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight) {
+	clFinish(commandQueue);
+
+	char* newFrame = new (std::nothrow) char[(size_t)newFrameWidth * frameBPP * newFrameHeight];
+	if (!newFrame) { return ErrorCode::FRAME_REINIT_FAILED_INSUFFICIENT_HOST_MEM; }
+	delete[] frame;
+	frame = newFrame;
+	frameWidth = newFrameWidth;
+	frameHeight = newFrameHeight;
+
+	if (!releaseFrameBuffersOnDevice()) { return ErrorCode::DEVICE_RELEASE_FRAME_FAILED; }
+	if (!allocateFrameBuffersOnDevice()) { return ErrorCode::DEVICE_REALLOCATE_FRAME_FAILED_INSUFFICIENT_DEVICE_MEM; }
+
+	resetAccumulation();
+	if (baseRayOrigin != -1) { transferRayOrigin(); }
+
+	return ErrorCode::SUCCESS;
+}
+
+void RendererInstance::loadCamera(const Camera& camera) { this->camera = camera; }
+void RendererInstance::transferCameraPosition() {
+	raytracingShader->setCameraPosition(camera.position);
+	if (!Camera::vectorsEqual(camera.position, transferredCamera.position)) { resetAccumulation(); }
+	transferredCamera.position = camera.position;
+}
+void RendererInstance::transferCameraRotation() {
+	raytracingShader->setCameraRotation(camera.rotation);
+	if (!Camera::vectorsEqual(camera.rotation, transferredCamera.rotation)) { resetAccumulation(); }
+	transferredCamera.rotation = camera.rotation;
+}
+void RendererInstance::transferCameraFOV() {
+	baseRayOrigin = 0.5f / tanf(camera.FOV / 360 * nmath::constants::pi);
+	transferRayOrigin();
+	if (camera.FOV != transferredCamera.FOV) { resetAccumulation(); }
+	transferredCamera.FOV = camera.FOV;
+}
+
+ErrorCode RendererInstance::render() {
+	// NOTE: Held until the frame is read back, the kernel reads the heaps the whole time.
+	std::shared_lock<std::shared_mutex> sceneLock(context->sceneMutex);
+
+	if (boundSceneVersion != context->sceneVersion) {
+		context->deviceScene.bindTo(raytracingShader);
+		boundSceneVersion = context->sceneVersion;
+		resetAccumulation();
+	}
+
+	bool accumulate = accumulationEnabled && computeAccumulationFrameAllocated;
+	if (!accumulate) { accumulatedFrameCount = 0; }
+
+	raytracingShader->setSampleIndex(accumulatedFrameCount);
+	if (accumulate) { raytracingShader->setAccumulationFrame(computeAccumulationFrame, accumulatedFrameCount); }
+	else { raytracingShader->setAccumulationFrame(nullptr, 0); }
+
+	switch (raytracingShader->enqueueTrace(commandQueue, nullptr, computeTraceGlobalSize, computeTraceLocalSize, 0, nullptr, nullptr, nullptr)) {
+	case CL_SUCCESS: break;
+	case CL_INVALID_KERNEL_ARGS: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_KERNEL_ARGS_UNSPECIFIED;
+	case CL_OUT_OF_RESOURCES: case CL_MEM_OBJECT_ALLOCATION_FAILURE: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_INSUFFICIENT_MEM;
+	default: return ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED;
+	}
+
+	if (clEnqueueReadImage(commandQueue, computeFrame, true, computeFrameOrigin, computeFrameRegion, (size_t)frameWidth * frameBPP, 0, frame, 0, nullptr, nullptr) != CL_SUCCESS) { return ErrorCode::READ_DEVICE_FRAME_FAILED; }
+
+	frameCamera = camera;
+	if (accumulate && accumulatedFrameCount != (uint32_t)-1) { accumulatedFrameCount++; }
+	return ErrorCode::SUCCESS;
+}
+
+Renderer::FrameView RendererInstance::getFrameView() const { return { frame, frameWidth, frameHeight, frameBPP, false, frameCamera }; }
+
+bool RendererInstance::release() {
+	bool successful = true;
+	if (commandQueue) { clFinish(commandQueue); }
+	if (raytracingShader && !raytracingShader->release()) { successful = false; }
+	if (!releaseFrameBuffersOnDevice()) { successful = false; }
+	if (commandQueue && clReleaseCommandQueue(commandQueue) != CL_SUCCESS) { successful = false; }
+	commandQueue = nullptr;
+	delete[] frame;
+	frame = nullptr;
+	return successful;
+}
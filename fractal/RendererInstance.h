@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Renderer.h"
+#include "RenderContext.h"
+
+#include "Camera.h"
+
+#include "ErrorCode.h"
+
+#include "cl_bindings_and_helpers.h"
+
+#include "RaytracingShader.h"
+
+#include <cstdint>
+
+/*
+
+NOTE: A non-static renderer for one view of the scene in a RenderContext.
+	- Every instance has its own command queue, shader (so its own kernel arguments), camera, frame and accumulation buffer. The scene heaps are the ones in the context.
+	- Different instances can render from different threads at the same time. One instance is only ever used by one thread at a time, clSetKernelArg on the same kernel isn't thread-safe.
+	- Only fused resolving and copied frames, render is synchronous. Renderer stays the one with the frame pipeline and all the options, it's what the window uses.
+	- Every instance builds its own program, since a kernel can only hold one set of arguments. The build is the slow part of init.
+
+*/
+
+class RendererInstance {
+	RenderContext* context = nullptr;
+	cl_command_queue commandQueue = nullptr;
+
+	cl_image_format frameFormat;
+	unsigned char frameBPP;
+	uint16_t samplesPerPixelSideLength;
+
+	float baseRayOrigin = -1;
+	Camera transferredCamera = Camera::makeUntransferred();					// NOTE: Same as in Renderer, only transfers that change something reset the accumulation.
+
+	cl_mem computeFrame = nullptr;
+	cl_mem computeAccumulationFrame;
+	bool computeAccumulationFrameAllocated = false;
+
+	size_t computeFrameOrigin[3];
+	size_t computeFrameRegion[3];
+	size_t computeTraceGlobalSize[2];
+	size_t computeTraceLocalSize[2];
+
+	uint64_t boundSceneVersion = -1;											// NOTE: The sceneVersion of the context that the shader was last pointed at.
+
+	bool allocateFrameBuffersOnDevice();
+	bool releaseFrameBuffersOnDevice();
+
+	void transferRayOrigin();
+
+public:
+	char* frame = nullptr;
+	Camera frameCamera;
+	uint32_t frameWidth;
+	uint32_t frameHeight;
+
+	Camera camera;
+
+	bool accumulationEnabled = true;
+	uint32_t accumulatedFrameCount = 0;
+	void resetAccumulation();
+
+	RaytracingShader* raytracingShader = nullptr;							// NOTE: Owned by the caller, same as with Renderer. Every instance needs its own.
+
+	ErrorCode init(RenderContext* context, RaytracingShader* raytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder);
+
+	ErrorCode resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight);
+
+	void loadCamera(const Camera& camera);
+	void transferCameraPosition();
+	void transferCameraRotation();
+	void transferCameraFOV();
+
+	ErrorCode render();
+
+	Renderer::FrameView getFrameView() const;
+
+	bool release();
+};
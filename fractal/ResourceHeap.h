@@ -4,15 +4,24 @@
 
 #include "Material.h"
 
+#include "DirtyRanges.h"
+
 class ResourceHeap {
 public:
 	Material* materialHeap;
 	size_t materialHeapOffset;
 	size_t materialHeapLength;
 
+	DirtyRanges materialHeapDirtyRanges;									// NOTE: Same idea as the dirty ranges in Scene.
+
+	void markMaterialsDirty(size_t index, size_t count = 1) { materialHeapDirtyRanges.mark(index, count); }
+	bool isDirty() const { return !materialHeapDirtyRanges.empty(); }
+	void clearDirty() { materialHeapDirtyRanges.clear(); }
+
 	constexpr ResourceHeap() = default;
-	constexpr ResourceHeap(size_t materialHeapOffset, size_t materialHeapLength) : materialHeapOffset(materialHeapOffset), materialHeapLength(materialHeapLength) {
+	ResourceHeap(size_t materialHeapOffset, size_t materialHeapLength) : materialHeapOffset(materialHeapOffset), materialHeapLength(materialHeapLength) {
 		materialHeap = new (std::nothrow) Material[materialHeapLength];
+		materialHeapDirtyRanges.markAll();
 	}
 
 
@@ -21,6 +30,7 @@ public:
 		right.materialHeap = nullptr;
 		materialHeapOffset = right.materialHeapOffset;
 		materialHeapLength = right.materialHeapLength;
+		materialHeapDirtyRanges = std::move(right.materialHeapDirtyRanges);
 		return *this;
 	}
 
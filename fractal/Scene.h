@@ -6,17 +6,35 @@
 
 #include "KDTree.h"
 
+#include "ThreadPool.h"
+
+#include "DirtyRanges.h"
+
 #include <new>
 #include <cstdint>
+#include <cmath>
 
 #include <vector>
+#include <algorithm>
+#include <memory>
 
 #include "logging/debugOutput.h"
 
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <csignal>
+// NOTE: The Linux build (CMakeLists.txt) has no Windows.h. SIGTRAP stops in the debugger just like DebugBreak does.
+inline void DebugBreak() { raise(SIGTRAP); }
+#endif
 
 #include "nmath/vectors/Vector3f.h"
 
+enum class KDTreeBuilderType {
+	MIDPOINT,
+	SAH
+};
+
 class Scene {
 public:
 	Entity* entityHeap;
@@ -25,13 +43,82 @@ public:
 	KDTree kdTree;
 	std::vector<KDTreeNode> kdTreeNodeHeap;
 
+	bool kdTreeRopesEnabled = true;
+	std::vector<KDTreeNodeRopes> kdTreeRopeHeap;
+
+	bool compactKDTreeEnabled = true;
+	std::vector<CompactKDTreeNode> compactKDTreeNodeHeap;
+
+	KDTreeBuilderType kdTreeBuilderType = KDTreeBuilderType::SAH;					// NOTE: The midpoint builder is only left in so that we can compare against it.
+
+	// Cost constants for the SAH builder. Only the ratio between the traversal and the intersection cost really matters.
+	float kdTreeTraversalCost = 1;
+	float kdTreeIntersectionCost = 1.5f;
+	float kdTreeEmptySpaceBonus = 0.2f;											// Fraction of the cost that gets taken off of splits that cut away empty space.
+	uint64_t kdTreeMaxDepth = 40;
+
+	// Settings for making the SAH builder fast on big scenes.
+	uint32_t kdTreeBuildThreadCount = 0;										// 0 means one thread per hardware thread, 1 means build on the calling thread only.
+	uint64_t kdTreeParallelBuildThreshold = 4096;								// Nodes with fewer objects than this build their children on the current thread.
+	uint64_t kdTreeExactSAHThreshold = 1024;									// Nodes with more objects than this use binned split candidates instead of every object bound.
+	uint32_t kdTreeSAHBinCount = 32;
+
+	// How far entities can move (or grow) after the build before markEntitiesDirty has to rebuild the tree. The SAH builder and the tree bounds treat every radius as this much bigger,
+	// which costs some extra leaf overlaps, so leave it at 0 for scenes that don't move. The midpoint builder ignores it.
+	float kdTreeMotionMargin = 0;
+
 	Light* lightHeap;
 	uint64_t lightHeapLength;
 
+	/*
+
+	NOTE: If you change entities or lights after the scene was transferred, mark them here and the next transferScene only uploads what you marked.
+		- The kernels take the sphere geometry from leafSphereHeap, not from the entities. markEntitiesDirty copies the new position and radius of every
+			marked entity into its leaf spheres right away (see entityLeafSlotOffsets) and marks those as dirty too, so they go up as dirty ranges as well.
+		- That only works as long as an entity stays inside the leaves that it's already in. If it reaches into a leaf that doesn't list it (or out of the tree),
+			markEntitiesDirty sets kdTreeOutdated and the next transferScene rebuilds the tree through updateKDTree, which uploads all of the kd-tree heaps.
+			kdTreeMotionMargin is how much room the entities get for that.
+		- generateKDTree sets kdTreeDirty, which makes the renderer upload all of the kd-tree heaps.
+
+	*/
+	DirtyRanges entityHeapDirtyRanges;
+	DirtyRanges lightHeapDirtyRanges;
+	DirtyRanges leafSphereHeapDirtyRanges;
+	bool kdTreeDirty = true;
+	bool kdTreeOutdated = false;
+
+	void markEntitiesDirty(size_t index, size_t count = 1) {
+		entityHeapDirtyRanges.mark(index, count);
+		for (size_t i = index; i < index + count && i < entityHeapLength; i++) {
+			if (!patchLeafSpheres(i)) { kdTreeOutdated = true; }
+		}
+	}
+	void markLightsDirty(size_t index, size_t count = 1) { lightHeapDirtyRanges.mark(index, count); }
+	void markAllDirty() {
+		entityHeapDirtyRanges.markAll();
+		lightHeapDirtyRanges.markAll();
+		kdTreeDirty = true;
+	}
+	// NOTE: Whether the next transfer has anything to upload. Only those transfers reset the accumulation, see Renderer::accumulationEnabled.
+	bool isDirty() const { return !entityHeapDirtyRanges.empty() || !lightHeapDirtyRanges.empty() || !leafSphereHeapDirtyRanges.empty() || kdTreeDirty; }
+	void clearDirty() {
+		entityHeapDirtyRanges.clear();
+		lightHeapDirtyRanges.clear();
+		leafSphereHeapDirtyRanges.clear();
+		kdTreeDirty = false;
+	}
+
+	// NOTE: The renderers call this at the start of transferScene. Only rebuilds if an entity got marked that doesn't fit into its leaves anymore.
+	void updateKDTree() {
+		if (kdTreeOutdated) { generateKDTree(); }
+	}
+
 	constexpr Scene() = default;
-	constexpr Scene(size_t entityHeapLength, uint64_t lightHeapLength) : entityHeapLength(entityHeapLength), lightHeapLength(lightHeapLength) {
+	// NOTE: Not constexpr, new can't run in a constant expression. MSVC lets that slide, GCC doesn't.
+	Scene(size_t entityHeapLength, uint64_t lightHeapLength) : entityHeapLength(entityHeapLength), lightHeapLength(lightHeapLength) {
 		entityHeap = new (std::nothrow) Entity[entityHeapLength];
 		lightHeap = new (std::nothrow) Light[lightHeapLength];
+		markAllDirty();
 	}
 
 	constexpr Scene& operator=(Scene&& right) {
@@ -41,11 +128,35 @@ public:
 		right.lightHeap = nullptr;
 		entityHeapLength = right.entityHeapLength;
 		lightHeapLength = right.lightHeapLength;
+		entityHeapDirtyRanges = std::move(right.entityHeapDirtyRanges);
+		lightHeapDirtyRanges = std::move(right.lightHeapDirtyRanges);
+		leafSphereHeapDirtyRanges = std::move(right.leafSphereHeapDirtyRanges);
+		kdTreeDirty = right.kdTreeDirty;
+		kdTreeOutdated = right.kdTreeOutdated;
 
 		kdTree = right.kdTree;
 		kdTreeNodeHeap = std::move(right.kdTreeNodeHeap);
+		kdTreeRopesEnabled = right.kdTreeRopesEnabled;
+		kdTreeRopeHeap = std::move(right.kdTreeRopeHeap);
+		compactKDTreeEnabled = right.compactKDTreeEnabled;
+		compactKDTreeNodeHeap = std::move(right.compactKDTreeNodeHeap);
+
+		kdTreeBuilderType = right.kdTreeBuilderType;
+		kdTreeTraversalCost = right.kdTreeTraversalCost;
+		kdTreeIntersectionCost = right.kdTreeIntersectionCost;
+		kdTreeEmptySpaceBonus = right.kdTreeEmptySpaceBonus;
+		kdTreeMaxDepth = right.kdTreeMaxDepth;
+		kdTreeBuildThreadCount = right.kdTreeBuildThreadCount;
+		kdTreeParallelBuildThreshold = right.kdTreeParallelBuildThreshold;
+		kdTreeExactSAHThreshold = right.kdTreeExactSAHThreshold;
+		kdTreeSAHBinCount = right.kdTreeSAHBinCount;
+		kdTreeMotionMargin = right.kdTreeMotionMargin;
 
 		leafObjectHeap = std::move(right.leafObjectHeap);
+		leafSphereHeap = std::move(right.leafSphereHeap);
+		leafEntityIndexHeap = std::move(right.leafEntityIndexHeap);
+		entityLeafSlotOffsets = std::move(right.entityLeafSlotOffsets);
+		entityLeafSlots = std::move(right.entityLeafSlots);
 
 		return *this;
 	}
@@ -67,6 +178,11 @@ public:
 		delete[] yList;
 		delete[] zList;
 		delete[] list;
+
+		delete[] xListR;
+		delete[] yListR;
+		delete[] zListR;
+		delete[] listR;
 	}
 
 	void createSortedLists() {
@@ -102,111 +218,123 @@ public:
 			zListR[i] = i;
 		}
 
-		uint64_t* List = xList;
+		// NOTE: stable_sort keeps the order of equal keys the same as the bubble sort that used to be here did, so the midpoint builder still builds the exact same tree.
+		auto sortList = [this](uint64_t* list, char dimension, float radiusSign) {
+			std::stable_sort(list, list + entityHeapLength, [this, dimension, radiusSign](uint64_t left, uint64_t right) {
+				return entityHeap[left].position[dimension] + radiusSign * entityHeap[left].scale.x < entityHeap[right].position[dimension] + radiusSign * entityHeap[right].scale.x;
+			});
+		};
+		sortList(xList, 0, 1);
+		sortList(yList, 1, 1);
+		sortList(zList, 2, 1);
+		sortList(xListR, 0, -1);
+		sortList(yListR, 1, -1);
+		sortList(zListR, 2, -1);
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.x + entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.x + entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
-			}
-			if (!neededToSort) { break; }
-		}
+		// interleave lists:
 
-		List = yList;
+		for (int i = 0; i < entityHeapLength; i++) {
+			list[i * 3 + 0] = xList[i];
+			list[i * 3 + 1] = yList[i];
+			list[i * 3 + 2] = zList[i];
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.y + entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.y + entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
-			}
-			if (!neededToSort) { break; }
+			listR[i * 3 + 0] = xListR[i];
+			listR[i * 3 + 1] = yListR[i];
+			listR[i * 3 + 2] = zListR[i];
 		}
+	}
 
-		List = zList;
+	std::vector<uint64_t> leafObjectHeap;
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.z + entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.z + entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
-			}
-			if (!neededToSort) { break; }
+	// NOTE: Packed copies of leafObjectHeap for the kernels, see generateLeafSphereHeap.
+	std::vector<LeafSphere> leafSphereHeap;
+	std::vector<uint32_t> leafEntityIndexHeap;
+
+	// NOTE: The other direction of leafObjectHeap: the leaf slots of entity i are entityLeafSlots[entityLeafSlotOffsets[i]] up to entityLeafSlots[entityLeafSlotOffsets[i + 1]].
+	// An entity that straddles a split is in more than one leaf, so it can have more than one slot.
+	std::vector<uint64_t> entityLeafSlotOffsets;
+	std::vector<uint64_t> entityLeafSlots;
+
+	// NOTE: generateKDTree calls this. Leaves the heaps empty if an entity index doesn't fit into 32 bits.
+	bool generateLeafSphereHeap() {
+		leafSphereHeap.clear();
+		leafEntityIndexHeap.clear();
+		entityLeafSlotOffsets.clear();
+		entityLeafSlots.clear();
+		leafSphereHeapDirtyRanges.clear();
+		if (entityHeapLength > (uint32_t)-1) { return false; }
+
+		leafSphereHeap.resize(leafObjectHeap.size());
+		leafEntityIndexHeap.resize(leafObjectHeap.size());
+		entityLeafSlotOffsets.assign(entityHeapLength + 1, 0);
+		for (size_t i = 0; i < leafObjectHeap.size(); i++) {
+			const Entity& entity = entityHeap[leafObjectHeap[i]];
+			leafSphereHeap[i].position = entity.position;
+			leafSphereHeap[i].radius = entity.scale.x;
+			leafEntityIndexHeap[i] = (uint32_t)leafObjectHeap[i];
+			entityLeafSlotOffsets[leafObjectHeap[i] + 1]++;
 		}
+		for (size_t i = 0; i < entityHeapLength; i++) { entityLeafSlotOffsets[i + 1] += entityLeafSlotOffsets[i]; }
+		entityLeafSlots.resize(leafObjectHeap.size());
+		std::vector<uint64_t> nextSlot(entityLeafSlotOffsets.begin(), entityLeafSlotOffsets.end() - 1);
+		for (size_t i = 0; i < leafObjectHeap.size(); i++) { entityLeafSlots[nextSlot[leafObjectHeap[i]]++] = i; }
+		return true;
+	}
 
-		List = xListR;
+	float getEntityBuildRadius(const Entity& entity) const { return entity.scale.x + kdTreeMotionMargin; }
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.x - entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.x - entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
-			}
-			if (!neededToSort) { break; }
-		}
+	/*
 
-		List = yListR;
+	NOTE: Whether every leaf that the bounds of the entity reach into lists it.
+		- The SAH builder likes to put splits right on the edges of entities. The float math in here is the kernel's, which can put those splits an ulp or so
+			away from where the builder had them, so reaching past a split by less than kdTreeSplitTolerance doesn't count. A fresh build has the same error.
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.y - entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.y - entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
+	*/
+	static constexpr float kdTreeSplitTolerance = 1.0f / 65536;
+	bool entityFitsIntoItsLeaves(size_t entityIndex, uint64_t nodeIndex, nmath::Vector3f boxPos, nmath::Vector3f boxSize) const {
+		const Entity& entity = entityHeap[entityIndex];
+		const KDTreeNode& node = kdTreeNodeHeap[nodeIndex];
+		if (node.objectCount != (uint32_t)-1) {
+			for (uint64_t i = entityLeafSlotOffsets[entityIndex]; i < entityLeafSlotOffsets[entityIndex + 1]; i++) {
+				if (entityLeafSlots[i] >= node.childrenIndex && entityLeafSlots[i] < node.childrenIndex + node.objectCount) { return true; }
 			}
-			if (!neededToSort) { break; }
+			return false;
 		}
 
-		List = zListR;
+		char dimension = node.childrenIndex >> (sizeof(uint64_t) * 8 - 2);
+		uint64_t childrenIndex = node.childrenIndex & ((uint64_t)-1 >> 2);
+
+		// NOTE: Same float math as calculateKDTreeNodeBounds, which is the same as the kernel's.
+		nmath::Vector3f leftBoxSize = boxSize;
+		leftBoxSize[dimension] = boxSize[dimension] * node.split;
+		nmath::Vector3f rightBoxPos = boxPos;
+		rightBoxPos[dimension] += leftBoxSize[dimension];
+		nmath::Vector3f rightBoxSize = boxSize;
+		rightBoxSize[dimension] = boxSize[dimension] * (1 - node.split);
+
+		float tolerance = kdTreeSplitTolerance * (std::abs(rightBoxPos[dimension]) + 1);
+		if (entity.position[dimension] - entity.scale.x < rightBoxPos[dimension] - tolerance && !entityFitsIntoItsLeaves(entityIndex, childrenIndex, boxPos, leftBoxSize)) { return false; }
+		if (entity.position[dimension] + entity.scale.x > rightBoxPos[dimension] + tolerance && !entityFitsIntoItsLeaves(entityIndex, childrenIndex + 1, rightBoxPos, rightBoxSize)) { return false; }
+		return true;
+	}
 
-		while (true) {
-			bool neededToSort = false;
-			for (int i = 0; i < entityHeapLength - 1; i++) {
-				if (entityHeap[List[i]].position.z - entityHeap[List[i]].scale.x > entityHeap[List[i + 1]].position.z - entityHeap[List[i + 1]].scale.x) {
-					uint64_t temp = List[i];
-					List[i] = List[i + 1];
-					List[i + 1] = temp;
-					neededToSort = true;
-				}
-			}
-			if (!neededToSort) { break; }
+	// NOTE: Copies the entity's current position and radius into its leaf spheres and marks them dirty. Returns false if the tree has to be rebuilt for the entity, see markEntitiesDirty.
+	bool patchLeafSpheres(size_t entityIndex) {
+		if (kdTreeNodeHeap.size() == 0 || entityLeafSlotOffsets.size() != entityHeapLength + 1) { return false; }
+		const Entity& entity = entityHeap[entityIndex];
+		for (uint64_t i = entityLeafSlotOffsets[entityIndex]; i < entityLeafSlotOffsets[entityIndex + 1]; i++) {
+			uint64_t slot = entityLeafSlots[i];
+			leafSphereHeap[slot].position = entity.position;
+			leafSphereHeap[slot].radius = entity.scale.x;
+			leafSphereHeapDirtyRanges.mark(slot);
 		}
 
-		// interleave lists:
-
-		for (int i = 0; i < entityHeapLength; i++) {
-			list[i * 3 + 0] = xList[i];
-			list[i * 3 + 1] = yList[i];
-			list[i * 3 + 2] = zList[i];
-
-			listR[i * 3 + 0] = xListR[i];
-			listR[i * 3 + 1] = yListR[i];
-			listR[i * 3 + 2] = zListR[i];
+		for (char dimension = 0; dimension < 3; dimension++) {
+			if (entity.position[dimension] - entity.scale.x < kdTree.position[dimension] || entity.position[dimension] + entity.scale.x > kdTree.position[dimension] + kdTree.size[dimension]) { return false; }
 		}
+		return entityFitsIntoItsLeaves(entityIndex, 0, kdTree.position, kdTree.size);
 	}
 
-	std::vector<uint64_t> leafObjectHeap;
-
 	template <typename Lambda>
 	void doThisThingForEveryObjectInRange(Lambda thing, char dimension, uint64_t limitBegins[6], uint64_t limitEnds[6], nmath::Vector3f boxPos, nmath::Vector3f boxSize) {
 		uint64_t& yLimit = limitBegins[1];
@@ -358,36 +486,406 @@ public:
 			generateKDTreeNode(tempsave, thisIndex, newBoxPos, newBoxSize, rightLimitBegins, limitEnds, (dimension + 1) % 3);
 	}
 
+	static float calculateSurfaceArea(nmath::Vector3f size) { return 2 * (size.x * size.y + size.y * size.z + size.z * size.x); }
+
+	float calculateSAHSplitCost(nmath::Vector3f boxSize, float boxSurfaceArea, char dimension, float leftLength, uint64_t leftCount, uint64_t rightCount) {
+		nmath::Vector3f leftSize = boxSize;
+		leftSize[dimension] = leftLength;
+		nmath::Vector3f rightSize = boxSize;
+		rightSize[dimension] = boxSize[dimension] - leftLength;
+
+		float cost = kdTreeTraversalCost + kdTreeIntersectionCost * (calculateSurfaceArea(leftSize) * leftCount + calculateSurfaceArea(rightSize) * rightCount) / boxSurfaceArea;
+		if (leftCount == 0 || rightCount == 0) { cost *= 1 - kdTreeEmptySpaceBonus; }
+		return cost;
+	}
+
+	/*
+
+	NOTE: How the SAH split search works:
+		- For every dimension, we take the lower and upper bounds of every object (clipped to the node) and sort them.
+		- The only split planes worth looking at are the ones that lie on those bounds, because the object counts on either side only change there.
+		- We sweep through both sorted lists at the same time. At any plane, every object whose lower bound is below the plane is on the left and
+			every object whose upper bound is above the plane is on the right. Objects that straddle the plane are on both sides.
+		- Cost of a split = traversal cost + intersection cost * (left area * left count + right area * right count) / node area.
+		- Planes that lie on the node bounds are skipped. They would create a child of zero thickness, which the kernel can't reconstruct the parent from
+			since it divides by the split (and by 1 - split).
+
+	NOTE: Sorting at every node makes the whole build O(n log^2 n), which hurts at the top of the tree where the nodes are huge. That's why big nodes
+		use binning instead: the node gets cut into kdTreeSAHBinCount slabs per dimension and only the slab boundaries are evaluated. Counting the bounds
+		into the bins is O(n), so the build as a whole is O(n log n). The exact sweep only runs once the nodes are small, where it's cheap and where
+		the precision actually matters.
+
+	*/
+	bool findBestSAHSplitExact(const std::vector<uint64_t>& objects, nmath::Vector3f boxPos, nmath::Vector3f boxSize, float boxSurfaceArea, char& bestDimension, float& bestPosition, float& bestCost) {
+		uint64_t objectCount = objects.size();
+		std::vector<float> lowerBounds(objectCount);
+		std::vector<float> upperBounds(objectCount);
+
+		bool foundSplit = false;
+		for (char dimension = 0; dimension < 3; dimension++) {
+			float boxStart = boxPos[dimension];
+			float boxEnd = boxPos[dimension] + boxSize[dimension];
+			if (boxSize[dimension] <= 0) { continue; }
+
+			for (uint64_t i = 0; i < objectCount; i++) {
+				const Entity& entity = entityHeap[objects[i]];
+				lowerBounds[i] = std::max(entity.position[dimension] - getEntityBuildRadius(entity), boxStart);
+				upperBounds[i] = std::min(entity.position[dimension] + getEntityBuildRadius(entity), boxEnd);
+			}
+			std::sort(lowerBounds.begin(), lowerBounds.end());
+			std::sort(upperBounds.begin(), upperBounds.end());
+
+			uint64_t lowerIndex = 0;
+			uint64_t upperIndex = 0;
+			while (lowerIndex < objectCount || upperIndex < objectCount) {
+				float position;
+				if (upperIndex == objectCount || (lowerIndex < objectCount && lowerBounds[lowerIndex] < upperBounds[upperIndex])) { position = lowerBounds[lowerIndex]; }
+				else { position = upperBounds[upperIndex]; }
+
+				while (upperIndex < objectCount && upperBounds[upperIndex] <= position) { upperIndex++; }
+
+				float splitFraction = (position - boxStart) / boxSize[dimension];
+				if (splitFraction > 0 && splitFraction < 1) {				// NOTE: Checking the fraction instead of the position catches planes that are so close to the bounds that the fraction rounds to 0 or 1.
+					float cost = calculateSAHSplitCost(boxSize, boxSurfaceArea, dimension, position - boxStart, lowerIndex, objectCount - upperIndex);
+					if (!foundSplit || cost < bestCost) {
+						bestCost = cost;
+						bestDimension = dimension;
+						bestPosition = position;
+						foundSplit = true;
+					}
+				}
+
+				while (lowerIndex < objectCount && lowerBounds[lowerIndex] <= position) { lowerIndex++; }
+			}
+		}
+
+		return foundSplit;
+	}
+
+	bool findBestSAHSplitBinned(const std::vector<uint64_t>& objects, nmath::Vector3f boxPos, nmath::Vector3f boxSize, float boxSurfaceArea, char& bestDimension, float& bestPosition, float& bestCost) {
+		std::vector<uint64_t> lowerBins(kdTreeSAHBinCount);
+		std::vector<uint64_t> upperBins(kdTreeSAHBinCount);
+
+		bool foundSplit = false;
+		for (char dimension = 0; dimension < 3; dimension++) {
+			if (boxSize[dimension] <= 0) { continue; }
+			float binsPerUnit = kdTreeSAHBinCount / boxSize[dimension];
+
+			std::fill(lowerBins.begin(), lowerBins.end(), 0);
+			std::fill(upperBins.begin(), upperBins.end(), 0);
+			for (uint64_t object : objects) {
+				const Entity& entity = entityHeap[object];
+				int64_t lowerBin = (int64_t)((entity.position[dimension] - getEntityBuildRadius(entity) - boxPos[dimension]) * binsPerUnit);
+				int64_t upperBin = (int64_t)((entity.position[dimension] + getEntityBuildRadius(entity) - boxPos[dimension]) * binsPerUnit);
+				lowerBins[std::clamp<int64_t>(lowerBin, 0, kdTreeSAHBinCount - 1)]++;
+				upperBins[std::clamp<int64_t>(upperBin, 0, kdTreeSAHBinCount - 1)]++;
+			}
+
+			// NOTE: Every object whose lower bound is in a bin before the boundary is on the left, every object whose upper bound is in a bin after the boundary is on the right.
+			uint64_t leftCount = 0;
+			uint64_t rightCount = objects.size();
+			for (uint32_t boundary = 1; boundary < kdTreeSAHBinCount; boundary++) {
+				leftCount += lowerBins[boundary - 1];
+				rightCount -= upperBins[boundary - 1];
+
+				float leftLength = boundary / binsPerUnit;
+				float cost = calculateSAHSplitCost(boxSize, boxSurfaceArea, dimension, leftLength, leftCount, rightCount);
+				if (!foundSplit || cost < bestCost) {
+					bestCost = cost;
+					bestDimension = dimension;
+					bestPosition = boxPos[dimension] + leftLength;
+					foundSplit = true;
+				}
+			}
+		}
+
+		return foundSplit;
+	}
+
+	bool findBestSAHSplit(const std::vector<uint64_t>& objects, nmath::Vector3f boxPos, nmath::Vector3f boxSize, char& bestDimension, float& bestPosition, float& bestCost) {
+		float boxSurfaceArea = calculateSurfaceArea(boxSize);
+		if (boxSurfaceArea <= 0) { return false; }
+
+		if (objects.size() > kdTreeExactSAHThreshold && kdTreeSAHBinCount > 1) { return findBestSAHSplitBinned(objects, boxPos, boxSize, boxSurfaceArea, bestDimension, bestPosition, bestCost); }
+		return findBestSAHSplitExact(objects, boxPos, boxSize, boxSurfaceArea, bestDimension, bestPosition, bestCost);
+	}
+
+	/*
+
+	NOTE: The SAH builder doesn't write into kdTreeNodeHeap directly. Sibling subtrees get built in parallel, so nobody knows at which index a subtree is
+		going to start until every subtree to the left of it is done. Instead, every task builds its own little tree of KDTreeBuildNodes and once
+		everything is done, flattenKDTreeBuildNode lays the whole thing out in kdTreeNodeHeap in one go.
+		The layout is exactly what the single-threaded recursion would produce (depth-first, siblings next to each other, first child of the root at index 1),
+		so the kernel doesn't notice a difference.
+
+	*/
+	struct KDTreeBuildNode {
+		char dimension;
+		float split;
+		std::unique_ptr<KDTreeBuildNode> children[2];
+		std::vector<uint64_t> objects;
+	};
+
+	void buildKDTreeNodeSAH(KDTreeBuildNode& node, bool isRoot, nmath::Vector3f boxPos, nmath::Vector3f boxSize, std::vector<uint64_t>& objects, uint64_t depth, ThreadPool* pool) {
+		char dimension;
+		float position;
+		float cost;
+		bool foundSplit = depth < kdTreeMaxDepth && objects.size() != 0 && findBestSAHSplit(objects, boxPos, boxSize, dimension, position, cost);
+
+		// NOTE: The parent traversal in traceRays can't deal with a root node that is a leaf, so the root always gets split, even if it isn't worth it.
+		if (isRoot) {
+			if (!foundSplit) {
+				dimension = boxSize.x >= boxSize.y ? (boxSize.x >= boxSize.z ? 0 : 2) : (boxSize.y >= boxSize.z ? 1 : 2);
+				position = boxPos[dimension] + boxSize[dimension] / 2;
+			}
+		} else if (!foundSplit || cost >= kdTreeIntersectionCost * objects.size()) {
+			node.objects = std::move(objects);
+			return;
+		}
+
+		std::vector<uint64_t> leftObjects;
+		std::vector<uint64_t> rightObjects;
+		for (uint64_t object : objects) {
+			const Entity& entity = entityHeap[object];
+			bool isLeft = entity.position[dimension] - getEntityBuildRadius(entity) < position;
+			bool isRight = entity.position[dimension] + getEntityBuildRadius(entity) > position;
+			if (isLeft || !isRight) { leftObjects.push_back(object); }
+			if (isRight) { rightObjects.push_back(object); }
+		}
+		uint64_t objectCount = objects.size();
+		objects.clear();
+		objects.shrink_to_fit();						// NOTE: Free the memory before going deeper, else every level of the recursion holds on to its object lists.
+
+		node.dimension = dimension;
+		node.split = (position - boxPos[dimension]) / boxSize[dimension];
+		node.children[0] = std::make_unique<KDTreeBuildNode>();
+		node.children[1] = std::make_unique<KDTreeBuildNode>();
+
+		nmath::Vector3f leftBoxSize = boxSize;
+		leftBoxSize[dimension] = position - boxPos[dimension];
+		nmath::Vector3f rightBoxPos = boxPos;
+		rightBoxPos[dimension] = position;
+		nmath::Vector3f rightBoxSize = boxSize;
+		rightBoxSize[dimension] = boxPos[dimension] + boxSize[dimension] - position;
+
+		if (pool && objectCount >= kdTreeParallelBuildThreshold) {
+			TaskGroup children(*pool);
+			children.run([&]() { buildKDTreeNodeSAH(*node.children[0], false, boxPos, leftBoxSize, leftObjects, depth + 1, pool); });
+			buildKDTreeNodeSAH(*node.children[1], false, rightBoxPos, rightBoxSize, rightObjects, depth + 1, pool);
+			children.wait();
+			return;
+		}
+
+		buildKDTreeNodeSAH(*node.children[0], false, boxPos, leftBoxSize, leftObjects, depth + 1, pool);
+		buildKDTreeNodeSAH(*node.children[1], false, rightBoxPos, rightBoxSize, rightObjects, depth + 1, pool);
+	}
+
+	void flattenKDTreeBuildNode(KDTreeBuildNode& node, uint64_t thisIndex, uint64_t parentIndex) {
+		kdTreeNodeHeap[thisIndex].parentIndex = parentIndex;
+
+		if (!node.children[0]) {
+			kdTreeNodeHeap[thisIndex].split = 0.5f;
+			kdTreeNodeHeap[thisIndex].childrenIndex = leafObjectHeap.size();
+			kdTreeNodeHeap[thisIndex].objectCount = node.objects.size();
+			leafObjectHeap.insert(leafObjectHeap.end(), node.objects.begin(), node.objects.end());
+			return;
+		}
+
+		kdTreeNodeHeap[thisIndex].split = node.split;
+		kdTreeNodeHeap[thisIndex].objectCount = -1;
+		kdTreeNodeHeap[thisIndex].childrenIndex = kdTreeNodeHeap.size();
+		kdTreeNodeHeap[thisIndex].childrenIndex |= (uint64_t)node.dimension << (sizeof(uint64_t) * 8 - 2);
+
+		kdTreeNodeHeap.push_back(KDTreeNode());
+		kdTreeNodeHeap.push_back(KDTreeNode());
+		uint64_t leftIndex = kdTreeNodeHeap.size() - 2;
+
+		flattenKDTreeBuildNode(*node.children[0], leftIndex, thisIndex);
+		node.children[0].reset();
+		flattenKDTreeBuildNode(*node.children[1], leftIndex + 1, thisIndex);
+		node.children[1].reset();
+	}
+
+	void calculateKDTreeNodeBounds(uint64_t thisIndex, nmath::Vector3f boxPos, nmath::Vector3f boxSize) {
+		kdTreeRopeHeap[thisIndex].position = boxPos;
+		kdTreeRopeHeap[thisIndex].size = boxSize;
+		for (char face = 0; face < 6; face++) { kdTreeRopeHeap[thisIndex].ropes[face] = KD_TREE_NO_ROPE; }
+
+		if (kdTreeNodeHeap[thisIndex].objectCount != (uint32_t)-1) { return; }
+
+		char dimension = kdTreeNodeHeap[thisIndex].childrenIndex >> (sizeof(uint64_t) * 8 - 2);
+		uint64_t childrenIndex = kdTreeNodeHeap[thisIndex].childrenIndex & ((uint64_t)-1 >> 2);
+
+		// NOTE: This has to do the exact same float math as the kernel does when it goes down the tree, so that both agree on where the nodes are.
+		nmath::Vector3f leftBoxSize = boxSize;
+		leftBoxSize[dimension] = boxSize[dimension] * kdTreeNodeHeap[thisIndex].split;
+		nmath::Vector3f rightBoxPos = boxPos;
+		rightBoxPos[dimension] += leftBoxSize[dimension];
+		nmath::Vector3f rightBoxSize = boxSize;
+		rightBoxSize[dimension] = boxSize[dimension] * (1 - kdTreeNodeHeap[thisIndex].split);
+
+		calculateKDTreeNodeBounds(childrenIndex, boxPos, leftBoxSize);
+		calculateKDTreeNodeBounds(childrenIndex + 1, rightBoxPos, rightBoxSize);
+	}
+
+	// Pushes the rope down the neighbouring subtree for as long as there is a child that still covers the whole face.
+	uint64_t optimizeKDTreeRope(uint64_t rope, char face, nmath::Vector3f boxPos, nmath::Vector3f boxSize) {
+		char faceDimension = face / 2;
+		while (rope != KD_TREE_NO_ROPE && kdTreeNodeHeap[rope].objectCount == (uint32_t)-1) {
+			char dimension = kdTreeNodeHeap[rope].childrenIndex >> (sizeof(uint64_t) * 8 - 2);
+			uint64_t childrenIndex = kdTreeNodeHeap[rope].childrenIndex & ((uint64_t)-1 >> 2);
+
+			if (dimension == faceDimension) {
+				rope = face % 2 == 1 ? childrenIndex : childrenIndex + 1;			// NOTE: The child that touches the face is the near one, which is the lower one for + faces and the upper one for - faces.
+				continue;
+			}
+
+			float splitPosition = kdTreeRopeHeap[childrenIndex + 1].position[dimension];
+			if (splitPosition <= boxPos[dimension]) { rope = childrenIndex + 1; continue; }
+			if (splitPosition >= boxPos[dimension] + boxSize[dimension]) { rope = childrenIndex; continue; }
+			break;
+		}
+		return rope;
+	}
+
+	void assignKDTreeRopes(uint64_t thisIndex, const uint64_t ropes[6]) {
+		if (kdTreeNodeHeap[thisIndex].objectCount != (uint32_t)-1) {
+			for (char face = 0; face < 6; face++) {
+				kdTreeRopeHeap[thisIndex].ropes[face] = optimizeKDTreeRope(ropes[face], face, kdTreeRopeHeap[thisIndex].position, kdTreeRopeHeap[thisIndex].size);
+			}
+			return;
+		}
+
+		char dimension = kdTreeNodeHeap[thisIndex].childrenIndex >> (sizeof(uint64_t) * 8 - 2);
+		uint64_t childrenIndex = kdTreeNodeHeap[thisIndex].childrenIndex & ((uint64_t)-1 >> 2);
+
+		uint64_t childRopes[6] = { ropes[0], ropes[1], ropes[2], ropes[3], ropes[4], ropes[5] };
+		childRopes[dimension * 2 + 1] = childrenIndex + 1;
+		assignKDTreeRopes(childrenIndex, childRopes);
+
+		childRopes[dimension * 2 + 1] = ropes[dimension * 2 + 1];
+		childRopes[dimension * 2] = childrenIndex;
+		assignKDTreeRopes(childrenIndex + 1, childRopes);
+	}
+
+	void generateKDTreeRopes() {
+		kdTreeRopeHeap.clear();
+		if (kdTreeNodeHeap.size() == 0) { return; }
+
+		kdTreeRopeHeap.resize(kdTreeNodeHeap.size());
+		calculateKDTreeNodeBounds(0, kdTree.position, kdTree.size);
+
+		uint64_t rootRopes[6] = { KD_TREE_NO_ROPE, KD_TREE_NO_ROPE, KD_TREE_NO_ROPE, KD_TREE_NO_ROPE, KD_TREE_NO_ROPE, KD_TREE_NO_ROPE };
+		assignKDTreeRopes(0, rootRopes);
+	}
+
+	bool compactKDTreeNode(uint64_t thisIndex, nmath::Vector3f boxPos, nmath::Vector3f boxSize) {
+		const KDTreeNode& node = kdTreeNodeHeap[thisIndex];
+		CompactKDTreeNode& compactNode = compactKDTreeNodeHeap[thisIndex];
+
+		if (node.objectCount != (uint32_t)-1) {
+			if (node.childrenIndex > COMPACT_KD_TREE_MAX_INDEX) { return false; }
+			compactNode.header = ((uint32_t)node.childrenIndex << 2) | COMPACT_KD_TREE_LEAF_AXIS;
+			compactNode.objectCount = node.objectCount;
+			return true;
+		}
+
+		char dimension = node.childrenIndex >> (sizeof(uint64_t) * 8 - 2);
+		uint64_t childrenIndex = node.childrenIndex & ((uint64_t)-1 >> 2);
+		if (childrenIndex + 1 > COMPACT_KD_TREE_MAX_INDEX) { return false; }
+
+		// NOTE: Same float math as everywhere else that turns the split fractions into bounds, so the planes end up exactly where the builder put them.
+		nmath::Vector3f leftBoxSize = boxSize;
+		leftBoxSize[dimension] = boxSize[dimension] * node.split;
+		nmath::Vector3f rightBoxPos = boxPos;
+		rightBoxPos[dimension] += leftBoxSize[dimension];
+		nmath::Vector3f rightBoxSize = boxSize;
+		rightBoxSize[dimension] = boxSize[dimension] * (1 - node.split);
+
+		compactNode.header = ((uint32_t)childrenIndex << 2) | dimension;
+		compactNode.split = rightBoxPos[dimension];
+
+		return compactKDTreeNode(childrenIndex, boxPos, leftBoxSize) && compactKDTreeNode(childrenIndex + 1, rightBoxPos, rightBoxSize);
+	}
+
+	// NOTE: Leaves the compact heap empty if the tree is too big for the 30-bit indices.
+	bool generateCompactKDTree() {
+		compactKDTreeNodeHeap.clear();
+		if (kdTreeNodeHeap.size() == 0) { return true; }
+
+		compactKDTreeNodeHeap.resize(kdTreeNodeHeap.size());
+		if (!compactKDTreeNode(0, kdTree.position, kdTree.size)) { compactKDTreeNodeHeap.clear(); return false; }
+		return true;
+	}
+
 	void generateKDTree() {
 
 		kdTree.position = nmath::Vector3f(10000, 1000000, 1000000);
 		kdTree.size = nmath::Vector3f(-10000, -1000000, -1000000);
 
 		for (uint64_t i = 0; i < entityHeapLength; i++) {
-			float entityLowestValue = entityHeap[i].position.x - entityHeap[i].scale.x;
+			float entityLowestValue = entityHeap[i].position.x - getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue < kdTree.position.x) { kdTree.position.x = entityLowestValue; }
-			entityLowestValue = entityHeap[i].position.y - entityHeap[i].scale.x;
+			entityLowestValue = entityHeap[i].position.y - getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue < kdTree.position.y) { kdTree.position.y = entityLowestValue; }
-			entityLowestValue = entityHeap[i].position.z - entityHeap[i].scale.x;
+			entityLowestValue = entityHeap[i].position.z - getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue < kdTree.position.z) { kdTree.position.z = entityLowestValue; }
 		}
 		for (uint64_t i = 0; i < entityHeapLength; i++) {
-			float entityLowestValue = entityHeap[i].position.x + entityHeap[i].scale.x;
+			float entityLowestValue = entityHeap[i].position.x + getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue > kdTree.size.x + kdTree.position.x) { kdTree.size.x = entityLowestValue - kdTree.position.x; }
-			entityLowestValue = entityHeap[i].position.y + entityHeap[i].scale.x;
+			entityLowestValue = entityHeap[i].position.y + getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue > kdTree.size.y + kdTree.position.y) { kdTree.size.y = entityLowestValue - kdTree.position.y; }
-			entityLowestValue = entityHeap[i].position.z + entityHeap[i].scale.x;
+			entityLowestValue = entityHeap[i].position.z + getEntityBuildRadius(entityHeap[i]);
 			if (entityLowestValue > kdTree.size.z + kdTree.position.z) { kdTree.size.z = entityLowestValue - kdTree.position.z; }
 		}
 
-		createSortedLists();
-
+		kdTreeDirty = true;
+		kdTreeOutdated = false;
+		kdTreeNodeHeap.clear();
+		leafObjectHeap.clear();
+		leafSphereHeap.clear();
+		leafEntityIndexHeap.clear();
+		entityLeafSlotOffsets.clear();
+		entityLeafSlots.clear();
+		kdTreeRopeHeap.clear();
+		compactKDTreeNodeHeap.clear();
+		if (entityHeapLength == 0) { return; }						// NOTE: An empty node heap tells the renderer that there is nothing to traverse.
 		kdTreeNodeHeap.push_back(KDTreeNode());
-		uint64_t limitBegins[] = { 0, 0, 0, 0, 0, 0 };
-		uint64_t limitEnds[] = { entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength };
-		generateKDTreeNode(0, -1, kdTree.position, kdTree.size, limitBegins, limitEnds, 0);
 
-		releaseSortedLists();
+		switch (kdTreeBuilderType) {
+		case KDTreeBuilderType::MIDPOINT:
+			{
+				createSortedLists();
+
+				uint64_t limitBegins[] = { 0, 0, 0, 0, 0, 0 };
+				uint64_t limitEnds[] = { entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength, entityHeapLength };
+				generateKDTreeNode(0, -1, kdTree.position, kdTree.size, limitBegins, limitEnds, 0);
+
+				releaseSortedLists();
+			}
+			break;
+		case KDTreeBuilderType::SAH:
+			{
+				std::vector<uint64_t> objects(entityHeapLength);
+				for (uint64_t i = 0; i < entityHeapLength; i++) { objects[i] = i; }
+
+				KDTreeBuildNode root;
+				if (kdTreeBuildThreadCount != 1 && entityHeapLength >= kdTreeParallelBuildThreshold) {
+					ThreadPool pool(kdTreeBuildThreadCount);
+					buildKDTreeNodeSAH(root, true, kdTree.position, kdTree.size, objects, 0, &pool);
+				} else {
+					buildKDTreeNodeSAH(root, true, kdTree.position, kdTree.size, objects, 0, nullptr);
+				}
+
+				flattenKDTreeBuildNode(root, 0, -1);
+			}
+			break;
+		}
+
+		generateLeafSphereHeap();
+		if (kdTreeRopesEnabled) { generateKDTreeRopes(); }
+		if (compactKDTreeEnabled) { generateCompactKDTree(); }
 	}
 
 
@@ -1,10 +1,82 @@
 #include "Shader.h"
 
+#include "ProgramBinaryCache.h"
+
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
+
+// NOTE: Generated by embed_kernels.py. Without it, the kernels get read from the working directory like they always did.
+#if __has_include("EmbeddedKernels.h")
+#include "EmbeddedKernels.h"
+#define EMBEDDED_KERNELS_AVAILABLE
+#else
+struct EmbeddedKernelSource {
+	const char* fileName;
+	const char* sourceCode;
+	size_t length;
+};
+#endif
+
+// NOTE: The build options that setupComputeKernelFromString builds with. The binaries have to be built with the same ones, and they're part of the cache key.
+static const char* const programBuildOptions = "";
+
+static const EmbeddedKernelSource* findEmbeddedKernelSource(const char* sourceCodeFile) {
+#ifdef EMBEDDED_KERNELS_AVAILABLE
+	for (const EmbeddedKernelSource& embeddedSource : embeddedKernelSources) {
+		if (!strcmp(embeddedSource.fileName, sourceCodeFile)) { return &embeddedSource; }
+	}
+#endif
+	return nullptr;
+}
+
+// NOTE: The embedded copy wins, the working directory only gets looked at for kernels that weren't embedded.
+static bool loadKernelSource(const char* sourceCodeFile, std::string& sourceCode) {
+	const EmbeddedKernelSource* embeddedSource = findEmbeddedKernelSource(sourceCodeFile);
+	if (embeddedSource) { sourceCode.append(embeddedSource->sourceCode, embeddedSource->length); return true; }
+
+	FILE* file = fopen(sourceCodeFile, "rb");
+	if (!file) { return false; }
+	char buffer[4096];
+	size_t readSize;
+	while ((readSize = fread(buffer, 1, sizeof(buffer), file)) != 0) { sourceCode.append(buffer, readSize); }
+	bool readFailed = ferror(file);
+	fclose(file);
+	return !readFailed;
+}
+
+// NOTE: Same steps as setupComputeKernelFromString, except that the program comes from a binary. Any failure just means that the binary is no good for this device, so nothing gets touched then and the caller builds from source.
+bool Shader::setupFromBinary(cl_context computeContext, cl_device_id computeDevice, const std::vector<unsigned char>& binary, const char* computeKernelName) {
+	const unsigned char* binaryData = binary.data();
+	size_t binaryLength = binary.size();
+	cl_int binaryStatus;
+	cl_int err;
+	cl_program program = clCreateProgramWithBinary(computeContext, 1, &computeDevice, &binaryLength, &binaryData, &binaryStatus, &err);
+	if (err != CL_SUCCESS) { return false; }
+	if (binaryStatus != CL_SUCCESS || clBuildProgram(program, 1, &computeDevice, programBuildOptions, nullptr, nullptr) != CL_SUCCESS) { clReleaseProgram(program); return false; }
+
+	cl_kernel kernel = clCreateKernel(program, computeKernelName, &err);
+	if (err != CL_SUCCESS) { clReleaseProgram(program); return false; }
+	size_t workGroupSize;
+	if (clGetKernelWorkGroupInfo(kernel, computeDevice, CL_KERNEL_WORK_GROUP_SIZE, sizeof(workGroupSize), &workGroupSize, nullptr) != CL_SUCCESS) { clReleaseKernel(kernel); clReleaseProgram(program); return false; }
+
+	computeProgram = program;
+	computeKernel = kernel;
+	computeKernelWorkGroupSize = workGroupSize;
+	return true;
+}
 
 ErrorCode Shader::setupFromString(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeString, const char* computeKernelName, std::string& buildLog) {
+	uint64_t cacheKey;
+	bool cacheable = ProgramBinaryCache::enabled && ProgramBinaryCache::getKey(computeDevice, sourceCodeString, programBuildOptions, cacheKey);
+	if (cacheable) {
+		std::vector<unsigned char> binary;
+		if (ProgramBinaryCache::load(cacheKey, binary) && setupFromBinary(computeContext, computeDevice, binary, computeKernelName)) { return ErrorCode::SUCCESS; }
+	}
+
 	switch (setupComputeKernelFromString(computeContext, computeDevice, sourceCodeString, computeKernelName, computeProgram, computeKernel, computeKernelWorkGroupSize, buildLog)) {
-	case CL_SUCCESS: return ErrorCode::SUCCESS;
+	case CL_SUCCESS: break;
 	case CL_EXT_CREATE_PROGRAM_FAILED: return ErrorCode::SHADER_CREATE_PROGRAM_FAILED;
 	case CL_EXT_INSUFFICIENT_HOST_MEM: return ErrorCode::SHADER_SETUP_FAILED_INSUFFICIENT_HOST_MEM;
 	case CL_EXT_GET_BUILD_LOG_FAILED: return ErrorCode::SHADER_GET_BUILD_LOG_FAILED;
@@ -13,24 +85,94 @@ ErrorCode Shader::setupFromString(cl_context computeContext, cl_device_id comput
 	case CL_EXT_CREATE_KERNEL_FAILED: return ErrorCode::SHADER_CREATE_KERNEL_FAILED;
 	case CL_EXT_GET_KERNEL_WORK_GROUP_INFO_FAILED: return ErrorCode::SHADER_GET_KERNEL_WORK_GROUP_INFO_FAILED;
 	}
+
+	// NOTE: A failed store only costs the next startup a build, so it doesn't fail the setup.
+	if (cacheable) { ProgramBinaryCache::store(cacheKey, computeDevice, computeProgram); }
+	return ErrorCode::SUCCESS;
 }
 
 ErrorCode Shader::setupFromFile(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, std::string& buildLog) {
-	switch (setupComputeKernelFromFile(computeContext, computeDevice, sourceCodeFile, computeKernelName, computeProgram, computeKernel, computeKernelWorkGroupSize, buildLog)) {
-	case CL_SUCCESS: return ErrorCode::SUCCESS;
-	case CL_EXT_FILE_OPEN_FAILED: return ErrorCode::SHADER_OPEN_SOURCE_CODE_FILE_FAILED;
-	case CL_EXT_CREATE_PROGRAM_FAILED: return ErrorCode::SHADER_CREATE_PROGRAM_FAILED;
-	case CL_EXT_INSUFFICIENT_HOST_MEM: return ErrorCode::SHADER_SETUP_FAILED_INSUFFICIENT_HOST_MEM;
-	case CL_EXT_GET_BUILD_LOG_FAILED: return ErrorCode::SHADER_GET_BUILD_LOG_FAILED;
-	case CL_EXT_BUILD_FAILED_WITH_BUILD_LOG: return ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG;
-	case CL_EXT_BUILD_FAILED_WITHOUT_BUILD_LOG: return ErrorCode::SHADER_BUILD_FAILED_WITHOUT_BUILD_LOG;
-	case CL_EXT_CREATE_KERNEL_FAILED: return ErrorCode::SHADER_CREATE_KERNEL_FAILED;
-	case CL_EXT_GET_KERNEL_WORK_GROUP_INFO_FAILED: return ErrorCode::SHADER_GET_KERNEL_WORK_GROUP_INFO_FAILED;
+	std::string sourceCode;
+	if (!loadKernelSource(sourceCodeFile, sourceCode)) { return ErrorCode::SHADER_OPEN_SOURCE_CODE_FILE_FAILED; }
+	return setupFromString(computeContext, computeDevice, sourceCode.c_str(), computeKernelName, buildLog);
+}
+
+ErrorCode Shader::setupFromFile(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, const char* sourceCodePrefix, std::string& buildLog) {
+	std::string sourceCode = sourceCodePrefix;
+	sourceCode += "\n#line 1\n";
+	if (!loadKernelSource(sourceCodeFile, sourceCode)) { return ErrorCode::SHADER_OPEN_SOURCE_CODE_FILE_FAILED; }
+	return setupFromString(computeContext, computeDevice, sourceCode.c_str(), computeKernelName, buildLog);
+}
+
+ErrorCode Shader::selectVariant(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, const std::string& sourceCodePrefix, std::string& buildLog) {
+	if (kernelVariants.empty()) {
+		variantContext = computeContext;
+		variantDevice = computeDevice;
+	}
+	return selectVariant(sourceCodeFile, computeKernelName, sourceCodePrefix, buildLog);
+}
+
+ErrorCode Shader::selectVariant(const char* sourceCodeFile, const char* computeKernelName, const std::string& sourceCodePrefix, std::string& buildLog) {
+	std::string variantKey = computeKernelName;
+	variantKey += '\n';
+	variantKey += sourceCodePrefix;
+
+	KernelVariant variant;
+	auto existingVariant = kernelVariants.find(variantKey);
+	if (existingVariant != kernelVariants.end()) { variant = existingVariant->second; }
+	else {
+		bool firstVariant = kernelVariants.empty();
+		KernelVariant currentVariant = { computeProgram, computeKernel };
+		size_t currentWorkGroupSize = computeKernelWorkGroupSize;
+
+		// NOTE: The setups write straight into the members, so the current variant gets put back afterwards, whatever happens.
+		ErrorCode err = sourceCodePrefix.empty() ? setupFromFile(variantContext, variantDevice, sourceCodeFile, computeKernelName, buildLog)
+												 : setupFromFile(variantContext, variantDevice, sourceCodeFile, computeKernelName, sourceCodePrefix.c_str(), buildLog);
+		variant = { computeProgram, computeKernel };
+		size_t variantWorkGroupSize = computeKernelWorkGroupSize;
+		if (!firstVariant) {
+			computeProgram = currentVariant.computeProgram;
+			computeKernel = currentVariant.computeKernel;
+			computeKernelWorkGroupSize = currentWorkGroupSize;
+		}
+		if (err != ErrorCode::SUCCESS) { return err; }
+		if (!firstVariant && variantWorkGroupSize < computeKernelWorkGroupSize) {
+			clReleaseKernel(variant.computeKernel);
+			clReleaseProgram(variant.computeProgram);
+			return ErrorCode::SHADER_VARIANT_WORK_GROUP_SIZE_TOO_SMALL;
+		}
+		kernelVariants.emplace(variantKey, variant);
 	}
+
+	computeProgram = variant.computeProgram;
+	computeKernel = variant.computeKernel;
+	for (cl_uint i = 0; i < kernelArguments.size(); i++) {
+		if (!kernelArguments[i].empty()) { clSetKernelArg(computeKernel, i, kernelArguments[i].size(), kernelArguments[i].data()); }
+	}
+	return ErrorCode::SUCCESS;
+}
+
+void Shader::setKernelArgument(cl_uint index, size_t size, const void* value) {
+	if (index >= kernelArguments.size()) { kernelArguments.resize(index + 1); }
+	const unsigned char* bytes = (const unsigned char*)value;
+	kernelArguments[index].assign(bytes, bytes + size);
+	if (!kernelVariants.empty()) { clSetKernelArg(computeKernel, index, size, value); }			// NOTE: Before the first variant there's no kernel yet, the value just waits for the replay then.
 }
 
 bool Shader::releaseBaseVars() {
-	if (clReleaseKernel(computeKernel) != CL_SUCCESS) { clReleaseProgram(computeProgram); return false; }
-	if (clReleaseProgram(computeProgram) != CL_SUCCESS) { return false; }
-	return true;
+	if (kernelVariants.empty()) {
+		if (clReleaseKernel(computeKernel) != CL_SUCCESS) { clReleaseProgram(computeProgram); return false; }
+		if (clReleaseProgram(computeProgram) != CL_SUCCESS) { return false; }
+		return true;
+	}
+
+	// NOTE: computeKernel and computeProgram are one of the variants, so they get released in here as well.
+	bool successful = true;
+	for (auto& [variantKey, variant] : kernelVariants) {
+		if (clReleaseKernel(variant.computeKernel) != CL_SUCCESS) { successful = false; }
+		if (clReleaseProgram(variant.computeProgram) != CL_SUCCESS) { successful = false; }
+	}
+	kernelVariants.clear();
+	kernelArguments.clear();
+	return successful;
 }
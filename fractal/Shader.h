@@ -10,24 +10,67 @@
 #include "ResourceHeap.h"
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 
 class Shader
 {
 	friend class Renderer;							// NOTE: friend is simple, it just allows the following class or function (friend ErrorCode Renderer::render(); for example) access to the private and protected members of this class.
+	friend class SplitFrameRenderer;
+	friend class RendererInstance;
 
 	virtual ErrorCode init(cl_context context, cl_device_id device) = 0;
 
 	// GARANTEE: You can use pretty much all of the variables (OpenCL constructs and frame buffers) that we've established in this release function, since all those things get released after the shaders.
 	virtual bool release() = 0;
 
+	bool setupFromBinary(cl_context computeContext, cl_device_id computeDevice, const std::vector<unsigned char>& binary, const char* computeKernelName);
+
+	struct KernelVariant {
+		cl_program computeProgram;
+		cl_kernel computeKernel;
+	};
+
+	std::unordered_map<std::string, KernelVariant> kernelVariants;					// NOTE: Keyed by kernel name and source prefix. Stays around until release, so switching back never builds anything.
+	std::vector<std::vector<unsigned char>> kernelArguments;						// NOTE: Every value that went through setKernelArgument, by index. Empty means never set.
+	cl_context variantContext;
+	cl_device_id variantDevice;
+
 protected:
+	// NOTE: Every setup goes through ProgramBinaryCache first and only builds from source on a miss. The files are looked up in the embedded kernels first, see embed_kernels.py.
 	ErrorCode setupFromString(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeString, const char* computeKernelName, std::string& buildLog);
 	ErrorCode setupFromFile(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, std::string& buildLog);
+	// NOTE: Same thing, but sourceCodePrefix goes in front of the file's source, which is how the #defines for the optional kernel features get in. The line numbers in the build log still match the file.
+	ErrorCode setupFromFile(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, const char* sourceCodePrefix, std::string& buildLog);
+
+	/*
 
-	bool releaseBaseVars();
+	NOTE: Variants are builds of the same kernel with different #defines in front of the source, so that settings can be compile-time constants instead of arguments.
+		- selectVariant makes the variant current. It only builds it if it hasn't been built since the last release, otherwise it's just a lookup.
+		- The arguments carry over. Shaders that use variants have to set their arguments through setKernelArgument, which remembers them and sets them on the
+			current kernel. A new current kernel gets all of them replayed.
+		- computeKernelWorkGroupSize stays what the first variant had, the renderers size their launches with it once at init. A later variant that can't
+			do work groups that big doesn't get selected.
+		- Only the first selectVariant after a release takes the context and the device, the later ones reuse them.
+
+	*/
+	ErrorCode selectVariant(cl_context computeContext, cl_device_id computeDevice, const char* sourceCodeFile, const char* computeKernelName, const std::string& sourceCodePrefix, std::string& buildLog);
+	ErrorCode selectVariant(const char* sourceCodeFile, const char* computeKernelName, const std::string& sourceCodePrefix, std::string& buildLog);
+	void setKernelArgument(cl_uint index, size_t size, const void* value);
+	bool hasVariants() const { return !kernelVariants.empty(); }
+
+	bool releaseBaseVars();							// NOTE: Releases every variant, not just the current one.
 
 public:
+	virtual ~Shader() = default;					// NOTE: SplitFrameRenderer deletes the shaders it gets from its factory through the base class.
+
 	cl_program computeProgram;
 	cl_kernel computeKernel;
 	size_t computeKernelWorkGroupSize;
+
+	// NOTE: Rounds width x height up to whole work groups of localSize. The edge groups stick out of the frame and the kernels skip the work items that land outside of it.
+	static void getGlobalSize(const size_t* localSize, size_t width, size_t height, size_t* globalSize) {
+		globalSize[0] = (width + localSize[0] - 1) / localSize[0] * localSize[0];
+		globalSize[1] = (height + localSize[1] - 1) / localSize[1] * localSize[1];
+	}
 };
@@ -0,0 +1,457 @@
+#include "SplitFrameRenderer.h"
+
+#include "nmath/constants.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+#include <new>
+
+cl_image_format SplitFrameRenderer::frameFormat;
+unsigned char SplitFrameRenderer::frameBPP;
+uint16_t SplitFrameRenderer::samplesPerPixelSideLength;
+
+float SplitFrameRenderer::baseRayOrigin = -1;
+
+std::vector<SplitFrameDevice> SplitFrameRenderer::devices;
+
+char* SplitFrameRenderer::frame = nullptr;
+Camera SplitFrameRenderer::frameCamera;
+uint32_t SplitFrameRenderer::frameWidth;
+uint32_t SplitFrameRenderer::frameHeight;
+
+ResourceHeap SplitFrameRenderer::resources;
+Scene SplitFrameRenderer::scene;
+Camera SplitFrameRenderer::camera;
+Camera SplitFrameRenderer::transferredCamera = Camera::makeUntransferred();
+
+float SplitFrameRenderer::rebalanceSmoothing = 0.25f;
+float SplitFrameRenderer::rebalanceThreshold = 0.05f;
+
+bool SplitFrameRenderer::accumulationEnabled = true;
+uint32_t SplitFrameRenderer::accumulatedFrameCount = 0;
+
+// NOTE: Same minimum as Renderer asks initOpenCLVarsForBestDevice for. The version string always starts with "OpenCL <major>.<minor>".
+static bool deviceSupportsVersion(cl_device_id device, int requiredMajor, int requiredMinor) {
+	char version[128];
+	if (clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version, nullptr) != CL_SUCCESS) { return false; }
+	version[sizeof(version) - 1] = '\0';
+	int major, minor;
+	if (sscanf(version, "OpenCL %d.%d", &major, &minor) != 2) { return false; }
+	return major > requiredMajor || (major == requiredMajor && minor >= requiredMinor);
+}
+
+bool SplitFrameRenderer::discoverDevices(cl_device_type deviceType, uint8_t subDevicesPerCPU) {
+	cl_uint platformCount;
+	if (clGetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) { return false; }
+	std::vector<cl_platform_id> platforms(platformCount);
+	if (clGetPlatformIDs(platformCount, platforms.data(), nullptr) != CL_SUCCESS) { return false; }
+
+	for (cl_platform_id platform : platforms) {
+		cl_uint deviceCount;
+		if (clGetDeviceIDs(platform, deviceType, 0, nullptr, &deviceCount) != CL_SUCCESS || deviceCount == 0) { continue; }			// NOTE: Platforms without devices of this type return an error, that's fine.
+		std::vector<cl_device_id> platformDevices(deviceCount);
+		if (clGetDeviceIDs(platform, deviceType, deviceCount, platformDevices.data(), nullptr) != CL_SUCCESS) { continue; }
+
+		for (cl_device_id device : platformDevices) {
+			if (!deviceSupportsVersion(device, 3, 0)) { continue; }
+
+			cl_device_type type;
+			cl_uint computeUnitCount;
+			if (clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr) != CL_SUCCESS) { continue; }
+			if (clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnitCount), &computeUnitCount, nullptr) != CL_SUCCESS) { computeUnitCount = 1; }
+
+			if ((type & CL_DEVICE_TYPE_CPU) && subDevicesPerCPU > 1 && computeUnitCount >= subDevicesPerCPU) {
+				cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(computeUnitCount / subDevicesPerCPU), 0 };
+				cl_uint subDeviceCount;
+				if (clCreateSubDevices(device, properties, 0, nullptr, &subDeviceCount) == CL_SUCCESS && subDeviceCount != 0) {
+					std::vector<cl_device_id> subDevices(subDeviceCount);
+					if (clCreateSubDevices(device, properties, subDeviceCount, subDevices.data(), nullptr) == CL_SUCCESS) {
+						// NOTE: Partitioning equally can leave us with a few more sub-devices than asked for if the compute units don't divide evenly. We only want the even ones.
+						for (cl_uint i = 0; i < subDeviceCount; i++) {
+							if (i >= subDevicesPerCPU) { clReleaseDevice(subDevices[i]); continue; }
+							SplitFrameDevice& subDevice = devices.emplace_back();
+							subDevice.device = subDevices[i];
+							subDevice.subDevice = true;
+							subDevice.rowsPerSecond = computeUnitCount / subDevicesPerCPU;
+						}
+						continue;
+					}
+				}
+				// NOTE: If the CPU can't be split, it just gets used as a whole.
+			}
+
+			SplitFrameDevice& wholeDevice = devices.emplace_back();
+			wholeDevice.device = device;
+			wholeDevice.subDevice = false;
+			wholeDevice.rowsPerSecond = computeUnitCount;
+		}
+	}
+
+	return !devices.empty();
+}
+
+ErrorCode SplitFrameRenderer::initDevice(SplitFrameDevice& device, RaytracingShaderFactory createRaytracingShader) {
+	device.context = nullptr;
+	device.commandQueue = nullptr;
+	device.raytracingShader = nullptr;
+	device.computeAccumulationFrameAllocated = false;
+	device.traceStartEvent = nullptr;
+	device.traceEvent = nullptr;
+	device.readEvent = nullptr;
+	device.bandStart = 0;
+	device.bandHeight = 0;
+
+	cl_int err;
+	device.context = clCreateContext(nullptr, 1, &device.device, nullptr, nullptr, &err);
+	if (!device.context) { return ErrorCode::DEVICE_CONTEXT_CREATION_FAILED; }
+
+	cl_queue_properties queueProperties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+	device.commandQueue = clCreateCommandQueueWithProperties(device.context, device.device, queueProperties, &err);
+	if (!device.commandQueue) { clReleaseContext(device.context); device.context = nullptr; return ErrorCode::DEVICE_COMMAND_QUEUE_CREATION_FAILED; }
+
+	device.raytracingShader = createRaytracingShader();
+	device.raytracingShader->specializeSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	ErrorCode shaderErr = device.raytracingShader->init(device.context, device.device);
+	if (shaderErr != ErrorCode::SUCCESS) {
+		delete device.raytracingShader;
+		device.raytracingShader = nullptr;
+		clReleaseCommandQueue(device.commandQueue);
+		device.commandQueue = nullptr;
+		clReleaseContext(device.context);
+		device.context = nullptr;
+		return shaderErr;
+	}
+
+	device.scene.init(device.context, device.device, device.commandQueue);
+
+	device.raytracingShader->getTraceLocalSize(device.traceLocalSize);
+	device.traceGlobalOffset[0] = 0;
+	device.bandOrigin[0] = 0;
+	device.bandOrigin[2] = 0;
+	device.bandRegion[2] = 1;
+
+	device.raytracingShader->setSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	return ErrorCode::SUCCESS;
+}
+
+bool SplitFrameRenderer::releaseDevice(SplitFrameDevice& device) {
+	bool successful = true;
+	if (device.commandQueue) { clFinish(device.commandQueue); }
+	if (device.raytracingShader) {
+		if (!device.raytracingShader->release()) { successful = false; }
+		delete device.raytracingShader;
+		device.raytracingShader = nullptr;
+	}
+	if (device.context) {
+		if (!device.scene.release()) { successful = false; }
+		if (!releaseFrameBuffersOnDevice(device)) { successful = false; }
+	}
+	if (device.commandQueue && clReleaseCommandQueue(device.commandQueue) != CL_SUCCESS) { successful = false; }
+	if (device.context && clReleaseContext(device.context) != CL_SUCCESS) { successful = false; }
+	if (device.subDevice && clReleaseDevice(device.device) != CL_SUCCESS) { successful = false; }
+	device.commandQueue = nullptr;
+	device.context = nullptr;
+	return successful;
+}
+
+bool SplitFrameRenderer::allocateFrameBuffersOnDevice(SplitFrameDevice& device) {
+	cl_int err;
+	device.computeFrame = clCreateImage2D(device.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, &frameFormat, frameWidth, frameHeight, 0, nullptr, &err);
+	if (!device.computeFrame) { return false; }
+	device.raytracingShader->setBeforeAverageFrameData(device.computeFrame, frameWidth, frameHeight);			// NOTE: Fused mode, so the frame goes where the before-average frame would go.
+
+	// NOTE: Same as in Renderer, the accumulation buffer is only a cache. Not having it only means no accumulation.
+	device.computeAccumulationFrame = clCreateBuffer(device.context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, (size_t)frameWidth * frameHeight * sizeof(cl_float4), nullptr, &err);
+	device.computeAccumulationFrameAllocated = device.computeAccumulationFrame != nullptr;
+
+	Shader::getGlobalSize(device.traceLocalSize, frameWidth, frameHeight, device.traceGlobalSize);
+	return true;
+}
+
+bool SplitFrameRenderer::releaseFrameBuffersOnDevice(SplitFrameDevice& device) {
+	bool successful = true;
+	if (device.computeFrame) {
+		if (clReleaseMemObject(device.computeFrame) != CL_SUCCESS) { successful = false; }
+		device.computeFrame = nullptr;
+	}
+	if (device.computeAccumulationFrameAllocated) {
+		if (clReleaseMemObject(device.computeAccumulationFrame) != CL_SUCCESS) { successful = false; }
+		device.computeAccumulationFrameAllocated = false;
+	}
+	return successful;
+}
+
+void SplitFrameRenderer::measureBands() {
+	for (SplitFrameDevice& device : devices) {
+		if (device.bandHeight == 0) { continue; }
+		cl_ulong start, end;
+		if (clGetEventProfilingInfo(device.traceStartEvent, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) != CL_SUCCESS) { continue; }
+		if (clGetEventProfilingInfo(device.traceEvent, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS) { continue; }
+		if (end <= start) { continue; }
+		double rowsPerSecond = device.bandHeight / ((end - start) * 1e-9);
+		device.rowsPerSecond += (rowsPerSecond - device.rowsPerSecond) * rebalanceSmoothing;
+	}
+}
+
+bool SplitFrameRenderer::layoutBands(uint32_t minimumBoundaryShift) {
+	double totalRowsPerSecond = 0;
+	for (const SplitFrameDevice& device : devices) { totalRowsPerSecond += device.rowsPerSecond; }
+
+	// NOTE: Every device keeps at least one row if there are enough of them, otherwise it could never be measured again and would be stuck at zero forever.
+	uint32_t minimumBandHeight = frameHeight >= devices.size() ? 1 : 0;
+	std::vector<uint32_t> bandHeights(devices.size());
+	uint32_t bandStart = 0;
+	uint32_t largestBoundaryShift = 0;
+	for (size_t i = 0; i < devices.size(); i++) {
+		const SplitFrameDevice& device = devices[i];
+		uint32_t remainingRows = frameHeight - bandStart;
+		uint32_t bandHeight;
+		if (i == devices.size() - 1) { bandHeight = remainingRows; }
+		else {
+			bandHeight = totalRowsPerSecond > 0 ? (uint32_t)(frameHeight * (device.rowsPerSecond / totalRowsPerSecond) + 0.5) : frameHeight / (uint32_t)devices.size();
+			uint32_t reservedRows = minimumBandHeight * (uint32_t)(devices.size() - i - 1);
+			bandHeight = std::max(bandHeight, minimumBandHeight);
+			bandHeight = std::min(bandHeight, remainingRows - std::min(reservedRows, remainingRows));
+		}
+		bandHeights[i] = bandHeight;
+		// NOTE: The end of the last band is always the bottom of the frame, so the starts and the heights cover every boundary there is.
+		largestBoundaryShift = std::max(largestBoundaryShift, bandStart > device.bandStart ? bandStart - device.bandStart : device.bandStart - bandStart);
+		largestBoundaryShift = std::max(largestBoundaryShift, bandHeight > device.bandHeight ? bandHeight - device.bandHeight : device.bandHeight - bandHeight);
+		bandStart += bandHeight;
+	}
+	if (minimumBoundaryShift != 0 && largestBoundaryShift < minimumBoundaryShift) { return false; }
+
+	bandStart = 0;
+	for (size_t i = 0; i < devices.size(); i++) {
+		SplitFrameDevice& device = devices[i];
+		uint32_t bandHeight = bandHeights[i];
+		device.bandStart = bandStart;
+		device.bandHeight = bandHeight;
+		device.traceGlobalOffset[1] = bandStart;
+		// NOTE: With tiles, the last row of tiles can stick out of the band into the next one. Those rows land in this device's own frame and never get read back, it's just a bit of extra work.
+		Shader::getGlobalSize(device.traceLocalSize, frameWidth, bandHeight, device.traceGlobalSize);
+		device.bandOrigin[1] = bandStart;
+		device.bandRegion[0] = frameWidth;
+		device.bandRegion[1] = bandHeight;
+		bandStart += bandHeight;
+	}
+	return largestBoundaryShift != 0;
+}
+
+void SplitFrameRenderer::resetAccumulation() { accumulatedFrameCount = 0; }
+
+void SplitFrameRenderer::transferRayOrigin() {
+	uint32_t beforeAverageFrameWidth = frameWidth * samplesPerPixelSideLength;
+	uint32_t beforeAverageFrameHeight = frameHeight * samplesPerPixelSideLength;
+	float rayOrigin = (beforeAverageFrameWidth > beforeAverageFrameHeight ? beforeAverageFrameHeight : beforeAverageFrameWidth) * baseRayOrigin;
+	for (SplitFrameDevice& device : devices) { device.raytracingShader->setRayOrigin(rayOrigin); }
+}
+
+ErrorCode SplitFrameRenderer::init(RaytracingShaderFactory createRaytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder,
+									cl_device_type deviceType, uint8_t subDevicesPerCPU) {
+	SplitFrameRenderer::samplesPerPixelSideLength = samplesPerPixelSideLength;
+	SplitFrameRenderer::frameWidth = frameWidth;
+	transferredCamera = Camera::makeUntransferred();
+	SplitFrameRenderer::frameHeight = frameHeight;
+
+	switch (frameChannelOrder) {
+	case ImageChannelOrderType::RGBA: frameFormat.image_channel_order = CL_RGBA; frameBPP = 4; break;
+	case ImageChannelOrderType::BGRA: frameFormat.image_channel_order = CL_BGRA; frameBPP = 4; break;
+	case ImageChannelOrderType::ARGB: frameFormat.image_channel_order = CL_ARGB; frameBPP = 4; break;
+	case ImageChannelOrderType::RGB: frameFormat.image_channel_order = CL_RGB; frameBPP = 3; break;
+	}
+	frameFormat.image_channel_data_type = CL_UNSIGNED_INT8;
+
+	frame = new (std::nothrow) char[(size_t)frameWidth * frameBPP * frameHeight];
+	if (!frame) { return ErrorCode::FRAME_INIT_FAILED_INSUFFICIENT_HOST_MEM; }
+
+	switch (initOpenCLBindings()) {
+	case CL_SUCCESS: break;
+	case CL_EXT_DLL_LOAD_FAILURE: delete[] frame; frame = nullptr; freeOpenCLLib(); return ErrorCode::OPENCL_DLL_LOAD_FAILED;
+	case CL_EXT_DLL_FUNC_BIND_FAILURE: delete[] frame; frame = nullptr; freeOpenCLLib(); return ErrorCode::OPENCL_DLL_FUNC_BIND_FAILED;
+	}
+
+	if (!discoverDevices(deviceType, subDevicesPerCPU)) {
+		for (SplitFrameDevice& device : devices) { if (device.subDevice) { clReleaseDevice(device.device); } }
+		devices.clear();
+		delete[] frame;
+		frame = nullptr;
+		freeOpenCLLib();
+		return ErrorCode::NO_DEVICES_FOUND;
+	}
+
+	for (size_t i = 0; i < devices.size(); i++) {
+		devices[i].computeFrame = nullptr;
+		ErrorCode err = initDevice(devices[i], createRaytracingShader);
+		if (err == ErrorCode::SUCCESS && !allocateFrameBuffersOnDevice(devices[i])) { err = ErrorCode::DEVICE_FRAME_ALLOCATION_FAILED; }
+		if (err != ErrorCode::SUCCESS) {
+			for (size_t j = 0; j <= i; j++) { releaseDevice(devices[j]); }
+			for (size_t j = i + 1; j < devices.size(); j++) { if (devices[j].subDevice) { clReleaseDevice(devices[j].device); } }
+			devices.clear();
+			delete[] frame;
+			frame = nullptr;
+			freeOpenCLLib();
+			return err;
+		}
+	}
+
+	layoutBands();
+	resetAccumulation();
+	return ErrorCode::SUCCESS;
+}
+
+size_t SplitFrameRenderer::getDeviceCount() { return devices.size(); }
+const SplitFrameDevice& SplitFrameRenderer::getDevice(size_t index) { return devices[index]; }
+
+ErrorCode SplitFrameRenderer::resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight) {
+	for (SplitFrameDevice& device : devices) { clFinish(device.commandQueue); }
+
+	char* newFrame = new (std::nothrow) char[(size_t)newFrameWidth * frameBPP * newFrameHeight];
+	if (!newFrame) { return ErrorCode::FRAME_REINIT_FAILED_INSUFFICIENT_HOST_MEM; }
+	delete[] frame;
+	frame = newFrame;
+	frameWidth = newFrameWidth;
+	frameHeight = newFrameHeight;
+
+	for (SplitFrameDevice& device : devices) {
+		if (!releaseFrameBuffersOnDevice(device)) { return ErrorCode::DEVICE_RELEASE_FRAME_FAILED; }
+		if (!allocateFrameBuffersOnDevice(device)) { return ErrorCode::DEVICE_REALLOCATE_FRAME_FAILED_INSUFFICIENT_DEVICE_MEM; }
+	}
+
+	layoutBands();						// NOTE: The rows per second carry over, they don't depend on the width all that much.
+	resetAccumulation();
+	if (baseRayOrigin != -1) { transferRayOrigin(); }
+
+	return ErrorCode::SUCCESS;
+}
+
+void SplitFrameRenderer::loadCamera(const Camera& camera) { SplitFrameRenderer::camera = camera; }
+void SplitFrameRenderer::transferCameraPosition() {
+	for (SplitFrameDevice& device : devices) { device.raytracingShader->setCameraPosition(camera.position); }
+	if (!Camera::vectorsEqual(camera.position, transferredCamera.position)) { resetAccumulation(); }
+	transferredCamera.position = camera.position;
+}
+void SplitFrameRenderer::transferCameraRotation() {
+	for (SplitFrameDevice& device : devices) { device.raytracingShader->setCameraRotation(camera.rotation); }
+	if (!Camera::vectorsEqual(camera.rotation, transferredCamera.rotation)) { resetAccumulation(); }
+	transferredCamera.rotation = camera.rotation;
+}
+void SplitFrameRenderer::transferCameraFOV() {
+	baseRayOrigin = 0.5f / tanf(camera.FOV / 360 * nmath::constants::pi);
+	transferRayOrigin();
+	if (camera.FOV != transferredCamera.FOV) { resetAccumulation(); }
+	transferredCamera.FOV = camera.FOV;
+}
+
+void SplitFrameRenderer::loadResources(ResourceHeap&& resources) {
+	SplitFrameRenderer::resources = std::move(resources);
+	SplitFrameRenderer::resources.materialHeapDirtyRanges.markAll();
+}
+
+ErrorCode SplitFrameRenderer::transferResources() {
+	if (resources.isDirty()) { resetAccumulation(); }
+	for (SplitFrameDevice& device : devices) {
+		ErrorCode err = device.scene.transferResources(resources, device.raytracingShader);
+		if (err != ErrorCode::SUCCESS) { return err; }
+	}
+	resources.clearDirty();						// NOTE: Only once every device has seen the dirty ranges.
+	return ErrorCode::SUCCESS;
+}
+
+void SplitFrameRenderer::loadScene(Scene&& scene) {
+	SplitFrameRenderer::scene = std::move(scene);
+	SplitFrameRenderer::scene.markAllDirty();
+}
+
+ErrorCode SplitFrameRenderer::transferScene() {
+	scene.updateKDTree();
+	if (scene.isDirty()) { resetAccumulation(); }
+	for (SplitFrameDevice& device : devices) {
+		ErrorCode err = device.scene.transferScene(scene, device.raytracingShader);
+		if (err != ErrorCode::SUCCESS) { return err; }
+	}
+	scene.clearDirty();
+	return ErrorCode::SUCCESS;
+}
+
+ErrorCode SplitFrameRenderer::render() {
+	bool accumulate = accumulationEnabled;
+	for (const SplitFrameDevice& device : devices) { if (!device.computeAccumulationFrameAllocated) { accumulate = false; } }
+	if (!accumulate) { accumulatedFrameCount = 0; }
+
+	// NOTE: Every device only has the running mean of its own rows, so moving the bands in the middle of accumulating would mix fresh rows into somebody else's means.
+	// NOTE: That's why the accumulation starts over whenever they do move, and why they only move for a big enough change while there's something accumulated to lose.
+	uint32_t minimumBoundaryShift = accumulatedFrameCount == 0 ? 0 : std::max((uint32_t)(frameHeight * rebalanceThreshold), (uint32_t)1);
+	if (layoutBands(minimumBoundaryShift)) { accumulatedFrameCount = 0; }
+
+	size_t rowPitch = (size_t)frameWidth * frameBPP;
+	size_t enqueuedDeviceCount = 0;
+	ErrorCode err = ErrorCode::SUCCESS;
+	for (SplitFrameDevice& device : devices) {
+		if (device.bandHeight == 0) { continue; }
+
+		device.raytracingShader->setSampleIndex(accumulatedFrameCount);
+		if (accumulate) { device.raytracingShader->setAccumulationFrame(device.computeAccumulationFrame, accumulatedFrameCount); }
+		else { device.raytracingShader->setAccumulationFrame(nullptr, 0); }
+
+		switch (device.raytracingShader->enqueueTrace(device.commandQueue, device.traceGlobalOffset, device.traceGlobalSize, device.traceLocalSize,
+													(cl_uint)device.scene.uploadWaitList.size(), device.scene.uploadWaitList.empty() ? nullptr : device.scene.uploadWaitList.data(), &device.traceStartEvent, &device.traceEvent)) {
+		case CL_SUCCESS: device.scene.uploadWaitList.clear(); break;
+		case CL_INVALID_KERNEL_ARGS: err = ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_KERNEL_ARGS_UNSPECIFIED; break;
+		case CL_OUT_OF_RESOURCES: case CL_MEM_OBJECT_ALLOCATION_FAILURE: err = ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED_INSUFFICIENT_MEM; break;
+		default: err = ErrorCode::DEVICE_ENQUEUE_RENDER_FAILED; break;
+		}
+		if (err != ErrorCode::SUCCESS) { break; }
+
+		// NOTE: Every device reads its band straight into its own rows of frame, so there's nothing left to assemble afterwards.
+		if (clEnqueueReadImage(device.commandQueue, device.computeFrame, false, device.bandOrigin, device.bandRegion, rowPitch, 0, frame + device.bandStart * rowPitch, 0, nullptr, &device.readEvent) != CL_SUCCESS) {
+			clWaitForEvents(1, &device.traceEvent);
+			clReleaseEvent(device.traceStartEvent);
+			clReleaseEvent(device.traceEvent);
+			err = ErrorCode::DEVICE_ENQUEUE_READ_FRAME_FAILED;
+			break;
+		}
+		clFlush(device.commandQueue);						// NOTE: Gets this device going before we even start enqueueing on the next one.
+		enqueuedDeviceCount++;
+	}
+
+	// NOTE: The devices that got enqueued have to be waited for either way, they're writing into frame.
+	bool readFailed = false;
+	size_t waitedDeviceCount = 0;
+	for (SplitFrameDevice& device : devices) {
+		if (waitedDeviceCount == enqueuedDeviceCount) { break; }
+		if (device.bandHeight == 0) { continue; }
+		if (clWaitForEvents(1, &device.readEvent) != CL_SUCCESS) { readFailed = true; }
+		waitedDeviceCount++;
+	}
+	if (err == ErrorCode::SUCCESS && !readFailed) { measureBands(); }
+	waitedDeviceCount = 0;
+	for (SplitFrameDevice& device : devices) {
+		if (waitedDeviceCount == enqueuedDeviceCount) { break; }
+		if (device.bandHeight == 0) { continue; }
+		clReleaseEvent(device.traceStartEvent);
+		clReleaseEvent(device.traceEvent);
+		clReleaseEvent(device.readEvent);
+		waitedDeviceCount++;
+	}
+	if (err != ErrorCode::SUCCESS) { return err; }
+	if (readFailed) { return ErrorCode::READ_DEVICE_FRAME_FAILED; }
+
+	frameCamera = camera;
+	if (accumulate && accumulatedFrameCount != (uint32_t)-1) { accumulatedFrameCount++; }
+	return ErrorCode::SUCCESS;
+}
+
+Renderer::FrameView SplitFrameRenderer::getFrameView() { return { frame, frameWidth, frameHeight, frameBPP, false, frameCamera }; }
+
+bool SplitFrameRenderer::release() {
+	bool successful = true;
+	for (SplitFrameDevice& device : devices) { if (!releaseDevice(device)) { successful = false; } }
+	devices.clear();
+	delete[] frame;
+	frame = nullptr;
+	if (!freeOpenCLLib()) { successful = false; }
+	return successful;
+}
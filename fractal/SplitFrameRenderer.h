@@ -0,0 +1,135 @@
+#pragma once
+
+#include "Renderer.h"
+
+#include "Scene.h"
+#include "ResourceHeap.h"
+
+#include "Camera.h"
+
+#include "ErrorCode.h"
+
+#include "cl_bindings_and_helpers.h"
+
+#include "RaytracingShader.h"
+#include "DeviceScene.h"
+
+#include <cstdint>
+
+#include <vector>
+
+// NOTE: Every device needs its own kernel, so SplitFrameRenderer needs a way to make as many shaders as it finds devices. The shaders have to come from new, they get deleted in release.
+typedef RaytracingShader* (*RaytracingShaderFactory)();
+
+struct SplitFrameDevice {
+	cl_device_id device;
+	bool subDevice;																	// NOTE: Sub-devices were created by us, so we have to release them.
+	cl_context context;
+	cl_command_queue commandQueue;													// NOTE: Created with profiling enabled, the kernel times are what the bands get balanced by.
+
+	RaytracingShader* raytracingShader;
+	DeviceScene scene;
+
+	cl_mem computeFrame;															// NOTE: Full size, but the device only ever renders and reads back its own band. That way the kernel doesn't need to know about bands, the global work offset does it all.
+	cl_mem computeAccumulationFrame;
+	bool computeAccumulationFrameAllocated;
+
+	size_t traceGlobalOffset[2];
+	size_t traceGlobalSize[2];
+	size_t traceLocalSize[2];
+	size_t bandOrigin[3];
+	size_t bandRegion[3];
+
+	uint32_t bandStart;
+	uint32_t bandHeight;
+	double rowsPerSecond;															// NOTE: Smoothed over the last few frames. Starts out as the compute unit count, which is a bad guess, but good enough for the first frame.
+
+	cl_event traceStartEvent;														// NOTE: Same event as traceEvent unless the shader takes more than one kernel to trace, see RaytracingShader::enqueueTrace.
+	cl_event traceEvent;
+	cl_event readEvent;
+};
+
+/*
+
+NOTE: How split-frame rendering works:
+	- Every OpenCL device we can find gets its own context, queue, shader and copy of the scene. CPUs can optionally be split into sub-devices (clCreateSubDevices),
+		which is also how you test this on a single machine with POCL.
+	- The frame is cut into horizontal bands, one per device, from top to bottom. Every device renders its band with a global work offset and reads it straight into its rows of frame.
+	- After every frame, the trace times from the profiling info update every device's rows per second, and the bands get resized to match before the next one.
+		Every device only has the running mean of its own rows though, so while accumulating, moving a band resets the accumulation. That's why the bands only
+		move then if a boundary moves by more than rebalanceThreshold, small jitter in the timings just gets ignored.
+	- This is its own renderer next to Renderer, with its own scene, resources and camera. Don't init both at the same time, they both load and free the OpenCL library.
+	- Only fused resolving and copied frames are supported. Nothing is pipelined, render waits for every band. The devices still run at the same time, which is the whole point.
+
+*/
+
+class SplitFrameRenderer {
+	static cl_image_format frameFormat;
+	static unsigned char frameBPP;
+	static uint16_t samplesPerPixelSideLength;
+
+	static float baseRayOrigin;
+	static Camera transferredCamera;												// NOTE: Same as in Renderer, only transfers that change something reset the accumulation.
+
+	static std::vector<SplitFrameDevice> devices;
+
+	static bool discoverDevices(cl_device_type deviceType, uint8_t subDevicesPerCPU);
+	static ErrorCode initDevice(SplitFrameDevice& device, RaytracingShaderFactory createRaytracingShader);
+	static bool releaseDevice(SplitFrameDevice& device);
+
+	static bool allocateFrameBuffersOnDevice(SplitFrameDevice& device);
+	static bool releaseFrameBuffersOnDevice(SplitFrameDevice& device);
+
+	static void measureBands();
+	// NOTE: Returns whether any band boundary moved. With a minimumBoundaryShift, the bands only move if at least one boundary would move by that many rows.
+	static bool layoutBands(uint32_t minimumBoundaryShift = 0);
+
+	static void transferRayOrigin();
+
+public:
+	static char* frame;
+	static Camera frameCamera;
+	static uint32_t frameWidth;
+	static uint32_t frameHeight;
+
+	static ResourceHeap resources;
+	static Scene scene;
+	static Camera camera;
+
+	static float rebalanceSmoothing;												// NOTE: How much the newest measurement counts. 1 follows every hiccup, 0 never rebalances at all.
+	static float rebalanceThreshold;												// NOTE: Fraction of the frame height that a boundary has to move by before a rebalance is worth resetting the accumulation for.
+
+	static bool accumulationEnabled;
+	static uint32_t accumulatedFrameCount;
+	static void resetAccumulation();
+
+	// NOTE: Uses every device of the given types on every platform. subDevicesPerCPU > 1 splits every CPU into that many sub-devices, if it can be split.
+	static ErrorCode init(RaytracingShaderFactory createRaytracingShader, uint16_t samplesPerPixelSideLength, uint32_t frameWidth, uint32_t frameHeight, ImageChannelOrderType frameChannelOrder,
+							cl_device_type deviceType = CL_DEVICE_TYPE_ALL, uint8_t subDevicesPerCPU = 1);
+
+	static size_t getDeviceCount();
+	static const SplitFrameDevice& getDevice(size_t index);
+
+	static ErrorCode resizeFrame(uint32_t newFrameWidth, uint32_t newFrameHeight);
+
+	static void loadCamera(const Camera& camera);
+	static void transferCameraPosition();
+	static void transferCameraRotation();
+	static void transferCameraFOV();
+
+	static void loadResources(ResourceHeap&& resources);
+
+	// WARNING: A valid state is not garanteed if this function fails.
+	static ErrorCode transferResources();
+
+	static void loadScene(Scene&& scene);
+
+	// WARNING: A valid state is not garanteed if this function fails.
+	static ErrorCode transferScene();
+
+	static ErrorCode render();
+
+	static Renderer::FrameView getFrameView();
+
+	static bool release();
+};
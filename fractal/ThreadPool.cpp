@@ -0,0 +1,89 @@
+#include "ThreadPool.h"
+
+thread_local ThreadPool* ThreadPool::currentPool = nullptr;
+thread_local size_t ThreadPool::currentWorkerIndex = -1;
+
+ThreadPool::ThreadPool(size_t threadCount) : running(true), pendingTaskCount(0), nextWorkerIndex(0) {
+	if (threadCount == 0) {
+		threadCount = std::thread::hardware_concurrency();
+		if (threadCount == 0) { threadCount = 1; }						// NOTE: hardware_concurrency is allowed to return 0 if it can't figure it out.
+	}
+	workerCount = threadCount;
+	workers = std::make_unique<Worker[]>(workerCount);
+	threads.reserve(workerCount);
+	for (size_t i = 0; i < workerCount; i++) { threads.emplace_back(&ThreadPool::workerLoop, this, i); }
+}
+
+bool ThreadPool::popTask(std::function<void()>& task) {
+	size_t ownIndex = currentPool == this ? currentWorkerIndex : -1;
+
+	if (ownIndex != (size_t)-1) {
+		Worker& ownWorker = workers[ownIndex];
+		std::lock_guard<std::mutex> lock(ownWorker.mutex);
+		if (!ownWorker.tasks.empty()) {
+			task = std::move(ownWorker.tasks.back());
+			ownWorker.tasks.pop_back();
+			pendingTaskCount--;
+			return true;
+		}
+	}
+
+	size_t startIndex = ownIndex == (size_t)-1 ? 0 : ownIndex + 1;
+	for (size_t i = 0; i < workerCount; i++) {
+		size_t victimIndex = (startIndex + i) % workerCount;
+		if (victimIndex == ownIndex) { continue; }
+		Worker& victim = workers[victimIndex];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			pendingTaskCount--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::workerLoop(size_t workerIndex) {
+	currentPool = this;
+	currentWorkerIndex = workerIndex;
+
+	std::function<void()> task;
+	while (running) {
+		if (popTask(task)) { task(); task = nullptr; continue; }
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepCondition.wait(lock, [this]() { return pendingTaskCount != 0 || !running; });
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	size_t targetIndex = currentPool == this ? currentWorkerIndex : nextWorkerIndex++ % workerCount;
+	{
+		Worker& target = workers[targetIndex];
+		std::lock_guard<std::mutex> lock(target.mutex);
+		target.tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);					// NOTE: Incrementing under the lock makes sure a worker can't check the count and go to sleep right between the increment and the notify.
+		pendingTaskCount++;
+	}
+	sleepCondition.notify_one();
+}
+
+bool ThreadPool::runPendingTask() {
+	std::function<void()> task;
+	if (!popTask(task)) { return false; }
+	task();
+	return true;
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		running = false;
+	}
+	sleepCondition.notify_all();
+	for (std::thread& thread : threads) { thread.join(); }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+
+/*
+
+NOTE: How the work stealing works:
+	- Every worker thread has its own deque of tasks.
+	- Tasks that get submitted from inside a worker go onto the back of that worker's own deque. The worker also takes its own tasks off of the back,
+		which means it works depth-first on the stuff it just created, which is good for the cache and keeps the deques short for recursive work.
+	- If a worker runs out of tasks, it steals from the front of the other workers' deques. The front holds the oldest tasks, which for recursive work
+		are the biggest ones, so a single steal usually gives the thief a lot to do.
+	- Threads that aren't part of the pool (like the main thread) push their tasks round-robin into the worker deques.
+	- Anyone who waits on a TaskGroup helps out by running pending tasks while waiting. Without that, recursive fork-join would deadlock as soon as
+		every worker is waiting on a child task that nobody is free to run.
+
+*/
+
+class ThreadPool {
+	struct Worker {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::unique_ptr<Worker[]> workers;											// NOTE: Can't be a vector because mutexes aren't movable.
+	size_t workerCount;
+	std::vector<std::thread> threads;
+
+	std::atomic<bool> running;
+	std::atomic<size_t> pendingTaskCount;
+	std::atomic<size_t> nextWorkerIndex;
+
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+
+	static thread_local ThreadPool* currentPool;
+	static thread_local size_t currentWorkerIndex;
+
+	bool popTask(std::function<void()>& task);
+
+	void workerLoop(size_t workerIndex);
+
+public:
+	// NOTE: A threadCount of 0 means one thread per hardware thread.
+	ThreadPool(size_t threadCount = 0);
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void submit(std::function<void()> task);
+
+	// Runs one pending task on the calling thread if there is one. Returns false if there was nothing to do.
+	bool runPendingTask();
+
+	size_t getThreadCount() const { return workerCount; }
+
+	~ThreadPool();
+};
+
+class TaskGroup {
+	ThreadPool& pool;
+	std::atomic<size_t> outstandingTaskCount;
+
+public:
+	TaskGroup(ThreadPool& pool) : pool(pool), outstandingTaskCount(0) { }
+
+	void run(std::function<void()> task) {
+		outstandingTaskCount++;
+		pool.submit([this, task = std::move(task)]() { task(); outstandingTaskCount--; });
+	}
+
+	void wait() {
+		while (outstandingTaskCount != 0) {
+			if (!pool.runPendingTask()) { std::this_thread::yield(); }
+		}
+	}
+
+	~TaskGroup() { wait(); }
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// NOTE: Same order as the STATISTIC_ indices in raytracer.cl.
+enum class TraversalStatistic {
+	NODE_VISITS,
+	AABB_TESTS,
+	LEAF_SPHERE_TESTS,
+	BOUNCES,
+	RESTARTS,						// NOTE: Steps up a parent link, ropes followed, or descents from the root again, depending on the traversal.
+	COUNT
+};
+
+enum class TraversalStatisticsMode {
+	OFF,							// NOTE: The kernel gets built without TRAVERSAL_STATISTICS, so it's the exact same kernel as without any of this.
+	COUNTERS,						// NOTE: Counts what the rays do and reports it per frame.
+	HEATMAP							// NOTE: Counts as well, but the frame shows the per-pixel cost instead of the shaded color.
+};
+
+// NOTE: The counts of one whole frame, summed over every work group.
+struct TraversalStatistics {
+	uint64_t counts[(size_t)TraversalStatistic::COUNT];
+
+	uint64_t get(TraversalStatistic statistic) const { return counts[(size_t)statistic]; }
+};
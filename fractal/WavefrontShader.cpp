@@ -0,0 +1,264 @@
+#include "WavefrontShader.h"
+
+#include "logging/debugOutput.h"
+
+#include <string>
+#include <algorithm>
+
+static const char* const wavefrontKernelNames[] = {
+	"generateWavefrontRays", "extendWavefrontRays", "shadeWavefrontRays", "resolveWavefrontSamples",
+	"computeWavefrontSortKeys", "countWavefrontSortDigits", "scanWavefrontSortDigits", "scatterWavefrontSortDigits", "gatherWavefrontRays"
+};
+static_assert(sizeof(wavefrontKernelNames) / sizeof(wavefrontKernelNames[0]) == (size_t)WavefrontKernel::COUNT, "Every wavefront kernel needs a name.");
+
+// NOTE: The argument indices in WAVEFRONT_KERNEL_PARAMETERS that enqueueTrace sets itself.
+enum WavefrontArgument : cl_uint {
+	RAY_QUEUE_ARGUMENT = 18,
+	NEXT_RAY_QUEUE_ARGUMENT,
+	HITS_ARGUMENT,
+	SAMPLE_COLORS_ARGUMENT,
+	RAY_COUNTS_ARGUMENT,
+	PASS_ARGUMENT,
+	BATCH_PIXEL_START_ARGUMENT,
+	BATCH_PIXEL_COUNT_ARGUMENT,
+	SORT_KEYS_ARGUMENT,
+	SORT_VALUES_ARGUMENT,
+	NEXT_SORT_KEYS_ARGUMENT,
+	NEXT_SORT_VALUES_ARGUMENT,
+	SORT_HISTOGRAMS_ARGUMENT,
+	SORT_ITEM_COUNT_ARGUMENT,
+	SORT_SHIFT_ARGUMENT
+};
+
+ErrorCode WavefrontShader::init(cl_context context, cl_device_id device) {
+	std::string sourceCodePrefix = "#define WAVEFRONT\n#define MAX_BOUNCES " + std::to_string(maxBounces) + '\n';
+	std::string buildLog;
+	ErrorCode err = setupFromFile(context, device, "raytracer.cl", wavefrontKernelNames[(size_t)WavefrontKernel::GENERATE], sourceCodePrefix.c_str(), buildLog);
+	if (err == ErrorCode::SHADER_BUILD_FAILED_WITH_BUILD_LOG) {
+		debuglogger::out << buildLog << '\n';
+	}
+	if (err != ErrorCode::SUCCESS) { return err; }
+
+	// NOTE: The rest of the kernels come out of the program that setupFromFile built for the generate kernel. The launches all use the smallest work group size out of all of them.
+	kernels[(size_t)WavefrontKernel::GENERATE] = computeKernel;
+	for (size_t i = (size_t)WavefrontKernel::GENERATE + 1; i < (size_t)WavefrontKernel::COUNT; i++) {
+		cl_int kernelErr;
+		kernels[i] = clCreateKernel(computeProgram, wavefrontKernelNames[i], &kernelErr);
+		size_t workGroupSize;
+		if (kernelErr == CL_SUCCESS) { kernelErr = clGetKernelWorkGroupInfo(kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(workGroupSize), &workGroupSize, nullptr); }
+		else { kernels[i] = nullptr; }
+		if (kernelErr != CL_SUCCESS) {
+			bool kernelCreated = kernels[i] != nullptr;
+			for (size_t j = (size_t)WavefrontKernel::GENERATE + 1; j <= i; j++) { if (kernels[j]) { clReleaseKernel(kernels[j]); } }
+			releaseBaseVars();
+			return kernelCreated ? ErrorCode::SHADER_GET_KERNEL_WORK_GROUP_INFO_FAILED : ErrorCode::SHADER_CREATE_KERNEL_FAILED;
+		}
+		computeKernelWorkGroupSize = std::min(computeKernelWorkGroupSize, workGroupSize);
+	}
+
+	cl_int bufferErr;
+	computeRayCounts = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, (maxBounces + 1) * sizeof(cl_uint), nullptr, &bufferErr);
+	if (!computeRayCounts) {
+		for (size_t i = (size_t)WavefrontKernel::GENERATE + 1; i < (size_t)WavefrontKernel::COUNT; i++) { clReleaseKernel(kernels[i]); }
+		releaseBaseVars();
+		return ErrorCode::SHADER_BUFFER_ALLOCATION_FAILED;
+	}
+	setWavefrontArgument(RAY_COUNTS_ARGUMENT, sizeof(cl_mem), &computeRayCounts);
+
+	// NOTE: The queues depend on the samples per pixel, which only come after init, so the first enqueueTrace allocates them.
+	this->context = context;
+	computeRayQueues[0] = nullptr;
+	computeRayQueues[1] = nullptr;
+	computeHits = nullptr;
+	computeSampleColors = nullptr;
+	computeSortKeys[0] = nullptr;
+	computeSortKeys[1] = nullptr;
+	computeSortValues[0] = nullptr;
+	computeSortValues[1] = nullptr;
+	computeSortHistograms = nullptr;
+	allocatedSampleCount = 0;
+	return ErrorCode::SUCCESS;
+}
+
+bool WavefrontShader::release() {
+	bool successful = releaseQueues();
+	if (clReleaseMemObject(computeRayCounts) != CL_SUCCESS) { successful = false; }
+	for (size_t i = (size_t)WavefrontKernel::GENERATE + 1; i < (size_t)WavefrontKernel::COUNT; i++) {
+		if (clReleaseKernel(kernels[i]) != CL_SUCCESS) { successful = false; }
+	}
+	if (!releaseBaseVars()) { successful = false; }
+	return successful;
+}
+
+void WavefrontShader::setWavefrontArgument(cl_uint index, size_t size, const void* value) {
+	for (cl_kernel kernel : kernels) { clSetKernelArg(kernel, index, size, value); }
+}
+
+// NOTE: Only ever grows. The old buffers can still be in use by frames in flight, but OpenCL keeps them around until those are done.
+cl_int WavefrontShader::allocateQueues(size_t sampleCount) {
+	if (sampleCount <= allocatedSampleCount) { return CL_SUCCESS; }
+	releaseQueues();
+
+	// NOTE: One count and scatter work item per chunk, rounded up so that the launches don't need any extra padding.
+	size_t chunkCount = (sampleCount + sortChunkSize - 1) / sortChunkSize;
+	sortItemCount = (cl_uint)(chunkCount + (computeKernelWorkGroupSize - chunkCount % computeKernelWorkGroupSize) % computeKernelWorkGroupSize);
+
+	struct QueueBuffer {
+		cl_mem* buffer;
+		size_t size;
+	};
+	QueueBuffer buffers[] = {
+		{ &computeRayQueues[0], sampleCount * rayQueueEntrySize },
+		{ &computeRayQueues[1], sampleCount * rayQueueEntrySize },
+		{ &computeHits, sampleCount * hitEntrySize },
+		{ &computeSampleColors, sampleCount * sizeof(cl_float4) },
+		{ &computeSortKeys[0], sampleCount * sizeof(cl_uint) },
+		{ &computeSortKeys[1], sampleCount * sizeof(cl_uint) },
+		{ &computeSortValues[0], sampleCount * sizeof(cl_uint) },
+		{ &computeSortValues[1], sampleCount * sizeof(cl_uint) },
+		{ &computeSortHistograms, sortDigitCount * sortItemCount * sizeof(cl_uint) }
+	};
+	for (QueueBuffer& buffer : buffers) {
+		cl_int err;
+		*buffer.buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, buffer.size, nullptr, &err);
+		if (err != CL_SUCCESS) { *buffer.buffer = nullptr; releaseQueues(); return err; }
+	}
+
+	allocatedSampleCount = sampleCount;
+	setWavefrontArgument(HITS_ARGUMENT, sizeof(cl_mem), &computeHits);
+	setWavefrontArgument(SAMPLE_COLORS_ARGUMENT, sizeof(cl_mem), &computeSampleColors);
+	setWavefrontArgument(SORT_HISTOGRAMS_ARGUMENT, sizeof(cl_mem), &computeSortHistograms);
+	setWavefrontArgument(SORT_ITEM_COUNT_ARGUMENT, sizeof(cl_uint), &sortItemCount);
+	return CL_SUCCESS;
+}
+
+bool WavefrontShader::releaseQueues() {
+	bool successful = true;
+	cl_mem* buffers[] = { &computeRayQueues[0], &computeRayQueues[1], &computeHits, &computeSampleColors,
+						  &computeSortKeys[0], &computeSortKeys[1], &computeSortValues[0], &computeSortValues[1], &computeSortHistograms };
+	for (cl_mem* buffer : buffers) {
+		if (*buffer && clReleaseMemObject(*buffer) != CL_SUCCESS) { successful = false; }
+		*buffer = nullptr;
+	}
+	allocatedSampleCount = 0;
+	return successful;
+}
+
+cl_int WavefrontShader::enqueueTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+									 cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent) {
+	// NOTE: The renderers size the launch for the 2D megakernels, with the width padded up to the work group size. Only the rows matter in here.
+	size_t pixelStart = (globalOffset ? globalOffset[1] : 0) * frameWidth;
+	size_t pixelEnd = pixelStart + globalSize[1] * frameWidth;
+	size_t samplesPerPixel = (size_t)samplesPerPixelSideLength * samplesPerPixelSideLength;
+
+	if (pixelStart == pixelEnd || samplesPerPixel == 0) {
+		// NOTE: Nothing to trace, but the caller still gets its events.
+		cl_event event;
+		cl_int err = clEnqueueMarkerWithWaitList(commandQueue, waitListLength, waitList, startEvent || endEvent ? &event : nullptr);
+		if (err != CL_SUCCESS) { return err; }
+		if (startEvent && endEvent) { clRetainEvent(event); }
+		if (startEvent) { *startEvent = event; }
+		if (endEvent) { *endEvent = event; }
+		return CL_SUCCESS;
+	}
+
+	size_t batchPixelCapacity = std::min(std::max(maxBatchSampleCount / samplesPerPixel, (size_t)1), pixelEnd - pixelStart);
+	cl_int err = allocateQueues(batchPixelCapacity * samplesPerPixel);
+	if (err != CL_SUCCESS) { return err; }
+
+	// NOTE: Only the first command waits on the wait list and hands out startEvent, the in-order queue takes care of the rest.
+	bool firstCommand = true;
+	auto enqueuePass = [&](WavefrontKernel kernel, size_t workItemCount, size_t passLocalSize, bool lastCommand, cl_event* passEvent) -> cl_int {
+		size_t passGlobalSize = workItemCount + (passLocalSize - workItemCount % passLocalSize) % passLocalSize;
+		cl_event* eventTargets[] = { firstCommand ? startEvent : nullptr, lastCommand ? endEvent : nullptr, passEvent };
+		bool wantsEvent = eventTargets[0] || eventTargets[1] || eventTargets[2];
+		cl_event event;
+		cl_int passErr = clEnqueueNDRangeKernel(commandQueue, kernels[(size_t)kernel], 1, nullptr, &passGlobalSize, &passLocalSize,
+												firstCommand ? waitListLength : 0, firstCommand ? waitList : nullptr, wantsEvent ? &event : nullptr);
+		if (passErr != CL_SUCCESS) {
+			if (!firstCommand && startEvent) { clReleaseEvent(*startEvent); }
+			return passErr;
+		}
+		bool eventHandedOut = false;
+		for (cl_event* eventTarget : eventTargets) {
+			if (!eventTarget) { continue; }
+			if (eventHandedOut) { clRetainEvent(event); }
+			*eventTarget = event;
+			eventHandedOut = true;
+		}
+		firstCommand = false;
+		return CL_SUCCESS;
+	};
+
+	size_t rayQueueIndex = 0;						// NOTE: Which of the two queues holds the rays of the current pass.
+
+	// NOTE: Sorts the current pass's queue into the other one, which then becomes the current one. PASS_ARGUMENT has to be set already.
+	auto enqueueSort = [&](size_t sampleCount) -> cl_int {
+		cl_event sortStartEvent;
+		cl_event sortEndEvent;
+		setWavefrontArgument(RAY_QUEUE_ARGUMENT, sizeof(cl_mem), &computeRayQueues[rayQueueIndex]);
+		setWavefrontArgument(NEXT_RAY_QUEUE_ARGUMENT, sizeof(cl_mem), &computeRayQueues[1 - rayQueueIndex]);
+		setWavefrontArgument(SORT_KEYS_ARGUMENT, sizeof(cl_mem), &computeSortKeys[0]);
+		setWavefrontArgument(SORT_VALUES_ARGUMENT, sizeof(cl_mem), &computeSortValues[0]);
+		cl_int sortErr = enqueuePass(WavefrontKernel::SORT_KEYS, sampleCount, computeKernelWorkGroupSize, false, profiler ? &sortStartEvent : nullptr);
+		if (sortErr != CL_SUCCESS) { return sortErr; }
+
+		size_t scanSize = std::min(sortScanSize, computeKernelWorkGroupSize);
+		size_t sortBufferIndex = 0;
+		for (cl_uint sortShift = 0; sortShift < sortKeyBits; sortShift += sortDigitBits) {
+			setWavefrontArgument(SORT_KEYS_ARGUMENT, sizeof(cl_mem), &computeSortKeys[sortBufferIndex]);
+			setWavefrontArgument(SORT_VALUES_ARGUMENT, sizeof(cl_mem), &computeSortValues[sortBufferIndex]);
+			setWavefrontArgument(NEXT_SORT_KEYS_ARGUMENT, sizeof(cl_mem), &computeSortKeys[1 - sortBufferIndex]);
+			setWavefrontArgument(NEXT_SORT_VALUES_ARGUMENT, sizeof(cl_mem), &computeSortValues[1 - sortBufferIndex]);
+			setWavefrontArgument(SORT_SHIFT_ARGUMENT, sizeof(cl_uint), &sortShift);
+			if ((sortErr = enqueuePass(WavefrontKernel::SORT_COUNT, sortItemCount, computeKernelWorkGroupSize, false, nullptr)) != CL_SUCCESS ||
+				(sortErr = enqueuePass(WavefrontKernel::SORT_SCAN, scanSize, scanSize, false, nullptr)) != CL_SUCCESS ||
+				(sortErr = enqueuePass(WavefrontKernel::SORT_SCATTER, sortItemCount, computeKernelWorkGroupSize, false, nullptr)) != CL_SUCCESS) {
+				if (profiler) { clReleaseEvent(sortStartEvent); }
+				return sortErr;
+			}
+			sortBufferIndex = 1 - sortBufferIndex;
+		}
+
+		setWavefrontArgument(SORT_VALUES_ARGUMENT, sizeof(cl_mem), &computeSortValues[sortBufferIndex]);
+		sortErr = enqueuePass(WavefrontKernel::SORT_GATHER, sampleCount, computeKernelWorkGroupSize, false, profiler ? &sortEndEvent : nullptr);
+		if (sortErr != CL_SUCCESS) {
+			if (profiler) { clReleaseEvent(sortStartEvent); }
+			return sortErr;
+		}
+		if (profiler) {
+			profiler->record(ProfileStage::SORT, sortStartEvent, sortEndEvent);
+			clReleaseEvent(sortStartEvent);
+			clReleaseEvent(sortEndEvent);
+		}
+		rayQueueIndex = 1 - rayQueueIndex;
+		return CL_SUCCESS;
+	};
+
+	for (size_t batchPixelStart = pixelStart; batchPixelStart < pixelEnd; batchPixelStart += batchPixelCapacity) {
+		cl_uint batchPixelStartArgument = (cl_uint)batchPixelStart;
+		cl_uint batchPixelCount = (cl_uint)std::min(batchPixelCapacity, pixelEnd - batchPixelStart);
+		size_t batchSampleCount = batchPixelCount * samplesPerPixel;
+		setWavefrontArgument(BATCH_PIXEL_START_ARGUMENT, sizeof(cl_uint), &batchPixelStartArgument);
+		setWavefrontArgument(BATCH_PIXEL_COUNT_ARGUMENT, sizeof(cl_uint), &batchPixelCount);
+
+		rayQueueIndex = 0;
+		setWavefrontArgument(RAY_QUEUE_ARGUMENT, sizeof(cl_mem), &computeRayQueues[rayQueueIndex]);
+		if ((err = enqueuePass(WavefrontKernel::GENERATE, batchSampleCount, computeKernelWorkGroupSize, false, nullptr)) != CL_SUCCESS) { return err; }
+
+		// NOTE: Every pass gets launched for the whole batch, even though most of the rays are usually gone after the first few bounces. See the NOTE in raytracer.cl.
+		for (cl_uint pass = 0; pass <= maxBounces; pass++) {
+			setWavefrontArgument(PASS_ARGUMENT, sizeof(cl_uint), &pass);
+			if (getRaySorting((uint8_t)pass) && (err = enqueueSort(batchSampleCount)) != CL_SUCCESS) { return err; }
+
+			setWavefrontArgument(RAY_QUEUE_ARGUMENT, sizeof(cl_mem), &computeRayQueues[rayQueueIndex]);
+			setWavefrontArgument(NEXT_RAY_QUEUE_ARGUMENT, sizeof(cl_mem), &computeRayQueues[1 - rayQueueIndex]);
+			if ((err = enqueuePass(WavefrontKernel::EXTEND, batchSampleCount, computeKernelWorkGroupSize, false, nullptr)) != CL_SUCCESS) { return err; }
+			if ((err = enqueuePass(WavefrontKernel::SHADE, batchSampleCount, computeKernelWorkGroupSize, false, nullptr)) != CL_SUCCESS) { return err; }
+			rayQueueIndex = 1 - rayQueueIndex;
+		}
+
+		if ((err = enqueuePass(WavefrontKernel::RESOLVE, batchPixelCount, computeKernelWorkGroupSize, batchPixelStart + batchPixelCount == pixelEnd, nullptr)) != CL_SUCCESS) { return err; }
+	}
+	return CL_SUCCESS;
+}
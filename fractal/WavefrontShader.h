@@ -0,0 +1,155 @@
+#pragma once
+
+#include "Shader.h"
+#include "RaytracingShader.h"
+
+#include "cl_bindings_and_helpers.h"
+
+#include <cstdint>
+
+#include <bitset>
+
+#include "nmath/matrices/Matrix4f.h"
+
+/*
+
+NOTE: Wavefront path tracing. Instead of one kernel that follows every sample through all of its bounces, the trace is split into passes over queues of rays,
+	so that the rays that are still alive after a bounce get packed together and the work groups don't sit half idle behind the few that bounce the longest.
+	- The kernels are the WAVEFRONT section of raytracer.cl: generate the camera rays, then extend (closest hit) and shade (finish or bounce into the next queue)
+		once for every bounce, then resolve the samples into the pixels. enqueueTrace enqueues all of it, so the renderers drive it like any other shader.
+	- Traces with the compact kd-tree, so it needs Scene::compactKDTreeEnabled. Traversal statistics aren't supported.
+	- The frame gets traced in batches of whole pixels, which bounds the queue memory to about maxBatchSampleCount * 180 bytes no matter the resolution.
+	- The queue lengths only ever live on the device. The host enqueues every pass for the full batch and the kernels return early past the length,
+		there's no indirect dispatch in OpenCL and reading the lengths back would stall the queue on every bounce.
+	- The queue that enqueueTrace gets has to be in-order, the passes rely on that instead of events.
+	- The queues can be sorted for coherence before they get extended, per bounce depth, see setRaySorting. With profiler set, every sort gets recorded as
+		ProfileStage::SORT on its own. It's part of the TRACE span as well, since that goes from the first kernel to the last.
+
+*/
+
+enum class WavefrontKernel {
+	GENERATE,
+	EXTEND,
+	SHADE,
+	RESOLVE,
+	SORT_KEYS,
+	SORT_COUNT,
+	SORT_SCAN,
+	SORT_SCATTER,
+	SORT_GATHER,
+	COUNT
+};
+
+class WavefrontShader : public RaytracingShader
+{
+	uint8_t maxBounces;
+	size_t maxBatchSampleCount;
+	std::bitset<128> sortedBounceDepths;
+
+	cl_context context;
+	cl_kernel kernels[(size_t)WavefrontKernel::COUNT];				// NOTE: The generate one is computeKernel.
+
+	cl_mem computeRayQueues[2];
+	cl_mem computeHits;
+	cl_mem computeSampleColors;
+	cl_mem computeRayCounts;
+	cl_mem computeSortKeys[2];
+	cl_mem computeSortValues[2];
+	cl_mem computeSortHistograms;
+	size_t allocatedSampleCount;
+	cl_uint sortItemCount;
+
+	uint32_t frameWidth = 0;
+	uint16_t samplesPerPixelSideLength = 1;
+
+	ErrorCode init(cl_context context, cl_device_id device) override;
+	bool release() override;
+
+	void setWavefrontArgument(cl_uint index, size_t size, const void* value);
+	cl_int allocateQueues(size_t sampleCount);
+	bool releaseQueues();
+
+public:
+	// NOTE: Have to match the structs and the sort #defines in raytracer.cl.
+	static constexpr size_t rayQueueEntrySize = 64;
+	static constexpr size_t hitEntrySize = 16;
+	static constexpr cl_uint sortKeyBits = 30;
+	static constexpr cl_uint sortDigitBits = 4;
+	static constexpr size_t sortDigitCount = 1 << sortDigitBits;
+	static constexpr size_t sortChunkSize = 64;
+	static constexpr size_t sortScanSize = 256;
+
+	WavefrontShader(uint8_t maxBounces = 10, size_t maxBatchSampleCount = 1 << 20) : maxBounces(maxBounces > 127 ? 127 : maxBounces), maxBatchSampleCount(maxBatchSampleCount == 0 ? 1 : maxBatchSampleCount) { }
+
+	// NOTE: bounceDepth is how often the rays in the queue have bounced already, so 1 sorts the first bounce rays before they get extended. The camera rays (0) come out of generate in pixel order, which is about as coherent as it gets already.
+	void setRaySorting(uint8_t bounceDepth, bool enabled) { if (bounceDepth < sortedBounceDepths.size()) { sortedBounceDepths.set(bounceDepth, enabled); } }
+	bool getRaySorting(uint8_t bounceDepth) const { return bounceDepth < sortedBounceDepths.size() && sortedBounceDepths.test(bounceDepth); }
+
+	cl_int enqueueTrace(cl_command_queue commandQueue, const size_t* globalOffset, const size_t* globalSize, const size_t* localSize,
+						cl_uint waitListLength, const cl_event* waitList, cl_event* startEvent, cl_event* endEvent) override;
+	bool usesTraceLocalSize() const override { return false; }				// NOTE: The passes size their own 1D launches.
+	uint8_t getMaxBounces() const override { return maxBounces; }
+
+	void setBeforeAverageFrameData(cl_mem computeBeforeAverageFrame, cl_uint beforeAverageFrameWidth, cl_uint beforeAverageFrameHeight) override {
+		frameWidth = beforeAverageFrameWidth;
+		setWavefrontArgument(0, sizeof(cl_mem), &computeBeforeAverageFrame);
+		setWavefrontArgument(1, sizeof(cl_uint), &beforeAverageFrameWidth);
+		setWavefrontArgument(2, sizeof(cl_uint), &beforeAverageFrameHeight);
+	}
+
+	void setCameraPosition(nmath::Vector3f position) override {
+		setWavefrontArgument(3, sizeof(nmath::Vector3f), &position);
+	}
+
+	void setCameraRotation(nmath::Vector3f rotation) override {
+		nmath::Matrix4f rotationMatrix = nmath::Matrix4f::createRotation(rotation);
+		setWavefrontArgument(4, sizeof(nmath::Matrix4f), &rotationMatrix);
+	}
+
+	void setRayOrigin(float rayOrigin) override {
+		setWavefrontArgument(5, sizeof(float), &rayOrigin);
+	}
+
+	void setEntityHeap(cl_mem computeEntityHeap, uint64_t computeEntityHeapLength) override {
+		setWavefrontArgument(6, sizeof(cl_mem), &computeEntityHeap);
+	}
+
+	void setMaterialHeap(cl_mem computeMaterialHeap, uint64_t computeMaterialHeapLength) override {
+		setWavefrontArgument(7, sizeof(cl_mem), &computeMaterialHeap);
+	}
+
+	void setKDTree(nmath::Vector3f position, nmath::Vector3f size, cl_mem computeKDTreeNodeHeap, uint64_t computeKDTreeNodeHeapLength) override {
+		setWavefrontArgument(8, sizeof(nmath::Vector3f), &position);
+		setWavefrontArgument(9, sizeof(nmath::Vector3f), &size);
+	}
+
+	void setCompactKDTreeNodeHeap(cl_mem computeCompactKDTreeNodeHeap, uint64_t computeCompactKDTreeNodeHeapLength) override {
+		setWavefrontArgument(10, sizeof(cl_mem), &computeCompactKDTreeNodeHeap);
+		setWavefrontArgument(11, sizeof(uint64_t), &computeCompactKDTreeNodeHeapLength);
+	}
+
+	void setLeafSphereHeap(cl_mem computeLeafSphereHeap, cl_mem computeLeafEntityIndexHeap, uint64_t computeLeafSphereHeapLength) override {
+		setWavefrontArgument(12, sizeof(cl_mem), &computeLeafSphereHeap);
+		setWavefrontArgument(13, sizeof(cl_mem), &computeLeafEntityIndexHeap);
+	}
+
+	void setSampleIndex(uint32_t sampleIndex) override {
+		setWavefrontArgument(14, sizeof(uint32_t), &sampleIndex);
+	}
+
+	void setSamplesPerPixelSideLength(uint16_t samplesPerPixelSideLength) override {
+		this->samplesPerPixelSideLength = samplesPerPixelSideLength;
+		setWavefrontArgument(15, sizeof(uint16_t), &samplesPerPixelSideLength);
+	}
+
+	void setAccumulationFrame(cl_mem computeAccumulationFrame, uint32_t accumulatedFrameCount) override {
+		setWavefrontArgument(16, sizeof(cl_mem), &computeAccumulationFrame);
+		setWavefrontArgument(17, sizeof(uint32_t), &accumulatedFrameCount);
+	}
+
+	// NOTE: The wavefront kernels don't need these, they only go through the compact tree and the leaf spheres.
+	void setLeafObjectHeap(cl_mem computeLeafObjectHeap, uint64_t computeLeafObjectHeapLength) override { }
+	void setKDTreeRopeHeap(cl_mem computeKDTreeRopeHeap, uint64_t computeKDTreeRopeHeapLength) override { }
+	void setLightHeap(cl_mem computeLightHeap, uint64_t computeLightHeapLength) override { }
+	void setMaterialHeapOffset(uint64_t computeMaterialHeapOffset) override { }
+};
@@ -0,0 +1,146 @@
+#include "WorkGroupAutotuner.h"
+
+#include "ProgramBinaryCache.h"
+#include "Shader.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+bool WorkGroupAutotuner::enabled = true;
+uint32_t WorkGroupAutotuner::measuredLaunchCount = 4;
+
+// NOTE: Goes into the file name hash, bump it whenever the file layout changes.
+static constexpr char profileFileMagic[8] = { 'F', 'R', 'W', 'G', 'P', 'R', 'F', '1' };
+
+static bool getProfileFilePath(cl_device_id device, std::filesystem::path& path) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (char character : profileFileMagic) {
+		hash ^= (unsigned char)character;
+		hash *= 0x100000001B3ull;
+	}
+	if (!ProgramBinaryCache::hashDevice(device, hash) || !ProgramBinaryCache::getDirectory(path)) { return false; }
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), "%016llx.workgroups", (unsigned long long)hash);
+	path /= fileName;
+	return true;
+}
+
+bool WorkGroupAutotuner::getKernelName(cl_kernel kernel, std::string& kernelName) {
+	size_t size;
+	if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &size) != CL_SUCCESS || size == 0) { return false; }
+	std::vector<char> name(size);
+	if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size, name.data(), nullptr) != CL_SUCCESS) { return false; }
+	kernelName.assign(name.data());
+	return true;
+}
+
+bool WorkGroupAutotuner::fits(cl_device_id device, size_t maxWorkGroupSize, const size_t* localSize) {
+	if (localSize[0] == 0 || localSize[1] == 0 || localSize[0] * localSize[1] > maxWorkGroupSize) { return false; }
+	cl_uint dimensionCount;
+	if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(dimensionCount), &dimensionCount, nullptr) != CL_SUCCESS || dimensionCount < 2) { return false; }
+	std::vector<size_t> maxWorkItemSizes(dimensionCount);
+	if (clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, dimensionCount * sizeof(size_t), maxWorkItemSizes.data(), nullptr) != CL_SUCCESS) { return false; }
+	return localSize[0] <= maxWorkItemSizes[0] && localSize[1] <= maxWorkItemSizes[1];
+}
+
+bool WorkGroupAutotuner::load(cl_device_id device, WorkGroupProfile& profile) {
+	std::filesystem::path path;
+	if (!enabled || !getProfileFilePath(device, path)) { return false; }
+	FILE* file = fopen(path.string().c_str(), "r");
+	if (!file) { return false; }
+
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		char kernelName[128];
+		unsigned long long localSizeX, localSizeY;
+		if (sscanf(line, "%127s %llu %llu", kernelName, &localSizeX, &localSizeY) != 3 || localSizeX == 0 || localSizeY == 0) { continue; }
+		size_t localSize[2] = { (size_t)localSizeX, (size_t)localSizeY };
+		profile.set(kernelName, localSize);
+	}
+	fclose(file);
+	return true;
+}
+
+bool WorkGroupAutotuner::store(cl_device_id device, const WorkGroupProfile& profile) {
+	std::filesystem::path path;
+	if (!enabled || !getProfileFilePath(device, path)) { return false; }
+
+	std::error_code err;
+	std::filesystem::create_directories(path.parent_path(), err);
+	if (err) { return false; }
+
+	// NOTE: Same deal as ProgramBinaryCache::store, a temporary file that's unique across processes and a rename over the real one, so nobody ever reads half a profile.
+	uint64_t uniqueValue = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)std::hash<std::thread::id>{}(std::this_thread::get_id());
+	char temporarySuffix[32];
+	snprintf(temporarySuffix, sizeof(temporarySuffix), ".%016llx.tmp", (unsigned long long)uniqueValue);
+	std::filesystem::path temporaryPath = path;
+	temporaryPath += temporarySuffix;
+
+	FILE* file = fopen(temporaryPath.string().c_str(), "w");
+	if (!file) { return false; }
+	bool successful = true;
+	for (const WorkGroupProfileEntry& entry : profile.entries) {
+		if (fprintf(file, "%s %zu %zu\n", entry.kernelName.c_str(), entry.localSize[0], entry.localSize[1]) < 0) { successful = false; }
+	}
+	if (fclose(file) != 0) { successful = false; }
+
+	if (successful) {
+		std::filesystem::rename(temporaryPath, path, err);
+		successful = !err;
+	}
+	if (!successful) { std::filesystem::remove(temporaryPath, err); }
+	return successful;
+}
+
+bool WorkGroupAutotuner::tune(cl_command_queue commandQueue, cl_device_id device, size_t maxWorkGroupSize, size_t width, size_t height,
+							  const std::function<cl_int(const size_t* globalSize, const size_t* localSize)>& enqueueLaunch, size_t* localSize) {
+	struct Candidate {
+		size_t localSize[2];
+	};
+	std::vector<Candidate> candidates;
+	candidates.push_back({ { localSize[0], localSize[1] } });
+	candidates.push_back({ { maxWorkGroupSize, 1 } });
+	for (size_t workItemCount = 16; workItemCount <= 1024; workItemCount *= 2) {
+		for (size_t rowCount = 1; rowCount <= 16 && rowCount * rowCount <= workItemCount; rowCount *= 2) {
+			candidates.push_back({ { workItemCount / rowCount, rowCount } });
+		}
+	}
+
+	// NOTE: The clock starts after the warm-up launch is done, so it only sees the measured launches. Host time is good enough at this length and doesn't need a profiling queue.
+	bool anyMeasured = false;
+	double bestMilliseconds = 0;
+	size_t bestLocalSize[2];
+	for (size_t i = 0; i < candidates.size(); i++) {
+		const size_t* candidateLocalSize = candidates[i].localSize;
+		bool alreadyMeasured = false;
+		for (size_t j = 0; j < i; j++) { alreadyMeasured |= candidates[j].localSize[0] == candidateLocalSize[0] && candidates[j].localSize[1] == candidateLocalSize[1]; }
+		if (alreadyMeasured || !fits(device, maxWorkGroupSize, candidateLocalSize)) { continue; }
+
+		size_t globalSize[2];
+		Shader::getGlobalSize(candidateLocalSize, width, height, globalSize);
+		if (enqueueLaunch(globalSize, candidateLocalSize) != CL_SUCCESS || clFinish(commandQueue) != CL_SUCCESS) { clFinish(commandQueue); continue; }
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool launched = true;
+		for (uint32_t j = 0; j < measuredLaunchCount && launched; j++) { launched = enqueueLaunch(globalSize, candidateLocalSize) == CL_SUCCESS; }
+		if (clFinish(commandQueue) != CL_SUCCESS || !launched) { continue; }
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		if (!anyMeasured || milliseconds < bestMilliseconds) {
+			bestMilliseconds = milliseconds;
+			bestLocalSize[0] = candidateLocalSize[0];
+			bestLocalSize[1] = candidateLocalSize[1];
+			anyMeasured = true;
+		}
+	}
+
+	if (!anyMeasured) { return false; }
+	localSize[0] = bestLocalSize[0];
+	localSize[1] = bestLocalSize[1];
+	return true;
+}
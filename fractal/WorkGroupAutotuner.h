@@ -0,0 +1,78 @@
+#pragma once
+
+#include "cl_bindings_and_helpers.h"
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <functional>
+
+/*
+
+NOTE: Work group shapes that were measured on a device, by kernel name. CL_KERNEL_WORK_GROUP_SIZE is only the biggest work group the kernel can do,
+	which often isn't the fastest one, so Renderer::autotuneWorkGroups measures a couple of shapes and WorkGroupAutotuner keeps the winners around.
+	- Every entry is a 2D local size. Entries for kernels that the current renderer doesn't use just get carried along, so that switching shaders
+		doesn't throw away what was measured for the other ones.
+
+*/
+struct WorkGroupProfileEntry {
+	std::string kernelName;
+	size_t localSize[2];
+};
+
+class WorkGroupProfile {
+public:
+	std::vector<WorkGroupProfileEntry> entries;
+
+	bool get(const std::string& kernelName, size_t* localSize) const {
+		for (const WorkGroupProfileEntry& entry : entries) {
+			if (entry.kernelName == kernelName) { localSize[0] = entry.localSize[0]; localSize[1] = entry.localSize[1]; return true; }
+		}
+		return false;
+	}
+
+	void set(const std::string& kernelName, const size_t* localSize) {
+		for (WorkGroupProfileEntry& entry : entries) {
+			if (entry.kernelName == kernelName) { entry.localSize[0] = localSize[0]; entry.localSize[1] = localSize[1]; return; }
+		}
+		entries.push_back({ kernelName, { localSize[0], localSize[1] } });
+	}
+};
+
+/*
+
+NOTE: Measures work group shapes and keeps the per-device profiles on disk.
+	- The profiles live next to the program binaries (ProgramBinaryCache::getDirectory), one text file per device and driver, named after
+		ProgramBinaryCache::hashDevice. A driver update means a new file, so the shapes get measured again for it.
+	- The file is one "<kernel name> <x> <y>" line per kernel, so it can be looked at and edited by hand. Lines that don't parse get skipped.
+	- The shapes are keyed by the kernel's function name. The variants of a kernel (DefaultShaderVariant) share one entry.
+	- Same as the program cache, everything in here is best effort. A missing or broken profile just means the default shapes.
+
+*/
+class WorkGroupAutotuner {
+public:
+	static bool enabled;										// NOTE: Off means Renderer::init doesn't load anything and nothing gets stored.
+	static uint32_t measuredLaunchCount;						// NOTE: How many launches every candidate gets timed over, after one launch to warm up.
+
+	static bool getKernelName(cl_kernel kernel, std::string& kernelName);
+	// NOTE: Whether localSize is a work group that the device can launch kernels with at most maxWorkGroupSize work items with.
+	static bool fits(cl_device_id device, size_t maxWorkGroupSize, const size_t* localSize);
+
+	static bool load(cl_device_id device, WorkGroupProfile& profile);
+	static bool store(cl_device_id device, const WorkGroupProfile& profile);
+
+	/*
+
+	NOTE: Times every candidate shape for a width x height launch and puts the fastest one into localSize.
+		- localSize goes in as the shape that's in use right now. It's the first candidate, the others have to beat it.
+		- The candidates are the power of two shapes with 16 to 1024 work items that fit (see fits), at most 16 rows and never taller than wide,
+			plus the full maxWorkGroupSize strip that the renderers use without a profile.
+		- enqueueLaunch enqueues one launch with the global and local size it gets. A candidate it fails for (CL_INVALID_WORK_GROUP_SIZE and such) gets skipped.
+		- Every candidate waits for the queue with clFinish, so there can't be anything else in flight on it.
+		- Returns false if none of the candidates could be launched, localSize stays as it was then.
+
+	*/
+	static bool tune(cl_command_queue commandQueue, cl_device_id device, size_t maxWorkGroupSize, size_t width, size_t height,
+					 const std::function<cl_int(const size_t* globalSize, const size_t* localSize)>& enqueueLaunch, size_t* localSize);
+};
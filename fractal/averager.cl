@@ -1,19 +1,63 @@
+// NOTE: Same as in raytracer.cl, the averaging shaders put SAMPLES_PER_PIXEL_SIDE_LENGTH in front of the source so that the loops unroll. The argument stays either way.
+#ifdef SAMPLES_PER_PIXEL_SIDE_LENGTH
+#define SAMPLE_SIDE_LENGTH SAMPLES_PER_PIXEL_SIDE_LENGTH
+#else
+#define SAMPLE_SIDE_LENGTH samplesPerPixelSideLength
+#endif
+
 __kernel void doAverage(__read_only image2d_t beforeAverageFrame, uint beforeAverageFrameWidth, uint beforeAverageFrameHeight, 
 						ushort samplesPerPixelSideLength, __write_only image2d_t frame, uint frameWidth, uint frameHeight) {
 
-	int x = get_global_id(0);
-	if (x >= frameWidth) { return; }                    // WARNING: Comparison of signed with unsigned. Only works when both are positive like they are here.
-	int2 coords = (int2)(x, get_global_id(1));          // REASON: signed is converted into unsigned, causing negative numbers to be super large.
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	// WARNING: Comparison of signed with unsigned. Only works when both are positive like they are here.
+	// REASON: signed is converted into unsigned, causing negative numbers to be super large.
+	if (coords.x >= frameWidth || coords.y >= frameHeight) { return; }
 
-	int2 beforeAverageCoords = coords * samplesPerPixelSideLength;
+	int2 beforeAverageCoords = coords * SAMPLE_SIDE_LENGTH;
 
 	uint4 color = (uint4)(0, 0, 0, 1);
-	for (ushort y = 0; y < samplesPerPixelSideLength; y++) {
-		for (ushort x = 0; x < samplesPerPixelSideLength; x++) {
+	for (ushort y = 0; y < SAMPLE_SIDE_LENGTH; y++) {
+		for (ushort x = 0; x < SAMPLE_SIDE_LENGTH; x++) {
 			color += read_imageui(beforeAverageFrame, (int2)(beforeAverageCoords.x + x, beforeAverageCoords.y + y));
 		}
 	}
 
-	write_imageui(frame, coords, color / (samplesPerPixelSideLength * samplesPerPixelSideLength));
+	write_imageui(frame, coords, color / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH));
+
+}
+
+/*
+
+NOTE: Same as doAverage, except that the averaged frame also gets mixed into a running mean of all the frames since the last reset.
+	- accumulatedFrameCount is the number of frames that are already in the mean. 0 means the accumulation got reset, in which case we
+		just overwrite whatever is in there, so the buffer never needs to be cleared.
+	- We keep the mean instead of the sum so that the floats stay in the same range no matter how long the view stays still.
+
+*/
+__kernel void doAccumulate(__read_only image2d_t beforeAverageFrame, uint beforeAverageFrameWidth, uint beforeAverageFrameHeight, 
+							ushort samplesPerPixelSideLength, __write_only image2d_t frame, uint frameWidth, uint frameHeight, 
+							__global float4* accumulationFrame, uint accumulatedFrameCount) {
+
+	int2 coords = (int2)(get_global_id(0), get_global_id(1));
+	if (coords.x >= frameWidth || coords.y >= frameHeight) { return; }
+
+	int2 beforeAverageCoords = coords * SAMPLE_SIDE_LENGTH;
+
+	float4 color = (float4)(0, 0, 0, 0);
+	for (ushort y = 0; y < SAMPLE_SIDE_LENGTH; y++) {
+		for (ushort x = 0; x < SAMPLE_SIDE_LENGTH; x++) {
+			color += convert_float4(read_imageui(beforeAverageFrame, (int2)(beforeAverageCoords.x + x, beforeAverageCoords.y + y)));
+		}
+	}
+	color /= SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH;
+
+	size_t accumulationIndex = (size_t)coords.y * frameWidth + coords.x;
+	if (accumulatedFrameCount != 0) {
+		float4 mean = accumulationFrame[accumulationIndex];
+		color = mean + (color - mean) / (accumulatedFrameCount + 1);
+	}
+	accumulationFrame[accumulationIndex] = color;
+
+	write_imageui(frame, coords, convert_uint4_sat_rte(color));
 
 }
\ No newline at end of file
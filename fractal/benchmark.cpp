@@ -0,0 +1,609 @@
+/*
+
+NOTE: Benchmark suite. Generates synthetic sphere scenes, times the kd-tree build, the scene upload and the rendering, and writes everything out as JSON so that runs can be diffed against each other.
+	- This is its own executable, same as headless, so it isn't part of fractal.vcxproj. On Linux, it's the benchmark target of CMakeLists.txt:
+		cmake -S . -B build && cmake --build build --target benchmark
+	- Every scene comes from its own seeded generator, so the same options give the same scenes, the same trees and the same frames on every machine.
+	- Renderer picks the best device it finds. On a box with only a CPU platform like POCL that's the CPU, --require-cpu makes sure of it, which is what the regression runs should use.
+	- The native fallback is off by default, the numbers should come from an OpenCL device. --native-fallback turns it back on, the JSON says which backend ran.
+	- The CMake build embeds the kernels through embed_kernels.py, so the executable doesn't need raytracer.cl next to it. Built programs get cached on disk, see ProgramBinaryCache.
+
+	Usage: benchmark [options]
+		--scenes <list>				comma separated generators out of grid, clustered and huge, default all of them
+		--sizes <list>				comma separated entity counts, default 1000,10000,100000,1000000
+		--resolutions <list>			comma separated <w>x<h>, default 640x360,1280x720,1920x1080
+		--spp <list>				comma separated samples per pixel side lengths, default 1,2
+		--frames <n>				measured frames per resolution, default 10
+		--warmup <n>				frames that get thrown away before measuring, default 2
+		--traversal <type>			parent, ropes or compact, default parent
+		--wavefront				trace with WavefrontShader instead of the megakernel, which always uses the compact tree, so --traversal doesn't matter then
+		--persistent <list>			comma separated persistent threads batch sizes in pixels, 0 for one per work item. Every resolution then gets measured with the
+							normal dispatch first and then once per batch size, so the renders can be compared right in the JSON. Not with --wavefront
+		--tile <n>				trace in n x n tiles, 0 (the default) picks the side length for the device, 1 traces in strips. The JSON has what the device got
+		--morton				walk the tiles in Z-order, see DefaultShaderVariant::mortonTileOrder
+		--autotune				measure the work group shapes on the first scene if the device has no profile yet, see Renderer::autotuneWorkGroups.
+							The profile replaces --tile's shape. The JSON has the shape the trace ran with either way
+		--out <file>				where the JSON goes, default stdout
+		--require-cpu				fail if the device isn't a CPU
+		--native-fallback			allow Renderer to fall back to NativeRaytracer
+		--compare-native			render one more frame per render on NativeRaytracer as well and put how far it is from the kernel's frame into the JSON.
+							Does nothing if the native backend is what ran in the first place
+
+	Progress goes to stderr.
+
+*/
+
+#include "Renderer.h"
+#include "DefaultShader.h"
+#include "WavefrontShader.h"
+#include "Camera.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+enum class SceneGenerator {
+	GRID,								// NOTE: Equal spheres on a cubic lattice. Every leaf ends up with about the same amount of work.
+	CLUSTERED,							// NOTE: Random clouds around random centers with mostly empty space in between, which is what the SAH builder is supposed to be good at.
+	HUGE_AND_TINY						// NOTE: One sphere that covers a big part of the scene plus lots of tiny ones. The huge one ends up in a lot of leaves, which is the bad case for the leaf sphere tests.
+};
+
+static const char* const sceneGeneratorNames[] = { "grid", "clustered", "huge" };
+
+struct BenchmarkResolution {
+	uint32_t width;
+	uint32_t height;
+};
+
+struct BenchmarkOptions {
+	std::vector<SceneGenerator> sceneGenerators = { SceneGenerator::GRID, SceneGenerator::CLUSTERED, SceneGenerator::HUGE_AND_TINY };
+	std::vector<size_t> entityCounts = { 1000, 10000, 100000, 1000000 };
+	std::vector<BenchmarkResolution> resolutions = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+	std::vector<uint16_t> samplesPerPixelSideLengths = { 1, 2 };
+	uint32_t frameCount = 10;
+	uint32_t warmupFrameCount = 2;
+	KDTreeTraversalType traversalType = KDTreeTraversalType::PARENT_LINKS;
+	bool wavefront = false;
+	std::vector<uint32_t> persistentBatchSizes;
+	uint8_t tileSideLength = 0;
+	bool mortonTileOrder = false;
+	bool autotune = false;
+	const char* outputFile = nullptr;
+	bool requireCPU = false;
+	bool nativeFallback = false;
+	bool compareNative = false;
+};
+
+struct RenderResult {
+	BenchmarkResolution resolution;
+	bool persistentThreads;
+	uint32_t persistentBatchSize;
+	double meanFrameMilliseconds;
+	double minFrameMilliseconds;
+	double maxFrameMilliseconds;
+	double megaRaysPerSecond;
+	bool nativeCompared;
+	uint32_t maxNativeChannelDifference;				// NOTE: Over the color channels of every pixel, 0 to 255.
+	double meanNativeChannelDifference;
+	double differingNativePixelFraction;				// NOTE: Pixels where any color channel differs at all.
+};
+
+struct SamplesPerPixelResult {
+	uint16_t samplesPerPixelSideLength;
+	double uploadMilliseconds;
+	std::vector<RenderResult> renders;
+};
+
+struct SceneResult {
+	SceneGenerator generator;
+	size_t entityCount;
+	uint64_t seed;
+	double buildMilliseconds;
+	size_t kdTreeNodeCount;
+	size_t leafObjectCount;
+	std::vector<SamplesPerPixelResult> runs;
+};
+
+// NOTE: splitmix64. Not rand, because rand's sequence depends on the C library, and the scenes have to be the same everywhere.
+class BenchmarkRandom {
+	uint64_t state;
+
+public:
+	BenchmarkRandom(uint64_t seed) : state(seed) { }
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	// NOTE: 24 random bits, so every value is exactly representable and the result is in [0, 1).
+	float nextFloat() { return (next() >> 40) * (1.0f / 16777216.0f); }
+	float nextFloat(float min, float max) { return min + nextFloat() * (max - min); }
+
+	// NOTE: Sum of uniforms, roughly normal with a standard deviation of 1. Good enough for clouds and doesn't need any libm calls, so it's the same on every platform.
+	float nextCentered() { return (nextFloat() + nextFloat() + nextFloat() + nextFloat() - 2) * 1.7320508f; }
+};
+
+static constexpr uint32_t benchmarkMaterialCount = 4;
+
+// NOTE: Integer on purpose, cbrt isn't guaranteed to round the same way everywhere and one ulp is enough to land on the other side of a ceil.
+static size_t getCeilCubeRoot(size_t value) {
+	size_t root = 1;
+	while (root * root * root < value) { root++; }
+	return root;
+}
+
+// NOTE: Every scene fills a cube of about the same density, the side length grows with the cube root of the entity count.
+static float getSceneExtent(size_t entityCount) { return 4.0f * getCeilCubeRoot(entityCount); }
+
+static uint64_t getSceneSeed(SceneGenerator generator, size_t entityCount) { return ((uint64_t)generator + 1) * 0x100000000ull + entityCount; }
+
+static Entity makeEntity(nmath::Vector3f position, float radius, uint32_t material) {
+	Entity entity;
+	entity.position = position;
+	entity.scale = nmath::Vector3f(radius, 0, 0);
+	entity.material = material;
+	return entity;
+}
+
+static float clampToScene(float value, float sceneExtent) { return std::min(std::max(value, 0.0f), sceneExtent); }
+
+// NOTE: scene has to come in with the entityCount entities and the lights already allocated.
+static void generateScene(SceneGenerator generator, size_t entityCount, Scene& scene) {
+	BenchmarkRandom random(getSceneSeed(generator, entityCount));
+	float sceneExtent = getSceneExtent(entityCount);
+
+	switch (generator) {
+	case SceneGenerator::GRID:
+		{
+			size_t sideLength = getCeilCubeRoot(entityCount);
+			float spacing = sceneExtent / sideLength;
+			for (size_t i = 0; i < entityCount; i++) {
+				size_t x = i % sideLength;
+				size_t y = i / sideLength % sideLength;
+				size_t z = i / (sideLength * sideLength);
+				scene.entityHeap[i] = makeEntity(nmath::Vector3f((x + 0.5f) * spacing, (y + 0.5f) * spacing, (z + 0.5f) * spacing), spacing / 4, i % benchmarkMaterialCount);
+			}
+		}
+		break;
+	case SceneGenerator::CLUSTERED:
+		{
+			// NOTE: About 2048 spheres per cluster, the clouds are tight enough that most of the scene is empty.
+			size_t clusterCount = std::max<size_t>(1, entityCount / 2048);
+			float clusterSpread = sceneExtent / (8 * getCeilCubeRoot(clusterCount));
+			std::vector<nmath::Vector3f> clusterCenters(clusterCount);
+			for (nmath::Vector3f& center : clusterCenters) { center = nmath::Vector3f(random.nextFloat(0, sceneExtent), random.nextFloat(0, sceneExtent), random.nextFloat(0, sceneExtent)); }
+			for (size_t i = 0; i < entityCount; i++) {
+				const nmath::Vector3f& center = clusterCenters[random.next() % clusterCount];
+				nmath::Vector3f position(clampToScene(center.x + random.nextCentered() * clusterSpread, sceneExtent),
+										 clampToScene(center.y + random.nextCentered() * clusterSpread, sceneExtent),
+										 clampToScene(center.z + random.nextCentered() * clusterSpread, sceneExtent));
+				scene.entityHeap[i] = makeEntity(position, random.nextFloat(0.25f, 1), random.next() % benchmarkMaterialCount);
+			}
+		}
+		break;
+	case SceneGenerator::HUGE_AND_TINY:
+		scene.entityHeap[0] = makeEntity(nmath::Vector3f(sceneExtent / 2, sceneExtent / 2, sceneExtent / 2), sceneExtent / 4, 0);
+		for (size_t i = 1; i < entityCount; i++) {
+			nmath::Vector3f position(random.nextFloat(0, sceneExtent), random.nextFloat(0, sceneExtent), random.nextFloat(0, sceneExtent));
+			scene.entityHeap[i] = makeEntity(position, 0.1f, random.next() % benchmarkMaterialCount);
+		}
+		break;
+	}
+
+	// NOTE: Four white lights above the corners in front of the camera, so the shadow rays go all the way through the scene.
+	for (uint64_t i = 0; i < scene.lightHeapLength; i++) {
+		Light light;
+		light.position = nmath::Vector3f((i & 1) ? sceneExtent * 1.25f : -sceneExtent * 0.25f, sceneExtent * 1.25f, (i & 2) ? sceneExtent * 1.25f : sceneExtent * 0.5f);
+		light.color = nmath::Vector3f(1, 1, 1);
+		scene.lightHeap[i] = light;
+	}
+}
+
+static void loadResources() {
+	ResourceHeap resources(0, benchmarkMaterialCount);
+	const nmath::Vector3f colors[benchmarkMaterialCount] = { { 0.8f, 0.8f, 0.8f }, { 0.9f, 0.3f, 0.3f }, { 0.3f, 0.9f, 0.3f }, { 0.3f, 0.3f, 0.9f } };
+	const float reflectivities[benchmarkMaterialCount] = { 0.9f, 0.5f, 0.2f, 0 };
+	for (uint32_t i = 0; i < benchmarkMaterialCount; i++) {
+		resources.materialHeap[i].color = colors[i];
+		resources.materialHeap[i].reflectivity = reflectivities[i];
+	}
+	Renderer::loadResources(std::move(resources));
+}
+
+// NOTE: In front of the cube, looking down -z at its center. The whole front face is in view with a FOV of 90.
+static Camera getSceneCamera(size_t entityCount) {
+	float sceneExtent = getSceneExtent(entityCount);
+	return Camera({ sceneExtent / 2, sceneExtent / 2, sceneExtent * 1.6f }, { 0, 0, 0 }, 90);
+}
+
+template <typename T, typename ParseElement>
+static bool parseList(const char* list, std::vector<T>& elements, ParseElement parseElement) {
+	elements.clear();
+	std::string remaining = list;
+	size_t begin = 0;
+	while (true) {
+		size_t end = remaining.find(',', begin);
+		std::string element = remaining.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+		T value;
+		if (!parseElement(element.c_str(), value)) { fprintf(stderr, "invalid list element \"%s\"\n", element.c_str()); return false; }
+		elements.push_back(value);
+		if (end == std::string::npos) { break; }
+		begin = end + 1;
+	}
+	return true;
+}
+
+static bool parseSceneGenerator(const char* name, SceneGenerator& generator) {
+	for (size_t i = 0; i < sizeof(sceneGeneratorNames) / sizeof(sceneGeneratorNames[0]); i++) {
+		if (!strcmp(name, sceneGeneratorNames[i])) { generator = (SceneGenerator)i; return true; }
+	}
+	return false;
+}
+
+static bool parseEntityCount(const char* text, size_t& entityCount) {
+	char* end;
+	entityCount = strtoull(text, &end, 10);
+	return end != text && *end == '\0' && entityCount != 0;
+}
+
+static bool parsePersistentBatchSize(const char* text, uint32_t& batchSize) {
+	char* end;
+	unsigned long long value = strtoull(text, &end, 10);
+	if (end == text || *end != '\0' || value > UINT32_MAX) { return false; }
+	batchSize = (uint32_t)value;
+	return true;
+}
+
+static bool parseResolution(const char* text, BenchmarkResolution& resolution) {
+	return sscanf(text, "%ux%u", &resolution.width, &resolution.height) == 2 && resolution.width != 0 && resolution.height != 0;
+}
+
+static bool parseSamplesPerPixelSideLength(const char* text, uint16_t& samplesPerPixelSideLength) {
+	int value = atoi(text);
+	if (value <= 0 || value > UINT16_MAX) { return false; }
+	samplesPerPixelSideLength = (uint16_t)value;
+	return true;
+}
+
+static bool parseOptions(int argc, char** argv, BenchmarkOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		const char* option = argv[i];
+		if (!strcmp(option, "--require-cpu")) { options.requireCPU = true; continue; }
+		if (!strcmp(option, "--native-fallback")) { options.nativeFallback = true; continue; }
+		if (!strcmp(option, "--wavefront")) { options.wavefront = true; continue; }
+		if (!strcmp(option, "--morton")) { options.mortonTileOrder = true; continue; }
+		if (!strcmp(option, "--autotune")) { options.autotune = true; continue; }
+		if (!strcmp(option, "--compare-native")) { options.compareNative = true; continue; }
+		if (i + 1 >= argc) { fprintf(stderr, "missing value for %s\n", option); return false; }
+		const char* value = argv[++i];
+		if (!strcmp(option, "--scenes")) { if (!parseList(value, options.sceneGenerators, parseSceneGenerator)) { return false; } }
+		else if (!strcmp(option, "--sizes")) { if (!parseList(value, options.entityCounts, parseEntityCount)) { return false; } }
+		else if (!strcmp(option, "--resolutions")) { if (!parseList(value, options.resolutions, parseResolution)) { return false; } }
+		else if (!strcmp(option, "--spp")) { if (!parseList(value, options.samplesPerPixelSideLengths, parseSamplesPerPixelSideLength)) { return false; } }
+		else if (!strcmp(option, "--frames")) { options.frameCount = atoi(value); }
+		else if (!strcmp(option, "--warmup")) { options.warmupFrameCount = atoi(value); }
+		else if (!strcmp(option, "--out")) { options.outputFile = value; }
+		else if (!strcmp(option, "--tile")) {
+			unsigned long sideLength = strtoul(value, nullptr, 10);
+			if (sideLength > UINT8_MAX) { fprintf(stderr, "invalid tile side length %s\n", value); return false; }
+			options.tileSideLength = (uint8_t)sideLength;
+		}
+		else if (!strcmp(option, "--persistent")) { if (!parseList(value, options.persistentBatchSizes, parsePersistentBatchSize)) { return false; } }
+		else if (!strcmp(option, "--traversal")) {
+			if (!strcmp(value, "parent")) { options.traversalType = KDTreeTraversalType::PARENT_LINKS; }
+			else if (!strcmp(value, "ropes")) { options.traversalType = KDTreeTraversalType::ROPES; }
+			else if (!strcmp(value, "compact")) { options.traversalType = KDTreeTraversalType::COMPACT_RESTART; }
+			else { fprintf(stderr, "unknown traversal type %s\n", value); return false; }
+		}
+		else { fprintf(stderr, "unknown option %s\n", option); return false; }
+	}
+	if (options.frameCount == 0) { fprintf(stderr, "need at least one measured frame\n"); return false; }
+	if (options.wavefront && !options.persistentBatchSizes.empty()) { fprintf(stderr, "--persistent only works with the megakernel\n"); return false; }
+	if (options.wavefront && (options.tileSideLength != 0 || options.mortonTileOrder)) { fprintf(stderr, "--tile and --morton only work with the megakernel\n"); return false; }
+	return true;
+}
+
+static const char* getTraversalTypeName(const BenchmarkOptions& options) {
+	if (options.wavefront) { return "wavefront"; }
+	switch (options.traversalType) {
+	case KDTreeTraversalType::PARENT_LINKS: return "parent";
+	case KDTreeTraversalType::ROPES: return "ropes";
+	case KDTreeTraversalType::COMPACT_RESTART: return "compact";
+	}
+	return "unknown";
+}
+
+struct DeviceDescription {
+	std::string name = "native";
+	const char* type = "cpu";
+	const char* backend = "native";
+	size_t traceLocalSize[2] = { 1, 1 };
+};
+
+static DeviceDescription describeDevice() {
+	DeviceDescription description;
+	if (Renderer::nativeBackendActive) { return description; }
+	description.backend = "opencl";
+
+	size_t nameSize;
+	if (clGetDeviceInfo(Renderer::computeDevice, CL_DEVICE_NAME, 0, nullptr, &nameSize) == CL_SUCCESS && nameSize != 0) {
+		std::vector<char> name(nameSize);
+		if (clGetDeviceInfo(Renderer::computeDevice, CL_DEVICE_NAME, nameSize, name.data(), nullptr) == CL_SUCCESS) { description.name = name.data(); }
+	}
+	cl_device_type type;
+	if (clGetDeviceInfo(Renderer::computeDevice, CL_DEVICE_TYPE, sizeof(type), &type, nullptr) != CL_SUCCESS) { description.type = "unknown"; }
+	else if (type & CL_DEVICE_TYPE_CPU) { description.type = "cpu"; }
+	else if (type & CL_DEVICE_TYPE_GPU) { description.type = "gpu"; }
+	else { description.type = "other"; }
+	return description;
+}
+
+using benchmark_clock = std::chrono::steady_clock;
+
+static double getMillisecondsSince(benchmark_clock::time_point start) { return std::chrono::duration<double, std::milli>(benchmark_clock::now() - start).count(); }
+
+// NOTE: Frame N + 1 is always in flight while we wait for frame N, same as headless and the window, so the time between two retrieves is the time the device needs for one frame.
+static ErrorCode measureRender(const BenchmarkOptions& options, uint16_t samplesPerPixelSideLength, RenderResult& result) {
+	uint32_t totalFrameCount = options.warmupFrameCount + options.frameCount;
+	std::vector<double> frameMilliseconds;
+	frameMilliseconds.reserve(options.frameCount);
+
+	ErrorCode err = Renderer::submitFrame();
+	if (err != ErrorCode::SUCCESS) { return err; }
+	benchmark_clock::time_point lastFrameEnd = benchmark_clock::now();
+	for (uint32_t frameIndex = 0; frameIndex < totalFrameCount; frameIndex++) {
+		if (frameIndex + 1 < totalFrameCount) {
+			err = Renderer::submitFrame();
+			if (err != ErrorCode::SUCCESS) { break; }
+		}
+		err = Renderer::retrieveFrame();
+		if (err != ErrorCode::SUCCESS) { break; }
+		benchmark_clock::time_point frameEnd = benchmark_clock::now();
+		// NOTE: The first measured interval starts at the last warmup retrieve, so it's already a steady state one.
+		if (frameIndex >= options.warmupFrameCount) { frameMilliseconds.push_back(std::chrono::duration<double, std::milli>(frameEnd - lastFrameEnd).count()); }
+		lastFrameEnd = frameEnd;
+	}
+	if (err != ErrorCode::SUCCESS) { Renderer::finishFramePipeline(); return err; }
+
+	double sum = 0;
+	for (double milliseconds : frameMilliseconds) { sum += milliseconds; }
+	result.meanFrameMilliseconds = sum / frameMilliseconds.size();
+	result.minFrameMilliseconds = *std::min_element(frameMilliseconds.begin(), frameMilliseconds.end());
+	result.maxFrameMilliseconds = *std::max_element(frameMilliseconds.begin(), frameMilliseconds.end());
+	// NOTE: Only counts camera rays. The bounce and shadow rays depend on what gets hit, so they'd make the number incomparable between scenes.
+	double cameraRayCount = (double)result.resolution.width * result.resolution.height * samplesPerPixelSideLength * samplesPerPixelSideLength;
+	result.megaRaysPerSecond = cameraRayCount / (result.meanFrameMilliseconds * 1000);
+	return ErrorCode::SUCCESS;
+}
+
+/*
+
+NOTE: Renders one more frame on the device and the same frame on NativeRaytracer, then compares the two.
+	- Same camera, ray origin, seeds, sample grid and bounces, so both trace the same rays. Whatever differs comes from the device doing the float math differently
+		(contractions, native divisions), which is usually a channel off by one and sometimes a bounce that goes somewhere else entirely.
+	- That's the megakernel. WavefrontShader seeds every sub-sample on its own, so past the first sub-sample its rays are different ones and a lot more differs.
+	- The kernel rounds without accumulation, so does NativeRaytracer. Accumulation is off in here anyway.
+
+*/
+static ErrorCode compareWithNative(NativeRaytracer& nativeRaytracer, const RaytracingShader& raytracingShader, uint16_t samplesPerPixelSideLength, const Camera& camera, RenderResult& result) {
+	ErrorCode err = Renderer::render();
+	if (err != ErrorCode::SUCCESS) { return err; }
+	Renderer::FrameView frameView = Renderer::getFrameView();
+
+	nativeRaytracer.setCameraPosition(camera.position);
+	nativeRaytracer.setCameraRotation(camera.rotation);
+	nativeRaytracer.setRayOrigin(Renderer::getRayOrigin());
+	nativeRaytracer.setSampleIndex(0);
+	nativeRaytracer.setSamplesPerPixelSideLength(samplesPerPixelSideLength);
+	nativeRaytracer.setMaxBounces(raytracingShader.getMaxBounces());
+	nativeRaytracer.setAccumulation(false, 0);
+	std::vector<char> nativeFrame((size_t)frameView.width * frameView.height * frameView.bytesPerPixel);
+	nativeRaytracer.render(Renderer::scene, Renderer::resources, nativeFrame.data(), frameView.width, frameView.height, { frameView.bytesPerPixel, 0, 1, 2, -1 });			// NOTE: The frame is RGBA, see runSamplesPerPixel.
+
+	size_t pixelCount = (size_t)frameView.width * frameView.height;
+	uint32_t maxChannelDifference = 0;
+	uint64_t channelDifferenceSum = 0;
+	size_t differingPixelCount = 0;
+	for (size_t i = 0; i < pixelCount; i++) {
+		bool differs = false;
+		for (size_t channel = 0; channel < 3; channel++) {
+			size_t index = i * frameView.bytesPerPixel + channel;
+			uint32_t difference = (uint32_t)std::abs((int)(unsigned char)frameView.data[index] - (int)(unsigned char)nativeFrame[index]);
+			maxChannelDifference = std::max(maxChannelDifference, difference);
+			channelDifferenceSum += difference;
+			if (difference != 0) { differs = true; }
+		}
+		if (differs) { differingPixelCount++; }
+	}
+
+	result.nativeCompared = true;
+	result.maxNativeChannelDifference = maxChannelDifference;
+	result.meanNativeChannelDifference = (double)channelDifferenceSum / (pixelCount * 3);
+	result.differingNativePixelFraction = (double)differingPixelCount / pixelCount;
+	return ErrorCode::SUCCESS;
+}
+
+// NOTE: Renderer::scene has to hold the scene already. Everything else gets set up from scratch, so every run pays the same upload and compile costs.
+static bool runSamplesPerPixel(const BenchmarkOptions& options, RaytracingShader& raytracingShader, NativeRaytracer* nativeRaytracer, uint16_t samplesPerPixelSideLength, const Camera& camera,
+							   SamplesPerPixelResult& result, DeviceDescription& device) {
+	result.samplesPerPixelSideLength = samplesPerPixelSideLength;
+	const BenchmarkResolution& firstResolution = options.resolutions.front();
+	ErrorCode err = Renderer::init(&raytracingShader, samplesPerPixelSideLength, firstResolution.width, firstResolution.height, ImageChannelOrderType::RGBA, FrameResolveType::FUSED, 2, FrameMemoryType::AUTO);
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "renderer init failed: %d\n", (int)(int16_t)err); return false; }
+	Renderer::accumulationEnabled = false;
+
+	device = describeDevice();
+	if (options.requireCPU && strcmp(device.type, "cpu")) { fprintf(stderr, "device %s isn't a CPU\n", device.name.c_str()); Renderer::release(); return false; }
+
+	loadResources();
+	err = Renderer::transferResources();
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "resource transfer failed: %d\n", (int)(int16_t)err); Renderer::release(); return false; }
+
+	// NOTE: The staged uploads only wait for themselves on the next transfer, finishUploads makes sure that the time covers the whole copy.
+	Renderer::scene.markAllDirty();
+	benchmark_clock::time_point uploadStart = benchmark_clock::now();
+	err = Renderer::transferScene();
+	if (!Renderer::nativeBackendActive) { Renderer::deviceScene.finishUploads(); }
+	result.uploadMilliseconds = getMillisecondsSince(uploadStart);
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "scene transfer failed: %d\n", (int)(int16_t)err); Renderer::release(); return false; }
+
+	Renderer::loadCamera(camera);
+	Renderer::transferCameraPosition();
+	Renderer::transferCameraRotation();
+	Renderer::transferCameraFOV();
+
+	// NOTE: Once there's a profile for the device, autotuneWorkGroups doesn't measure anything anymore, so only the first run pays for it.
+	if (options.autotune) {
+		err = Renderer::autotuneWorkGroups();
+		if (err != ErrorCode::SUCCESS) { fprintf(stderr, "work group autotuning failed: %d\n", (int)(int16_t)err); Renderer::release(); return false; }
+	}
+	if (!Renderer::nativeBackendActive && raytracingShader.usesTraceLocalSize()) {
+		device.traceLocalSize[0] = Renderer::getTraceLocalSize()[0];
+		device.traceLocalSize[1] = Renderer::getTraceLocalSize()[1];
+	}
+
+	// NOTE: --persistent is only allowed without --wavefront, so the shader is the DefaultShader then. The native backend doesn't have dispatch modes, it just gets the normal run.
+	DefaultShader* defaultShader = options.persistentBatchSizes.empty() || Renderer::nativeBackendActive ? nullptr : dynamic_cast<DefaultShader*>(&raytracingShader);
+	size_t dispatchCount = defaultShader ? options.persistentBatchSizes.size() + 1 : 1;
+
+	for (size_t i = 0; i < options.resolutions.size(); i++) {
+		if (i != 0) { err = Renderer::resizeFrame(options.resolutions[i].width, options.resolutions[i].height); }
+		for (size_t j = 0; j < dispatchCount; j++) {
+			RenderResult render;
+			render.resolution = options.resolutions[i];
+			render.persistentThreads = j != 0;
+			render.persistentBatchSize = j != 0 ? options.persistentBatchSizes[j - 1] : 0;
+			render.nativeCompared = false;
+			if (err == ErrorCode::SUCCESS && defaultShader) {
+				DefaultShaderVariant variant = defaultShader->getVariant();
+				variant.persistentThreads = render.persistentThreads;
+				err = defaultShader->setVariant(variant);
+				defaultShader->setPersistentBatchSize(render.persistentBatchSize);
+			}
+			if (err == ErrorCode::SUCCESS) { err = measureRender(options, samplesPerPixelSideLength, render); }
+			if (err == ErrorCode::SUCCESS && nativeRaytracer && !Renderer::nativeBackendActive) { err = compareWithNative(*nativeRaytracer, raytracingShader, samplesPerPixelSideLength, camera, render); }
+			if (err != ErrorCode::SUCCESS) { fprintf(stderr, "rendering at %ux%u failed: %d\n", render.resolution.width, render.resolution.height, (int)(int16_t)err); Renderer::release(); return false; }
+			if (render.persistentThreads) {
+				fprintf(stderr, "\tspp %u, %ux%u, persistent batch %u: %.3f ms/frame, %.2f Mrays/s\n", samplesPerPixelSideLength, render.resolution.width, render.resolution.height,
+						render.persistentBatchSize, render.meanFrameMilliseconds, render.megaRaysPerSecond);
+			}
+			else { fprintf(stderr, "\tspp %u, %ux%u: %.3f ms/frame, %.2f Mrays/s\n", samplesPerPixelSideLength, render.resolution.width, render.resolution.height, render.meanFrameMilliseconds, render.megaRaysPerSecond); }
+			if (render.nativeCompared) {
+				fprintf(stderr, "\t\tnative: %.3f%% of the pixels differ, max channel difference %u, mean %.4f\n", render.differingNativePixelFraction * 100,
+						render.maxNativeChannelDifference, render.meanNativeChannelDifference);
+			}
+			result.renders.push_back(render);
+		}
+	}
+
+	if (!Renderer::release()) { fprintf(stderr, "renderer release failed\n"); return false; }
+	return true;
+}
+
+static void writeJSONString(FILE* file, const char* string) {
+	fputc('"', file);
+	for (const char* character = string; *character; character++) {
+		if (*character == '"' || *character == '\\') { fputc('\\', file); fputc(*character, file); }
+		else if ((unsigned char)*character < 0x20) { fprintf(file, "\\u%04x", (unsigned char)*character); }
+		else { fputc(*character, file); }
+	}
+	fputc('"', file);
+}
+
+static bool writeResults(const BenchmarkOptions& options, const DeviceDescription& device, const std::vector<SceneResult>& scenes) {
+	FILE* file = options.outputFile ? fopen(options.outputFile, "w") : stdout;
+	if (!file) { return false; }
+
+	fprintf(file, "{\n\t\"device\": { \"name\": ");
+	writeJSONString(file, device.name.c_str());
+	fprintf(file, ", \"type\": \"%s\", \"backend\": \"%s\", \"traceLocalSize\": [%zu, %zu] },\n", device.type, device.backend, device.traceLocalSize[0], device.traceLocalSize[1]);
+	fprintf(file, "\t\"mortonTileOrder\": %s,\n", options.mortonTileOrder ? "true" : "false");
+	fprintf(file, "\t\"traversal\": \"%s\",\n\t\"warmupFrames\": %u,\n\t\"measuredFrames\": %u,\n\t\"scenes\": [", getTraversalTypeName(options), options.warmupFrameCount, options.frameCount);
+	for (size_t i = 0; i < scenes.size(); i++) {
+		const SceneResult& scene = scenes[i];
+		fprintf(file, "%s\n\t\t{\n\t\t\t\"generator\": \"%s\", \"entities\": %zu, \"seed\": %llu,\n", i ? "," : "", sceneGeneratorNames[(size_t)scene.generator], scene.entityCount, (unsigned long long)scene.seed);
+		fprintf(file, "\t\t\t\"buildMs\": %.3f, \"kdTreeNodes\": %zu, \"leafObjects\": %zu,\n\t\t\t\"runs\": [", scene.buildMilliseconds, scene.kdTreeNodeCount, scene.leafObjectCount);
+		for (size_t j = 0; j < scene.runs.size(); j++) {
+			const SamplesPerPixelResult& run = scene.runs[j];
+			fprintf(file, "%s\n\t\t\t\t{ \"samplesPerPixelSideLength\": %u, \"uploadMs\": %.3f, \"renders\": [", j ? "," : "", run.samplesPerPixelSideLength, run.uploadMilliseconds);
+			for (size_t k = 0; k < run.renders.size(); k++) {
+				const RenderResult& render = run.renders[k];
+				fprintf(file, "%s\n\t\t\t\t\t{ \"width\": %u, \"height\": %u, ", k ? "," : "", render.resolution.width, render.resolution.height);
+				if (render.persistentThreads) { fprintf(file, "\"dispatch\": \"persistent\", \"persistentBatchSize\": %u, ", render.persistentBatchSize); }
+				else { fprintf(file, "\"dispatch\": \"grid\", "); }
+				fprintf(file, "\"msPerFrame\": %.3f, \"minMsPerFrame\": %.3f, \"maxMsPerFrame\": %.3f, \"mraysPerSecond\": %.3f",
+						render.meanFrameMilliseconds, render.minFrameMilliseconds, render.maxFrameMilliseconds, render.megaRaysPerSecond);
+				if (render.nativeCompared) {
+					fprintf(file, ", \"nativeComparison\": { \"differingPixelFraction\": %.6f, \"maxChannelDifference\": %u, \"meanChannelDifference\": %.6f }",
+							render.differingNativePixelFraction, render.maxNativeChannelDifference, render.meanNativeChannelDifference);
+				}
+				fprintf(file, " }");
+			}
+			fprintf(file, "\n\t\t\t\t] }");
+		}
+		fprintf(file, "\n\t\t\t]\n\t\t}");
+	}
+	fprintf(file, "\n\t]\n}\n");
+
+	bool successful = !ferror(file);
+	if (!options.outputFile) { fflush(file); }
+	else if (fclose(file) != 0) { successful = false; }
+	return successful;
+}
+
+int main(int argc, char** argv) {
+	BenchmarkOptions options;
+	if (!parseOptions(argc, argv, options)) { return EXIT_FAILURE; }
+
+	Renderer::nativeFallbackEnabled = options.nativeFallback;
+	DefaultShaderVariant defaultShaderVariant;
+	defaultShaderVariant.traversalType = options.traversalType;
+	defaultShaderVariant.mortonTileOrder = options.mortonTileOrder;
+	DefaultShader defaultShader(defaultShaderVariant);
+	defaultShader.setTileSideLength(options.tileSideLength);
+	WavefrontShader wavefrontShader;
+	RaytracingShader& raytracingShader = options.wavefront ? (RaytracingShader&)wavefrontShader : defaultShader;
+	std::unique_ptr<NativeRaytracer> nativeRaytracer(options.compareNative ? new NativeRaytracer() : nullptr);			// NOTE: Only spins up its threads if it's needed.
+	DeviceDescription device;
+	std::vector<SceneResult> scenes;
+
+	for (SceneGenerator generator : options.sceneGenerators) {
+		for (size_t entityCount : options.entityCounts) {
+			SceneResult result;
+			result.generator = generator;
+			result.entityCount = entityCount;
+			result.seed = getSceneSeed(generator, entityCount);
+
+			Scene scene(entityCount, 4);
+			if (!scene.entityHeap || !scene.lightHeap) { fprintf(stderr, "failed to allocate a scene with %zu entities\n", entityCount); return EXIT_FAILURE; }
+			generateScene(generator, entityCount, scene);
+			benchmark_clock::time_point buildStart = benchmark_clock::now();
+			scene.generateKDTree();
+			result.buildMilliseconds = getMillisecondsSince(buildStart);
+			result.kdTreeNodeCount = scene.kdTreeNodeHeap.size();
+			result.leafObjectCount = scene.leafObjectHeap.size();
+			fprintf(stderr, "%s, %zu entities: %.3f ms build, %zu nodes\n", sceneGeneratorNames[(size_t)generator], entityCount, result.buildMilliseconds, result.kdTreeNodeCount);
+			Renderer::loadScene(std::move(scene));
+
+			for (uint16_t samplesPerPixelSideLength : options.samplesPerPixelSideLengths) {
+				SamplesPerPixelResult run;
+				if (!runSamplesPerPixel(options, raytracingShader, nativeRaytracer.get(), samplesPerPixelSideLength, getSceneCamera(entityCount), run, device)) { return EXIT_FAILURE; }
+				result.runs.push_back(std::move(run));
+			}
+			scenes.push_back(std::move(result));
+		}
+	}
+
+	if (!writeResults(options, device, scenes)) { fprintf(stderr, "failed to write the results\n"); return EXIT_FAILURE; }
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+# NOTE: Turns the kernel sources into EmbeddedKernels.h, which Shader.cpp picks up if it's there. With it, the executable doesn't need the .cl files next to it anymore.
+#	- fractal.vcxproj and CMakeLists.txt both run this before every build, so the executables always have the current kernels.
+#	- The header only gets rewritten when something changed, so an unchanged kernel doesn't cause Shader.cpp to recompile.
+#	- Byte arrays instead of string literals because MSVC caps string literals at 64K and raytracer.cl is close to that. Unsigned, so that non-ASCII bytes don't narrow.
+#
+#	Usage: python embed_kernels.py [output directory]
+
+import os
+import sys
+
+KERNEL_FILES = ["raytracer.cl", "averager.cl"]
+
+def main():
+	sourceDirectory = os.path.dirname(os.path.abspath(__file__))
+	outputDirectory = sys.argv[1] if len(sys.argv) > 1 else sourceDirectory
+
+	lines = [
+		"// NOTE: Generated by embed_kernels.py from " + ", ".join(KERNEL_FILES) + ". Don't edit, rerun the script instead.",
+		"",
+		"#pragma once",
+		"",
+		"#include <cstddef>",
+		"",
+		"struct EmbeddedKernelSource {",
+		"\tconst char* fileName;",
+		"\tconst char* sourceCode;\t\t\t\t\t\t\t// NOTE: Null-terminated.",
+		"\tsize_t length;",
+		"};",
+		"",
+	]
+	for index, fileName in enumerate(KERNEL_FILES):
+		with open(os.path.join(sourceDirectory, fileName), "rb") as file:
+			source = file.read()
+		lines.append("static const unsigned char embeddedKernelSource%d[] = {" % index)
+		data = list(source) + [0]
+		for begin in range(0, len(data), 32):
+			lines.append("\t" + ", ".join("0x%02x" % byte for byte in data[begin:begin + 32]) + ",")
+		lines.append("};")
+		lines.append("")
+
+	lines.append("static const EmbeddedKernelSource embeddedKernelSources[] = {")
+	for index, fileName in enumerate(KERNEL_FILES):
+		lines.append("\t{ \"%s\", (const char*)embeddedKernelSource%d, sizeof(embeddedKernelSource%d) - 1 }," % (fileName, index, index))
+	lines.append("};")
+	header = "\n".join(lines) + "\n"
+
+	outputPath = os.path.join(outputDirectory, "EmbeddedKernels.h")
+	if os.path.exists(outputPath):
+		with open(outputPath, "r", newline="") as file:
+			if file.read() == header:
+				return
+	with open(outputPath, "w", newline="") as file:
+		file.write(header)
+
+if __name__ == "__main__":
+	main()
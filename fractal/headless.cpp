@@ -0,0 +1,338 @@
+/*
+
+NOTE: Headless offline renderer. No window, no present step, no input. Renders a camera path as fast as the device goes and writes every frame out as a binary PPM.
+	- This is its own executable, it has its own main, so it isn't part of fractal.vcxproj. On Linux, it's the headless target of CMakeLists.txt:
+		cmake -S . -B build && cmake --build build --target headless
+	- Without any OpenCL platform it still runs, Renderer falls back to NativeRaytracer on the CPU. A CPU platform like POCL is usually faster though.
+	- The CMake build embeds the kernels through embed_kernels.py, so the executable doesn't need raytracer.cl next to it. Built programs get cached on disk, see ProgramBinaryCache.
+
+	Usage: headless [options]
+		--width <w>				default 1280
+		--height <h>				default 720
+		--spp <n>				samples per pixel side length, default 2
+		--path <file>				camera keyframes, one per line: <time> <x> <y> <z> <rotX> <rotY> <rotZ> <FOV>, # starts a comment
+		--fps <n>				frames per second of path time, default 30
+		--frames <n>				frame count when there's no path, the camera just sits still
+		--out <pattern>				printf pattern with exactly one %d, %i or %u for the frame index, with flags, width and precision if you want (default frame_%05d.ppm),
+							%% for a literal percent sign, or - for stdout
+		--accumulate				mix frames with an unchanged camera into a running mean instead of rendering each one on its own
+		--statistics				build the kernel with traversal statistics and print the counts of every frame
+		--heatmap				like --statistics, but the frames show the traversal cost per pixel instead of the shaded color
+		--trace <file>				profile every device command and write the last 256 frames out as a Chrome trace, plus per-stage statistics on stderr
+		--wavefront				trace with WavefrontShader instead of the megakernel, doesn't go together with --statistics or --heatmap
+		--sort-bounces <list>			comma separated bounce depths whose ray queues get sorted for coherence first, needs --wavefront, --trace shows what the sorts cost
+		--persistent <n>			launch the megakernel as persistent threads that take batches of n pixels off an atomic counter, 0 for one per work item,
+							doesn't go together with --wavefront, --statistics or --heatmap
+		--tile <n>				trace the megakernel in n x n tiles, 0 (the default) picks the side length for the device, 1 traces in strips
+		--morton				walk the tiles in Z-order
+		--autotune				measure the work group shapes on the first frame's camera if the device has no profile yet and store them for the next runs,
+							a stored profile wins over --tile
+
+	Timing goes to stderr, one line per frame, plus a summary at the end.
+
+*/
+
+#include "Renderer.h"
+#include "DefaultShader.h"
+#include "WavefrontShader.h"
+#include "Camera.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cinttypes>
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+struct CameraKeyframe {
+	float time;
+	Camera camera;
+};
+
+struct HeadlessOptions {
+	uint32_t frameWidth = 1280;
+	uint32_t frameHeight = 720;
+	uint16_t samplesPerPixelSideLength = 2;
+	const char* pathFile = nullptr;
+	float framesPerSecond = 30;
+	uint32_t frameCount = 1;
+	const char* outputPattern = "frame_%05d.ppm";
+	bool accumulate = false;
+	const char* traceFile = nullptr;
+	TraversalStatisticsMode traversalStatisticsMode = TraversalStatisticsMode::OFF;
+	bool wavefront = false;
+	std::vector<uint8_t> sortedBounceDepths;
+	bool persistentThreads = false;
+	uint32_t persistentBatchSize = 0;
+	uint8_t tileSideLength = 0;
+	bool mortonTileOrder = false;
+	bool autotune = false;
+};
+
+// NOTE: The pattern goes to snprintf as the format, so anything but exactly one integer conversion would read arguments that aren't there. Length modifiers aren't allowed either, the index is always an unsigned int.
+static bool isValidOutputPattern(const char* pattern) {
+	if (!strcmp(pattern, "-")) { return true; }
+	uint32_t conversionCount = 0;
+	for (const char* character = pattern; *character; character++) {
+		if (*character != '%') { continue; }
+		character++;
+		if (*character == '%') { continue; }
+		while (*character && strchr("-+ #0", *character)) { character++; }
+		while (*character >= '0' && *character <= '9') { character++; }
+		if (*character == '.') {
+			character++;
+			while (*character >= '0' && *character <= '9') { character++; }
+		}
+		if (!*character || !strchr("diu", *character)) { return false; }
+		conversionCount++;
+	}
+	return conversionCount == 1;
+}
+
+static bool parseOptions(int argc, char** argv, HeadlessOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		const char* option = argv[i];
+		if (!strcmp(option, "--accumulate")) { options.accumulate = true; continue; }
+		if (!strcmp(option, "--statistics")) { options.traversalStatisticsMode = TraversalStatisticsMode::COUNTERS; continue; }
+		if (!strcmp(option, "--heatmap")) { options.traversalStatisticsMode = TraversalStatisticsMode::HEATMAP; continue; }
+		if (!strcmp(option, "--wavefront")) { options.wavefront = true; continue; }
+		if (!strcmp(option, "--morton")) { options.mortonTileOrder = true; continue; }
+		if (!strcmp(option, "--autotune")) { options.autotune = true; continue; }
+		if (i + 1 >= argc) { fprintf(stderr, "missing value for %s\n", option); return false; }
+		const char* value = argv[++i];
+		if (!strcmp(option, "--width")) { options.frameWidth = strtoul(value, nullptr, 10); }
+		else if (!strcmp(option, "--height")) { options.frameHeight = strtoul(value, nullptr, 10); }
+		else if (!strcmp(option, "--spp")) { options.samplesPerPixelSideLength = (uint16_t)strtoul(value, nullptr, 10); }
+		else if (!strcmp(option, "--path")) { options.pathFile = value; }
+		else if (!strcmp(option, "--fps")) { options.framesPerSecond = strtof(value, nullptr); }
+		else if (!strcmp(option, "--frames")) { options.frameCount = strtoul(value, nullptr, 10); }
+		else if (!strcmp(option, "--out")) { options.outputPattern = value; }
+		else if (!strcmp(option, "--trace")) { options.traceFile = value; }
+		else if (!strcmp(option, "--tile")) { options.tileSideLength = (uint8_t)std::min(strtoul(value, nullptr, 10), (unsigned long)UINT8_MAX); }
+		else if (!strcmp(option, "--persistent")) { options.persistentThreads = true; options.persistentBatchSize = strtoul(value, nullptr, 10); }
+		else if (!strcmp(option, "--sort-bounces")) {
+			for (const char* depth = value; *depth; ) {
+				char* depthEnd;
+				unsigned long bounceDepth = strtoul(depth, &depthEnd, 10);
+				if (depthEnd == depth || bounceDepth > 127) { fprintf(stderr, "invalid bounce depth list %s\n", value); return false; }
+				options.sortedBounceDepths.push_back((uint8_t)bounceDepth);
+				depth = *depthEnd == ',' ? depthEnd + 1 : depthEnd;
+			}
+		}
+		else { fprintf(stderr, "unknown option %s\n", option); return false; }
+	}
+	if (options.frameWidth == 0 || options.frameHeight == 0 || options.samplesPerPixelSideLength == 0 || options.framesPerSecond <= 0) { fprintf(stderr, "invalid frame options\n"); return false; }
+	if (!isValidOutputPattern(options.outputPattern)) { fprintf(stderr, "--out needs exactly one %%d, %%i or %%u for the frame index, or - for stdout: %s\n", options.outputPattern); return false; }
+	if (options.wavefront && options.traversalStatisticsMode != TraversalStatisticsMode::OFF) { fprintf(stderr, "the wavefront kernels don't have traversal statistics\n"); return false; }
+	if (!options.wavefront && !options.sortedBounceDepths.empty()) { fprintf(stderr, "--sort-bounces needs --wavefront\n"); return false; }
+	if (options.persistentThreads && (options.wavefront || options.traversalStatisticsMode != TraversalStatisticsMode::OFF)) { fprintf(stderr, "--persistent only works with the megakernel and without traversal statistics\n"); return false; }
+	return true;
+}
+
+// NOTE: The keyframes have to be sorted by time, we don't sort them for you.
+static bool loadCameraPath(const char* pathFile, std::vector<CameraKeyframe>& keyframes) {
+	FILE* file = fopen(pathFile, "r");
+	if (!file) { return false; }
+	char line[512];
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || line[0] == '\n') { continue; }
+		CameraKeyframe keyframe;
+		if (sscanf(line, "%f %f %f %f %f %f %f %f", &keyframe.time,
+					&keyframe.camera.position.x, &keyframe.camera.position.y, &keyframe.camera.position.z,
+					&keyframe.camera.rotation.x, &keyframe.camera.rotation.y, &keyframe.camera.rotation.z, &keyframe.camera.FOV) != 8) { continue; }
+		if (!keyframes.empty() && keyframe.time < keyframes.back().time) { fclose(file); return false; }
+		keyframes.push_back(keyframe);
+	}
+	fclose(file);
+	return !keyframes.empty();
+}
+
+static float lerp(float a, float b, float t) { return a + (b - a) * t; }
+
+// NOTE: Plain linear interpolation between the two keyframes around time. Clamps to the first and last keyframe.
+static Camera sampleCameraPath(const std::vector<CameraKeyframe>& keyframes, float time) {
+	if (time <= keyframes.front().time) { return keyframes.front().camera; }
+	if (time >= keyframes.back().time) { return keyframes.back().camera; }
+	size_t next = 1;
+	while (keyframes[next].time < time) { next++; }
+	const CameraKeyframe& a = keyframes[next - 1];
+	const CameraKeyframe& b = keyframes[next];
+	float t = b.time == a.time ? 1 : (time - a.time) / (b.time - a.time);
+	Camera camera;
+	camera.position.x = lerp(a.camera.position.x, b.camera.position.x, t);
+	camera.position.y = lerp(a.camera.position.y, b.camera.position.y, t);
+	camera.position.z = lerp(a.camera.position.z, b.camera.position.z, t);
+	camera.rotation.x = lerp(a.camera.rotation.x, b.camera.rotation.x, t);
+	camera.rotation.y = lerp(a.camera.rotation.y, b.camera.rotation.y, t);
+	camera.rotation.z = lerp(a.camera.rotation.z, b.camera.rotation.z, t);
+	camera.FOV = lerp(a.camera.FOV, b.camera.FOV, t);
+	return camera;
+}
+
+// NOTE: Same scene as the window starts up with, with the random lights seeded so every run renders the same thing.
+static void loadDefaultScene() {
+	Scene scene(2, 5);
+	for (size_t i = 0; i < scene.entityHeapLength; i++) {
+		Entity entity;
+		entity.position = nmath::Vector3f(500, 11, 500);
+		entity.scale = nmath::Vector3f(10, 0, 0);
+		entity.material = 0;
+		scene.entityHeap[i] = entity;
+	}
+	srand(0);
+	for (int i = 0; i < 5; i++) {
+		Light light;
+		light.position = nmath::Vector3f(rand() % 100, 0, rand() % 100);
+		light.color = nmath::Vector3f(1, 1, 1);
+		scene.lightHeap[i] = light;
+	}
+	scene.entityHeap[1].position = nmath::Vector3f(521, 11, 500);
+	scene.generateKDTree();
+	Renderer::loadScene(std::move(scene));
+
+	ResourceHeap resources(0, 1);
+	resources.materialHeap[0].color = nmath::Vector3f(0.8f, 0.8f, 0.8f);
+	resources.materialHeap[0].reflectivity = 0.9f;
+	Renderer::loadResources(std::move(resources));
+}
+
+// NOTE: The frame is RGBA, PPM wants RGB, so the alpha gets dropped row by row. Writing to stdout just concatenates the PPMs, which is what most video tools expect from an image pipe.
+static bool writeFrame(const Renderer::FrameView& frameView, const char* outputPattern, uint32_t frameIndex, std::vector<unsigned char>& rowBuffer) {
+	FILE* file;
+	bool toStdout = !strcmp(outputPattern, "-");
+	if (toStdout) { file = stdout; }
+	else {
+		char path[1024];
+		int pathLength = snprintf(path, sizeof(path), outputPattern, (unsigned int)frameIndex);			// NOTE: parseOptions made sure that the pattern has exactly one integer conversion.
+		if (pathLength < 0 || (size_t)pathLength >= sizeof(path)) { return false; }
+		file = fopen(path, "wb");
+		if (!file) { return false; }
+	}
+
+	bool successful = fprintf(file, "P6\n%u %u\n255\n", frameView.width, frameView.height) > 0;
+	rowBuffer.resize((size_t)frameView.width * 3);
+	for (uint32_t y = 0; y < frameView.height && successful; y++) {
+		const char* row = frameView.data + (size_t)y * frameView.width * frameView.bytesPerPixel;
+		for (uint32_t x = 0; x < frameView.width; x++) {
+			rowBuffer[x * 3 + 0] = row[x * frameView.bytesPerPixel + 0];
+			rowBuffer[x * 3 + 1] = row[x * frameView.bytesPerPixel + 1];
+			rowBuffer[x * 3 + 2] = row[x * frameView.bytesPerPixel + 2];
+		}
+		if (fwrite(rowBuffer.data(), 1, rowBuffer.size(), file) != rowBuffer.size()) { successful = false; }
+	}
+
+	if (toStdout) { fflush(file); }
+	else if (fclose(file) != 0) { successful = false; }
+	return successful;
+}
+
+// NOTE: Only transfers what actually changed. Renderer would keep the accumulation going for an unchanged value anyway, this just skips setting the same arguments again.
+static void transferCamera(const Camera& camera, bool first) {
+	Camera previousCamera = Renderer::camera;
+	Renderer::loadCamera(camera);
+	if (first || camera.position.x != previousCamera.position.x || camera.position.y != previousCamera.position.y || camera.position.z != previousCamera.position.z) { Renderer::transferCameraPosition(); }
+	if (first || camera.rotation.x != previousCamera.rotation.x || camera.rotation.y != previousCamera.rotation.y || camera.rotation.z != previousCamera.rotation.z) { Renderer::transferCameraRotation(); }
+	if (first || camera.FOV != previousCamera.FOV) { Renderer::transferCameraFOV(); }
+}
+
+int main(int argc, char** argv) {
+	HeadlessOptions options;
+	if (!parseOptions(argc, argv, options)) { return EXIT_FAILURE; }
+
+	std::vector<CameraKeyframe> keyframes;
+	if (options.pathFile) {
+		if (!loadCameraPath(options.pathFile, keyframes)) { fprintf(stderr, "failed to load camera path %s\n", options.pathFile); return EXIT_FAILURE; }
+		options.frameCount = (uint32_t)((keyframes.back().time - keyframes.front().time) * options.framesPerSecond) + 1;
+	} else {
+		keyframes.push_back({ 0, Camera({ 511, 11, 500 }, { 0, 0, 0 }, 90) });
+	}
+
+	DefaultShaderVariant defaultShaderVariant;
+	defaultShaderVariant.persistentThreads = options.persistentThreads;
+	defaultShaderVariant.mortonTileOrder = options.mortonTileOrder;
+	DefaultShader defaultShader(defaultShaderVariant, options.traversalStatisticsMode);
+	defaultShader.setPersistentBatchSize(options.persistentBatchSize);
+	defaultShader.setTileSideLength(options.tileSideLength);
+	WavefrontShader wavefrontShader;
+	for (uint8_t bounceDepth : options.sortedBounceDepths) { wavefrontShader.setRaySorting(bounceDepth, true); }
+	RaytracingShader& raytracingShader = options.wavefront ? (RaytracingShader&)wavefrontShader : defaultShader;
+	Renderer::profilingEnabled = options.traceFile != nullptr;
+	// NOTE: Two frames in flight is enough to keep the device busy while we write the last one out. Mapped frames on CPU devices like POCL skip the readback copy.
+	ErrorCode err = Renderer::init(&raytracingShader, options.samplesPerPixelSideLength, options.frameWidth, options.frameHeight, ImageChannelOrderType::RGBA, FrameResolveType::FUSED, 2, FrameMemoryType::AUTO);
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "renderer init failed: %d\n", (int)(int16_t)err); return EXIT_FAILURE; }
+	Renderer::accumulationEnabled = options.accumulate;
+
+	loadDefaultScene();
+	err = Renderer::transferResources();
+	if (err == ErrorCode::SUCCESS) { err = Renderer::transferScene(); }
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "scene transfer failed: %d\n", (int)(int16_t)err); Renderer::release(); return EXIT_FAILURE; }
+
+	using clock = std::chrono::steady_clock;
+	std::vector<unsigned char> rowBuffer;
+	int exitCode = EXIT_SUCCESS;
+
+	clock::time_point renderStart = clock::now();
+	clock::time_point lastFrameEnd = renderStart;
+	double totalWriteMilliseconds = 0;
+	uint32_t renderedFrameCount = 0;										// NOTE: Can be less than options.frameCount if something fails on the way.
+
+	// NOTE: Frame N + 1 gets submitted before we wait for frame N, same as the window does it. The kernel arguments are captured at enqueue time, so the camera for N + 1 can be transferred while N is still rendering.
+	transferCamera(sampleCameraPath(keyframes, keyframes.front().time), true);
+	if (options.autotune) {
+		err = Renderer::autotuneWorkGroups();
+		if (err != ErrorCode::SUCCESS) { fprintf(stderr, "work group autotuning failed: %d\n", (int)(int16_t)err); Renderer::release(); return EXIT_FAILURE; }
+		fprintf(stderr, "trace work group: %zu x %zu\n", Renderer::getTraceLocalSize()[0], Renderer::getTraceLocalSize()[1]);
+		renderStart = lastFrameEnd = clock::now();					// NOTE: The measurements aren't part of the render time.
+	}
+	err = Renderer::submitFrame();
+	for (uint32_t frameIndex = 0; frameIndex < options.frameCount && err == ErrorCode::SUCCESS; frameIndex++) {
+		if (frameIndex + 1 < options.frameCount) {
+			transferCamera(sampleCameraPath(keyframes, keyframes.front().time + (frameIndex + 1) / options.framesPerSecond), false);
+			err = Renderer::submitFrame();
+			if (err != ErrorCode::SUCCESS) { break; }
+		}
+
+		err = Renderer::retrieveFrame();
+		if (err != ErrorCode::SUCCESS) { break; }
+		clock::time_point frameEnd = clock::now();
+		renderedFrameCount++;
+
+		if (!writeFrame(Renderer::getFrameView(), options.outputPattern, frameIndex, rowBuffer)) {
+			fprintf(stderr, "failed to write frame %u\n", frameIndex);
+			exitCode = EXIT_FAILURE;
+			break;
+		}
+		clock::time_point writeEnd = clock::now();
+
+		double frameMilliseconds = std::chrono::duration<double, std::milli>(frameEnd - lastFrameEnd).count();
+		double writeMilliseconds = std::chrono::duration<double, std::milli>(writeEnd - frameEnd).count();
+		totalWriteMilliseconds += writeMilliseconds;
+		fprintf(stderr, "frame %u: %.3f ms frame, %.3f ms write\n", frameIndex, frameMilliseconds, writeMilliseconds);
+		if (options.traversalStatisticsMode != TraversalStatisticsMode::OFF) {
+			const TraversalStatistics& statistics = Renderer::frameTraversalStatistics;
+			fprintf(stderr, "\t%" PRIu64 " node visits, %" PRIu64 " AABB tests, %" PRIu64 " leaf sphere tests, %" PRIu64 " bounces, %" PRIu64 " restarts\n",
+					statistics.get(TraversalStatistic::NODE_VISITS), statistics.get(TraversalStatistic::AABB_TESTS), statistics.get(TraversalStatistic::LEAF_SPHERE_TESTS),
+					statistics.get(TraversalStatistic::BOUNCES), statistics.get(TraversalStatistic::RESTARTS));
+		}
+		lastFrameEnd = writeEnd;
+	}
+	if (err != ErrorCode::SUCCESS) { fprintf(stderr, "rendering failed: %d\n", (int)(int16_t)err); exitCode = EXIT_FAILURE; }
+
+	double totalMilliseconds = std::chrono::duration<double, std::milli>(clock::now() - renderStart).count();
+	fprintf(stderr, "%u frames in %.3f ms (%.3f ms writing), %.2f fps\n", renderedFrameCount, totalMilliseconds, totalWriteMilliseconds, renderedFrameCount / (totalMilliseconds / 1000));
+
+	if (options.traceFile) {
+		for (size_t i = 0; i < (size_t)ProfileStage::COUNT; i++) {
+			ProfileStageStatistics statistics = Renderer::profiler.getStageStatistics((ProfileStage)i);
+			if (statistics.sampleCount == 0) { continue; }
+			fprintf(stderr, "%s: %zu commands, min %.3f ms, mean %.3f ms, p95 %.3f ms, p99 %.3f ms\n", getProfileStageName((ProfileStage)i), statistics.sampleCount, statistics.min, statistics.mean, statistics.p95, statistics.p99);
+		}
+		if (!Renderer::profiler.writeChromeTrace(options.traceFile, Renderer::profiler.windowFrameCount)) { fprintf(stderr, "failed to write trace %s\n", options.traceFile); exitCode = EXIT_FAILURE; }
+	}
+
+	if (!Renderer::release()) { fprintf(stderr, "renderer release failed\n"); exitCode = EXIT_FAILURE; }
+	return exitCode;
+}
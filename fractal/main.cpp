@@ -204,7 +204,9 @@ void graphicsLoop() {
 	debuglogger::out << alignof(uint64_t) << '\n';
 
 	DefaultShader mainShader;
-	ErrorCode err = Renderer::init(&mainShader, 4, windowWidth, windowHeight, ImageChannelOrderType::RGBA);
+	// NOTE: With accumulation on, every frame only needs one sample per pixel. The samples pile up over the frames for as long as the camera sits still, and a moving camera gets its frames that much faster.
+	uint16_t samplesPerPixelSideLength = Renderer::accumulationEnabled ? 1 : 4;
+	ErrorCode err = Renderer::init(&mainShader, samplesPerPixelSideLength, windowWidth, windowHeight, ImageChannelOrderType::RGBA, FrameResolveType::FUSED, 2, FrameMemoryType::AUTO);
 	debuglogger::out << (int16_t)err << '\n';
 	Camera camera({ 511, 11, 500 }, { 0, 0, 0 }, 90);
 	Renderer::loadCamera(camera);
@@ -253,6 +255,10 @@ void graphicsLoop() {
 	err = Renderer::transferScene();
 	debuglogger::out << "tran scene err: " << (int16_t)err << '\n';
 
+	// NOTE: Measures on the scene and camera that were just transferred. Once the device has a profile, this doesn't do anything anymore, so only the very first startup takes longer.
+	err = Renderer::autotuneWorkGroups();
+	debuglogger::out << "autotune err: " << (int16_t)err << '\n';
+
 
 
 
@@ -266,14 +272,23 @@ void graphicsLoop() {
 	captureMouse = true;
 	captureKeyboard = true;
 
+	err = Renderer::submitFrame();
+	if (err != ErrorCode::SUCCESS) { debuglogger::out << (int16_t)err << '\n'; }
+
 	while (isAlive) {
 
-		err = Renderer::render();
+		// NOTE: Frame N + 1 goes out before we wait for frame N, so the device always has something to do while we present.
+		err = Renderer::submitFrame();
+		if (err != ErrorCode::SUCCESS) {
+			debuglogger::out << (int16_t)err << '\n';
+		}
+		err = Renderer::retrieveFrame();
 		if (err != ErrorCode::SUCCESS) {
 			debuglogger::out << (int16_t)err << '\n';
 		}
 
-		if (!SetBitmapBits(bmp, outputFrame_size, Renderer::frame)) {			// TODO: Replace this copy (which is unnecessary), with a direct access to the bitmap bits.
+		Renderer::FrameView frameView = Renderer::getFrameView();				// NOTE: On devices that share memory with the host, this points straight at what the device rendered, so this is the only copy left.
+		if (frameView.data && !SetBitmapBits(bmp, outputFrame_size, frameView.data)) {			// TODO: Replace this copy (which is unnecessary), with a direct access to the bitmap bits.
 			debuglogger::out << debuglogger::error << "failed to set bmp bits\n";
 			EXIT_FROM_THREAD;
 		}
@@ -296,6 +311,9 @@ void graphicsLoop() {
 			outputFrame_size = windowWidth * windowHeight * 4;
 			SelectObject(g, bmp);
 
+			err = Renderer::submitFrame();			// NOTE: resizeFrame throws away the frames in flight, so the pipeline has to be primed again.
+			if (err != ErrorCode::SUCCESS) { debuglogger::out << (int16_t)err << '\n'; }
+
 			continue;
 		}
 
@@ -313,8 +331,10 @@ void graphicsLoop() {
 		if (keys::d) { moveVector.x += MOVE_SENSITIVITY; }
 		if (keys::space) { moveVector.y += MOVE_SENSITIVITY; }
 		if (keys::ctrl) { moveVector.y -= MOVE_SENSITIVITY; }
-		Renderer::camera.position += moveVector.rotate(Renderer::camera.rotation);
-		Renderer::transferCameraPosition();
+		if (moveVector.x != 0 || moveVector.y != 0 || moveVector.z != 0) {			// NOTE: Only on input, every transfer that moves the camera starts the accumulation over.
+			Renderer::camera.position += moveVector.rotate(Renderer::camera.rotation);
+			Renderer::transferCameraPosition();
+		}
 		//camera.move(moveVector);			// TODO: Is there really a reason to use custom vector rotation code when you can just pipe the vec through cameraRotMat? Do that.
 
 		//if (!renderer.loadCameraPos(&camera.pos)) { debuglogger::out << debuglogger::error << "failed to load new camera position" << debuglogger::endl; EXIT_FROM_THREAD; }
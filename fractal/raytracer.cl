@@ -77,6 +77,79 @@ typedef struct KDTreeNode {
 	float split;
 } KDTreeNode;
 
+typedef struct KDTreeNodeRopes {
+	float3 position;
+	float3 size;
+	ulong ropes[6];				// -x, +x, -y, +y, -z, +z
+} KDTreeNodeRopes;
+
+#define KD_TREE_NO_ROPE ((ulong)-1)
+
+typedef struct CompactKDTreeNode {
+	uint header;						// split axis (or COMPACT_KD_TREE_LEAF_AXIS) in the first two bits, left child index or leaf object offset in the rest
+	uint splitOrObjectCount;			// absolute split plane as float bits for inner nodes, object count for leaves
+} CompactKDTreeNode;
+
+#define COMPACT_KD_TREE_LEAF_AXIS 3
+
+/*
+
+NOTE: Traversal statistics, only compiled in if the host defines TRAVERSAL_STATISTICS (see DefaultShader). Without it, every macro below expands to nothing, so the kernels are exactly what they'd be without this block.
+	- Every work item counts into its own private copy, the work group sums them up in local memory and one slot per work group gets written to traversalStatistics.
+		The host adds the slots together. That way nobody needs 64-bit atomics, the counts of a whole frame don't fit into 32 bits.
+	- A restart is every time the walk has to pick itself back up instead of just going down: going up a parent link, following a rope or going down from the root again in the compact walk.
+	- With TRAVERSAL_HEATMAP on as well, the pixels show how much work they took (node visits + leaf sphere tests per sample, TRAVERSAL_HEATMAP_SCALE is red) instead of the shaded color.
+	- The indices have to match TraversalStatistic in TraversalStatistics.h.
+
+*/
+
+#ifdef TRAVERSAL_STATISTICS
+
+#define STATISTIC_NODE_VISITS 0
+#define STATISTIC_AABB_TESTS 1
+#define STATISTIC_LEAF_SPHERE_TESTS 2
+#define STATISTIC_BOUNCES 3
+#define STATISTIC_RESTARTS 4
+#define TRAVERSAL_STATISTIC_COUNT 5
+
+#ifndef TRAVERSAL_HEATMAP_SCALE
+#define TRAVERSAL_HEATMAP_SCALE 256
+#endif
+
+typedef struct TraversalStatistics { uint counts[TRAVERSAL_STATISTIC_COUNT]; } TraversalStatistics;
+
+// NOTE: These include their semicolon and get used without one, so that nothing at all is left of them without TRAVERSAL_STATISTICS, not even an empty statement.
+#define COUNT_STATISTIC(name) statistics->counts[STATISTIC_##name]++;
+#define STATISTICS_PARAMETER , TraversalStatistics* statistics
+#define STATISTICS_ARGUMENT , statistics
+
+#else
+
+#define COUNT_STATISTIC(name)
+#define STATISTICS_PARAMETER
+#define STATISTICS_ARGUMENT
+
+#endif
+
+/*
+
+NOTE: Build-time constants. DefaultShader puts them in front of the source, see DefaultShaderVariant. Without them, everything works off of the arguments like before.
+	- MAX_BOUNCES is how often a ray can bounce before it counts as done.
+	- SAMPLES_PER_PIXEL_SIDE_LENGTH takes the place of the samplesPerPixelSideLength argument. The argument is still there so that every variant takes the same arguments,
+		it just doesn't get read. With a constant, the compiler can unroll the sample loops and fold the divisions.
+
+*/
+
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 10
+#endif
+
+#ifdef SAMPLES_PER_PIXEL_SIDE_LENGTH
+#define SAMPLE_SIDE_LENGTH SAMPLES_PER_PIXEL_SIDE_LENGTH
+#else
+#define SAMPLE_SIDE_LENGTH samplesPerPixelSideLength
+#endif
+
 inline float rayIntersectAABB(float3 rayOrigin, float3 ray, float3 startPosition, float3 stopPosition) {
 
 	/*
@@ -232,17 +305,20 @@ nothingToFinish:
 	return -1;
 }
 
-#define DEBUG_RETURN write_imageui(frame, coords, (uint4)(100, 100, 0, 255)); return;
-#define SECOND_DEBUG_RETURN write_imageui(frame, coords, (uint4)(0, 100, 100, 255)); return;
+#define DEBUG_RETURN return (float3)(100, 100, 0) / 255;
+#define SECOND_DEBUG_RETURN return (float3)(0, 100, 100) / 255;
 
-inline uint4 sampleSkybox(float3 ray) {
-	//return (uint4)(0, 255, 0, 255);
+inline float3 sampleSkybox(float3 ray) {
+	//return (float3)(0, 1, 0);
 	ray = normalize(ray);
-	return (uint4)(fabs(ray.x * 255), fabs(ray.y * 255), fabs(ray.z * 255), 255);
+	return fabs(ray);
 }
 
-inline ulong initRandSeed(uint frameWidth) {
-	return ((ulong)get_global_id(0) * (ulong)frameWidth + (ulong)get_global_id(1)) << 32;
+inline ulong initRandSeed(int2 coords, uint frameWidth, uint sampleIndex) {
+	// NOTE: The row-major pixel index goes into the high half, so every pixel of the frame gets its own seed. The sample index goes into the low half,
+	// the multiplications in randInt carry it up into the bits that we actually use.
+	// The seed only depends on the pixel, not on the work item, so the frames stay the same no matter how the launch is shaped.
+	return (((ulong)coords.y * (ulong)frameWidth + (ulong)coords.x) << 32) | (uint)(sampleIndex * 2654435761u);
 }
 
 inline uint randInt(ulong* seed) {
@@ -255,13 +331,51 @@ inline float randFloat(ulong* seed) {
 	return randomInteger * (1 / (float)((uint)-1));
 }
 
+// NOTE: Has to be above the randFloat() macro, since the macro would otherwise swallow the call below.
+inline float3 calculateBounceRay(float3 ray, float3 normal, float reflectivity, ulong* randSeed) {
+	float dotIncomingRayNormal = dot(ray, normal);			// NOTE: Assumes ray is normalized.
+	float3 reflectedRay = ray - dotIncomingRayNormal * 2 * normal;
+	float3 diffuseRay = (float3)(randFloat(randSeed) * 2 - 1, randFloat(randSeed) * 2 - 1, randFloat(randSeed) * 2 - 1);
+	diffuseRay = normalize(diffuseRay);
+	float dotUnadjustedDiffuseRayNormal = dot(diffuseRay, normal);
+	if (dotUnadjustedDiffuseRayNormal < 0) { diffuseRay -= dotUnadjustedDiffuseRayNormal * 2 * normal; }
+	float3 diffReflectedDiffuse = reflectedRay - diffuseRay;
+	return normalize(diffuseRay + diffReflectedDiffuse * reflectivity);
+}
+
+// NOTE: The sub-samples of a pixel lie on a grid that's samplesPerPixelSideLength times finer than the frame. With a side length of 1 that's just the frame itself.
+inline float3 generateCameraRay(int2 coords, ushort subX, ushort subY, ushort samplesPerPixelSideLength, uint frameWidth, uint frameHeight, 
+								float rayOriginZ, Matrix4f cameraRotationMat, ulong* randSeed) {
+	int2 sampleCoords = coords * samplesPerPixelSideLength + (int2)(subX, subY);
+	int sampleGridWidth = frameWidth * samplesPerPixelSideLength;
+	int sampleGridHeight = frameHeight * samplesPerPixelSideLength;
+	float3 ray = (float3)(sampleCoords.x - sampleGridWidth / 2 + randFloat(randSeed), -sampleCoords.y + sampleGridHeight / 2 - randFloat(randSeed), -rayOriginZ);
+	ray = normalize(ray);
+	return multiplyMatWithFloat3(cameraRotationMat, ray);
+}
+
+// NOTE: A null accumulationFrame means no accumulation. Otherwise the pixel gets mixed into the running mean, see doAccumulate in averager.cl.
+inline void writeResolvedPixel(__write_only image2d_t frame, int2 coords, float3 color, uint frameWidth, __global float4* accumulationFrame, uint accumulatedFrameCount) {
+	float4 pixel = (float4)(color * 255, 255);
+	if (!accumulationFrame) { write_imageui(frame, coords, convert_uint4(pixel)); return; }
+
+	size_t accumulationIndex = (size_t)coords.y * frameWidth + coords.x;
+	if (accumulatedFrameCount != 0) {
+		float4 mean = accumulationFrame[accumulationIndex];
+		pixel = mean + (pixel - mean) / (accumulatedFrameCount + 1);
+	}
+	accumulationFrame[accumulationIndex] = pixel;
+	write_imageui(frame, coords, convert_uint4_sat_rte(pixel));
+}
+
 #define randInt() randInt(&randSeed)
 #define randFloat() randFloat(&randSeed)
 
 inline char extractDimensionValue(ulong input) { return input >> (sizeof(input) * 8 - 2); }
 inline ulong removeDimensionValue(ulong input) { return input & ((ulong)-1 >> 2); }
 
-#define RECONSTRUCT_PARENT 	if (noDimChildrenIndex == previousKDTreeNodeIndex) { \
+#define RECONSTRUCT_PARENT 	COUNT_STATISTIC(RESTARTS) \
+							if (noDimChildrenIndex == previousKDTreeNodeIndex) { \
 								switch (splitDimension) { \
 								case 0: \
 									if (upwardsTraversalCacheSize != 0) { \
@@ -323,34 +437,22 @@ inline ulong removeDimensionValue(ulong input) { return input & ((ulong)-1 >> 2)
 
 #define FREE_STACK_SPACE_IN_UNITS_OF_4 100
 
-__kernel void traceRays(__write_only image2d_t frame, uint frameWidth, uint frameHeight, 
-						float3 cameraPos, Matrix4f cameraRotationMat, float rayOriginZ, 
-						__global Entity* entityHeap, ulong entityHeapLength, 
-						float3 kdTreePosition, float3 kdTreeSize, __global KDTreeNode* kdTreeNodeHeap, ulong kdTreeNodeHeapLength, __global ulong* leafObjectHeap, ulong leafObjectHeapLength, 
-						__global Light* lightHeap, ulong lightHeapLength, 
-						__global Material* materialHeap, ulong materialHeapLength, ulong materialHeapOffset) {
-
-	ulong randSeed = initRandSeed(frameWidth);
+/*
 
-	int x = get_global_id(0);
-	if (x >= frameWidth) { return; }
-	int2 coords = (int2)(x, get_global_id(1));
+NOTE: Every traversal is a function that traces one camera ray (bounces included) and returns its color. The kernels further down only generate the rays,
+	loop over the sub-samples of their pixel and write the result. That way, the same kernel can either write every sample into the big
+	before-average frame (samplesPerPixelSideLength = 1 on the fine grid, averager.cl does the rest) or resolve whole pixels on its own (fused mode).
 
-	float3 renderColorSum = (float3)(0, 0, 0);
+*/
 
-	float3 cameraBackup = cameraPos;
+inline float3 traceRayWithParentLinks(float3 cameraPos, float3 ray, ulong* randSeed, __global Entity* entityHeap, 
+									float3 kdTreePosition, float3 kdTreeSize, __global KDTreeNode* kdTreeNodeHeap, ulong kdTreeNodeHeapLength, 
+									__global Material* materialHeap, __global float4* leafSphereHeap, __global uint* leafEntityIndexHeap STATISTICS_PARAMETER) {
 
-// TODO: Figure out a way to measure variance between the samples and a way to conditionally add more samples to the mix.
-for (int indexthing = 0; indexthing < 1; indexthing++) {
+	float3 renderColorSum = (float3)(0, 0, 0);
 
 	float upwardsTraversalCache[FREE_STACK_SPACE_IN_UNITS_OF_4];
 	ulong upwardsTraversalCacheSize = 0;
-
-	cameraPos = cameraBackup;
-
-	float3 ray = (float3)(coords.x - (int)frameWidth / 2 + randFloat(), -coords.y + (int)frameHeight / 2 - randFloat(), -rayOriginZ);
-	ray = normalize(ray);
-	ray = multiplyMatWithFloat3(cameraRotationMat, ray);
 /*
 float3 colorCollector;
 
@@ -410,9 +512,10 @@ for (int j = 0; j < 10; j++) {
 
 */
 
-	if (kdTreeNodeHeapLength == 0) { write_imageui(frame, coords, sampleSkybox(ray)); return; }
+	if (kdTreeNodeHeapLength == 0) { return sampleSkybox(ray); }
 
-	if (rayIntersectAABB(cameraPos, ray, kdTreePosition, kdTreePosition + kdTreeSize) == -1) { write_imageui(frame, coords, sampleSkybox(ray)); return; }
+	COUNT_STATISTIC(AABB_TESTS)
+	if (rayIntersectAABB(cameraPos, ray, kdTreePosition, kdTreePosition + kdTreeSize) == -1) { return sampleSkybox(ray); }
 
 	ulong previousKDTreeNodeIndex = 0;
 	ulong currentKDTreeNodeIndex = 0;
@@ -425,7 +528,7 @@ for (int j = 0; j < 10; j++) {
 
 	float3 colorSum = (float3)(0, 0, 0);
 	float3 colorProduct = (float3)(1, 1, 1);
-	char maxBounces = 10;			// TODO: Handle this through parameter.
+	char maxBounces = MAX_BOUNCES;
 
 	while (true) {
 
@@ -447,6 +550,7 @@ for (int j = 0; j < 10; j++) {
 
 		if (kdTreeNodeHeap[currentKDTreeNodeIndex].objectCount == -1) {
 upwardsTraversalLoop:
+			COUNT_STATISTIC(NODE_VISITS)
 			/*
 
 			NOTE: Something I didn't know about switch cases in C/C++ is that the standard defines that if no case is hit, none
@@ -485,6 +589,7 @@ upwardsTraversalLoop:
 				break;
 			}
 
+			COUNT_STATISTIC(AABB_TESTS)
 			float rightDist = rayIntersectAABB(cameraPos, ray, rightKDTreeNodePosition, rightKDTreeNodePosition + rightKDTreeNodeSize);
 
 			if (rightDist == -1) {
@@ -521,6 +626,7 @@ upwardsTraversalLoop:
 				continue;
 			}
 
+			COUNT_STATISTIC(AABB_TESTS)
 			float leftDist = rayIntersectAABB(cameraPos, ray, kdTreePosition, kdTreePosition + leftKDTreeNodeSize);
 
 			if (leftDist == -1) {
@@ -636,6 +742,7 @@ upwardsTraversalLoop:
 			continue;
 		}
 
+		COUNT_STATISTIC(NODE_VISITS)
 		if (kdTreeNodeHeap[currentKDTreeNodeIndex].objectCount == 0) {
 			//write_imageui(frame, coords, (uint4)((currentKDTreeNodeIndex * 100) % 256, 0, 0, 255));
 			//return;
@@ -646,44 +753,41 @@ upwardsTraversalLoop:
 
 			float closestDistance = -1;
 			float3 closestHitPoint;
-			ulong closestEntityIndex;
+			ulong closestLeafObjectIndex;
 			for (ulong i = kdTreeNodeHeap[currentKDTreeNodeIndex].childrenIndex; i < kdTreeNodeHeap[currentKDTreeNodeIndex].childrenIndex + kdTreeNodeHeap[currentKDTreeNodeIndex].objectCount; i++) {
 				//write_imageui(frame, coords, (uint4)(0, 0, (currentKDTreeNodeIndex * 100) % 256, 255));
 				//return;
 
-				float3 pos = entityHeap[leafObjectHeap[i]].position;
-				float radius = entityHeap[leafObjectHeap[i]].scale.x;
+				float4 sphere = leafSphereHeap[i];
+				float3 pos = sphere.xyz;
+				float radius = sphere.w;
 				float3 offset = (float3)(radius, radius, radius);
+				COUNT_STATISTIC(AABB_TESTS)
 				if (rayIntersectAABB(cameraPos, ray, pos - offset, pos + offset) == -1) { continue; }
 
+				COUNT_STATISTIC(LEAF_SPHERE_TESTS)
 				float dist;
 				bool didItHit;
-				float3 hitPoint = intersectWithSphere(cameraPos, ray, entityHeap[leafObjectHeap[i]].position, entityHeap[leafObjectHeap[i]].scale.x, &didItHit, &dist);
+				float3 hitPoint = intersectWithSphere(cameraPos, ray, pos, radius, &didItHit, &dist);
 				if (didItHit) {
 					if (closestDistance == -1 || dist < closestDistance) {
 						closestDistance = dist;
 						closestHitPoint = hitPoint;
-						closestEntityIndex = leafObjectHeap[i];
+						closestLeafObjectIndex = i;
 					}
 				}
 			}
 			if (closestDistance != -1) {
 				if (maxBounces > 0) {
+					uint closestEntityIndex = leafEntityIndexHeap[closestLeafObjectIndex];
 					colorProduct *= materialHeap[entityHeap[closestEntityIndex].material].color;
 					// TODO: Add point lights somehow. You need to traverse the kd tree for them, which is problematic.
 					colorSum += 0 * colorProduct;
-					float3 normal = normalize(closestHitPoint - entityHeap[closestEntityIndex].position);
-					float dotIncomingRayNormal = dot(ray, normal);			// NOTE: Assumes ray is normalized.
-					float3 reflectedRay = ray - dotIncomingRayNormal * 2 * normal;
-					float3 diffuseRay = (float3)(randFloat() * 2 - 1, randFloat() * 2 - 1, randFloat() * 2 - 1);
-					diffuseRay = normalize(diffuseRay);
-					float dotUnadjustedDiffuseRayNormal = dot(diffuseRay, normal);
-					if (dotUnadjustedDiffuseRayNormal < 0) { diffuseRay -= dotUnadjustedDiffuseRayNormal * 2 * normal; }
-					float3 diffReflectedDiffuse = reflectedRay - diffuseRay;
-					ray = diffuseRay + diffReflectedDiffuse * materialHeap[entityHeap[closestEntityIndex].material].reflectivity;
-					ray = normalize(ray);
+					float3 normal = normalize(closestHitPoint - leafSphereHeap[closestLeafObjectIndex].xyz);
+					ray = calculateBounceRay(ray, normal, materialHeap[entityHeap[closestEntityIndex].material].reflectivity, randSeed);
 					cameraPos = closestHitPoint;
 					maxBounces--;
+					COUNT_STATISTIC(BOUNCES)
 				} else {
 					RENDER;
 					break;
@@ -698,7 +802,714 @@ upwardsTraversalLoop:
 		RECONSTRUCT_PARENT;
 		goto upwardsTraversalLoop;
 	}
+
+	return renderColorSum;
+}
+
+/*
+
+NOTE: The leaf sphere heap is leafObjectHeap with the spheres copied in, so a leaf's spheres are one contiguous block of (center, radius) records
+	instead of a gather from 64-byte entities. The entity indices are in a separate stream that only gets read when we need the material or want to skip an entity.
+
+*/
+
+#define NO_LEAF_OBJECT ((ulong)-1)
+
+// Returns the index (into the leaf sphere heap) of the closest hit that's at most maxDistance away, or NO_LEAF_OBJECT.
+inline ulong intersectLeafSpheres(__global float4* leafSphereHeap, __global uint* leafEntityIndexHeap, ulong leafObjectsStart, ulong leafObjectsEnd, 
+									float3 rayOrigin, float3 ray, float maxDistance, uint skipEntityIndex, float* closestDistance STATISTICS_PARAMETER) {
+	ulong closestLeafObjectIndex = NO_LEAF_OBJECT;
+	*closestDistance = maxDistance;
+	for (ulong i = leafObjectsStart; i < leafObjectsEnd; i++) {
+		float4 sphere = leafSphereHeap[i];
+		COUNT_STATISTIC(LEAF_SPHERE_TESTS)
+		float dist = intersectLineSphere(rayOrigin, ray, sphere.xyz, sphere.w);
+		if (dist < 0 || dist > *closestDistance) { continue; }
+		if (leafEntityIndexHeap[i] == skipEntityIndex) { continue; }			// NOTE: Otherwise the bounce ray hits the sphere it's leaving because of float imprecision.
+		*closestDistance = dist;
+		closestLeafObjectIndex = i;
+	}
+	return closestLeafObjectIndex;
+}
+
+/*
+
+NOTE: How the rope traversal works:
+	- We go down the tree once to find the leaf that contains the point where the ray enters the tree.
+	- In a leaf, we only accept hits that are inside of the leaf's part of the ray. If there is one, that's the closest hit in the whole scene, since we visit the leaves in order along the ray.
+	- If there isn't, we find the face through which the ray leaves the leaf and follow that face's rope. The rope lands us in the neighbouring node,
+		from which we go down to the leaf that contains the exit point. No parent links, no reconstruction of parent bounds and no stack.
+	- After a bounce, the new ray starts inside the leaf that contained the hit, so we just keep going from there.
+	- The bounds of every node are stored in the rope heap, so going down only needs one comparison against the split plane per level.
+
+*/
+
+inline bool rayIntersectAABBInterval(float3 rayOrigin, float3 inverseRay, float3 startPosition, float3 stopPosition, float* entryDistance, float* exitDistance) {
+	float3 startDistances = (startPosition - rayOrigin) * inverseRay;
+	float3 stopDistances = (stopPosition - rayOrigin) * inverseRay;
+	float3 nearDistances = fmin(startDistances, stopDistances);
+	float3 farDistances = fmax(startDistances, stopDistances);
+	float nearDistance = fmax(fmax(nearDistances.x, nearDistances.y), nearDistances.z);
+	float farDistance = fmin(fmin(farDistances.x, farDistances.y), farDistances.z);
+	*entryDistance = fmax(nearDistance, 0);
+	*exitDistance = farDistance;
+	return farDistance >= 0 && nearDistance <= farDistance;
+}
+
+inline ulong descendKDTreeWithRopes(__global KDTreeNode* kdTreeNodeHeap, __global KDTreeNodeRopes* kdTreeRopeHeap, ulong nodeIndex, float3 point, float3 ray STATISTICS_PARAMETER) {
+	COUNT_STATISTIC(NODE_VISITS)
+	while (kdTreeNodeHeap[nodeIndex].objectCount == -1) {
+		char splitDimension = extractDimensionValue(kdTreeNodeHeap[nodeIndex].childrenIndex);
+		ulong noDimChildrenIndex = removeDimensionValue(kdTreeNodeHeap[nodeIndex].childrenIndex);
+		float splitPosition;
+		float pointPosition;
+		float rayDirection;
+		switch (splitDimension) {
+		case 0: splitPosition = kdTreeRopeHeap[noDimChildrenIndex + 1].position.x; pointPosition = point.x; rayDirection = ray.x; break;
+		case 1: splitPosition = kdTreeRopeHeap[noDimChildrenIndex + 1].position.y; pointPosition = point.y; rayDirection = ray.y; break;
+		default: splitPosition = kdTreeRopeHeap[noDimChildrenIndex + 1].position.z; pointPosition = point.z; rayDirection = ray.z; break;
+		}
+		// NOTE: Points right on the split plane go to whichever side the ray is headed for, otherwise we'd immediately leave the leaf again.
+		nodeIndex = pointPosition < splitPosition || (pointPosition == splitPosition && rayDirection < 0) ? noDimChildrenIndex : noDimChildrenIndex + 1;
+		COUNT_STATISTIC(NODE_VISITS)
+	}
+	return nodeIndex;
+}
+
+inline float calculateLeafExit(float3 rayOrigin, float3 ray, float3 inverseRay, float3 startPosition, float3 stopPosition, char* exitFace) {
+	float3 exitPlanes = (float3)(ray.x > 0 ? stopPosition.x : startPosition.x, ray.y > 0 ? stopPosition.y : startPosition.y, ray.z > 0 ? stopPosition.z : startPosition.z);
+	float3 exitDistances = (exitPlanes - rayOrigin) * inverseRay;
+	// NOTE: A ray that's parallel to a face can't leave through it.
+	if (ray.x == 0) { exitDistances.x = INFINITY; }
+	if (ray.y == 0) { exitDistances.y = INFINITY; }
+	if (ray.z == 0) { exitDistances.z = INFINITY; }
+
+	if (exitDistances.x <= exitDistances.y && exitDistances.x <= exitDistances.z) { *exitFace = ray.x > 0 ? 1 : 0; return exitDistances.x; }
+	if (exitDistances.y <= exitDistances.z) { *exitFace = ray.y > 0 ? 3 : 2; return exitDistances.y; }
+	*exitFace = ray.z > 0 ? 5 : 4; return exitDistances.z;
+}
+
+inline float3 traceRayWithRopes(float3 cameraPos, float3 ray, ulong* randSeed, __global Entity* entityHeap, 
+								float3 kdTreePosition, float3 kdTreeSize, __global KDTreeNode* kdTreeNodeHeap, __global KDTreeNodeRopes* kdTreeRopeHeap, ulong kdTreeRopeHeapLength, 
+								__global Material* materialHeap, __global float4* leafSphereHeap, __global uint* leafEntityIndexHeap STATISTICS_PARAMETER) {
+
+	float3 renderColorSum = (float3)(0, 0, 0);
+
+	if (kdTreeRopeHeapLength == 0) { return sampleSkybox(ray); }
+
+	float3 inverseRay = 1 / ray;
+
+	float entryDistance;
+	float exitDistance;
+	COUNT_STATISTIC(AABB_TESTS)
+	if (!rayIntersectAABBInterval(cameraPos, inverseRay, kdTreePosition, kdTreePosition + kdTreeSize, &entryDistance, &exitDistance)) { return sampleSkybox(ray); }
+
+	ulong currentKDTreeNodeIndex = 0;
+	uint lastHitEntityIndex = (uint)-1;
+
+	float3 colorSum = (float3)(0, 0, 0);
+	float3 colorProduct = (float3)(1, 1, 1);
+	char maxBounces = MAX_BOUNCES;
+
+	while (true) {
+		currentKDTreeNodeIndex = descendKDTreeWithRopes(kdTreeNodeHeap, kdTreeRopeHeap, currentKDTreeNodeIndex, cameraPos + ray * entryDistance, ray STATISTICS_ARGUMENT);
+
+		float3 leafPosition = kdTreeRopeHeap[currentKDTreeNodeIndex].position;
+		char exitFace;
+		float leafExitDistance = calculateLeafExit(cameraPos, ray, inverseRay, leafPosition, leafPosition + kdTreeRopeHeap[currentKDTreeNodeIndex].size, &exitFace);
+
+		// NOTE: Hits behind the leaf belong to a later leaf and could be hidden by something in between, so they have to wait until we get there.
+		ulong leafObjectsStart = kdTreeNodeHeap[currentKDTreeNodeIndex].childrenIndex;
+		float closestDistance;
+		ulong closestLeafObjectIndex = intersectLeafSpheres(leafSphereHeap, leafEntityIndexHeap, leafObjectsStart, leafObjectsStart + kdTreeNodeHeap[currentKDTreeNodeIndex].objectCount, 
+															cameraPos, ray, leafExitDistance, lastHitEntityIndex, &closestDistance STATISTICS_ARGUMENT);
+
+		if (closestLeafObjectIndex != NO_LEAF_OBJECT) {
+			if (maxBounces == 0) { RENDER; break; }
+
+			uint closestEntityIndex = leafEntityIndexHeap[closestLeafObjectIndex];
+			float3 closestHitPoint = cameraPos + ray * closestDistance;
+			colorProduct *= materialHeap[entityHeap[closestEntityIndex].material].color;
+			// TODO: Add point lights somehow.
+			colorSum += 0 * colorProduct;
+			float3 normal = normalize(closestHitPoint - leafSphereHeap[closestLeafObjectIndex].xyz);
+			ray = calculateBounceRay(ray, normal, materialHeap[entityHeap[closestEntityIndex].material].reflectivity, randSeed);
+			inverseRay = 1 / ray;
+			cameraPos = closestHitPoint;
+			entryDistance = 0;
+			lastHitEntityIndex = closestEntityIndex;
+			maxBounces--;
+			COUNT_STATISTIC(BOUNCES)
+			continue;
+		}
+
+		ulong nextKDTreeNodeIndex = kdTreeRopeHeap[currentKDTreeNodeIndex].ropes[exitFace];
+		if (nextKDTreeNodeIndex == KD_TREE_NO_ROPE) { RENDER; break; }
+		COUNT_STATISTIC(RESTARTS)
+		currentKDTreeNodeIndex = nextKDTreeNodeIndex;
+		entryDistance = fmax(entryDistance, leafExitDistance);			// NOTE: Never step backwards, rounding could otherwise make us bounce between two leaves forever.
+	}
+
+	return renderColorSum;
 }
-//renderColorSum /= 4;
-write_imageui(frame, coords, (uint4)(fmin(renderColorSum.x, 1) * 255, fmin(renderColorSum.y, 1) * 255, fmin(renderColorSum.z, 1) * 255, 255));
-}
\ No newline at end of file
+
+
+/*
+
+NOTE: How the compact traversal works (kd-restart):
+	- The splits are absolute, so going down only takes one subtraction and one multiplication per level, but there is no way back up.
+	- So instead of going back up, we go down from the root again every time we leave a leaf, this time starting at the distance where we left it.
+		The nodes near the root are the same for every ray, so they're basically always in cache, which makes the restarts cheap.
+	- Going down, we keep track of the part of the ray that's inside the current node ([entryDistance, leafExitDistance]). A child that the ray
+		only touches before entryDistance gets skipped, which is what makes the restart land in the next leaf and not the one we just left.
+
+*/
+
+inline float getComponent(float3 vector, uint axis) { return axis == 0 ? vector.x : (axis == 1 ? vector.y : vector.z); }
+
+// NOTE: Returns the closest hit inside [entryDistance, sceneExitDistance] of the ray, going down from the root again for every leaf it leaves. traceRayCompact and the wavefront extend kernel both use this.
+inline ulong findClosestHitCompact(float3 rayOrigin, float3 ray, float3 inverseRay, float entryDistance, float sceneExitDistance, uint skipEntityIndex, 
+									__global CompactKDTreeNode* compactKDTreeNodeHeap, __global float4* leafSphereHeap, __global uint* leafEntityIndexHeap, float* closestDistance STATISTICS_PARAMETER) {
+	while (true) {
+		uint currentKDTreeNodeIndex = 0;
+		uint header = compactKDTreeNodeHeap[0].header;
+		float leafExitDistance = sceneExitDistance;
+		COUNT_STATISTIC(NODE_VISITS)
+
+		while ((header & 3) != COMPACT_KD_TREE_LEAF_AXIS) {
+			uint splitAxis = header & 3;
+			uint childrenIndex = header >> 2;
+			float split = as_float(compactKDTreeNodeHeap[currentKDTreeNodeIndex].splitOrObjectCount);
+
+			float originComponent = getComponent(rayOrigin, splitAxis);
+			float rayComponent = getComponent(ray, splitAxis);
+			float splitDistance = (split - originComponent) * getComponent(inverseRay, splitAxis);
+
+			// NOTE: An origin right on the split plane counts as being on the side the ray is headed for.
+			bool originIsLeft = originComponent < split || (originComponent == split && rayComponent < 0);
+			uint nearChildIndex = originIsLeft ? childrenIndex : childrenIndex + 1;
+
+			if (rayComponent == 0 || splitDistance <= 0 || splitDistance > leafExitDistance) {
+				currentKDTreeNodeIndex = nearChildIndex;
+			} else if (splitDistance <= entryDistance) {
+				currentKDTreeNodeIndex = originIsLeft ? childrenIndex + 1 : childrenIndex;
+			} else {
+				currentKDTreeNodeIndex = nearChildIndex;
+				leafExitDistance = splitDistance;
+			}
+			header = compactKDTreeNodeHeap[currentKDTreeNodeIndex].header;
+			COUNT_STATISTIC(NODE_VISITS)
+		}
+
+		ulong leafObjectsStart = header >> 2;
+		ulong closestLeafObjectIndex = intersectLeafSpheres(leafSphereHeap, leafEntityIndexHeap, leafObjectsStart, leafObjectsStart + compactKDTreeNodeHeap[currentKDTreeNodeIndex].splitOrObjectCount, 
+															rayOrigin, ray, leafExitDistance, skipEntityIndex, closestDistance STATISTICS_ARGUMENT);
+		if (closestLeafObjectIndex != NO_LEAF_OBJECT) { return closestLeafObjectIndex; }
+
+		if (leafExitDistance >= sceneExitDistance) { return NO_LEAF_OBJECT; }
+		COUNT_STATISTIC(RESTARTS)
+		entryDistance = leafExitDistance;
+	}
+}
+
+inline float3 traceRayCompact(float3 cameraPos, float3 ray, ulong* randSeed, __global Entity* entityHeap, 
+								float3 kdTreePosition, float3 kdTreeSize, __global CompactKDTreeNode* compactKDTreeNodeHeap, ulong compactKDTreeNodeHeapLength, 
+								__global Material* materialHeap, __global float4* leafSphereHeap, __global uint* leafEntityIndexHeap STATISTICS_PARAMETER) {
+
+	float3 renderColorSum = (float3)(0, 0, 0);
+
+	if (compactKDTreeNodeHeapLength == 0) { return sampleSkybox(ray); }
+
+	float3 inverseRay = 1 / ray;
+
+	float entryDistance;
+	float sceneExitDistance;
+	COUNT_STATISTIC(AABB_TESTS)
+	if (!rayIntersectAABBInterval(cameraPos, inverseRay, kdTreePosition, kdTreePosition + kdTreeSize, &entryDistance, &sceneExitDistance)) { return sampleSkybox(ray); }
+
+	uint lastHitEntityIndex = (uint)-1;
+
+	float3 colorSum = (float3)(0, 0, 0);
+	float3 colorProduct = (float3)(1, 1, 1);
+	char maxBounces = MAX_BOUNCES;
+
+	while (true) {
+		float closestDistance;
+		ulong closestLeafObjectIndex = findClosestHitCompact(cameraPos, ray, inverseRay, entryDistance, sceneExitDistance, lastHitEntityIndex, 
+															compactKDTreeNodeHeap, leafSphereHeap, leafEntityIndexHeap, &closestDistance STATISTICS_ARGUMENT);
+		if (closestLeafObjectIndex == NO_LEAF_OBJECT) { RENDER; break; }
+		if (maxBounces == 0) { RENDER; break; }
+
+		uint closestEntityIndex = leafEntityIndexHeap[closestLeafObjectIndex];
+		float3 closestHitPoint = cameraPos + ray * closestDistance;
+		colorProduct *= materialHeap[entityHeap[closestEntityIndex].material].color;
+		// TODO: Add point lights somehow.
+		colorSum += 0 * colorProduct;
+		float3 normal = normalize(closestHitPoint - leafSphereHeap[closestLeafObjectIndex].xyz);
+		ray = calculateBounceRay(ray, normal, materialHeap[entityHeap[closestEntityIndex].material].reflectivity, randSeed);
+		inverseRay = 1 / ray;
+		cameraPos = closestHitPoint;
+		lastHitEntityIndex = closestEntityIndex;
+		maxBounces--;
+		COUNT_STATISTIC(BOUNCES)
+		// NOTE: The hit point is inside the tree, so this only fails if it's right on the edge and the new ray points outwards.
+		COUNT_STATISTIC(AABB_TESTS)
+		COUNT_STATISTIC(RESTARTS)
+		if (!rayIntersectAABBInterval(cameraPos, inverseRay, kdTreePosition, kdTreePosition + kdTreeSize, &entryDistance, &sceneExitDistance)) { RENDER; break; }
+	}
+
+	return renderColorSum;
+}
+
+/*
+
+NOTE: The entry points. Every one of them takes the same arguments, so that the shader can set them without caring which one it's running.
+	- Separate mode: frame is the before-average frame, samplesPerPixelSideLength is 1 and accumulationFrame is null. Every work item traces one sample.
+	- Fused mode: frame is the final frame and every work item traces all samplesPerPixelSideLength^2 samples of its pixel, so the before-average frame and
+		the averaging pass aren't needed. The accumulation happens in here as well if accumulationFrame isn't null.
+
+*/
+
+#ifdef MORTON_TILE_ORDER
+// NOTE: Takes every other bit, starting with the lowest one, and packs them together. The inverse of interleaving two 16-bit coordinates.
+inline uint compactMortonBits(uint bits) {
+	bits &= 0x55555555;
+	bits = (bits | (bits >> 1)) & 0x33333333;
+	bits = (bits | (bits >> 2)) & 0x0F0F0F0F;
+	bits = (bits | (bits >> 4)) & 0x00FF00FF;
+	bits = (bits | (bits >> 8)) & 0x0000FFFF;
+	return bits;
+}
+#endif
+
+/*
+
+NOTE: The pixel of the work item. Without MORTON_TILE_ORDER that's just the global id, so a work group covers whatever shape the renderer launched it with
+	(RaytracingShader::getTraceLocalSize), strips or square tiles.
+	- With MORTON_TILE_ORDER, square power of two work groups walk their tile in Z-order instead of row by row. The work items that run next to each other
+		in the same SIMD unit then get a compact block of pixels instead of a couple of long rows, so their primary rays go down the same kd-tree nodes.
+	- Any other work group shape gets the plain mapping, the remap doesn't work for those.
+	- The edge groups stick out of the frame, the caller has to skip the pixels that aren't in it.
+
+*/
+inline int2 getTracePixelCoords() {
+#ifdef MORTON_TILE_ORDER
+	uint tileSideLength = get_local_size(0);
+	if (tileSideLength == get_local_size(1) && (tileSideLength & (tileSideLength - 1)) == 0) {
+		uint localIndex = get_local_id(1) * tileSideLength + get_local_id(0);
+		return (int2)(get_global_id(0) - get_local_id(0) + compactMortonBits(localIndex), get_global_id(1) - get_local_id(1) + compactMortonBits(localIndex >> 1));
+	}
+#endif
+	return (int2)(get_global_id(0), get_global_id(1));
+}
+
+#define TRACE_KERNEL_PARAMETERS __write_only image2d_t frame, uint frameWidth, uint frameHeight, \
+								float3 cameraPos, Matrix4f cameraRotationMat, float rayOriginZ, \
+								__global Entity* entityHeap, ulong entityHeapLength, \
+								float3 kdTreePosition, float3 kdTreeSize, __global KDTreeNode* kdTreeNodeHeap, ulong kdTreeNodeHeapLength, __global ulong* leafObjectHeap, ulong leafObjectHeapLength, \
+								__global Light* lightHeap, ulong lightHeapLength, \
+								__global Material* materialHeap, ulong materialHeapLength, ulong materialHeapOffset, \
+								__global KDTreeNodeRopes* kdTreeRopeHeap, ulong kdTreeRopeHeapLength, \
+								__global CompactKDTreeNode* compactKDTreeNodeHeap, ulong compactKDTreeNodeHeapLength, \
+								__global float4* leafSphereHeap, __global uint* leafEntityIndexHeap, ulong leafSphereHeapLength, \
+								uint sampleIndex, ushort samplesPerPixelSideLength, __global float4* accumulationFrame, uint accumulatedFrameCount TRACE_KERNEL_STATISTICS_PARAMETERS \
+								TRACE_KERNEL_PERSISTENT_PARAMETERS
+
+#ifdef PERSISTENT_THREADS
+#ifdef TRAVERSAL_STATISTICS
+#error "The persistent threads don't collect traversal statistics, the reduction needs one work group per slot."
+#endif
+// NOTE: persistentWorkCounter has to be 0 at launch. It counts pixels from the start of row persistentFirstRow, persistentRowCount rows in total.
+#define TRACE_KERNEL_PERSISTENT_PARAMETERS , __global uint* persistentWorkCounter, uint persistentBatchSize, uint persistentFirstRow, uint persistentRowCount
+#else
+#define TRACE_KERNEL_PERSISTENT_PARAMETERS
+#endif
+
+#ifndef TRAVERSAL_STATISTICS
+
+#define TRACE_KERNEL_STATISTICS_PARAMETERS
+
+#ifndef PERSISTENT_THREADS
+
+#define TRACE_KERNEL_BODY(traceCall) \
+	int2 coords = getTracePixelCoords(); \
+	if (coords.x >= frameWidth || coords.y >= frameHeight) { return; } \
+	\
+	ulong randSeed = initRandSeed(coords, frameWidth, sampleIndex); \
+	\
+	float3 colorSum = (float3)(0, 0, 0); \
+	/* TODO: Figure out a way to measure variance between the samples and a way to conditionally add more samples to the mix. */ \
+	for (ushort subY = 0; subY < SAMPLE_SIDE_LENGTH; subY++) { \
+		for (ushort subX = 0; subX < SAMPLE_SIDE_LENGTH; subX++) { \
+			float3 ray = generateCameraRay(coords, subX, subY, SAMPLE_SIDE_LENGTH, frameWidth, frameHeight, rayOriginZ, cameraRotationMat, &randSeed); \
+			colorSum += fmin(traceCall, 1); \
+		} \
+	} \
+	writeResolvedPixel(frame, coords, colorSum / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH), frameWidth, accumulationFrame, accumulatedFrameCount);
+
+#else
+
+/*
+
+NOTE: Persistent threads. DefaultShader::enqueueTrace only launches as many work groups as the device can keep resident at once, and every group keeps
+	taking the next persistentBatchSize pixels off persistentWorkCounter until the rows are done. A group that got cheap pixels (sky) just goes and gets
+	more, instead of the whole launch waiting on the groups with the long bounce chains before the next ones can take their place.
+	- One work item per group does the atomic, the batch start goes through local memory. The second barrier keeps it from being overwritten
+		while somebody is still reading it.
+	- Every work item of the group sees the same batch start, so they all leave the loop together.
+	- The batches are runs of pixels in row order, the work group shape and MORTON_TILE_ORDER don't matter in here.
+
+*/
+#define TRACE_KERNEL_BODY(traceCall) \
+	__local uint groupBatchStart; \
+	uint pixelCount = persistentRowCount * frameWidth; \
+	while (true) { \
+		if (get_local_id(0) == 0) { groupBatchStart = atomic_add(persistentWorkCounter, persistentBatchSize); } \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		uint batchStart = groupBatchStart; \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		if (batchStart >= pixelCount) { return; } \
+		uint batchEnd = min(batchStart + persistentBatchSize, pixelCount); \
+		for (uint pixelIndex = batchStart + get_local_id(0); pixelIndex < batchEnd; pixelIndex += get_local_size(0)) { \
+			int2 coords = (int2)(pixelIndex % frameWidth, persistentFirstRow + pixelIndex / frameWidth); \
+			\
+			ulong randSeed = initRandSeed(coords, frameWidth, sampleIndex); \
+			\
+			float3 colorSum = (float3)(0, 0, 0); \
+			for (ushort subY = 0; subY < SAMPLE_SIDE_LENGTH; subY++) { \
+				for (ushort subX = 0; subX < SAMPLE_SIDE_LENGTH; subX++) { \
+					float3 ray = generateCameraRay(coords, subX, subY, SAMPLE_SIDE_LENGTH, frameWidth, frameHeight, rayOriginZ, cameraRotationMat, &randSeed); \
+					colorSum += fmin(traceCall, 1); \
+				} \
+			} \
+			writeResolvedPixel(frame, coords, colorSum / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH), frameWidth, accumulationFrame, accumulatedFrameCount); \
+		} \
+	}
+
+#endif
+
+#else
+
+// NOTE: One slot of TRAVERSAL_STATISTIC_COUNT counts per work group. Can be null, then nothing gets written.
+#define TRACE_KERNEL_STATISTICS_PARAMETERS , __global uint* traversalStatistics
+
+inline float3 calculateHeatmapColor(TraversalStatistics* statistics, ushort samplesPerPixelSideLength) {
+	float cost = (statistics->counts[STATISTIC_NODE_VISITS] + statistics->counts[STATISTIC_LEAF_SPHERE_TESTS]) / (float)(samplesPerPixelSideLength * samplesPerPixelSideLength);
+	float t = clamp(cost / TRAVERSAL_HEATMAP_SCALE, 0.0f, 1.0f);
+	return (float3)(clamp(t * 2 - 1, 0.0f, 1.0f), 1 - fabs(t * 2 - 1), clamp(1 - t * 2, 0.0f, 1.0f));			// NOTE: Blue for cheap, green in the middle, red for TRAVERSAL_HEATMAP_SCALE and up.
+}
+
+inline void reduceTraversalStatistics(TraversalStatistics* itemStatistics, __local uint* groupStatistics, __global uint* traversalStatistics) {
+	size_t localIndex = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	size_t localSize = get_local_size(0) * get_local_size(1);
+	for (size_t i = localIndex; i < TRAVERSAL_STATISTIC_COUNT; i += localSize) { groupStatistics[i] = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = 0; i < TRAVERSAL_STATISTIC_COUNT; i++) {
+		if (itemStatistics->counts[i] != 0) { atomic_add(&groupStatistics[i], itemStatistics->counts[i]); }
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (!traversalStatistics) { return; }
+	size_t groupIndex = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+	for (size_t i = localIndex; i < TRAVERSAL_STATISTIC_COUNT; i += localSize) { traversalStatistics[groupIndex * TRAVERSAL_STATISTIC_COUNT + i] = groupStatistics[i]; }
+}
+
+#ifdef TRAVERSAL_HEATMAP
+#define RESOLVED_COLOR calculateHeatmapColor(statistics, SAMPLE_SIDE_LENGTH)
+#else
+#define RESOLVED_COLOR colorSum / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH)
+#endif
+
+// NOTE: Same as the normal body, except that the padding work items can't return early, every work item of the group has to make it to the barriers.
+#define TRACE_KERNEL_BODY(traceCall) \
+	__local uint groupStatistics[TRAVERSAL_STATISTIC_COUNT]; \
+	TraversalStatistics itemStatistics = { { 0 } }; \
+	TraversalStatistics* statistics = &itemStatistics; \
+	int2 coords = getTracePixelCoords(); \
+	if (coords.x < frameWidth && coords.y < frameHeight) { \
+		ulong randSeed = initRandSeed(coords, frameWidth, sampleIndex); \
+		\
+		float3 colorSum = (float3)(0, 0, 0); \
+		for (ushort subY = 0; subY < SAMPLE_SIDE_LENGTH; subY++) { \
+			for (ushort subX = 0; subX < SAMPLE_SIDE_LENGTH; subX++) { \
+				float3 ray = generateCameraRay(coords, subX, subY, SAMPLE_SIDE_LENGTH, frameWidth, frameHeight, rayOriginZ, cameraRotationMat, &randSeed); \
+				colorSum += fmin(traceCall, 1); \
+			} \
+		} \
+		writeResolvedPixel(frame, coords, RESOLVED_COLOR, frameWidth, accumulationFrame, accumulatedFrameCount); \
+	} \
+	reduceTraversalStatistics(&itemStatistics, groupStatistics, traversalStatistics);
+
+#endif
+
+#ifndef WAVEFRONT
+
+__kernel void traceRays(TRACE_KERNEL_PARAMETERS) {
+	TRACE_KERNEL_BODY(traceRayWithParentLinks(cameraPos, ray, &randSeed, entityHeap, kdTreePosition, kdTreeSize, kdTreeNodeHeap, kdTreeNodeHeapLength, materialHeap, leafSphereHeap, leafEntityIndexHeap STATISTICS_ARGUMENT))
+}
+
+__kernel void traceRaysWithRopes(TRACE_KERNEL_PARAMETERS) {
+	TRACE_KERNEL_BODY(traceRayWithRopes(cameraPos, ray, &randSeed, entityHeap, kdTreePosition, kdTreeSize, kdTreeNodeHeap, kdTreeRopeHeap, kdTreeRopeHeapLength, materialHeap, leafSphereHeap, leafEntityIndexHeap STATISTICS_ARGUMENT))
+}
+
+__kernel void traceRaysCompact(TRACE_KERNEL_PARAMETERS) {
+	TRACE_KERNEL_BODY(traceRayCompact(cameraPos, ray, &randSeed, entityHeap, kdTreePosition, kdTreeSize, compactKDTreeNodeHeap, compactKDTreeNodeHeapLength, materialHeap, leafSphereHeap, leafEntityIndexHeap STATISTICS_ARGUMENT))
+}
+
+#else
+
+/*
+
+NOTE: The wavefront kernels. WavefrontShader builds raytracer.cl with WAVEFRONT defined and runs these instead of one of the entry points above.
+	- generateWavefrontRays writes one camera ray per sample into the ray queue. extendWavefrontRays finds the closest hit of every ray in the queue
+		with the compact traversal, shadeWavefrontRays either finishes the sample or appends the bounce ray to the other queue. resolveWavefrontSamples
+		averages the samples into the pixels.
+	- Extend and shade run once per pass. Every ray in a queue has bounced exactly pass times, so the remaining bounces don't have to be stored per ray.
+	- rayCounts[pass] is the length of that pass's queue. Generate sets the first one and clears the rest, shade counts the surviving rays into the next one.
+		The host never reads them back, it launches every pass for the whole batch and the work items past the count return right away.
+	- The shading is the same as traceRayCompact's, only the random numbers differ. Every sample has its own seed here, the megakernels run all samples of a pixel off of one.
+	- Every kernel takes the same arguments, same as the entry points, so WavefrontShader can set them on all of them without caring which one uses what.
+	- Before an extend, the queue can get sorted for coherence, see the NOTE above computeWavefrontSortKeys.
+
+*/
+
+#ifdef TRAVERSAL_STATISTICS
+#error "The wavefront kernels don't collect traversal statistics."
+#endif
+
+// NOTE: Has to be WavefrontShader::rayQueueEntrySize bytes. The w components aren't used, float4 just keeps the layout the same on every compiler.
+typedef struct WavefrontRay {
+	float4 origin;
+	float4 direction;
+	float4 colorProduct;
+	ulong randSeed;
+	uint lastHitEntityIndex;
+	uint sampleSlot;					// NOTE: Where the finished sample goes in sampleColors.
+} WavefrontRay;
+
+// NOTE: Has to be WavefrontShader::hitEntrySize bytes.
+typedef struct WavefrontHit {
+	ulong leafObjectIndex;				// NOTE: NO_LEAF_OBJECT for a miss.
+	float distance;
+	uint enteredTree;					// NOTE: Whether the ray went through the tree's bounding box at all. A camera ray that didn't gets the skybox.
+} WavefrontHit;
+
+#define WAVEFRONT_KERNEL_PARAMETERS __write_only image2d_t frame, uint frameWidth, uint frameHeight, \
+									float3 cameraPos, Matrix4f cameraRotationMat, float rayOriginZ, \
+									__global Entity* entityHeap, __global Material* materialHeap, \
+									float3 kdTreePosition, float3 kdTreeSize, __global CompactKDTreeNode* compactKDTreeNodeHeap, ulong compactKDTreeNodeHeapLength, \
+									__global float4* leafSphereHeap, __global uint* leafEntityIndexHeap, \
+									uint sampleIndex, ushort samplesPerPixelSideLength, __global float4* accumulationFrame, uint accumulatedFrameCount, \
+									__global WavefrontRay* rayQueue, __global WavefrontRay* nextRayQueue, __global WavefrontHit* hits, __global float4* sampleColors, __global uint* rayCounts, \
+									uint pass, uint batchPixelStart, uint batchPixelCount, \
+									__global uint* sortKeys, __global uint* sortValues, __global uint* nextSortKeys, __global uint* nextSortValues, __global uint* sortHistograms, \
+									uint sortItemCount, uint sortShift
+
+// NOTE: The batch is batchPixelCount whole pixels in row-major order, starting at batchPixelStart. Sample slot i belongs to pixel i / SAMPLE_SIDE_LENGTH^2 of the batch.
+__kernel void generateWavefrontRays(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint sampleCount = batchPixelCount * SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH;
+	uint sampleSlot = get_global_id(0);
+	if (sampleSlot == 0) {
+		rayCounts[0] = sampleCount;
+		for (uint i = 1; i <= MAX_BOUNCES; i++) { rayCounts[i] = 0; }
+	}
+	if (sampleSlot >= sampleCount) { return; }
+
+	uint pixelIndex = batchPixelStart + sampleSlot / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH);
+	uint subSampleIndex = sampleSlot % (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH);
+	int2 coords = (int2)(pixelIndex % frameWidth, pixelIndex / frameWidth);
+
+	// NOTE: Same seed as initRandSeed for the first sub-sample, the other ones get the sub-sample index mixed into the low half.
+	ulong randSeed = initRandSeed(coords, frameWidth, sampleIndex) ^ (uint)(subSampleIndex * 2246822519u);
+
+	WavefrontRay cameraRay;
+	cameraRay.origin = (float4)(cameraPos, 0);
+	cameraRay.direction = (float4)(generateCameraRay(coords, subSampleIndex % SAMPLE_SIDE_LENGTH, subSampleIndex / SAMPLE_SIDE_LENGTH, SAMPLE_SIDE_LENGTH, 
+													frameWidth, frameHeight, rayOriginZ, cameraRotationMat, &randSeed), 0);
+	cameraRay.colorProduct = (float4)(1, 1, 1, 0);
+	cameraRay.randSeed = randSeed;
+	cameraRay.lastHitEntityIndex = (uint)-1;
+	cameraRay.sampleSlot = sampleSlot;
+	rayQueue[sampleSlot] = cameraRay;
+}
+
+__kernel void extendWavefrontRays(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint queueIndex = get_global_id(0);
+	if (queueIndex >= rayCounts[pass]) { return; }
+
+	WavefrontRay wavefrontRay = rayQueue[queueIndex];
+	float3 rayOrigin = wavefrontRay.origin.xyz;
+	float3 ray = wavefrontRay.direction.xyz;
+	float3 inverseRay = 1 / ray;
+
+	WavefrontHit hit;
+	hit.leafObjectIndex = NO_LEAF_OBJECT;
+	hit.distance = 0;
+	hit.enteredTree = 0;
+	float entryDistance;
+	float sceneExitDistance;
+	if (compactKDTreeNodeHeapLength != 0 && rayIntersectAABBInterval(rayOrigin, inverseRay, kdTreePosition, kdTreePosition + kdTreeSize, &entryDistance, &sceneExitDistance)) {
+		hit.enteredTree = 1;
+		hit.leafObjectIndex = findClosestHitCompact(rayOrigin, ray, inverseRay, entryDistance, sceneExitDistance, wavefrontRay.lastHitEntityIndex, 
+													compactKDTreeNodeHeap, leafSphereHeap, leafEntityIndexHeap, &hit.distance);
+	}
+	hits[queueIndex] = hit;
+}
+
+__kernel void shadeWavefrontRays(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint queueIndex = get_global_id(0);
+	if (queueIndex >= rayCounts[pass]) { return; }
+
+	WavefrontRay wavefrontRay = rayQueue[queueIndex];
+	WavefrontHit hit = hits[queueIndex];
+	float3 ray = wavefrontRay.direction.xyz;
+	float3 colorProduct = wavefrontRay.colorProduct.xyz;
+
+	if (hit.leafObjectIndex == NO_LEAF_OBJECT || pass == MAX_BOUNCES) {
+		// NOTE: Only a camera ray that misses the tree entirely gets the skybox. Everything else ends with the color product, same as RENDER in traceRayCompact.
+		float3 color = pass == 0 && !hit.enteredTree ? sampleSkybox(ray) : colorProduct;
+		sampleColors[wavefrontRay.sampleSlot] = (float4)(fmin(color, 1), 0);
+		return;
+	}
+
+	uint entityIndex = leafEntityIndexHeap[hit.leafObjectIndex];
+	Material material = materialHeap[entityHeap[entityIndex].material];
+	float3 hitPoint = wavefrontRay.origin.xyz + ray * hit.distance;
+	float3 normal = normalize(hitPoint - leafSphereHeap[hit.leafObjectIndex].xyz);
+	ulong randSeed = wavefrontRay.randSeed;
+
+	WavefrontRay bounceRay;
+	bounceRay.origin = (float4)(hitPoint, 0);
+	bounceRay.direction = (float4)(calculateBounceRay(ray, normal, material.reflectivity, &randSeed), 0);
+	bounceRay.colorProduct = (float4)(colorProduct * material.color, 0);
+	bounceRay.randSeed = randSeed;
+	bounceRay.lastHitEntityIndex = entityIndex;
+	bounceRay.sampleSlot = wavefrontRay.sampleSlot;
+	// NOTE: The order in the next queue is whatever order the atomics come in, which doesn't matter, the sample slot goes along with the ray.
+	nextRayQueue[atomic_inc(&rayCounts[pass + 1])] = bounceRay;
+}
+
+__kernel void resolveWavefrontSamples(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint batchPixelIndex = get_global_id(0);
+	if (batchPixelIndex >= batchPixelCount) { return; }
+
+	uint pixelIndex = batchPixelStart + batchPixelIndex;
+	int2 coords = (int2)(pixelIndex % frameWidth, pixelIndex / frameWidth);
+
+	float3 colorSum = (float3)(0, 0, 0);
+	uint firstSampleSlot = batchPixelIndex * SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH;
+	for (uint i = 0; i < SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH; i++) { colorSum += sampleColors[firstSampleSlot + i].xyz; }
+	writeResolvedPixel(frame, coords, colorSum / (SAMPLE_SIDE_LENGTH * SAMPLE_SIDE_LENGTH), frameWidth, accumulationFrame, accumulatedFrameCount);
+}
+
+/*
+
+NOTE: Sorting a queue by where its rays start and where they're headed, so that neighbouring work items go down the same parts of the tree.
+	- The key is the direction octant in the top 3 bits and the Morton code of the origin on a 512^3 grid over the tree's bounding box in the 27 below.
+		Sorting by octant first keeps rays that go opposite ways apart even if they start at the same spot.
+	- LSD radix sort over key and queue index pairs, WAVEFRONT_SORT_DIGIT_BITS at a time. Every digit is count, scan and scatter. gatherWavefrontRays then moves the
+		rays themselves over into the other queue once, at the end, instead of shuffling 64 bytes per ray on every digit.
+	- The count and scatter work items go through WAVEFRONT_SORT_CHUNK_SIZE consecutive entries each, serially, which is what keeps the scatter stable without any
+		ranking inside the work group. The histograms are digit-major (digit * sortItemCount + work item), so one exclusive scan over all of them gives every
+		work item its output offset for every digit.
+	- The queue length is only on the device again, so the kernels are launched for the whole batch and use rayCounts[pass] to know where to stop.
+
+*/
+
+#define WAVEFRONT_SORT_KEY_BITS 30
+#define WAVEFRONT_SORT_DIGIT_BITS 4
+#define WAVEFRONT_SORT_DIGIT_COUNT (1 << WAVEFRONT_SORT_DIGIT_BITS)
+#define WAVEFRONT_SORT_CHUNK_SIZE 64						// NOTE: Has to be WavefrontShader::sortChunkSize.
+#define WAVEFRONT_SORT_SCAN_SIZE 256						// NOTE: The most work items scanWavefrontSortDigits can be launched with, see WavefrontShader::sortScanSize.
+
+// NOTE: Spreads the low 9 bits out so that there are two zero bits after every one of them.
+inline uint spreadMortonBits(uint value) {
+	value &= 0x1FF;
+	value = (value | (value << 16)) & 0x030000FF;
+	value = (value | (value << 8)) & 0x0300F00F;
+	value = (value | (value << 4)) & 0x030C30C3;
+	value = (value | (value << 2)) & 0x09249249;
+	return value;
+}
+
+__kernel void computeWavefrontSortKeys(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint queueIndex = get_global_id(0);
+	if (queueIndex >= rayCounts[pass]) { return; }
+
+	WavefrontRay wavefrontRay = rayQueue[queueIndex];
+	float3 gridPosition = clamp((wavefrontRay.origin.xyz - kdTreePosition) / kdTreeSize, 0.0f, 1.0f) * 511;
+	uint mortonCode = spreadMortonBits((uint)gridPosition.x) | (spreadMortonBits((uint)gridPosition.y) << 1) | (spreadMortonBits((uint)gridPosition.z) << 2);
+	uint octant = (wavefrontRay.direction.x < 0) | ((wavefrontRay.direction.y < 0) << 1) | ((wavefrontRay.direction.z < 0) << 2);
+
+	sortKeys[queueIndex] = (octant << 27) | mortonCode;
+	sortValues[queueIndex] = queueIndex;
+}
+
+__kernel void countWavefrontSortDigits(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint itemIndex = get_global_id(0);
+	if (itemIndex >= sortItemCount) { return; }
+
+	uint digitCounts[WAVEFRONT_SORT_DIGIT_COUNT];
+	for (uint i = 0; i < WAVEFRONT_SORT_DIGIT_COUNT; i++) { digitCounts[i] = 0; }
+	uint chunkStart = itemIndex * WAVEFRONT_SORT_CHUNK_SIZE;
+	uint chunkEnd = min(chunkStart + WAVEFRONT_SORT_CHUNK_SIZE, rayCounts[pass]);
+	for (uint i = chunkStart; i < chunkEnd; i++) { digitCounts[(sortKeys[i] >> sortShift) & (WAVEFRONT_SORT_DIGIT_COUNT - 1)]++; }
+
+	// NOTE: The work items past the end of the queue still write their zeros, the scan goes over all of them.
+	for (uint i = 0; i < WAVEFRONT_SORT_DIGIT_COUNT; i++) { sortHistograms[i * sortItemCount + itemIndex] = digitCounts[i]; }
+}
+
+// NOTE: Exclusive scan over all WAVEFRONT_SORT_DIGIT_COUNT * sortItemCount counts, in a single work group. Every work item sums up its own stretch, item 0 scans the sums.
+__kernel void scanWavefrontSortDigits(WAVEFRONT_KERNEL_PARAMETERS) {
+	__local uint stretchSums[WAVEFRONT_SORT_SCAN_SIZE];
+	uint localIndex = get_local_id(0);
+	uint localSize = get_local_size(0);
+	uint entryCount = WAVEFRONT_SORT_DIGIT_COUNT * sortItemCount;
+	uint stretchLength = (entryCount + localSize - 1) / localSize;
+	uint stretchStart = min(localIndex * stretchLength, entryCount);
+	uint stretchEnd = min(stretchStart + stretchLength, entryCount);
+
+	uint sum = 0;
+	for (uint i = stretchStart; i < stretchEnd; i++) { sum += sortHistograms[i]; }
+	stretchSums[localIndex] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (localIndex == 0) {
+		uint runningSum = 0;
+		for (uint i = 0; i < localSize; i++) {
+			uint stretchSum = stretchSums[i];
+			stretchSums[i] = runningSum;
+			runningSum += stretchSum;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint runningSum = stretchSums[localIndex];
+	for (uint i = stretchStart; i < stretchEnd; i++) {
+		uint count = sortHistograms[i];
+		sortHistograms[i] = runningSum;
+		runningSum += count;
+	}
+}
+
+__kernel void scatterWavefrontSortDigits(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint itemIndex = get_global_id(0);
+	if (itemIndex >= sortItemCount) { return; }
+
+	uint digitOffsets[WAVEFRONT_SORT_DIGIT_COUNT];
+	for (uint i = 0; i < WAVEFRONT_SORT_DIGIT_COUNT; i++) { digitOffsets[i] = sortHistograms[i * sortItemCount + itemIndex]; }
+	uint chunkStart = itemIndex * WAVEFRONT_SORT_CHUNK_SIZE;
+	uint chunkEnd = min(chunkStart + WAVEFRONT_SORT_CHUNK_SIZE, rayCounts[pass]);
+	for (uint i = chunkStart; i < chunkEnd; i++) {
+		uint key = sortKeys[i];
+		uint outputIndex = digitOffsets[(key >> sortShift) & (WAVEFRONT_SORT_DIGIT_COUNT - 1)]++;
+		nextSortKeys[outputIndex] = key;
+		nextSortValues[outputIndex] = sortValues[i];
+	}
+}
+
+__kernel void gatherWavefrontRays(WAVEFRONT_KERNEL_PARAMETERS) {
+	uint queueIndex = get_global_id(0);
+	if (queueIndex >= rayCounts[pass]) { return; }
+	nextRayQueue[queueIndex] = rayQueue[sortValues[queueIndex]];
+}
+
+#endif